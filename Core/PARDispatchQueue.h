@@ -38,6 +38,26 @@ typedef NS_ENUM(NSInteger, PARDeadlockBehavior)
 };
 
 
+// Executors = how blocks dispatched synchronously are executed on a serial queue
+// PARExecutorDispatch: submit the block to the dispatch queue and wait (default)
+// PARExecutorLock:     execute the block inline on the calling thread, under a lock also held by the blocks dispatched asynchronously and the timers; blocks dispatched synchronously still wait for the blocks dispatched asynchronously before them, and the deadlock behaviors are the same; best for short critical sections
+typedef NS_ENUM(NSInteger, PARExecutor)
+{
+    PARExecutorDispatch,
+    PARExecutorLock,
+};
+
+
+// Task Priorities = priority of the tasks run by the fork/join helpers, which use the global concurrent queue with the corresponding priority
+typedef NS_ENUM(NSInteger, PARTaskPriority)
+{
+    PARTaskPriorityDefault,
+    PARTaskPriorityHigh,
+    PARTaskPriorityLow,
+    PARTaskPriorityBackground,
+};
+
+
 // The APIs were audited. None of the method return values, method parameters or properties are nullable.
 NS_ASSUME_NONNULL_BEGIN
 
@@ -50,6 +70,7 @@ NS_ASSUME_NONNULL_BEGIN
 + (PARDispatchQueue *)mainDispatchQueue;
 + (PARDispatchQueue *)dispatchQueueWithLabel:(NSString *)label;
 + (PARDispatchQueue *)dispatchQueueWithLabel:(NSString *)label behavior:(PARDeadlockBehavior)behavior;
++ (PARDispatchQueue *)dispatchQueueWithLabel:(NSString *)label behavior:(PARDeadlockBehavior)behavior executor:(PARExecutor)executor;
 
 // queue created lazily, then shared and guaranteed to be always the same
 // this is useful as an alternative to `globalDispatchQueue` to dispatch barrier blocks
@@ -59,6 +80,7 @@ NS_ASSUME_NONNULL_BEGIN
 /// @name Properties
 @property (readonly, copy) NSString *label;
 @property (readonly) PARDeadlockBehavior deadlockBehavior;
+@property (readonly) PARExecutor executor;
 
 
 /// @name Utilities
@@ -83,6 +105,14 @@ NS_ASSUME_NONNULL_BEGIN
 - (void)cancelAllTimers;
 - (NSUInteger)timerCount; // the returned value cannot be fully trusted, of course
 
+
+/// @name Fork/Join
+// For fine-grained CPU-bound work, e.g. encoding or decoding many property lists. The tasks are run by the pool of worker threads shared by all the global queues, which GCD sizes to the number of cores and balances between cores, and the calling thread also runs tasks until all of them are done. Consecutive tasks are grouped in chunks to amortize the scheduling cost.
+// The calls are synchronous and can be made from any queue, including from within a task. The tasks are not run within any PARDispatchQueue, and should not dispatch blocks synchronously into the queue of the caller.
++ (void)forkJoinWithTaskCount:(NSUInteger)count priority:(PARTaskPriority)priority block:(void(^)(NSUInteger index))block;
+// the block is called for each object, and the results are returned in the same order; nil results are replaced with NSNull
++ (NSArray *)forkJoinMapObjects:(NSArray *)objects priority:(PARTaskPriority)priority block:(id _Nullable (^)(id object, NSUInteger index))block;
+
 @end
 
 
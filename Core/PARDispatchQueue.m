@@ -5,6 +5,7 @@
 
 #import "PARDispatchQueue.h"
 #import <mach/mach_time.h>
+#import <pthread.h>
 
 // keys and context used for the `dispatch_xxx_specific` APIs and to keep track of the stack of queues
 static int PARQueueStackKey  = 1;
@@ -17,12 +18,35 @@ static int PARIsCurrentKey   = 1;
 @property (copy) NSString *_label;
 @property (strong) NSMutableDictionary *timers;
 @property (nonatomic) PARDeadlockBehavior _deadlockBehavior;
+@property (nonatomic) PARExecutor _executor;
 @property BOOL concurrent;
 @property NSUInteger timerCountPrivate;
 @end
 
 
 @implementation PARDispatchQueue
+{
+    // lock executor: the lock serializes all the blocks, whether executed inline or by the dispatch queue; the owner is only set while the lock is held, and can be compared to the current thread without holding the lock
+    pthread_mutex_t _lock;
+    pthread_t _lockOwner;
+    
+    // lock executor: blocks dispatched asynchronously and not done yet, that blocks dispatched synchronously should wait for
+    NSInteger _pendingAsynchronousBlockCount;
+}
+
+- (instancetype)init
+{
+    if (self = [super init])
+    {
+        pthread_mutex_init(&_lock, NULL);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    pthread_mutex_destroy(&_lock);
+}
 
 + (PARDispatchQueue *)dispatchQueueWithGCDQueue:(dispatch_queue_t)gcdQueue behavior:(PARDeadlockBehavior)behavior
 {
@@ -40,6 +64,13 @@ static int PARIsCurrentKey   = 1;
     return newQueue;
 }
 
++ (PARDispatchQueue *)dispatchQueueWithLabel:(NSString *)label behavior:(PARDeadlockBehavior)behavior executor:(PARExecutor)executor
+{
+    PARDispatchQueue *newQueue = [self dispatchQueueWithLabel:label behavior:behavior];
+    newQueue._executor = executor;
+    return newQueue;
+}
+
 + (PARDispatchQueue *)dispatchQueueWithLabel:(NSString *)label
 {
     return [self dispatchQueueWithLabel:label behavior:PARDeadlockBehaviorExecute];
@@ -122,38 +153,84 @@ static PARDispatchQueue *PARSharedConcurrentQueue = nil;
     return self._deadlockBehavior;
 }
 
+- (PARExecutor)executor
+{
+    return self._executor;
+}
+
+
+#pragma mark - Lock Executor
+
+- (BOOL)_isLockOwner
+{
+    pthread_t owner = __atomic_load_n(&_lockOwner, __ATOMIC_RELAXED);
+    return owner != (pthread_t)0 && pthread_equal(owner, pthread_self());
+}
+
+// the lock is not recursive: reentrant calls are handled by the deadlock behaviors, before getting here
+- (void)_performLockedBlock:(PARDispatchBlock)block
+{
+    pthread_mutex_lock(&_lock);
+    __atomic_store_n(&_lockOwner, pthread_self(), __ATOMIC_RELAXED);
+    block();
+    __atomic_store_n(&_lockOwner, (pthread_t)0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&_lock);
+}
+
+- (PARDispatchBlock)_lockedBlockWithBlock:(PARDispatchBlock)block
+{
+    if (self._executor != PARExecutorLock)
+        return block;
+    return ^{ [self _performLockedBlock:block]; };
+}
+
 
 #pragma mark - Dispatch
 
+// the queue stack of the caller is carried over inside the queue, so that the queues of the caller are still in the current queue stack when executing the block
+- (void)_dispatchSynchronouslyWithQueueStack:(PARDispatchBlock)block
+{
+    // prepare the new stack before we are inside the queue, so it can be set on the queue
+    NSMutableArray *queueStack = (__bridge NSMutableArray *)(dispatch_get_specific(&PARQueueStackKey));
+    BOOL newStack = NO;
+    if (!queueStack)
+    {
+        queueStack = [NSMutableArray array];
+        newStack = YES;
+    }
+    
+    // dispatch_queue_set_specific should be serialized within the queue, so it's consistent from one block execution to the next
+    dispatch_sync(self.queue, ^
+      {
+          if (!self.concurrent)
+              [queueStack addObject:self];
+          dispatch_queue_set_specific(self.queue, &PARQueueStackKey, (__bridge void *)queueStack, NULL);
+          block();
+          NSAssert([queueStack lastObject] == self, @"The queue stack set after execution of a block should have the parent queue as the last object: %@\n Iinstead, it has the following stack: %@", self, queueStack);
+          if (!self.concurrent)
+              [queueStack removeLastObject];
+          NSAssert(!newStack || [queueStack count] == 0, @"The queue stack should be empty after execution of a block dispatched synchronously that was started without a queue stack yet: %@", self);
+          dispatch_queue_set_specific(self.queue, &PARQueueStackKey, NULL, NULL);
+      });
+}
+
 - (void)dispatchSynchronously:(PARDispatchBlock)block
 {
     PARDeadlockBehavior behavior = self.deadlockBehavior;
 
+    // lock executor: no dispatch_sync, except to wait for the blocks dispatched asynchronously before this one
+    if (self._executor == PARExecutorLock && (behavior == PARDeadlockBehaviorBlock || ![self _isLockOwner]))
+    {
+        if (__atomic_load_n(&_pendingAsynchronousBlockCount, __ATOMIC_ACQUIRE) > 0)
+            [self _dispatchSynchronouslyWithQueueStack:^{ [self _performLockedBlock:block]; }];
+        else
+            [self _performLockedBlock:block];
+    }
+
     // dispatch_sync will only deadlock if that's the desired behavior
-    if (behavior == PARDeadlockBehaviorBlock || ![self isInCurrentQueueStack])
+    else if (behavior == PARDeadlockBehaviorBlock || ![self isInCurrentQueueStack])
     {
-        // prepare the new stack before we are inside the queue, so it can be set on the queue
-        NSMutableArray *queueStack = (__bridge NSMutableArray *)(dispatch_get_specific(&PARQueueStackKey));
-        BOOL newStack = NO;
-        if (!queueStack)
-        {
-            queueStack = [NSMutableArray array];
-            newStack = YES;
-        }
-        
-        // dispatch_queue_set_specific should be serialized within the queue, so it's consistent from one block execution to the next
-        dispatch_sync(self.queue, ^
-          {
-              if (!self.concurrent)
-                  [queueStack addObject:self];
-              dispatch_queue_set_specific(self.queue, &PARQueueStackKey, (__bridge void *)queueStack, NULL);
-              block();
-              NSAssert([queueStack lastObject] == self, @"The queue stack set after execution of a block should have the parent queue as the last object: %@\n Iinstead, it has the following stack: %@", self, queueStack);
-              if (!self.concurrent)
-                  [queueStack removeLastObject];
-              NSAssert(!newStack || [queueStack count] == 0, @"The queue stack should be empty after execution of a block dispatched synchronously that was started without a queue stack yet: %@", self);
-              dispatch_queue_set_specific(self.queue, &PARQueueStackKey, NULL, NULL);
-          });
+        [self _dispatchSynchronouslyWithQueueStack:block];
     }
 
     else
@@ -170,6 +247,11 @@ static PARDispatchQueue *PARSharedConcurrentQueue = nil;
 // asynchronous dispatch can only start a new queue stack
 - (void)dispatchAsynchronously:(PARDispatchBlock)block
 {
+    BOOL locked = (self._executor == PARExecutorLock);
+    PARDispatchBlock lockedBlock = [self _lockedBlockWithBlock:block];
+    if (locked)
+        __atomic_add_fetch(&_pendingAsynchronousBlockCount, 1, __ATOMIC_RELEASE);
+    
     if (self.concurrent)
         dispatch_async(self.queue, block);
     else
@@ -178,27 +260,39 @@ static PARDispatchQueue *PARSharedConcurrentQueue = nil;
                NSAssert(dispatch_get_specific(&PARQueueStackKey) == NULL, @"There should be no queue stack set before execution of a block dispatched asynchronously with queue: %@", self);
                NSMutableArray *queueStack = [NSMutableArray arrayWithObject:self];
                dispatch_queue_set_specific(self.queue, &PARQueueStackKey, (__bridge void *)queueStack, NULL);
-               block();
+               lockedBlock();
                NSAssert([queueStack lastObject] == self, @"The queue stack set after execution of a block should have the parent queue as the last object: %@\n Iinstead, it has the following stack: %@", self, queueStack);
                [queueStack removeLastObject];
                NSAssert([queueStack count] == 0, @"The queue stack should be empty after execution of a block dispatched asynchronously with queue: %@", self);
                dispatch_queue_set_specific(self.queue, &PARQueueStackKey, NULL, NULL);
+               if (locked)
+                   __atomic_sub_fetch(&self->_pendingAsynchronousBlockCount, 1, __ATOMIC_RELEASE);
            });
 }
 
+// with the lock executor, the queue is serial and barriers are not needed, but the lock is
 - (void)dispatchBarrierSynchronously:(PARDispatchBlock)block
 {
-    dispatch_barrier_sync(self.queue, block);
+    if (self._executor == PARExecutorLock)
+        [self dispatchSynchronously:block];
+    else
+        dispatch_barrier_sync(self.queue, block);
 }
 
 - (void)dispatchBarrierAsynchronously:(PARDispatchBlock)block
 {
-    dispatch_barrier_async(self.queue, block);
+    if (self._executor == PARExecutorLock)
+        [self dispatchAsynchronously:block];
+    else
+        dispatch_barrier_async(self.queue, block);
 }
 
 // see: https://devforums.apple.com/message/710745 for why using dispatch_get_current_queue() is not a good way to check the current queue, and why it's deprecated in iOS 6.0
+// with the lock executor, blocks dispatched synchronously run on the calling thread, and the lock owner is the reliable check
 - (BOOL)isCurrentQueue
 {
+    if (self._executor == PARExecutorLock)
+        return [self _isLockOwner];
     return (dispatch_get_specific(&PARIsCurrentKey) == (__bridge void *)(self));
 }
 
@@ -208,6 +302,9 @@ static PARDispatchQueue *PARSharedConcurrentQueue = nil;
     if (self == PARMainDispatchQueue)
         return [NSThread isMainThread];
     
+    if (self._executor == PARExecutorLock)
+        return [self _isLockOwner];
+    
     NSArray *queueStack = (__bridge NSArray *)(dispatch_get_specific(&PARQueueStackKey));
     return [queueStack containsObject:self];
 }
@@ -295,6 +392,7 @@ static PARDispatchQueue *PARSharedConcurrentQueue = nil;
     }
     
     // set the new event handler
+    PARDispatchBlock lockedBlock = [self _lockedBlockWithBlock:block];
     if (self.concurrent)
         dispatch_source_set_event_handler(dispatchTimer, ^
           {
@@ -307,7 +405,7 @@ static PARDispatchQueue *PARSharedConcurrentQueue = nil;
               NSAssert(dispatch_get_specific(&PARQueueStackKey) == NULL, @"There should be no queue stack set before execution of a block dispatched asynchronously by timer '%@' with queue: %@", name, self);
               NSMutableArray *queueStack = [NSMutableArray arrayWithObject:self];
               dispatch_queue_set_specific(self.queue, &PARQueueStackKey, (__bridge void *)queueStack, NULL);
-              block();
+              lockedBlock();
               NSAssert([queueStack lastObject] == self, @"The queue stack set after execution of a block should have the parent queue as the last object: %@\n Iinstead, it has the following stack: %@", self, queueStack);
               [queueStack removeLastObject];
               NSAssert([queueStack count] == 0, @"The queue stack should be empty after execution of a block dispatched asynchronously by timer '%@' with queue: %@", name, self);
@@ -394,6 +492,64 @@ static PARDispatchQueue *PARSharedConcurrentQueue = nil;
     return _timerCountPrivate;
 }
 
+
+
+#pragma mark - Fork/Join
+
+// chunks per core: enough for the load to balance when tasks have different costs, few enough for the scheduling cost to remain small
+#define PARForkJoinChunksPerCore 4
+
++ (void)forkJoinWithTaskCount:(NSUInteger)count priority:(PARTaskPriority)priority block:(void(^)(NSUInteger index))block
+{
+    NSUInteger processorCount = [[NSProcessInfo processInfo] activeProcessorCount];
+    if (count < 2 || processorCount < 2)
+    {
+        for (NSUInteger index = 0; index < count; index++)
+            block(index);
+        return;
+    }
+    
+    long queuePriority = DISPATCH_QUEUE_PRIORITY_DEFAULT;
+    if (priority == PARTaskPriorityHigh)
+        queuePriority = DISPATCH_QUEUE_PRIORITY_HIGH;
+    else if (priority == PARTaskPriorityLow)
+        queuePriority = DISPATCH_QUEUE_PRIORITY_LOW;
+    else if (priority == PARTaskPriorityBackground)
+        queuePriority = DISPATCH_QUEUE_PRIORITY_BACKGROUND;
+    
+    NSUInteger chunkCount = MIN(count, processorCount * PARForkJoinChunksPerCore);
+    NSUInteger chunkSize = count / chunkCount + (count % chunkCount ? 1 : 0);
+    dispatch_apply(chunkCount, dispatch_get_global_queue(queuePriority, 0), ^(size_t chunkIndex)
+    {
+        NSUInteger start = chunkIndex * chunkSize;
+        NSUInteger end = MIN(start + chunkSize, count);
+        for (NSUInteger index = start; index < end; index++)
+        {
+            @autoreleasepool
+            {
+                block(index);
+            }
+        }
+    });
+}
+
++ (NSArray *)forkJoinMapObjects:(NSArray *)objects priority:(PARTaskPriority)priority block:(id (^)(id object, NSUInteger index))block
+{
+    // each task writes to its own slot, so no locking is needed
+    NSArray *inputs = [objects copy];
+    NSUInteger count = inputs.count;
+    __strong id *results = (__strong id *)calloc(count, sizeof(id));
+    [self forkJoinWithTaskCount:count priority:priority block:^(NSUInteger index)
+    {
+        results[index] = block(inputs[index], index) ?: [NSNull null];
+    }];
+    NSArray *mappedObjects = [NSArray arrayWithObjects:results count:count];
+    for (NSUInteger index = 0; index < count; index++)
+        results[index] = nil;
+    free(results);
+    return mappedObjects;
+}
+
 @end
 
 
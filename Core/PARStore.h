@@ -17,6 +17,9 @@
 NS_ASSUME_NONNULL_BEGIN
 
 @class PARChange;
+@class PARStoreManager;
+@class PARCancellationToken;
+@class PARMergeEstimate;
 
 /// @name Notifications
 /// Notifications are posted asynchronously. You cannot expect the store to be in the state that it was after the last operation that triggered the notification. The 'Change' and 'Sync' notifications includes a user info dictionary with two entries @"values" and @"timestamps"; each entry contain a dictionary where the keys correspond to the keys changed by the sync, and the values corresponding property list values and timestamps, respectively. In the case of 'Sync' notifications, these are the same dictionaries as the one passed to the method `applySyncChangeWithValues:timestamps:`.
@@ -27,19 +30,48 @@ extern NSString *PARStoreDidDeleteNotification;
 extern NSString *PARStoreDidChangeNotification;
 extern NSString *PARStoreDidSyncNotification;
 
+/// What to do with new changes when the write backlog is full, see `maximumWriteBacklogRowCount`.
+typedef NS_ENUM(NSInteger, PARWriteBacklogPolicy)
+{
+    PARWriteBacklogPolicyBlock,
+    PARWriteBacklogPolicyFailFast,
+    PARWriteBacklogPolicyCoalesce,
+};
+
 @interface PARStore : NSObject <NSFilePresenter>
 
 /// @name Creating and Loading
 + (instancetype)storeWithURL:(nullable NSURL *)url deviceIdentifier:(NSString *)identifier;
 - (instancetype)initWithURL:(nullable NSURL *)url deviceIdentifier:(NSString *)identifier;
 + (instancetype)inMemoryStore;
++ (instancetype)storeWithURL:(nullable NSURL *)url deviceIdentifier:(NSString *)identifier manager:(nullable PARStoreManager *)manager;
+- (instancetype)initWithURL:(nullable NSURL *)url deviceIdentifier:(NSString *)identifier manager:(nullable PARStoreManager *)manager;
 - (void)load;
 - (void)closeDatabase;
 - (void)tearDown;
 
+/// @name In-Memory Stores
+/// In-memory stores keep the whole history of their changes, with timestamps and parent timestamps, so that the history, timestamps, `fetch...` and `insertChanges:...` methods behave as with a file package, without any disk access. Changes inserted for other devices are applied to the values right away, as a sync would. The history and the blobs can be written to a file package later: the changes of the in-memory store become the changes of the device passed, the changes of other devices go to their own device, and changes already in the package are skipped. This method is synchronous, and should not be called from within a transaction.
+- (BOOL)flushToURL:(NSURL *)url deviceIdentifier:(NSString *)deviceIdentifier error:(NSError **)error;
+
+/// @name Cancelling Operations
+/// Syncs, merges, history fetches and imports check for cancellation between batches of rows, so that they can be interrupted without leaving the database in an inconsistent state: batches already written are kept, and a cancelled sync does not apply any of the values it read, which are read again by the next sync. Each of these operations is cancelled by `cancelLongRunningOperations`, which `tearDown` and `tearDownNow` call first, so that they do not wait for long operations to finish; operations started afterwards are not affected. Some of them also accept a token, to be cancelled individually. A cancelled operation fails with the `NSUserCancelledError` code of the `NSCocoaErrorDomain`.
+- (void)cancelLongRunningOperations;
+
+/// @name Following Stores
+/// A follower store only reads: it opens the databases of all the devices read-only, never creates a device directory nor writes anything to the file package, and refuses any change to values or blobs. It does not cache values in memory, only the most recent timestamp of each key: values are accessed with the `fetch...` methods, and new changes are tailed by the incremental syncs, which post the usual sync notifications with the changed values.
++ (instancetype)followerStoreWithURL:(NSURL *)url;
+@property (readonly) BOOL follower;
+
+/// @name Sharing Stores
+/// Returns the same store for the same URL, device identifier and class, so that the data is only loaded and cached once in the process, and the local database is only written by one store. Each call returns a new handle on the shared store, which should be balanced by a call to `releaseSharedStore`; the store is torn down when the last handle is released, and should not be torn down directly.
++ (instancetype)sharedStoreWithURL:(NSURL *)url deviceIdentifier:(NSString *)identifier;
+- (void)releaseSharedStore;
+
 /// @name Getting Store Information
 @property (readonly, copy, nullable) NSURL *storeURL;
 @property (readonly, copy) NSString *deviceIdentifier;
+@property (readonly, retain, nullable) PARStoreManager *manager;
 @property (readonly, copy) NSArray *foreignDeviceIdentifiers;
 @property (readonly) BOOL loaded;
 @property (readonly) BOOL deleted;
@@ -53,6 +85,45 @@ extern NSString *PARStoreDidSyncNotification;
 /// @name File Coordination and Presentation
 - (void)disableFileCoordination;
 
+/// @name Database Keep-Alive
+/// After each access, the databases are kept open for a while, so that bursts of accesses do not pay over and over for reopening the databases and their prepared statements. The keep-alive interval adapts to the observed rate of accesses and to the measured time it takes to open the databases, within these bounds (default: 10 and 300 seconds). File locks are not affected: they are only held during transactions, and the local database is still "blinked" after each save for the benefit of file-syncing services.
+@property NSTimeInterval minimumDatabaseKeepAliveInterval;
+@property NSTimeInterval maximumDatabaseKeepAliveInterval;
+
+/// @name Tuning Foreign Databases
+/// SQLite settings used when opening the read-only databases of the other devices. They should be set before loading the store.
+/// `foreignDatabaseMemoryMapSize` is passed as the `mmap_size` pragma, in bytes. With memory-mapped I/O, repeated syncs read the foreign databases from mapped pages instead of `read()` calls, and all the connections opened on the same files in the process share those pages, including connections from other stores opened on the same package. Zero keeps the SQLite default.
+/// `foreignDatabaseCacheSize` is passed as the `cache_size` pragma: a positive value is a number of pages, a negative value is a number of kibibytes. Zero keeps the SQLite default.
+@property NSUInteger foreignDatabaseMemoryMapSize;
+@property NSInteger foreignDatabaseCacheSize;
+/// `maximumOpenForeignDatabaseCount` limits the number of foreign databases open at the same time, for packages with many devices. With a limit, the foreign databases are only opened when queried, syncs only read the databases that changed since the last sync, and queries on all the devices are done in groups of databases; the least recently used databases are closed first. Zero, the default, opens all the foreign databases when the database is opened.
+@property NSUInteger maximumOpenForeignDatabaseCount;
+
+/// @name Storage Maintenance
+/// New local databases are created with `auto_vacuum = INCREMENTAL`, so that free pages, e.g. left behind by merges, can be released. When the store is idle and the local database was written, a bounded step of at most `incrementalVacuumPageCount` pages is run after closing the databases (default: 256; zero disables it).
+/// `databasePageSize` is the SQLite page size in bytes used when the local database is created or rebuilt (zero keeps the SQLite default). A full rebuild runs `VACUUM` on the local database, which also migrates an existing database to the current page size and to incremental auto-vacuum. It rewrites the whole file and should be reserved for explicit maintenance. This method is synchronous, and should not be called from within a transaction, or it will fail.
+@property NSUInteger databasePageSize;
+@property NSUInteger incrementalVacuumPageCount;
+- (BOOL)performMaintenanceWithFullRebuild:(BOOL)rebuild error:(NSError **)error;
+
+/// @name Checksums
+/// When enabled, a CRC32C checksum of each new row (key, timestamps and blob) is recorded in a file next to the database of the device, and rows from other devices that arrive by sync after loading are checked against it: corrupt rows are logged and skipped. The initial load does not check checksums, to avoid slowing it down. Rows without a checksum, e.g. written by older versions, are considered valid. It should be set before loading the store.
+/// The verifier checks all the rows of all the devices in the background, with separate read-only connections, and calls the completion handler on a background queue with the corrupt rows by device identifier.
+@property BOOL checksumsEnabled;
+- (void)verifyChecksumsWithCompletionHandler:(void(^)(NSDictionary<NSString *, NSArray<PARChange *> *> *corruptChanges))completionHandler;
+
+/// @name Summaries
+/// When enabled, a summary of the rows of the device is kept in a file next to its database, and updated after each save: rows are hashed with FNV-1a and grouped by time, in buckets of about 18 minutes, which are the leaves of a hash tree. Comparing the summaries of two stores only descends into the branches that differ, and gives the ranges of timestamps with different rows, e.g. to pass to `fetchChangesFromTimestamp:toTimestamp:forDeviceIdentifier:` and `insertChanges:...`, so that only those rows need to be read and copied. Merging skips the devices with the same summary in both stores. The root hash and row count of the summary are also saved in the database metadata with the rows, so that a summary stays valid in a copy of the package, but not for a database synced without its summary. A summary that is missing or does not match its database, e.g. for devices running older versions, is rebuilt from the rows when needed. It should be set before loading the store.
+/// The summary hash is the root of the tree: two databases with the same rows have the same hash. The ranges are arrays with the first and last timestamps, inclusive, in timestamp order. Both return nil for in-memory stores or if a database cannot be read. These methods are synchronous, and should not be called from within a transaction, or they will fail.
+@property BOOL summariesEnabled;
+- (nullable NSData *)summaryHashForDeviceIdentifier:(NSString *)deviceIdentifier;
+- (nullable NSArray<NSArray<NSNumber *> *> *)timestampRangesDifferingFromStore:(PARStore *)store forDeviceIdentifier:(NSString *)deviceIdentifier;
+
+/// @name Journaling Writes
+/// Changes are saved to the database in batches, up to 15 seconds after they are made, so a crash can lose the most recent ones. When the journal is enabled, each change is also appended to a journal file in the device directory, which is replayed into the database the next time the store is loaded. Each save starts a new journal segment and removes the segments whose changes are all saved, so the journal stays small even while changes keep coming. Appends are flushed to disk with `fsync`: with a `journalSyncInterval` of zero, the default, before the setter returns; otherwise, the changes made within that interval share a single flush, and a crash can lose at most that interval. It should be set before loading the store.
+@property BOOL journalEnabled;
+@property NSTimeInterval journalSyncInterval;
+
 /// @name Adding and Accessing Values
 - (nullable id)propertyListValueForKey:(NSString *)key;
 - (void)setPropertyListValue:(nullable id)plist forKey:(NSString *)key;
@@ -63,6 +134,41 @@ extern NSString *PARStoreDidSyncNotification;
 
 - (void)runTransaction:(PARDispatchBlock)block;
 
+/// @name Bounding the Write Backlog
+/// Changes are applied to the memory layer immediately, and inserted in the database later, in the order they were made. When the database queue is busy, e.g. with a long sync or merge, the changes waiting to be inserted, with their encoded values, form a backlog. It can be capped by number of rows and by bytes (default: zero, no limit), and the policy decides what happens to new changes when the backlog is over the cap:
+///  - `PARWriteBacklogPolicyBlock` waits until the backlog is under the cap again, except within a transaction, where waiting could deadlock
+///  - `PARWriteBacklogPolicyFailFast` refuses the change, which is then not applied at all; `setPropertyListValue:forKey:error:` returns the error
+///  - `PARWriteBacklogPolicyCoalesce` applies the change, but only writes the latest change of each key until the backlog drains, so that the intermediate values do not appear in the history
+/// The cap is approximate, since concurrent changes are counted only after they pass the check. `writeBacklogRowCount` and `writeBacklogByteCount` are the current size of the backlog.
+@property NSUInteger maximumWriteBacklogRowCount;
+@property NSUInteger maximumWriteBacklogByteCount;
+@property PARWriteBacklogPolicy writeBacklogPolicy;
+@property (readonly) NSUInteger writeBacklogRowCount;
+@property (readonly) NSUInteger writeBacklogByteCount;
+- (BOOL)setPropertyListValue:(nullable id)plist forKey:(NSString *)key error:(NSError **)error NS_SWIFT_NAME(trySetPropertyListValue(_:forKey:));
+
+/// @name Importing Values
+/// Imports a large number of entries, without holding them all in memory at once. Each object returned by the enumerator should be a dictionary with one or more entries, with the same semantics as `setEntriesFromDictionary:`.
+/// Entries are written to the local database in large transactions, sorted by key, and applied to the memory layer batch by batch, with one change notification per batch. Batches already imported stay in the store if an error occurs.
+/// The store should be loaded first. These methods are synchronous, and should not be called from within a transaction, or they will fail.
+- (BOOL)importEntriesFromEnumerator:(NSEnumerator<NSDictionary *> *)enumerator error:(NSError **)error;
+- (BOOL)importEntriesFromEnumerator:(NSEnumerator<NSDictionary *> *)enumerator cancellationToken:(nullable PARCancellationToken *)cancellationToken error:(NSError **)error;
+/// The file should contain one JSON object per line (NDJSON); each object is a dictionary of entries, and JSON `null` values remove the corresponding keys.
+- (BOOL)importEntriesFromJSONLinesAtURL:(NSURL *)url error:(NSError **)error;
+
+/// @name Sealed Base Layer
+/// A sealed file is a compact and immutable snapshot of entries, with the keys sorted and indexed for binary search. It is typically used to ship large reference datasets, without having to replay their logs on every client.
+/// Once mounted, the sealed file acts as a read-only base layer below the logs of all devices: a sealed value is only visible for keys without any log, and any change to a key, including its removal, hides it. Mounting is instant, since the file is memory-mapped and only read when values are accessed. It is not supported for in-memory stores.
++ (BOOL)writeSealedFileWithEntries:(NSDictionary *)entries toURL:(NSURL *)url error:(NSError **)error;
+- (BOOL)mountSealedFileAtURL:(NSURL *)url error:(NSError **)error;
+@property (readonly, copy, nullable) NSURL *sealedFileURL;
+
+/// @name Sharing the Cache Between Processes
+/// Processes opening the same package can share a snapshot of its state instead of each loading and decoding all the logs. One process publishes the snapshot to `sharedCacheURL`, after its saves and syncs, or when asked to; the file is replaced atomically, so that readers always map a complete version. When loading, a store with a snapshot at `sharedCacheURL` maps it read-only, starts from its timestamps, and only syncs the logs added since. Values are decoded from the mapped file when first accessed. The URL should be set before loading; a snapshot published for another package, or for devices that cannot be found, is ignored.
+@property (copy, nullable) NSURL *sharedCacheURL;
+@property BOOL publishesSharedCache;
+- (BOOL)publishSharedCacheWithError:(NSError **)error;
+
 /// @name Adding and Accessing Blobs
 - (BOOL)writeBlobData:(NSData *)data toPath:(NSString *)path error:(NSError **)error;
 - (BOOL)writeBlobFromPath:(NSString *)sourcePath toPath:(NSString *)path error:(NSError **)error;
@@ -72,6 +178,12 @@ extern NSString *PARStoreDidSyncNotification;
 - (NSArray<NSString *> *)absolutePathsForBlobsPrefixedBy:(NSString *)prefix NS_SWIFT_NAME(absolutePaths(forBlobsPrefixedBy:));
 - (void)enumerateBlobs:(void(^)(NSString *path))block;
 
+/// @name Packing Blobs
+/// Blobs smaller than `blobPackThreshold` bytes are appended to a pack file of the device, in the hidden `.packs` directory of the blob directory, instead of each having its own file (default: 0, which disables packing). The paths and methods to access blobs are the same, and packed blobs are read and enumerated whatever the threshold, including blobs packed by other devices; for a given path, the most recent version wins, whether packed or in its own file. Packed blobs do not have a file of their own: `absolutePathForBlobPath:` gives the path the file would have, and `blobDataAtPath:error:` should be used to read them. Only enable packing once all the devices sharing the package can read packed blobs.
+/// Replaced and deleted blobs stay in the pack until it is repacked, which is done in the background once they take most of a pack larger than 1 MiB, or when asked to. Merging appends to the pack of the device the packed blobs that are more recent in the merged store.
+@property NSUInteger blobPackThreshold;
+- (BOOL)repackBlobsWithError:(NSError **)error;
+
 /// @name Syncing
 - (void)sync;
 
@@ -84,6 +196,14 @@ extern NSString *PARStoreDidSyncNotification;
 
 /// @name Merging
 - (void)mergeStore:(PARStore *)store unsafeDeviceIdentifiers:(NSArray *)activeDeviceIdentifiers completionHandler:(nullable void(^)(NSError*))completionHandler;
+/// A cancelled merge stops between devices: the devices already merged keep their merged logs, and the memory layer is reloaded as after a complete merge.
+- (void)mergeStore:(PARStore *)store unsafeDeviceIdentifiers:(NSArray *)activeDeviceIdentifiers cancellationToken:(nullable PARCancellationToken *)cancellationToken completionHandler:(nullable void(^)(NSError*))completionHandler;
+/// Reports what merging the store passed would change, without changing anything, e.g. to decide when to schedule a large merge. The databases are read with separate read-only connections, so the queues of the stores are not blocked, and only the timestamps, keys and parent timestamps of the rows are read, not their blobs: rows are compared on these attributes only. When summaries are enabled in both stores and up to date, identical devices are skipped and only the ranges that differ are read; summaries are not rebuilt. The completion handler is called on a background queue.
+- (void)estimateMergeOfStore:(PARStore *)store unsafeDeviceIdentifiers:(NSArray *)activeDeviceIdentifiers completionHandler:(void(^)(PARMergeEstimate * _Nullable estimate, NSError * _Nullable error))completionHandler;
+
+/// @name Archiving Inactive Devices
+/// Folds the logs of the devices without any change for the given time interval into a single read-only archive database, and removes their directories. The same safety rules as merging apply: the local device and the unsafe devices, which could still be writing, are never archived. Syncs only read the archive again after it changes, which speeds them up for packages with many retired devices. The completion handler is called on an arbitrary queue, with the identifiers of the archived devices.
+- (void)archiveDevicesInactiveForTimeInterval:(NSTimeInterval)interval unsafeDeviceIdentifiers:(nullable NSArray *)unsafeDeviceIdentifiers completionHandler:(nullable void(^)(NSArray<NSString *> *archivedDeviceIdentifiers, NSError * _Nullable error))completionHandler;
 
 /// @name Getting Timestamps
 + (NSNumber *)timestampNow;
@@ -115,6 +235,15 @@ extern NSString *PARStoreDidSyncNotification;
 /// Pass in nil for the device identifier to get results for all devices.
 - (NSArray<PARChange *> *)fetchChangesSinceTimestamp:(nullable NSNumber *)timestamp forDeviceIdentifier:(nullable NSString *)deviceIdentifier;
 
+/// Same as above, but returns nil if the fetch is cancelled.
+- (nullable NSArray<PARChange *> *)fetchChangesSinceTimestamp:(nullable NSNumber *)timestamp forDeviceIdentifier:(nullable NSString *)deviceIdentifier cancellationToken:(nullable PARCancellationToken *)cancellationToken;
+
+/// Same as above, but the changes are passed to the block one at a time, in timestamp order, instead of being returned at once.
+/// The history of each device is read a page at a time and merged, so that memory use is bounded by the number of devices rather than the number of changes.
+/// The block is called from within the database queue. Set `stop` to YES to end the enumeration early.
+/// Returns NO if the enumeration is cancelled.
+- (BOOL)enumerateChangesSinceTimestamp:(nullable NSNumber *)timestamp forDeviceIdentifier:(nullable NSString *)deviceIdentifier cancellationToken:(nullable PARCancellationToken *)cancellationToken usingBlock:(void(^)(PARChange *change, BOOL *stop))block;
+
 /// This method returns an array of PARChange instances for the device identifier passed in, between (and including) the timestamps passed.
 /// It should not be called from within a transaction, or it will fail.
 /// Pass in nil for the device identifier to get results for all devices.
@@ -155,6 +284,36 @@ extern NSString *PARStoreDidSyncNotification;
 @end
 
 
+/// Manages resources shared by many stores in the same process.
+/// Stores created with a manager use its notification queue, file presenter queue and file system event queue, instead of creating their own. Each store still has its own database and memory queues, which serialize access to its data.
+/// The databases of the stores are also held to the memory budget of the manager: when the estimated memory used by the open databases of all its stores goes over the budget, the databases of the least recently used stores are closed, and reopened as needed. The estimate is based on the SQLite page cache of each connection (default: 64 MiB; zero means no budget).
+@interface PARStoreManager : NSObject
++ (PARStoreManager *)sharedManager;
+@property NSUInteger memoryBudget;
+@property (readonly) NSUInteger estimatedMemoryUsage;
+@end
+
+
+/// Cancels the operations it is passed to. Cancelling is thread-safe, and cannot be undone: a new token should be used for each new operation.
+@interface PARCancellationToken : NSObject
++ (PARCancellationToken *)token;
+- (void)cancel;
+@property (readonly, getter=isCancelled) BOOL cancelled;
+@end
+
+
+/// What `mergeStore:...` would change, as estimated by `estimateMergeOfStore:...`.
+/// Row counts are by device identifier, and only include devices with rows to write: the rows to add to each device, and, for unsafe devices, the rows that would be written to their virtual device. Identical devices were found identical with their summaries, without reading their rows. Blob files are the files and packed blobs that would be copied, because they are missing or older in the destination.
+@interface PARMergeEstimate : NSObject
+@property (readonly, copy) NSDictionary<NSString *, NSNumber *> *addedRowCountsByDeviceIdentifier;
+@property (readonly, copy) NSDictionary<NSString *, NSNumber *> *virtualRowCountsByDeviceIdentifier;
+@property (readonly, copy) NSArray<NSString *> *identicalDeviceIdentifiers;
+@property (readonly) NSUInteger addedRowCount;
+@property (readonly) NSUInteger blobFileCount;
+@property (readonly) unsigned long long blobByteCount;
+@end
+
+
 @interface PARChange : NSObject
 + (PARChange *)changeWithTimestamp:(NSNumber *)timestamp parentTimestamp:(nullable NSNumber *)parentTimestamp key:(NSString *)key propertyList:(nullable id)propertyList;
 + (PARChange *)changeWithPropertyDictionary:(NSDictionary *)propertyDictionary;
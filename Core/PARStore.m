@@ -5,6 +5,9 @@
 #import "PARStore.h"
 #import "NSError+Factory.h"
 #import <CoreData/CoreData.h>
+#import <sys/stat.h>
+#import <fcntl.h>
+#import <unistd.h>
 
 #define ErrorLog(fmt, ...) NSLog(fmt, ##__VA_ARGS__)
 
@@ -31,6 +34,23 @@ NSString *const TimestampAttributeName       = @"timestamp";
 NSString *const ParentTimestampAttributeName = @"parentTimestamp";
 
 
+// identifies the version of a file on disk (inode, size, modification date), so we can skip work when the file did not change
+static NSString *PARFingerprintForFileInfo(const struct stat *info)
+{
+    return [NSString stringWithFormat:@"%llu-%lld-%ld.%09ld", (unsigned long long)info->st_ino, (long long)info->st_size, (long)info->st_mtimespec.tv_sec, (long)info->st_mtimespec.tv_nsec];
+}
+
+static NSString *PARFingerprintForFileAtPath(NSString *path)
+{
+    struct stat info;
+    if (path == nil || stat(path.fileSystemRepresentation, &info) != 0)
+    {
+        return nil;
+    }
+    return PARFingerprintForFileInfo(&info);
+}
+
+
 // A subclass of NSFileCoordinator that doesn't use coordination.
 // This is used to disable coordination, for a performance boost when it is not needed.
 @interface _PARFileUncoordinator : NSFileCoordinator
@@ -49,747 +69,3619 @@ NSString *const ParentTimestampAttributeName = @"parentTimestamp";
 @end
 
 
-@interface PARStore ()
-@property (readwrite, copy) NSURL *storeURL;
-@property (readwrite, copy) NSString *deviceIdentifier;
-
-// databaseQueue serializes access to all CoreData related stuff
-@property (retain) PARDispatchQueue *databaseQueue;
-@property (retain) NSManagedObjectContext *_managedObjectContext;
-@property (retain) NSPersistentStore *readwriteDatabase;
-@property (copy) NSArray *readonlyDatabases;
-@property (retain) NSMutableDictionary *databaseTimestamps;
-@property (copy) NSDictionary *keyTimestamps;
-
-// memoryQueue serializes access to in-memory storage
-// to avoid deadlocks, the memoryQueue should never schedule synchronous blocks in databaseQueue (but the opposite is fine)
-@property (retain) PARDispatchQueue *memoryQueue;
-@property (retain, nonatomic) NSMutableDictionary *_memory;
-@property (readwrite, nonatomic) BOOL _loaded;
-@property (readwrite, nonatomic) BOOL _deleted;
-@property (readwrite, nonatomic) BOOL _inMemory;
-@property (readwrite, nonatomic) BOOL _inMemoryCacheEnabled;
-@property (retain, nonatomic) NSMutableDictionary *_memoryFileData;
-@property (retain) NSMutableDictionary *_memoryKeyTimestamps;
-
-// handling transactions
-@property BOOL inTransaction;
-@property NSMutableDictionary *didChangeNotificationUserInfoInTransaction;
-
-// queue for the notifications
-@property (retain) PARDispatchQueue *notificationQueue;
-
-// queue needed for NSFilePresenter protocol
-@property (retain) NSOperationQueue *presenterQueue;
-
-// File coordination
-@property (readwrite, nonatomic) BOOL _fileCoordinationEnabled;
-
-// responding to file system events (Mac only)
-#if TARGET_OS_IPHONE | TARGET_IPHONE_SIMULATOR
-#elif TARGET_OS_MAC
-@property (strong) PARDispatchQueue *fileSystemEventQueue;
-@property FSEventStreamRef eventStreamDevices;
-@property FSEventStreamRef eventStreamLogs;
-#endif
-
-- (void)createFileSystemEventQueue;
-- (void)startFileSystemEventStreams;
-- (void)refreshFileSystemEventStreamLogs;
-- (void)stopFileSystemEventStreams;
-
+// Enumerates the objects in a file with one JSON object per line (also known as NDJSON), reading the file in chunks, so that large files do not need to be loaded in memory.
+// The enumeration stops at the first invalid line, and the `error` property is then set.
+@interface _PARJSONLinesEnumerator : NSEnumerator
+- (instancetype)initWithURL:(NSURL *)url;
+@property (readonly, retain) NSError *error;
 @end
 
+@interface _PARJSONLinesEnumerator ()
+@property (retain) NSInputStream *stream;
+@property (retain) NSMutableData *buffer;
+@property BOOL endOfStream;
+@property NSUInteger lineNumber;
+@property (readwrite, retain) NSError *error;
+@end
 
+@implementation _PARJSONLinesEnumerator
 
-@implementation PARStore
+- (instancetype)initWithURL:(NSURL *)url
+{
+    if (self = [super init])
+    {
+        self.stream = [NSInputStream inputStreamWithURL:url];
+        self.buffer = [NSMutableData data];
+        [self.stream open];
+    }
+    return self;
+}
 
-+ (instancetype)storeWithURL:(NSURL *)url deviceIdentifier:(NSString *)identifier
+- (void)dealloc
 {
-    return [[self alloc] initWithURL:url deviceIdentifier:identifier];
+    [_stream close];
 }
 
-- (instancetype)initWithURL:(NSURL *)url deviceIdentifier:(NSString *)identifier
+- (NSData *)nextLine
 {
-    if (self = [super init])
+    while (YES)
     {
-        self.storeURL = url;
-        self.deviceIdentifier = identifier;
-        
-        // queue labels appear in crash reports and other debugging info
-        NSString *urlLabel = [[url lastPathComponent] stringByReplacingOccurrencesOfString:@"." withString:@"_"];
-        NSString *databaseQueueLabel = [PARDispatchQueue labelByPrependingBundleIdentifierToString:[NSString stringWithFormat:@"database.%@", urlLabel]];
-        NSString *memoryQueueLabel = [PARDispatchQueue labelByPrependingBundleIdentifierToString:[NSString stringWithFormat:@"memory.%@", urlLabel]];
-        NSString *notificationQueueLabel = [PARDispatchQueue labelByPrependingBundleIdentifierToString:[NSString stringWithFormat:@"notifications.%@", urlLabel]];
-        self.databaseQueue     = [PARDispatchQueue dispatchQueueWithLabel:databaseQueueLabel];
-        self.memoryQueue       = [PARDispatchQueue dispatchQueueWithLabel:memoryQueueLabel];
-        self.notificationQueue = [PARDispatchQueue dispatchQueueWithLabel:notificationQueueLabel];
-        [self createFileSystemEventQueue];
+        // a complete line is already in the buffer
+        const char *bytes = self.buffer.bytes;
+        NSUInteger length = self.buffer.length;
+        const char *newline = (length > 0) ? memchr(bytes, '\n', length) : NULL;
+        if (newline != NULL)
+        {
+            NSUInteger lineLength = newline - bytes;
+            NSData *line = [self.buffer subdataWithRange:NSMakeRange(0, lineLength)];
+            [self.buffer replaceBytesInRange:NSMakeRange(0, lineLength + 1) withBytes:NULL length:0];
+            return line;
+        }
         
-        // misc initializations
-        self.databaseTimestamps = [NSMutableDictionary dictionary];
-        self.presenterQueue = [[NSOperationQueue alloc] init];
-        [self.presenterQueue setMaxConcurrentOperationCount:1];
-        self._memory = [NSMutableDictionary dictionary];
-        self._memoryFileData = [NSMutableDictionary dictionary];
-        self._memoryKeyTimestamps = [NSMutableDictionary dictionary];
-        self._loaded = NO;
-        self._deleted = NO;
-        self._inMemoryCacheEnabled = YES;
-        self._fileCoordinationEnabled = YES;
+        // the last line may not have a trailing newline
+        if (self.endOfStream)
+        {
+            if (length == 0)
+                return nil;
+            NSData *line = [self.buffer copy];
+            self.buffer.length = 0;
+            return line;
+        }
         
-        // in memory store?
-        if (url == nil)
+        // read the next chunk
+        uint8_t chunk[16 * 1024];
+        NSInteger readLength = [self.stream read:chunk maxLength:sizeof(chunk)];
+        if (readLength < 0)
         {
-            self._inMemory = YES;
-            self._loaded = YES;
-            // no database layer, already loaded
-            self.databaseQueue = nil;
+            self.error = [NSError errorWithObject:self code:__LINE__ localizedDescription:@"Could not read JSON lines from stream" underlyingError:self.stream.streamError];
+            return nil;
         }
+        if (readLength == 0)
+            self.endOfStream = YES;
+        else
+            [self.buffer appendBytes:chunk length:readLength];
     }
-    return self;
 }
 
-+ (instancetype)inMemoryStore
+- (id)nextObject
 {
-    return [self storeWithURL:nil deviceIdentifier:@""];
+    while (self.error == nil)
+    {
+        NSData *line = [self nextLine];
+        if (line == nil)
+            return nil;
+        self.lineNumber ++;
+        
+        // blank lines are ignored
+        NSString *string = [[NSString alloc] initWithData:line encoding:NSUTF8StringEncoding];
+        if ([[string stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]] length] == 0)
+            continue;
+        
+        NSError *jsonError = nil;
+        id object = [NSJSONSerialization JSONObjectWithData:line options:0 error:&jsonError];
+        if (![object isKindOfClass:[NSDictionary class]])
+        {
+            self.error = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Line %@ should be a JSON object", @(self.lineNumber)] underlyingError:jsonError];
+            return nil;
+        }
+        return object;
+    }
+    return nil;
 }
 
-- (NSString *)description
-{
-    return [NSString stringWithFormat:@"<%@:%p> (device identifier: %@, url path: %@)", self.class, self, self.deviceIdentifier, self.storeURL.path];
-}
+@end
 
-#pragma mark - In-Memory Caching
 
-- (BOOL)inMemoryCacheEnabled {
-    return self._inMemoryCacheEnabled;
-}
+// A sealed file is an immutable snapshot of entries, designed to be memory-mapped and queried in place, without loading it:
+//   header: magic "PARSEAL1", uint32 version, uint32 reserved, uint64 entry count, uint64 index offset
+//   data:   the keys (UTF-8) and values (binary property lists, same as the 'blob' column of the logs)
+//   index:  one record per entry, sorted by the UTF-8 bytes of the keys: uint64 key offset, uint64 value offset, uint32 key length, uint32 value length
+// All integers are little-endian, and all offsets are from the beginning of the file.
+static const char PARSealedFileMagic[8] = {'P', 'A', 'R', 'S', 'E', 'A', 'L', '1'};
+static const uint32_t PARSealedFileVersion = 1;
+#define PARSealedFileHeaderLength 32
+#define PARSealedFileIndexRecordLength 24
+
+@interface _PARSealedFile : NSObject
++ (instancetype)sealedFileWithURL:(NSURL *)url error:(NSError **)error;
++ (BOOL)writeBlobs:(NSDictionary *)blobs toURL:(NSURL *)url error:(NSError **)error;
+@property (readonly, copy) NSURL *URL;
+@property (readonly) uint64_t count;
+// the returned data points directly into the mapped file, and should not outlive the sealed file
+- (NSData *)blobForKey:(NSString *)key;
+- (void)enumerateKeysAndBlobsUsingBlock:(void(^)(NSString *key, NSData *blob, BOOL *stop))block;
+@end
 
-- (void)disableInMemoryCache {
-    self._inMemoryCacheEnabled = NO;
-    self._memory = nil;
-}
+@interface _PARSealedFile ()
+@property (readwrite, copy) NSURL *URL;
+@property (retain) NSData *data;
+@property (readwrite) uint64_t count;
+@property uint64_t indexOffset;
+@end
 
-#pragma mark - File Coordination and Presentation
+@implementation _PARSealedFile
 
-- (BOOL)fileCoordinationEnabled {
-    return self._fileCoordinationEnabled;
+static uint32_t PARSealedFileReadUInt32(const uint8_t *bytes)
+{
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return CFSwapInt32LittleToHost(value);
 }
 
-- (void)disableFileCoordination {
-    [NSFileCoordinator removeFilePresenter:self];
-    self._fileCoordinationEnabled = NO;
-    self.presenterQueue = nil;
+static uint64_t PARSealedFileReadUInt64(const uint8_t *bytes)
+{
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return CFSwapInt64LittleToHost(value);
 }
 
-#pragma mark - Loading / Closing Memory Layer
-
-// loading = populating the memory cache with the values from disk
-// loading is only done once, before adding or accessing values
+static void PARSealedFileAppendUInt32(NSMutableData *data, uint32_t value)
+{
+    value = CFSwapInt32HostToLittle(value);
+    [data appendBytes:&value length:sizeof(value)];
+}
 
-- (BOOL)loaded
+static void PARSealedFileAppendUInt64(NSMutableData *data, uint64_t value)
 {
-    __block BOOL loaded = NO;
-    [self.memoryQueue dispatchSynchronously:^{ loaded = self._loaded; }];
-    return loaded;
+    value = CFSwapInt64HostToLittle(value);
+    [data appendBytes:&value length:sizeof(value)];
 }
 
-- (void)_load
+static NSComparisonResult PARSealedFileCompareBytes(const void *bytes1, NSUInteger length1, const void *bytes2, NSUInteger length2)
 {
-    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class], NSStringFromSelector(_cmd));
+    int result = memcmp(bytes1, bytes2, MIN(length1, length2));
+    if (result == 0)
+        return (length1 == length2) ? NSOrderedSame : (length1 < length2 ? NSOrderedAscending : NSOrderedDescending);
+    return (result < 0) ? NSOrderedAscending : NSOrderedDescending;
+}
 
-    if ([self loaded])
++ (instancetype)sealedFileWithURL:(NSURL *)url error:(NSError **)error
+{
+    // mapping the file is instant, and pages are only read when accessed
+    NSError *readError = nil;
+    NSData *data = [NSData dataWithContentsOfURL:url options:NSDataReadingMappedAlways error:&readError];
+    NSString *failure = nil;
+    if (data == nil)
+        failure = @"Could not map sealed file";
+    else if (data.length < PARSealedFileHeaderLength || memcmp(data.bytes, PARSealedFileMagic, sizeof(PARSealedFileMagic)) != 0)
+        failure = @"Invalid sealed file header";
+    else if (PARSealedFileReadUInt32((const uint8_t *)data.bytes + 8) != PARSealedFileVersion)
+        failure = @"Unsupported sealed file version";
+    
+    uint64_t count = 0;
+    uint64_t indexOffset = 0;
+    if (failure == nil)
     {
-        return;
+        count = PARSealedFileReadUInt64((const uint8_t *)data.bytes + 16);
+        indexOffset = PARSealedFileReadUInt64((const uint8_t *)data.bytes + 24);
+        if (indexOffset < PARSealedFileHeaderLength || indexOffset > data.length || count > (data.length - indexOffset) / PARSealedFileIndexRecordLength)
+            failure = @"Invalid sealed file index";
     }
     
-    [self _sync];
+    if (failure != nil)
+    {
+        if (error != NULL)
+            *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"%@ at path: %@", failure, url.path] underlyingError:readError];
+        return nil;
+    }
     
-    if ([self loaded] && self._fileCoordinationEnabled)
+    _PARSealedFile *sealedFile = [[_PARSealedFile alloc] init];
+    sealedFile.URL = url;
+    sealedFile.data = data;
+    sealedFile.count = count;
+    sealedFile.indexOffset = indexOffset;
+    return sealedFile;
+}
+
+// the index records are only checked as they are accessed, so that mounting the file does not have to read it all
+- (BOOL)getRecordAtIndex:(uint64_t)index key:(const uint8_t **)key keyLength:(uint32_t *)keyLength value:(const uint8_t **)value valueLength:(uint32_t *)valueLength
+{
+    const uint8_t *bytes = self.data.bytes;
+    uint64_t length = self.data.length;
+    const uint8_t *record = bytes + self.indexOffset + index * PARSealedFileIndexRecordLength;
+    uint64_t keyOffset = PARSealedFileReadUInt64(record);
+    uint64_t valueOffset = PARSealedFileReadUInt64(record + 8);
+    *keyLength = PARSealedFileReadUInt32(record + 16);
+    *valueLength = PARSealedFileReadUInt32(record + 20);
+    if (keyOffset > length || *keyLength > length - keyOffset || valueOffset > length || *valueLength > length - valueOffset)
     {
-        // DebugLog(@"%@ added as file presenter", self.deviceIdentifier);
-        [NSFileCoordinator addFilePresenter:self];
-        [self startFileSystemEventStreams];
+        ErrorLog(@"Invalid record %@ in sealed file at path: %@", @(index), self.URL.path);
+        return NO;
     }
+    *key = bytes + keyOffset;
+    *value = bytes + valueOffset;
+    return YES;
 }
 
-- (void)load
+- (NSData *)blobForKey:(NSString *)key
 {
-    [self.databaseQueue dispatchAsynchronously:^{ [self _load]; }];
+    NSData *keyData = [key dataUsingEncoding:NSUTF8StringEncoding];
+    uint64_t low = 0;
+    uint64_t high = self.count;
+    while (low < high)
+    {
+        uint64_t middle = low + (high - low) / 2;
+        const uint8_t *recordKey, *recordValue;
+        uint32_t recordKeyLength, recordValueLength;
+        if (![self getRecordAtIndex:middle key:&recordKey keyLength:&recordKeyLength value:&recordValue valueLength:&recordValueLength])
+            return nil;
+        NSComparisonResult comparison = PARSealedFileCompareBytes(recordKey, recordKeyLength, keyData.bytes, keyData.length);
+        if (comparison == NSOrderedSame)
+            return [NSData dataWithBytesNoCopy:(void *)recordValue length:recordValueLength freeWhenDone:NO];
+        if (comparison == NSOrderedAscending)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return nil;
 }
 
-- (void)loadNow
+- (void)enumerateKeysAndBlobsUsingBlock:(void(^)(NSString *key, NSData *blob, BOOL *stop))block
 {
-    if ([self.memoryQueue isInCurrentQueueStack])
+    BOOL stop = NO;
+    for (uint64_t index = 0; index < self.count && !stop; index++)
     {
-        ErrorLog(@"To avoid deadlocks, %@ should not be called within a transaction. Bailing out.", NSStringFromSelector(_cmd));
-        return;
+        @autoreleasepool
+        {
+            const uint8_t *recordKey, *recordValue;
+            uint32_t recordKeyLength, recordValueLength;
+            if (![self getRecordAtIndex:index key:&recordKey keyLength:&recordKeyLength value:&recordValue valueLength:&recordValueLength])
+                continue;
+            NSString *key = [[NSString alloc] initWithBytes:recordKey length:recordKeyLength encoding:NSUTF8StringEncoding];
+            if (key == nil)
+                continue;
+            block(key, [NSData dataWithBytesNoCopy:(void *)recordValue length:recordValueLength freeWhenDone:NO], &stop);
+        }
     }
-    [self.databaseQueue dispatchSynchronously:^{ [self _load]; }];
 }
 
-- (void)_tearDownMemory
++ (BOOL)writeBlobs:(NSDictionary *)blobs toURL:(NSURL *)url error:(NSError **)error
 {
-    NSAssert([self.memoryQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the memory queue", [self class], NSStringFromSelector(_cmd));
+    // keys sorted by their UTF-8 bytes, the order used by the binary search
+    NSMutableArray *keys = [NSMutableArray arrayWithCapacity:blobs.count];
+    for (NSString *key in blobs)
+        [keys addObject:[key dataUsingEncoding:NSUTF8StringEncoding]];
+    [keys sortUsingComparator:^NSComparisonResult(NSData *key1, NSData *key2)
+     {
+         return PARSealedFileCompareBytes(key1.bytes, key1.length, key2.bytes, key2.length);
+     }];
+    
+    // header, with the index offset filled at the end
+    NSMutableData *data = [NSMutableData data];
+    [data appendBytes:PARSealedFileMagic length:sizeof(PARSealedFileMagic)];
+    PARSealedFileAppendUInt32(data, PARSealedFileVersion);
+    PARSealedFileAppendUInt32(data, 0);
+    PARSealedFileAppendUInt64(data, keys.count);
+    PARSealedFileAppendUInt64(data, 0);
+    
+    // keys and values
+    NSMutableData *index = [NSMutableData dataWithCapacity:keys.count * PARSealedFileIndexRecordLength];
+    for (NSData *key in keys)
+    {
+        NSData *blob = blobs[[[NSString alloc] initWithData:key encoding:NSUTF8StringEncoding]];
+        PARSealedFileAppendUInt64(index, data.length);
+        [data appendData:key];
+        PARSealedFileAppendUInt64(index, data.length);
+        [data appendData:blob];
+        PARSealedFileAppendUInt32(index, (uint32_t)key.length);
+        PARSealedFileAppendUInt32(index, (uint32_t)blob.length);
+    }
+    
+    // index
+    uint64_t indexOffset = CFSwapInt64HostToLittle(data.length);
+    [data replaceBytesInRange:NSMakeRange(24, sizeof(indexOffset)) withBytes:&indexOffset];
+    [data appendData:index];
+    
+    NSError *writeError = nil;
+    if (![data writeToURL:url options:NSDataWritingAtomic error:&writeError])
+    {
+        if (error != NULL)
+            *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Could not write sealed file at path: %@", url.path] underlyingError:writeError];
+        return NO;
+    }
+    return YES;
+}
 
-    // reset in-memory info
-    self._memory = self._inMemoryCacheEnabled ? [NSMutableDictionary dictionary] : nil;
-    self._memoryKeyTimestamps = [NSMutableDictionary dictionary];
-    self._loaded = NO;
-    self._deleted = NO;
+@end
 
-}
 
-- (void)_tearDown
+// Row checksums are kept in a file next to the database of each device, rather than in an additional column, so that the databases stay readable by clients using the current model.
+// The file is a sequence of 16-byte records, appended after each save: int64 timestamp, uint32 CRC32C of the key, uint32 CRC32C of the row (key, timestamp, parent timestamp and blob); all little-endian.
+// Rows without a record, e.g. written by older clients or not synced yet, cannot be checked and are considered valid.
+typedef struct
 {
-    NSAssert([self.memoryQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the memory queue", [self class], NSStringFromSelector(_cmd));
+    int64_t timestamp;
+    uint32_t keyChecksum;
+    uint32_t rowChecksum;
+} PARChecksumRecord;
+
+@interface _PARChecksumFile : NSObject
++ (instancetype)checksumFileWithPath:(NSString *)path;
++ (void)appendRecordForKey:(NSString *)key timestamp:(NSNumber *)timestamp parentTimestamp:(NSNumber *)parentTimestamp blob:(NSData *)blob toData:(NSMutableData *)data;
++ (BOOL)writeRecords:(NSData *)records toPath:(NSString *)path append:(BOOL)append error:(NSError **)error;
+@property (readonly, copy) NSString *fingerprint;
+- (BOOL)verifyKey:(NSString *)key timestamp:(NSNumber *)timestamp parentTimestamp:(NSNumber *)parentTimestamp blob:(NSData *)blob;
+@end
 
-    // reset database layer
-    // to avoid deadlocks, it is **critical** that the call into the database queue be asynchronous
-    if (!self._deleted)
-        [self.databaseQueue dispatchAsynchronously:^
-         {
-             [self _tearDownDatabase];
-         }];
-    
-    // reset memory layer
-    [self _tearDownMemory];
+@interface _PARChecksumFile ()
+@property (readwrite, copy) NSString *fingerprint;
+@property (retain) NSData *sortedRecords;
+@end
 
-    // to make sure the database is saved when the notification is received, the call is scheduled from within the database queue
-    [self.databaseQueue dispatchAsynchronously:^
+@implementation _PARChecksumFile
+
+static uint32_t PARCRC32CTable[256];
+
+// CRC32C (Castagnoli polynomial, reflected), table-driven
+static uint32_t PARCRC32C(uint32_t crc, const void *bytes, NSUInteger length)
+{
+    static dispatch_once_t pred = 0;
+    dispatch_once(&pred, ^
     {
-        [self postNotificationWithName:PARStoreDidTearDownNotification userInfo:nil];
-    }];
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; bit++)
+                value = (value & 1) ? (value >> 1) ^ 0x82F63B78 : (value >> 1);
+            PARCRC32CTable[i] = value;
+        }
+    });
+    
+    const uint8_t *p = bytes;
+    crc = ~crc;
+    for (NSUInteger i = 0; i < length; i++)
+        crc = PARCRC32CTable[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
 }
 
-- (void)tearDown
+static PARChecksumRecord PARChecksumRecordMake(NSString *key, NSNumber *timestamp, NSNumber *parentTimestamp, NSData *blob)
 {
-    [self.memoryQueue dispatchAsynchronously:^{ [self _tearDown]; }];
+    NSData *keyData = [key dataUsingEncoding:NSUTF8StringEncoding];
+    int64_t timestampValue = CFSwapInt64HostToLittle(timestamp.longLongValue);
+    int64_t parentTimestampValue = CFSwapInt64HostToLittle(parentTimestamp != nil ? parentTimestamp.longLongValue : INT64_MIN);
+    PARChecksumRecord record;
+    record.timestamp = timestamp.longLongValue;
+    record.keyChecksum = PARCRC32C(0, keyData.bytes, keyData.length);
+    uint32_t rowChecksum = record.keyChecksum;
+    rowChecksum = PARCRC32C(rowChecksum, &timestampValue, sizeof(timestampValue));
+    rowChecksum = PARCRC32C(rowChecksum, &parentTimestampValue, sizeof(parentTimestampValue));
+    rowChecksum = PARCRC32C(rowChecksum, blob.bytes, blob.length);
+    record.rowChecksum = rowChecksum;
+    return record;
 }
 
-- (void)tearDownNow
+static NSComparisonResult PARChecksumRecordCompare(const PARChecksumRecord *record1, const PARChecksumRecord *record2)
 {
-    if ([self.memoryQueue isInCurrentQueueStack])
-    {
-        ErrorLog(@"To avoid deadlocks, %@ should not be called within a transaction. Bailing out.", NSStringFromSelector(_cmd));
-        return;
-    }
-    [self.memoryQueue       dispatchSynchronously:^{ [self _tearDown]; }];
-    [self.databaseQueue     dispatchSynchronously:^{ }];
-    [self.notificationQueue dispatchSynchronously:^{ }];
+    if (record1->timestamp != record2->timestamp)
+        return (record1->timestamp < record2->timestamp) ? NSOrderedAscending : NSOrderedDescending;
+    if (record1->keyChecksum != record2->keyChecksum)
+        return (record1->keyChecksum < record2->keyChecksum) ? NSOrderedAscending : NSOrderedDescending;
+    return NSOrderedSame;
 }
 
-- (void)waitUntilFinished
+static int PARChecksumRecordSortFunction(const void *record1, const void *record2)
 {
-    if ([self.memoryQueue isInCurrentQueueStack])
+    return (int)PARChecksumRecordCompare(record1, record2);
+}
+
++ (instancetype)checksumFileWithPath:(NSString *)path
+{
+    NSData *data = [NSData dataWithContentsOfFile:path];
+    NSUInteger count = data.length / sizeof(PARChecksumRecord);
+    NSMutableData *records = [NSMutableData dataWithLength:count * sizeof(PARChecksumRecord)];
+    PARChecksumRecord *recordBytes = records.mutableBytes;
+    const uint8_t *bytes = data.bytes;
+    for (NSUInteger i = 0; i < count; i++)
     {
-        ErrorLog(@"To avoid deadlocks, %@ should not be called within a transaction. Bailing out.", NSStringFromSelector(_cmd));
-        return;
+        PARChecksumRecord record;
+        memcpy(&record, bytes + i * sizeof(PARChecksumRecord), sizeof(PARChecksumRecord));
+        record.timestamp = CFSwapInt64LittleToHost(record.timestamp);
+        record.keyChecksum = CFSwapInt32LittleToHost(record.keyChecksum);
+        record.rowChecksum = CFSwapInt32LittleToHost(record.rowChecksum);
+        recordBytes[i] = record;
     }
-    [self.memoryQueue       dispatchSynchronously:^{ }];
-    [self.databaseQueue     dispatchSynchronously:^{ [self _save:NULL]; [self _sync]; }];
-    [self.notificationQueue dispatchSynchronously:^{ }];
+    qsort(recordBytes, count, sizeof(PARChecksumRecord), PARChecksumRecordSortFunction);
+    
+    _PARChecksumFile *checksumFile = [[_PARChecksumFile alloc] init];
+    checksumFile.fingerprint = PARFingerprintForFileAtPath(path);
+    checksumFile.sortedRecords = records;
+    return checksumFile;
 }
 
-// since `self` is retained by the blocks used for scheduling a 'save' or a 'sync', we do not expect to be in a situation where the store is in an unsaved or inconsistent state when dealloc-ed
-// the database queue should not have any timer set anymore
-- (void)dealloc
++ (void)appendRecordForKey:(NSString *)key timestamp:(NSNumber *)timestamp parentTimestamp:(NSNumber *)parentTimestamp blob:(NSData *)blob toData:(NSMutableData *)data
 {
-    // do not access '_loaded' via the queue or via the safe `loaded` accessor, to avoid further waiting for a queue: if closed properly, this will be safe, and otherwise, we are already in trouble
-    NSUInteger timerCount = _databaseQueue.timerCount;
-    if (timerCount > 0)
-        ErrorLog(@"Unexpected timer count of %@ for the database queue of store at path: %@", @(timerCount), [self.storeURL path]);
+    PARChecksumRecord record = PARChecksumRecordMake(key, timestamp, parentTimestamp, blob);
+    record.timestamp = CFSwapInt64HostToLittle(record.timestamp);
+    record.keyChecksum = CFSwapInt32HostToLittle(record.keyChecksum);
+    record.rowChecksum = CFSwapInt32HostToLittle(record.rowChecksum);
+    [data appendBytes:&record length:sizeof(record)];
 }
 
-
-#pragma mark - Paths
-
-#ifdef PARSTORE_LEGACY
-NSString *PARDatabaseFileName = @"logs.db";
-NSString *PARDevicesDirectoryName = @"devices";
-NSString *PARBlobsDirectoryName = @"blobs";
-#else
-NSString *PARDatabaseFileName = @"Logs.db";
-NSString *PARDevicesDirectoryName = @"Devices";
-NSString *PARBlobsDirectoryName = @"Blobs";
-#endif
-
-- (NSString *)deviceRootPath
++ (BOOL)writeRecords:(NSData *)records toPath:(NSString *)path append:(BOOL)append error:(NSError **)error
 {
-    if (self._inMemory || ![self.storeURL isFileURL])
-        return nil;
-    return [[self.storeURL path] stringByAppendingPathComponent:PARDevicesDirectoryName];
+    // the same file may be appended to from the database queue and from `insertChanges:...`
+    NSError *writeError = nil;
+    @synchronized(self)
+    {
+        if (!append || ![[NSFileManager defaultManager] fileExistsAtPath:path])
+        {
+            [records writeToFile:path options:NSDataWritingAtomic error:&writeError];
+        }
+        else
+        {
+            NSFileHandle *fileHandle = [NSFileHandle fileHandleForWritingAtPath:path];
+            if (fileHandle == nil)
+            {
+                writeError = [NSError errorWithObject:self code:__LINE__ localizedDescription:@"Could not open checksum file" underlyingError:nil];
+            }
+            else
+            {
+                // a partial record left by an interrupted write would shift all the following records
+                unsigned long long length = [fileHandle seekToEndOfFile];
+                if (length % sizeof(PARChecksumRecord) != 0)
+                {
+                    length -= length % sizeof(PARChecksumRecord);
+                    [fileHandle truncateFileAtOffset:length];
+                }
+                [fileHandle writeData:records];
+                [fileHandle closeFile];
+            }
+        }
+    }
+    if (writeError != nil)
+    {
+        ErrorLog(@"Could not write checksums at path '%@': %@", path, writeError);
+        if (error != NULL)
+            *error = writeError;
+        return NO;
+    }
+    return YES;
 }
 
-- (NSString *)directoryPathForDeviceIdentifier:(NSString *)deviceIdentifier
+- (BOOL)verifyKey:(NSString *)key timestamp:(NSNumber *)timestamp parentTimestamp:(NSNumber *)parentTimestamp blob:(NSData *)blob
 {
-    return [[self deviceRootPath] stringByAppendingPathComponent:deviceIdentifier];
+    PARChecksumRecord record = PARChecksumRecordMake(key, timestamp, parentTimestamp, blob);
+    const PARChecksumRecord *records = self.sortedRecords.bytes;
+    NSUInteger count = self.sortedRecords.length / sizeof(PARChecksumRecord);
+    
+    // lower bound, then all the records for the same timestamp and key
+    NSUInteger low = 0;
+    NSUInteger high = count;
+    while (low < high)
+    {
+        NSUInteger middle = low + (high - low) / 2;
+        if (PARChecksumRecordCompare(&records[middle], &record) == NSOrderedAscending)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    BOOL hasRecord = NO;
+    for (NSUInteger i = low; i < count && PARChecksumRecordCompare(&records[i], &record) == NSOrderedSame; i++)
+    {
+        if (records[i].rowChecksum == record.rowChecksum)
+            return YES;
+        hasRecord = YES;
+    }
+    return !hasRecord;
 }
 
-- (NSString *)databasePathForDeviceIdentifier:(NSString *)deviceIdentifier
+@end
+
+// Changes not saved in the database yet are appended to a journal in the device directory, so that they survive a crash; the journal is replayed into the database when the store is loaded.
+// The journal is a sequence of segment files, `Journal-1.log`, `Journal-2.log`, etc. next to the journal path; each save starts a new segment, and removes the segments whose changes are all inserted, and thus saved, so the journal stays small under a steady load.
+// Each segment is a sequence of records: uint32 payload length, uint32 CRC32C of the payload, then the payload: int64 timestamp, int64 parent timestamp (INT64_MIN for none), uint32 key length, key in UTF-8, blob; all little-endian.
+// A record interrupted by a crash, or otherwise corrupt, ends the replay of its segment.
+@interface _PARJournal : NSObject
++ (instancetype)journalWithPath:(NSString *)path error:(NSError **)error;
++ (NSArray *)segmentPathsForPath:(NSString *)path;
++ (NSArray *)recordsAtPath:(NSString *)path;
+@property NSTimeInterval syncInterval;
+// returns the segment the record was appended to, to be passed back once the record is inserted, or nil if the record could not be appended
+- (id)appendRecordForKey:(NSString *)key timestamp:(NSNumber *)timestamp parentTimestamp:(NSNumber *)parentTimestamp blob:(NSData *)blob;
+- (void)didInsertRecordCount:(NSUInteger)count inSegment:(id)segment;
+- (void)didSave;
+- (void)synchronize;
+- (void)close;
+@end
+
+@interface _PARJournalSegment : NSObject
+@property (copy) NSString *path;
+@property int fileDescriptor;
+@property unsigned long long length;
+@property NSUInteger pendingRecordCount;
+@end
+
+@implementation _PARJournalSegment
+@end
+
+@interface _PARJournal ()
+@property (copy) NSString *path;
+@property (retain) PARDispatchQueue *syncQueue;
+@end
+
+@implementation _PARJournal
 {
-    return [[self directoryPathForDeviceIdentifier:deviceIdentifier] stringByAppendingPathComponent:PARDatabaseFileName];
+    // all accessed within @synchronized(self); the current segment is opened with the first append after a save
+    NSMutableArray *_segments;
+    _PARJournalSegment *_currentSegment;
+    NSUInteger _lastSegmentNumber;
+    BOOL _closed;
 }
 
-- (NSString *)deviceIdentifierForDatabasePath:(NSString *)path
++ (instancetype)journalWithPath:(NSString *)path error:(NSError **)error
 {
-    return [[path stringByDeletingLastPathComponent] lastPathComponent];
+    // a journal is only opened after the previous one is replayed, but existing segment numbers are skipped anyway
+    NSUInteger lastSegmentNumber = [[[[self segmentPathsForPath:path].lastObject lastPathComponent] stringByDeletingPathExtension] componentsSeparatedByString:@"-"].lastObject.integerValue;
+    _PARJournal *journal = [[_PARJournal alloc] init];
+    journal->_segments = [NSMutableArray array];
+    journal->_lastSegmentNumber = lastSegmentNumber;
+    journal.path = path;
+    journal.syncQueue = [PARDispatchQueue dispatchQueueWithLabel:[PARDispatchQueue labelByPrependingBundleIdentifierToString:@"journal"]];
+    
+    // the first segment is opened right away, so that a journal that cannot be written is not used at all
+    @synchronized(journal)
+    {
+        if (![journal _openSegmentWithError:error])
+            return nil;
+    }
+    return journal;
 }
 
-- (NSString *)readwriteDirectoryPath
+- (void)dealloc
 {
-    if (self._inMemory || ![self.storeURL isFileURL])
-        return nil;
-    return [self directoryPathForDeviceIdentifier:self.deviceIdentifier];
+    for (_PARJournalSegment *segment in _segments)
+    {
+        if (segment.fileDescriptor >= 0)
+            close(segment.fileDescriptor);
+    }
 }
 
-- (NSFileCoordinator *)newFileCoordinator {
-    if (self._fileCoordinationEnabled) {
-        return [[NSFileCoordinator alloc] initWithFilePresenter:self];
-    } else {
-        return [[_PARFileUncoordinator alloc] init];
+// the segments in replay order; a journal file at the path itself, written before segments, comes first
++ (NSArray *)segmentPathsForPath:(NSString *)path
+{
+    NSString *directoryPath = [path stringByDeletingLastPathComponent];
+    NSString *prefix = [[[path lastPathComponent] stringByDeletingPathExtension] stringByAppendingString:@"-"];
+    NSString *extension = [path pathExtension];
+    NSMutableDictionary *pathsBySegmentNumber = [NSMutableDictionary dictionary];
+    for (NSString *filename in [[NSFileManager defaultManager] contentsOfDirectoryAtPath:directoryPath error:NULL])
+    {
+        if (![filename hasPrefix:prefix] || ![[filename pathExtension] isEqualToString:extension])
+            continue;
+        NSString *number = [[filename stringByDeletingPathExtension] substringFromIndex:prefix.length];
+        NSInteger segmentNumber = number.integerValue;
+        if (segmentNumber > 0 && [number isEqualToString:[@(segmentNumber) stringValue]])
+            pathsBySegmentNumber[@(segmentNumber)] = [directoryPath stringByAppendingPathComponent:filename];
     }
+    NSMutableArray *paths = [NSMutableArray arrayWithCapacity:pathsBySegmentNumber.count + 1];
+    if ([[NSFileManager defaultManager] fileExistsAtPath:path])
+        [paths addObject:path];
+    for (NSNumber *segmentNumber in [pathsBySegmentNumber.allKeys sortedArrayUsingSelector:@selector(compare:)])
+        [paths addObject:pathsBySegmentNumber[segmentNumber]];
+    return paths;
 }
 
-- (BOOL)prepareFilePackageWithError:(NSError **)error
++ (NSArray *)recordsAtPath:(NSString *)path
 {
-    if (self._inMemory)
-        return YES;
-	
-    __block BOOL success = YES;
-    __block NSError *localError = nil;
-
-	// URL should be a file
-	if (![self.storeURL isFileURL])
-	{
-        localError = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"%@ only supports files and cannot create file package with URL: %@", NSStringFromClass([self class]), self.storeURL] underlyingError:nil];
-		success = NO;
-	}
-		
-	// file should be a directory
-	NSString *storePath = [self.storeURL path];
-	BOOL isDir = NO;
-	BOOL fileExists = [[NSFileManager defaultManager] fileExistsAtPath:storePath isDirectory:&isDir];
-	if (success && fileExists && !isDir)
-	{
-        localError = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"The path for a store should be a directory at path: %@", storePath] underlyingError:nil];
-		success = NO;
-	}
-		
-	// file package should have a 'devices' subdirectory
-	NSString *devicesPath = [self deviceRootPath];
-	BOOL devicesPathIsDir = NO;
-	BOOL devicesDirExists = [[NSFileManager defaultManager] fileExistsAtPath:devicesPath isDirectory:&devicesPathIsDir];
-	if (success && devicesDirExists && !devicesPathIsDir)
-	{
-        localError = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"The file package for a store should have a 'devices' subdirectory at path: %@", storePath] underlyingError:nil];
-		success = NO;
-	}
-
-	// 'devices' subdir may have a 'deviceID' subdir
-	NSString *identifierPath = [self readwriteDirectoryPath];
-	BOOL identifierPathIsDir = NO;
-	BOOL identifierDirExists = [[NSFileManager defaultManager] fileExistsAtPath:identifierPath isDirectory:&identifierPathIsDir];
-	if (success && identifierDirExists && !identifierPathIsDir)
+    NSData *data = [NSData dataWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:NULL];
+    const uint8_t *bytes = data.bytes;
+    NSUInteger length = data.length;
+    NSUInteger offset = 0;
+    NSMutableArray *records = [NSMutableArray array];
+    while (offset + 2 * sizeof(uint32_t) <= length)
     {
-        localError = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"The device identifier subpath '%@' should be a directory in the file package for the store at path: %@", self.deviceIdentifier, storePath] underlyingError:nil];
-		success = NO;
-	}
-
-	// create file package if necessary
-	if (success && !fileExists)
-	{
-		NSFileCoordinator *coordinator = [self newFileCoordinator];
-		[coordinator coordinateWritingItemAtURL:self.storeURL options:NSFileCoordinatorWritingForReplacing error:NULL byAccessor:^(NSURL *newURL) {
-			NSError *fmError = nil;
-			success = [[NSFileManager defaultManager] createDirectoryAtURL:self.storeURL withIntermediateDirectories:NO attributes:nil error:&fmError] && [[NSFileManager defaultManager] createDirectoryAtPath:devicesPath withIntermediateDirectories:NO attributes:nil error:&fmError];
-			if (!success)
-                localError = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Could not create the root directory for the file package for the store at path: %@", storePath] underlyingError:fmError];
-		}];
-	}
-		
-	// create deviceID subfolder if necessary
-	if (success && !identifierDirExists)
-	{
-		NSFileCoordinator *coordinator = [self newFileCoordinator];
-		[coordinator coordinateWritingItemAtURL:[NSURL fileURLWithPath:identifierPath] options:NSFileCoordinatorWritingForReplacing error:NULL byAccessor:^(NSURL *newURL) {
-			
-			NSError *fmError = nil;
-			success = [[NSFileManager defaultManager] createDirectoryAtPath:identifierPath withIntermediateDirectories:NO attributes:nil error:&fmError];
-			if (!success)
-                localError = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Could not create a subdirectory for the device identifier '%@' in the file package for the store at path: %@", self.deviceIdentifier, storePath] underlyingError:fmError];
-		}];
-	}
+        uint32_t payloadLength;
+        uint32_t checksum;
+        memcpy(&payloadLength, bytes + offset, sizeof(payloadLength));
+        memcpy(&checksum, bytes + offset + sizeof(payloadLength), sizeof(checksum));
+        payloadLength = CFSwapInt32LittleToHost(payloadLength);
+        checksum = CFSwapInt32LittleToHost(checksum);
+        const uint8_t *payload = bytes + offset + 2 * sizeof(uint32_t);
+        NSUInteger headerLength = 2 * sizeof(int64_t) + sizeof(uint32_t);
+        if (payloadLength < headerLength || payloadLength > length - offset - 2 * sizeof(uint32_t) || PARCRC32C(0, payload, payloadLength) != checksum)
+        {
+            if (offset + 2 * sizeof(uint32_t) + payloadLength != length)
+                ErrorLog(@"Ignoring the end of journal at path '%@' after %@ records", path, @(records.count));
+            break;
+        }
+        
+        int64_t timestampValue;
+        int64_t parentTimestampValue;
+        uint32_t keyLength;
+        memcpy(&timestampValue, payload, sizeof(timestampValue));
+        memcpy(&parentTimestampValue, payload + sizeof(int64_t), sizeof(parentTimestampValue));
+        memcpy(&keyLength, payload + 2 * sizeof(int64_t), sizeof(keyLength));
+        timestampValue = CFSwapInt64LittleToHost(timestampValue);
+        parentTimestampValue = CFSwapInt64LittleToHost(parentTimestampValue);
+        keyLength = CFSwapInt32LittleToHost(keyLength);
+        NSString *key = (keyLength <= payloadLength - headerLength) ? [[NSString alloc] initWithBytes:payload + headerLength length:keyLength encoding:NSUTF8StringEncoding] : nil;
+        if (key == nil)
+        {
+            ErrorLog(@"Ignoring the end of journal at path '%@' after %@ records", path, @(records.count));
+            break;
+        }
+        NSData *blob = [NSData dataWithBytes:payload + headerLength + keyLength length:payloadLength - headerLength - keyLength];
+        [records addObject:@[key, @(timestampValue), (parentTimestampValue != INT64_MIN) ? @(parentTimestampValue) : [NSNull null], blob]];
+        offset += 2 * sizeof(uint32_t) + payloadLength;
+    }
+    return records;
+}
 
-    if (!success)
+// called within @synchronized(self)
+- (_PARJournalSegment *)_openSegmentWithError:(NSError **)error
+{
+    NSUInteger segmentNumber = _lastSegmentNumber + 1;
+    NSString *path = [[self.path stringByDeletingPathExtension] stringByAppendingFormat:@"-%@", @(segmentNumber)];
+    if (self.path.pathExtension.length > 0)
+        path = [path stringByAppendingPathExtension:self.path.pathExtension];
+    int fileDescriptor = open([path fileSystemRepresentation], O_WRONLY | O_APPEND | O_CREAT | O_TRUNC, 0644);
+    if (fileDescriptor < 0)
     {
-        ErrorLog(@"Could not prepare file package for store at URL '%@' because of error: %@", self.storeURL, localError);
+        NSError *posixError = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+        ErrorLog(@"Could not open journal at path '%@': %@", path, posixError);
         if (error != NULL)
-            *error = localError;
+            *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:@"Could not open journal file" underlyingError:posixError];
+        return nil;
     }
-    return success;
+    
+    _PARJournalSegment *segment = [[_PARJournalSegment alloc] init];
+    segment.path = path;
+    segment.fileDescriptor = fileDescriptor;
+    [_segments addObject:segment];
+    _currentSegment = segment;
+    _lastSegmentNumber = segmentNumber;
+    return segment;
 }
 
-- (NSArray *)readonlyDirectoryPaths
+- (id)appendRecordForKey:(NSString *)key timestamp:(NSNumber *)timestamp parentTimestamp:(NSNumber *)parentTimestamp blob:(NSData *)blob
 {
-    // store should be a file on disk
-    if (self._inMemory || ![self.storeURL isFileURL])
-        return @[];
-    
-    // file should be a directory
-    NSString *storePath = [self.storeURL path];
-    BOOL isDir = NO;
-    BOOL fileExists = [[NSFileManager defaultManager] fileExistsAtPath:storePath isDirectory:&isDir];
-    if (!fileExists || !isDir)
-        return @[];
+    NSData *keyData = [key dataUsingEncoding:NSUTF8StringEncoding];
+    int64_t timestampValue = CFSwapInt64HostToLittle(timestamp.longLongValue);
+    int64_t parentTimestampValue = CFSwapInt64HostToLittle(parentTimestamp != nil ? parentTimestamp.longLongValue : INT64_MIN);
+    uint32_t keyLength = CFSwapInt32HostToLittle((uint32_t)keyData.length);
+    uint32_t payloadLength = (uint32_t)(2 * sizeof(int64_t) + sizeof(uint32_t) + keyData.length + blob.length);
+    NSMutableData *record = [NSMutableData dataWithLength:2 * sizeof(uint32_t)];
+    [record appendBytes:&timestampValue length:sizeof(timestampValue)];
+    [record appendBytes:&parentTimestampValue length:sizeof(parentTimestampValue)];
+    [record appendBytes:&keyLength length:sizeof(keyLength)];
+    [record appendData:keyData];
+    [record appendData:blob];
+    uint32_t header[2] = {CFSwapInt32HostToLittle(payloadLength), CFSwapInt32HostToLittle(PARCRC32C(0, (const uint8_t *)record.bytes + sizeof(header), payloadLength))};
+    [record replaceBytesInRange:NSMakeRange(0, sizeof(header)) withBytes:header];
     
-    // file package should have a 'devices' subdirectory
-    NSString *devicesPath = [self deviceRootPath];
-    BOOL devicesPathIsDir = NO;
-    BOOL devicesDirExists = [[NSFileManager defaultManager] fileExistsAtPath:devicesPath isDirectory:&devicesPathIsDir];
-    if (!devicesDirExists || !devicesPathIsDir)
-        return @[];
-    
-    // subdirs of 'devices' have device-specific files
-    NSArray *subpaths = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:devicesPath error:NULL];
-    if (!subpaths)
-        return @[];
-    NSMutableArray *paths = [NSMutableArray arrayWithCapacity:[subpaths count]];
-    for (NSString *subpath in subpaths)
+    @synchronized(self)
     {
-        if ([subpath hasPrefix:@"."])
-            continue;
-        if ([subpath isEqualToString:self.deviceIdentifier])
-            continue;
-        NSString *fullPath = [devicesPath stringByAppendingPathComponent:subpath];
-        BOOL subpathIsDir = NO;
-        if ([[NSFileManager defaultManager] fileExistsAtPath:fullPath isDirectory:&subpathIsDir] && subpathIsDir)
-            [paths addObject:fullPath];
+        if (_closed)
+            return nil;
+        _PARJournalSegment *segment = _currentSegment ?: [self _openSegmentWithError:NULL];
+        if (segment == nil)
+            return nil;
+        const uint8_t *bytes = record.bytes;
+        NSUInteger written = 0;
+        while (written < record.length)
+        {
+            ssize_t result = write(segment.fileDescriptor, bytes + written, record.length - written);
+            if (result < 0 && errno == EINTR)
+                continue;
+            if (result <= 0)
+            {
+                // a partial record would hide all the following records of the segment from the replay
+                ErrorLog(@"Could not append to journal at path '%@': %@", segment.path, [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil]);
+                ftruncate(segment.fileDescriptor, segment.length);
+                return nil;
+            }
+            written += result;
+        }
+        segment.length += record.length;
+        segment.pendingRecordCount++;
+        return segment;
     }
-    return [NSArray arrayWithArray:paths];
 }
 
-- (NSArray *)foreignDeviceIdentifiers
+- (void)didInsertRecordCount:(NSUInteger)count inSegment:(id)segment
 {
-    NSMutableArray *devices = [NSMutableArray array];
-    for (NSString *path in [self readonlyDirectoryPaths])
+    @synchronized(self)
     {
-        NSString *device = path.lastPathComponent;
-        if (device != nil)
+        _PARJournalSegment *journalSegment = segment;
+        journalSegment.pendingRecordCount -= MIN(count, journalSegment.pendingRecordCount);
+    }
+}
+
+// called after each save: the changes inserted so far are now in the database
+- (void)didSave
+{
+    NSMutableArray *closedFileDescriptors = [NSMutableArray array];
+    @synchronized(self)
+    {
+        if (_closed)
+            return;
+        
+        // the following appends go to a new segment, so that this one can be removed once its pending changes are inserted, even if more changes keep coming
+        if (_currentSegment.length > 0)
         {
-            [devices addObject:device];
+            [closedFileDescriptors addObject:@(_currentSegment.fileDescriptor)];
+            _currentSegment.fileDescriptor = -1;
+            _currentSegment = nil;
+        }
+        
+        for (_PARJournalSegment *segment in _segments.copy)
+        {
+            if (segment == _currentSegment || segment.pendingRecordCount > 0)
+                continue;
+            unlink([segment.path fileSystemRepresentation]);
+            [_segments removeObject:segment];
         }
     }
-    return devices.copy;
+    
+    // the file descriptors are only closed within the sync queue, after a last flush for the appends not flushed yet
+    if (closedFileDescriptors.count > 0)
+    {
+        [self.syncQueue dispatchAsynchronously:^
+         {
+             for (NSNumber *fileDescriptor in closedFileDescriptors)
+             {
+                 fsync(fileDescriptor.intValue);
+                 close(fileDescriptor.intValue);
+             }
+         }];
+    }
 }
 
-- (NSString *)subpathInPackageForPath:(NSString *)path
+// with a sync interval, the appends of that interval are flushed to disk together
+- (void)synchronize
 {
-	NSArray *components = [path pathComponents];
-    NSArray *directoryComponents = [[self.storeURL path] pathComponents];
-    if ([components count] < [directoryComponents count])
-        return nil;
-    return [[components subarrayWithRange:NSMakeRange([directoryComponents count] - 1, [components count] -[directoryComponents count] + 1)] componentsJoinedByString:@"/"];
+    NSTimeInterval syncInterval = self.syncInterval;
+    if (syncInterval <= 0.0)
+    {
+        [self.syncQueue dispatchSynchronously:^{ [self _synchronize]; }];
+        return;
+    }
+    __weak _PARJournal *weakSelf = self;
+    [self.syncQueue scheduleTimerWithName:@"sync" timeInterval:syncInterval behavior:PARTimerBehaviorCoalesce block:^{ [weakSelf _synchronize]; }];
 }
 
-- (BOOL)isReadwriteDirectorySubpath:(NSString *)path
+- (void)_synchronize
 {
-    if (self._inMemory || ![self.storeURL isFileURL])
-        return NO;
-    
-	// be careful to check relative path instead of full path comparison
-	NSString *fileName = [self.storeURL lastPathComponent];
-	NSString *relativeDevicesDir = [fileName stringByAppendingPathComponent:PARDevicesDirectoryName];
-	NSString *relativeReadWriteDir = [relativeDevicesDir stringByAppendingPathComponent:self.deviceIdentifier];
-	
-	return [path rangeOfString:relativeReadWriteDir].location != NSNotFound;
+    // the file descriptors are only closed within the sync queue, so they stay valid outside of the lock, and appends are not blocked while they are flushed; the segments replaced by a save were flushed when closed
+    int fileDescriptor;
+    @synchronized(self)
+    {
+        fileDescriptor = (_currentSegment != nil) ? _currentSegment.fileDescriptor : -1;
+    }
+    if (fileDescriptor >= 0)
+        fsync(fileDescriptor);
 }
 
-
-#pragma mark - Loading / Closing Database Layer
-
-+ (NSManagedObjectModel *)managedObjectModel
+- (void)close
 {
-    static dispatch_once_t pred = 0;
-    static NSManagedObjectModel *mom = nil;
-    dispatch_once(&pred,
-      ^{
-          NSAttributeDescription *blobAttribute = [[NSAttributeDescription alloc] init];
-          blobAttribute.name = BlobAttributeName;
-          blobAttribute.attributeType = NSBinaryDataAttributeType;
-          
-          NSAttributeDescription *keyAttribute = [[NSAttributeDescription alloc] init];
-          keyAttribute.name = KeyAttributeName;
-          keyAttribute.indexed = YES;
-          keyAttribute.attributeType = NSStringAttributeType;
-          
-          NSAttributeDescription *timestampAttribute = [[NSAttributeDescription alloc] init];
-          timestampAttribute.name = TimestampAttributeName;
-          timestampAttribute.indexed = YES;
-          timestampAttribute.attributeType = NSInteger64AttributeType;
-          
-          NSAttributeDescription *parentTimestampAttribute = [[NSAttributeDescription alloc] init];
-          parentTimestampAttribute.name = ParentTimestampAttributeName;
-          parentTimestampAttribute.indexed = YES;
-          parentTimestampAttribute.attributeType = NSInteger64AttributeType;
-          
-          NSEntityDescription *entity = [[NSEntityDescription alloc] init];
-          entity.name = LogEntityName;
-          entity.properties = @[blobAttribute, keyAttribute, timestampAttribute, parentTimestampAttribute];
-          
-          mom = [[NSManagedObjectModel alloc] init];
-          mom.entities = @[entity];
-      });
-    return mom;
+    [self.syncQueue cancelAllTimers];
+    [self.syncQueue dispatchSynchronously:^
+     {
+         [self _synchronize];
+         @synchronized(self)
+         {
+             _closed = YES;
+             _currentSegment = nil;
+             for (_PARJournalSegment *segment in _segments)
+             {
+                 if (segment.fileDescriptor >= 0)
+                     close(segment.fileDescriptor);
+                 segment.fileDescriptor = -1;
+             }
+         }
+     }];
 }
 
-- (NSPersistentStore *)addPersistentStoreWithCoordinator:(NSPersistentStoreCoordinator *)psc dirPath:(NSString *)path readOnly:(BOOL)readOnly error:(NSError **)error
+@end
+
+
+// Log engine of in-memory stores, with the semantics of the databases: the changes of each device sorted by timestamp, and an index of the changes of each key across devices, also sorted by timestamp.
+// Changes are usually made in timestamp order and simply appended; older changes, e.g. inserted for other devices, are inserted in place.
+@interface _PARMemoryLogs : NSObject
+- (void)addChange:(PARChange *)change forDeviceIdentifier:(NSString *)deviceIdentifier;
+- (BOOL)containsChange:(PARChange *)change forDeviceIdentifier:(NSString *)deviceIdentifier;
+- (NSArray *)changesMatchingPredicate:(NSPredicate *)predicate forDeviceIdentifier:(NSString *)deviceIdentifier;
+- (PARChange *)mostRecentChangeForKey:(NSString *)key timestamp:(NSNumber *)timestamp;
+- (NSNumber *)mostRecentTimestampForDeviceIdentifier:(NSString *)deviceIdentifier;
+@property (readonly, copy) NSArray *deviceIdentifiers;
+@property (readonly, copy) NSArray *allKeys;
+@end
+
+@interface _PARMemoryLogs ()
+@property (retain) NSMutableDictionary *changesByDeviceIdentifier;
+@property (retain) NSMutableDictionary *changesByKey;
+@end
+
+@implementation _PARMemoryLogs
+
+- (instancetype)init
 {
-    // for readonly stores, check whether a file is in fact present at that path (with iCloud or Dropbox, the directory could be there without the database yet)
-    NSString *storePath = [path stringByAppendingPathComponent:PARDatabaseFileName];
-    BOOL isDir = NO;
-    if (readOnly && (![[NSFileManager defaultManager] fileExistsAtPath:storePath isDirectory:&isDir] || isDir))
+    if (self = [super init])
     {
-        if (isDir)
-        {
-            ErrorLog(@"Cannot create persistent store for database at path '%@', because there is already a directory at this path", storePath);
-        }
+        self.changesByDeviceIdentifier = [NSMutableDictionary dictionary];
+        self.changesByKey = [NSMutableDictionary dictionary];
+    }
+    return self;
+}
+
+// index after the last change with a timestamp lower than or equal to the timestamp
+static NSUInteger PARChangesUpperBound(NSArray *changes, int64_t timestamp)
+{
+    NSUInteger low = 0;
+    NSUInteger high = changes.count;
+    while (low < high)
+    {
+        NSUInteger middle = low + (high - low) / 2;
+        if (((PARChange *)changes[middle]).timestamp.longLongValue <= timestamp)
+            low = middle + 1;
         else
-        {
-            ErrorLog(@"Cannot create persistent store for database at path '%@' in read-only mode, because there is no file at this path", storePath);
-        }
-        return nil;
+            high = middle;
     }
-	
-	// create the store
-    NSError *localError = nil;
-    NSDictionary *pragmas = @{
-                              @"journal_mode": @"TRUNCATE"
-                              };
-    NSDictionary *storeOptions = @{
-                                   NSMigratePersistentStoresAutomaticallyOption : @YES,
-                                   NSInferMappingModelAutomaticallyOption:        @YES,
-                                   NSReadOnlyPersistentStoreOption:               @(readOnly),
-                                   NSSQLitePragmasOption:                         pragmas,
-                                   };
-    NSPersistentStore *store = [psc addPersistentStoreWithType:NSSQLiteStoreType configuration:nil URL:[NSURL fileURLWithPath:storePath] options:storeOptions error:&localError];
-    if (!store)
+    return low;
+}
+
+static void PARChangesInsert(NSMutableArray *changes, PARChange *change)
+{
+    int64_t timestamp = change.timestamp.longLongValue;
+    if (changes.count == 0 || ((PARChange *)changes.lastObject).timestamp.longLongValue <= timestamp)
+        [changes addObject:change];
+    else
+        [changes insertObject:change atIndex:PARChangesUpperBound(changes, timestamp)];
+}
+
+- (void)addChange:(PARChange *)change forDeviceIdentifier:(NSString *)deviceIdentifier
+{
+    NSMutableArray *deviceChanges = self.changesByDeviceIdentifier[deviceIdentifier];
+    if (deviceChanges == nil)
     {
-        ErrorLog(@"Error creating persistent store for database at path '%@':\n%@", storePath, localError);
-        if (error != NULL)
-            *error = localError;
-        return nil;
+        deviceChanges = [NSMutableArray array];
+        self.changesByDeviceIdentifier[deviceIdentifier] = deviceChanges;
     }
-    return store;
+    PARChangesInsert(deviceChanges, change);
+    
+    NSMutableArray *keyChanges = self.changesByKey[change.key];
+    if (keyChanges == nil)
+    {
+        keyChanges = [NSMutableArray array];
+        self.changesByKey[change.key] = keyChanges;
+    }
+    PARChangesInsert(keyChanges, change);
 }
 
-// context for all the stores corresponding to the different devices
-// only the 'main' store is read/write
-- (NSManagedObjectContext *)managedObjectContext
+- (BOOL)containsChange:(PARChange *)change forDeviceIdentifier:(NSString *)deviceIdentifier
 {
-    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class],NSStringFromSelector(_cmd));
+    NSArray *deviceChanges = self.changesByDeviceIdentifier[deviceIdentifier];
+    int64_t timestamp = change.timestamp.longLongValue;
+    for (NSUInteger index = PARChangesUpperBound(deviceChanges, timestamp); index > 0; index--)
+    {
+        PARChange *existingChange = deviceChanges[index - 1];
+        if (existingChange.timestamp.longLongValue != timestamp)
+            break;
+        if ([existingChange isEqual:change])
+            return YES;
+    }
+    return NO;
+}
 
-    // lazy creation
-    NSManagedObjectContext *managedObjectContext = self._managedObjectContext;
-    if (managedObjectContext != nil)
+// sorted by timestamp, like the fetches on the databases; a nil device identifier returns the changes of all the devices
+- (NSArray *)changesMatchingPredicate:(NSPredicate *)predicate forDeviceIdentifier:(NSString *)deviceIdentifier
+{
+    NSArray *deviceIdentifiers = (deviceIdentifier != nil) ? @[deviceIdentifier] : self.changesByDeviceIdentifier.allKeys;
+    NSMutableArray *changes = [NSMutableArray array];
+    for (NSString *identifier in deviceIdentifiers)
     {
-        return managedObjectContext;
+        NSArray *deviceChanges = self.changesByDeviceIdentifier[identifier];
+        if (deviceChanges != nil)
+            [changes addObjectsFromArray:(predicate != nil) ? [deviceChanges filteredArrayUsingPredicate:predicate] : deviceChanges];
     }
+    if (deviceIdentifiers.count > 1)
+        [changes sortWithOptions:NSSortStable usingComparator:^NSComparisonResult(PARChange *change1, PARChange *change2) { return [change1.timestamp compare:change2.timestamp]; }];
+    return changes;
+}
 
-    // model
-    NSManagedObjectModel *mom = [PARStore managedObjectModel];
-    if (mom == nil)
+- (PARChange *)mostRecentChangeForKey:(NSString *)key timestamp:(NSNumber *)timestamp
+{
+    NSArray *keyChanges = self.changesByKey[key];
+    NSUInteger index = (timestamp != nil) ? PARChangesUpperBound(keyChanges, timestamp.longLongValue) : keyChanges.count;
+    return (index > 0) ? keyChanges[index - 1] : nil;
+}
+
+- (NSNumber *)mostRecentTimestampForDeviceIdentifier:(NSString *)deviceIdentifier
+{
+    return ((PARChange *)[self.changesByDeviceIdentifier[deviceIdentifier] lastObject]).timestamp;
+}
+
+- (NSArray *)deviceIdentifiers
+{
+    return self.changesByDeviceIdentifier.allKeys;
+}
+
+- (NSArray *)allKeys
+{
+    return self.changesByKey.allKeys;
+}
+
+@end
+
+
+// Cursor over the changes of one database, in timestamp order, read and decoded a page at a time by the loader, which returns the next page on each call, and an empty array at the end.
+// Cursors are merged with a binary heap, ordered by the timestamp of their current change, then by their order, so that the changes of several databases come out in timestamp order while only holding a page of each in memory.
+@interface _PARChangeCursor : NSObject
++ (instancetype)cursorWithOrder:(NSUInteger)order pageLoader:(NSArray *(^)(void))pageLoader;
+@property (readonly) NSUInteger order;
+@property (readonly, retain) PARChange *currentChange;
+- (BOOL)advance;
++ (BOOL)mergeCursors:(NSArray *)cursors usingBlock:(void(^)(PARChange *change, BOOL *stop))block;
+@end
+
+@interface _PARChangeCursor ()
+@property (readwrite) NSUInteger order;
+@property (readwrite, retain) PARChange *currentChange;
+@property (copy) NSArray *(^pageLoader)(void);
+@property (copy) NSArray *page;
+@property NSUInteger pageIndex;
+@end
+
+@implementation _PARChangeCursor
+
++ (instancetype)cursorWithOrder:(NSUInteger)order pageLoader:(NSArray *(^)(void))pageLoader
+{
+    _PARChangeCursor *cursor = [[_PARChangeCursor alloc] init];
+    cursor.order = order;
+    cursor.pageLoader = pageLoader;
+    cursor.page = @[];
+    [cursor advance];
+    return cursor;
+}
+
+// returns NO at the end
+- (BOOL)advance
+{
+    if (self.pageIndex >= self.page.count)
     {
-        return nil;
+        self.page = self.pageLoader() ?: @[];
+        self.pageIndex = 0;
+    }
+    if (self.pageIndex >= self.page.count)
+    {
+        self.currentChange = nil;
+        return NO;
+    }
+    self.currentChange = self.page[self.pageIndex++];
+    return YES;
+}
+
+static CFComparisonResult PARChangeCursorCompare(const void *ptr1, const void *ptr2, void *context)
+{
+    _PARChangeCursor *cursor1 = (__bridge _PARChangeCursor *)ptr1;
+    _PARChangeCursor *cursor2 = (__bridge _PARChangeCursor *)ptr2;
+    int64_t timestamp1 = cursor1.currentChange.timestamp.longLongValue;
+    int64_t timestamp2 = cursor2.currentChange.timestamp.longLongValue;
+    if (timestamp1 != timestamp2)
+        return (timestamp1 < timestamp2) ? kCFCompareLessThan : kCFCompareGreaterThan;
+    if (cursor1.order != cursor2.order)
+        return (cursor1.order < cursor2.order) ? kCFCompareLessThan : kCFCompareGreaterThan;
+    return kCFCompareEqualTo;
+}
+
+// returns NO if stopped by the block
++ (BOOL)mergeCursors:(NSArray *)cursors usingBlock:(void(^)(PARChange *change, BOOL *stop))block
+{
+    // the cursors are retained by the array, not by the heap
+    CFBinaryHeapCallBacks callbacks = {0, NULL, NULL, NULL, PARChangeCursorCompare};
+    CFBinaryHeapRef heap = CFBinaryHeapCreate(kCFAllocatorDefault, cursors.count, &callbacks, NULL);
+    for (_PARChangeCursor *cursor in cursors)
+    {
+        if (cursor.currentChange != nil)
+            CFBinaryHeapAddValue(heap, (__bridge const void *)cursor);
     }
     
-    // prepare file package on disk
-    if (![self prepareFilePackageWithError:NULL])
+    BOOL stop = NO;
+    while (!stop && CFBinaryHeapGetCount(heap) > 0)
+    {
+        _PARChangeCursor *cursor = (__bridge _PARChangeCursor *)CFBinaryHeapGetMinimum(heap);
+        CFBinaryHeapRemoveMinimumValue(heap);
+        block(cursor.currentChange, &stop);
+        if (!stop && [cursor advance])
+            CFBinaryHeapAddValue(heap, (__bridge const void *)cursor);
+    }
+    CFRelease(heap);
+    return !stop;
+}
+
+@end
+
+
+
+// Summary of the rows of a device database, to compare stores without reading their rows.
+// Each row (key, timestamps and blob) is hashed with FNV-1a, and the row hashes are added up in buckets of 2^30 microseconds (about 18 minutes), so that new rows can be added in any order, e.g. after each save. The file is the list of buckets, with their row count and hash sum.
+// The root hash and row count are also saved in the metadata of the database, in the same transaction as the rows: a summary file is only trusted if it matches the database it sits next to, and not just because it has the same number of rows, e.g. not for a database synced independently of the summary; a copy of the package keeps both, and stays valid.
+// The buckets are the leaves of a hash tree with a fan-out of 16, where each node hashes the keys and hashes of its children, in order: comparing two trees only descends into the nodes that differ, down to the buckets with different rows.
+@interface _PARMerkleSummary : NSObject
++ (instancetype)summaryWithPath:(NSString *)path;
++ (instancetype)summaryWithLogs:(id <NSFastEnumeration>)logs;
+- (void)addLogs:(id <NSFastEnumeration>)logs;
+- (void)addSummary:(_PARMerkleSummary *)summary;
+- (BOOL)writeToPath:(NSString *)path error:(NSError **)error;
+@property (readonly) uint64_t rowCount;
+@property (readonly) NSData *rootHash;
+// value saved under `PARMerkleMetadataKey` in the database metadata
+@property (readonly) NSDictionary *metadata;
+- (BOOL)matchesMetadata:(NSDictionary *)metadata;
+- (NSArray *)timestampRangesDifferingFromSummary:(_PARMerkleSummary *)summary;
+@end
+
+@interface _PARMerkleSummary ()
+// bucket --> @[row count, hash sum]
+@property (retain) NSMutableDictionary *buckets;
+// node key --> hash, for each level of the tree, from the buckets to the root; built when needed
+@property (copy) NSArray *cachedLevels;
+- (NSArray *)levels;
+@end
+
+@implementation _PARMerkleSummary
+
+#define PARMerkleBucketShift 30
+#define PARMerkleFanOutShift 4
+// buckets have 64 - 30 = 34 bits, and each level above removes 4 bits, so that the single node of the 10th level is the root
+#define PARMerkleLevelCount 10
+
+static const char PARMerkleFileMagic[8] = {'P', 'A', 'R', 'M', 'R', 'K', 'L', '3'};
+
+static NSString * const PARMerkleMetadataKey = @"PARMerkleSummary";
+
+static const uint64_t PARFNV1aOffsetBasis = 0xcbf29ce484222325ULL;
+
+// FNV-1a, 64 bits
+static uint64_t PARFNV1a(uint64_t hash, const void *bytes, NSUInteger length)
+{
+    const uint8_t *p = bytes;
+    for (NSUInteger i = 0; i < length; i++)
+    {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// the sign bit is flipped, so that the buckets of negative timestamps come first
+static uint64_t PARMerkleBucketForTimestamp(int64_t timestamp)
+{
+    return ((uint64_t)timestamp ^ 0x8000000000000000ULL) >> PARMerkleBucketShift;
+}
+
+static int64_t PARMerkleFirstTimestampForBucket(uint64_t bucket)
+{
+    return (int64_t)((bucket << PARMerkleBucketShift) ^ 0x8000000000000000ULL);
+}
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self)
+    {
+        _buckets = [NSMutableDictionary dictionary];
+    }
+    return self;
+}
+
+// returns nil if the file is missing or invalid
++ (instancetype)summaryWithPath:(NSString *)path
+{
+    NSData *data = [NSData dataWithContentsOfFile:path];
+    NSUInteger headerLength = sizeof(PARMerkleFileMagic);
+    if (data.length < headerLength || memcmp(data.bytes, PARMerkleFileMagic, sizeof(PARMerkleFileMagic)) != 0 || (data.length - headerLength) % (3 * sizeof(uint64_t)) != 0)
     {
-        ErrorLog(@"Could not create managed object context for store at URL '%@'", self.storeURL);
         return nil;
     }
+    const uint8_t *bytes = data.bytes;
+    _PARMerkleSummary *summary = [[_PARMerkleSummary alloc] init];
+    for (NSUInteger offset = headerLength; offset < data.length; offset += 3 * sizeof(uint64_t))
+    {
+        uint64_t record[3];
+        memcpy(record, bytes + offset, sizeof(record));
+        [summary addRowCount:CFSwapInt64LittleToHost(record[1]) hash:CFSwapInt64LittleToHost(record[2]) toBucket:CFSwapInt64LittleToHost(record[0])];
+    }
+    return summary;
+}
+
++ (instancetype)summaryWithLogs:(id <NSFastEnumeration>)logs
+{
+    _PARMerkleSummary *summary = [[_PARMerkleSummary alloc] init];
+    [summary addLogs:logs];
+    return summary;
+}
+
+- (void)addRowCount:(uint64_t)count hash:(uint64_t)hash toBucket:(uint64_t)bucket
+{
+    NSArray *value = self.buckets[@(bucket)];
+    if (value != nil)
+    {
+        count += [value[0] unsignedLongLongValue];
+        hash += [value[1] unsignedLongLongValue];
+    }
+    self.buckets[@(bucket)] = @[@(count), @(hash)];
+    self.cachedLevels = nil;
+}
+
+// `logs` can be managed objects or log representations
+- (void)addLogs:(id <NSFastEnumeration>)logs
+{
+    for (id log in logs)
+    {
+        NSNumber *timestamp = [log valueForKey:TimestampAttributeName];
+        NSNumber *parentTimestamp = [log valueForKey:ParentTimestampAttributeName];
+        NSData *keyData = [[log valueForKey:KeyAttributeName] dataUsingEncoding:NSUTF8StringEncoding];
+        NSData *blob = [log valueForKey:BlobAttributeName];
+        int64_t timestamps[2] = {CFSwapInt64HostToLittle(timestamp.longLongValue), CFSwapInt64HostToLittle(parentTimestamp != nil ? parentTimestamp.longLongValue : INT64_MIN)};
+        uint64_t hash = PARFNV1a(PARFNV1aOffsetBasis, keyData.bytes, keyData.length);
+        hash = PARFNV1a(hash, timestamps, sizeof(timestamps));
+        hash = PARFNV1a(hash, blob.bytes, blob.length);
+        [self addRowCount:1 hash:hash toBucket:PARMerkleBucketForTimestamp(timestamp.longLongValue)];
+    }
+}
+
+- (void)addSummary:(_PARMerkleSummary *)summary
+{
+    [summary.buckets enumerateKeysAndObjectsUsingBlock:^(NSNumber *bucket, NSArray *value, BOOL *stop)
+    {
+        [self addRowCount:[value[0] unsignedLongLongValue] hash:[value[1] unsignedLongLongValue] toBucket:bucket.unsignedLongLongValue];
+    }];
+}
+
+- (BOOL)writeToPath:(NSString *)path error:(NSError **)error
+{
+    NSMutableData *data = [NSMutableData dataWithCapacity:sizeof(PARMerkleFileMagic) + self.buckets.count * 3 * sizeof(uint64_t)];
+    [data appendBytes:PARMerkleFileMagic length:sizeof(PARMerkleFileMagic)];
+    for (NSNumber *bucket in [self.buckets.allKeys sortedArrayUsingSelector:@selector(compare:)])
+    {
+        NSArray *value = self.buckets[bucket];
+        uint64_t record[3] = {CFSwapInt64HostToLittle(bucket.unsignedLongLongValue), CFSwapInt64HostToLittle([value[0] unsignedLongLongValue]), CFSwapInt64HostToLittle([value[1] unsignedLongLongValue])};
+        [data appendBytes:record length:sizeof(record)];
+    }
+    NSError *writeError = nil;
+    @synchronized([_PARMerkleSummary class])
+    {
+        [data writeToFile:path options:NSDataWritingAtomic error:&writeError];
+    }
+    if (writeError != nil)
+    {
+        ErrorLog(@"Could not write summary at path '%@': %@", path, writeError);
+        if (error != NULL)
+            *error = writeError;
+        return NO;
+    }
+    return YES;
+}
+
+- (uint64_t)rowCount
+{
+    uint64_t count = 0;
+    for (NSArray *value in self.buckets.allValues)
+        count += [value[0] unsignedLongLongValue];
+    return count;
+}
+
+- (NSArray *)levels
+{
+    NSArray *levels = self.cachedLevels;
+    if (levels != nil)
+    {
+        return levels;
+    }
     
-    // stores
-    NSPersistentStoreCoordinator *psc = [[NSPersistentStoreCoordinator alloc] initWithManagedObjectModel:mom];
-    NSError *error = nil;
-    self.readwriteDatabase = [self addPersistentStoreWithCoordinator:psc dirPath:[self readwriteDirectoryPath] readOnly:NO error:&error];
-    if (!self.readwriteDatabase)
-        return nil;
-    NSArray *otherDirs = [self readonlyDirectoryPaths];
-    NSMutableArray *otherStores = [NSMutableArray array];
-    for (NSString *dir in otherDirs)
+    NSMutableDictionary *hashes = [NSMutableDictionary dictionaryWithCapacity:self.buckets.count];
+    [self.buckets enumerateKeysAndObjectsUsingBlock:^(NSNumber *bucket, NSArray *value, BOOL *stop)
     {
-        NSPersistentStore *store = [self addPersistentStoreWithCoordinator:psc dirPath:dir readOnly:YES error:NULL];
-        if (store)
-            [otherStores addObject:store];
+        uint64_t words[3] = {CFSwapInt64HostToLittle(bucket.unsignedLongLongValue), CFSwapInt64HostToLittle([value[0] unsignedLongLongValue]), CFSwapInt64HostToLittle([value[1] unsignedLongLongValue])};
+        hashes[bucket] = @(PARFNV1a(PARFNV1aOffsetBasis, words, sizeof(words)));
+    }];
+    NSMutableArray *mutableLevels = [NSMutableArray arrayWithObject:hashes];
+    for (NSUInteger level = 1; level < PARMerkleLevelCount; level++)
+    {
+        NSDictionary *childHashes = mutableLevels.lastObject;
+        NSMutableDictionary *parentHashes = [NSMutableDictionary dictionary];
+        for (NSNumber *childKey in [childHashes.allKeys sortedArrayUsingSelector:@selector(compare:)])
+        {
+            NSNumber *parentKey = @(childKey.unsignedLongLongValue >> PARMerkleFanOutShift);
+            uint64_t words[2] = {CFSwapInt64HostToLittle(childKey.unsignedLongLongValue), CFSwapInt64HostToLittle([childHashes[childKey] unsignedLongLongValue])};
+            uint64_t hash = (parentHashes[parentKey] != nil) ? [parentHashes[parentKey] unsignedLongLongValue] : PARFNV1aOffsetBasis;
+            parentHashes[parentKey] = @(PARFNV1a(hash, words, sizeof(words)));
+        }
+        [mutableLevels addObject:parentHashes];
     }
-    self.readonlyDatabases = [NSArray arrayWithArray:otherStores];
+    self.cachedLevels = mutableLevels;
+    return mutableLevels;
+}
 
-    // context
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wdeprecated-declarations"
-    NSManagedObjectContext *moc = [[NSManagedObjectContext alloc] init];
-#pragma clang diagnostic pop
-    [moc setPersistentStoreCoordinator:psc];
-    [moc setUndoManager:nil];
-    self._managedObjectContext = moc;
-    return moc;
+- (NSData *)rootHash
+{
+    NSNumber *root = [self.levels.lastObject objectForKey:@0];
+    uint64_t hash = CFSwapInt64HostToLittle(root != nil ? root.unsignedLongLongValue : PARFNV1aOffsetBasis);
+    return [NSData dataWithBytes:&hash length:sizeof(hash)];
 }
 
-- (void)refreshStoreList
+- (NSDictionary *)metadata
 {
-    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class],NSStringFromSelector(_cmd));
-    if (self._inMemory)
+    return @{@"rootHash": self.rootHash, @"rowCount": @(self.rowCount)};
+}
+
+- (BOOL)matchesMetadata:(NSDictionary *)metadata
+{
+    if (![metadata isKindOfClass:[NSDictionary class]])
+    {
+        return NO;
+    }
+    return [metadata[@"rowCount"] isEqual:@(self.rowCount)] && [metadata[@"rootHash"] isEqual:self.rootHash];
+}
+
+- (void)addBucketsDifferingFromSummary:(_PARMerkleSummary *)summary level:(NSUInteger)level key:(uint64_t)key toArray:(NSMutableArray *)buckets
+{
+    NSNumber *hash1 = [self.levels[level] objectForKey:@(key)];
+    NSNumber *hash2 = [summary.levels[level] objectForKey:@(key)];
+    if (hash1 == hash2 || [hash1 isEqualToNumber:hash2])
+    {
         return;
+    }
+    if (level == 0)
+    {
+        [buckets addObject:@(key)];
+        return;
+    }
+    uint64_t firstChildKey = key << PARMerkleFanOutShift;
+    for (uint64_t childKey = firstChildKey; childKey < firstChildKey + (1 << PARMerkleFanOutShift); childKey++)
+    {
+        [self addBucketsDifferingFromSummary:summary level:level - 1 key:childKey toArray:buckets];
+    }
+}
+
+// ranges of timestamps as @[first, last], inclusive, in timestamp order; adjacent buckets are merged into a single range
+- (NSArray *)timestampRangesDifferingFromSummary:(_PARMerkleSummary *)summary
+{
+    NSMutableArray *buckets = [NSMutableArray array];
+    [self addBucketsDifferingFromSummary:summary level:PARMerkleLevelCount - 1 key:0 toArray:buckets];
+    
+    NSMutableArray *ranges = [NSMutableArray array];
+    uint64_t firstBucket = 0;
+    uint64_t lastBucket = 0;
+    for (NSUInteger i = 0; i <= buckets.count; i++)
+    {
+        uint64_t bucket = (i < buckets.count) ? [buckets[i] unsignedLongLongValue] : 0;
+        if (i > 0 && i < buckets.count && bucket == lastBucket + 1)
+        {
+            lastBucket = bucket;
+            continue;
+        }
+        if (i > 0)
+        {
+            [ranges addObject:@[@(PARMerkleFirstTimestampForBucket(firstBucket)), @(PARMerkleFirstTimestampForBucket(lastBucket) + ((1LL << PARMerkleBucketShift) - 1))]];
+        }
+        firstBucket = bucket;
+        lastBucket = bucket;
+    }
+    return ranges;
+}
+
+@end
+
+
+
+// Pack of small blobs written by one device, at `Blobs/.packs/<device identifier>.pack`, so that the blobs do not each need their own file, file coordination and upload.
+// The pack is a sequence of records appended by its device: a header with the length and CRC32C of the record metadata (timestamp, data length, CRC32C of the data, and path), followed by the data. Deletions are records without data, with a length of -1. A torn record at the end, e.g. after a crash or while syncing, ends the pack and is overwritten by the next append; the data is checked when read.
+// For each path, the record with the most recent timestamp in all the packs wins; if it is a deletion, or if no pack has the path, the blob is a regular file in the blob directory.
+@interface _PARBlobPack : NSObject
++ (instancetype)packWithPath:(NSString *)path;
++ (NSArray *)packsInDirectoryAtPath:(NSString *)directoryPath;
++ (NSDictionary *)mostRecentRecordsInPacks:(NSArray *)packs;
++ (NSData *)recordWithPath:(NSString *)path timestamp:(int64_t)timestamp data:(NSData *)data;
+- (BOOL)appendRecords:(NSData *)records error:(NSError **)error;
+- (NSData *)dataForPath:(NSString *)path;
+@property (readonly, copy) NSString *path;
+@property (readonly, copy) NSString *fingerprint;
+// path --> @[timestamp, data offset, data length, data checksum], for the most recent record of each path in the pack
+@property (readonly, retain) NSMutableDictionary *entries;
+// length of the valid records, and of the records still needed
+@property (readonly) unsigned long long length;
+@property (readonly) unsigned long long liveLength;
+@end
+
+@interface _PARBlobPack ()
+@property (readwrite, copy) NSString *path;
+@property (readwrite, copy) NSString *fingerprint;
+@property (readwrite, retain) NSMutableDictionary *entries;
+@property (readwrite) unsigned long long length;
+@property (retain) NSData *mappedData;
+@end
+
+@implementation _PARBlobPack
+
+// timestamp, data length, data checksum, path length
+#define PARBlobPackMetadataLength (2 * sizeof(int64_t) + 2 * sizeof(uint32_t))
+
+// a missing file is an empty pack
++ (instancetype)packWithPath:(NSString *)path
+{
+    _PARBlobPack *pack = [[_PARBlobPack alloc] init];
+    pack.path = path;
+    pack.entries = [NSMutableDictionary dictionary];
+    [pack scan];
+    return pack;
+}
+
++ (NSArray *)packsInDirectoryAtPath:(NSString *)directoryPath
+{
+    NSMutableArray *packs = [NSMutableArray array];
+    for (NSString *name in [[NSFileManager defaultManager] contentsOfDirectoryAtPath:directoryPath error:NULL])
+    {
+        if ([name.pathExtension isEqualToString:@"pack"])
+            [packs addObject:[_PARBlobPack packWithPath:[directoryPath stringByAppendingPathComponent:name]]];
+    }
+    return packs;
+}
+
+// path --> @[pack, entry]
++ (NSDictionary *)mostRecentRecordsInPacks:(NSArray *)packs
+{
+    NSMutableDictionary *records = [NSMutableDictionary dictionary];
+    for (_PARBlobPack *pack in packs)
+    {
+        [pack.entries enumerateKeysAndObjectsUsingBlock:^(NSString *path, NSArray *entry, BOOL *stop)
+        {
+            NSArray *record = records[path];
+            if (record == nil || [entry[0] compare:record[1][0]] == NSOrderedDescending)
+                records[path] = @[pack, entry];
+        }];
+    }
+    return records;
+}
+
+// data is nil for a deletion
++ (NSData *)recordWithPath:(NSString *)path timestamp:(int64_t)timestamp data:(NSData *)data
+{
+    NSData *pathData = [path dataUsingEncoding:NSUTF8StringEncoding];
+    int64_t values[2] = {CFSwapInt64HostToLittle(timestamp), CFSwapInt64HostToLittle(data != nil ? (int64_t)data.length : -1)};
+    uint32_t dataChecksum = CFSwapInt32HostToLittle(PARCRC32C(0, data.bytes, data.length));
+    uint32_t pathLength = CFSwapInt32HostToLittle((uint32_t)pathData.length);
+    uint32_t metadataLength = (uint32_t)(PARBlobPackMetadataLength + pathData.length);
+    NSMutableData *record = [NSMutableData dataWithLength:2 * sizeof(uint32_t)];
+    [record appendBytes:values length:sizeof(values)];
+    [record appendBytes:&dataChecksum length:sizeof(dataChecksum)];
+    [record appendBytes:&pathLength length:sizeof(pathLength)];
+    [record appendData:pathData];
+    uint32_t header[2] = {CFSwapInt32HostToLittle(metadataLength), CFSwapInt32HostToLittle(PARCRC32C(0, (const uint8_t *)record.bytes + sizeof(header), metadataLength))};
+    [record replaceBytesInRange:NSMakeRange(0, sizeof(header)) withBytes:header];
+    if (data != nil)
+        [record appendData:data];
+    return record;
+}
+
+// reads the records appended since the last scan
+- (void)scan
+{
+    self.fingerprint = PARFingerprintForFileAtPath(self.path);
+    NSData *data = [NSData dataWithContentsOfFile:self.path options:NSDataReadingMappedIfSafe error:NULL];
+    self.mappedData = data;
+    const uint8_t *bytes = data.bytes;
+    unsigned long long length = data.length;
+    unsigned long long offset = self.length;
+    while (offset + 2 * sizeof(uint32_t) <= length)
+    {
+        uint32_t header[2];
+        memcpy(header, bytes + offset, sizeof(header));
+        uint32_t metadataLength = CFSwapInt32LittleToHost(header[0]);
+        uint32_t checksum = CFSwapInt32LittleToHost(header[1]);
+        const uint8_t *metadata = bytes + offset + sizeof(header);
+        if (metadataLength < PARBlobPackMetadataLength || metadataLength > length - offset - sizeof(header) || PARCRC32C(0, metadata, metadataLength) != checksum)
+        {
+            break;
+        }
+        
+        int64_t values[2];
+        uint32_t dataChecksum;
+        uint32_t pathLength;
+        memcpy(values, metadata, sizeof(values));
+        memcpy(&dataChecksum, metadata + sizeof(values), sizeof(dataChecksum));
+        memcpy(&pathLength, metadata + sizeof(values) + sizeof(dataChecksum), sizeof(pathLength));
+        int64_t timestamp = CFSwapInt64LittleToHost(values[0]);
+        int64_t dataLength = CFSwapInt64LittleToHost(values[1]);
+        pathLength = CFSwapInt32LittleToHost(pathLength);
+        unsigned long long dataOffset = offset + sizeof(header) + metadataLength;
+        NSString *path = (pathLength == metadataLength - PARBlobPackMetadataLength) ? [[NSString alloc] initWithBytes:metadata + PARBlobPackMetadataLength length:pathLength encoding:NSUTF8StringEncoding] : nil;
+        if (path == nil || dataLength < -1 || (dataLength > 0 && (unsigned long long)dataLength > length - dataOffset))
+        {
+            break;
+        }
+        
+        NSArray *entry = self.entries[path];
+        if (entry == nil || [entry[0] longLongValue] <= timestamp)
+            self.entries[path] = @[@(timestamp), @(dataOffset), @(dataLength), @(CFSwapInt32LittleToHost(dataChecksum))];
+        offset = dataOffset + MAX(dataLength, 0);
+    }
+    self.length = offset;
+}
+
+// written with `write`, as the journal, since `NSFileHandle` raises an exception when the disk is full
+- (BOOL)appendRecords:(NSData *)records error:(NSError **)error
+{
+    int fileDescriptor = open(self.path.fileSystemRepresentation, O_WRONLY | O_CREAT, 0644);
+    if (fileDescriptor < 0)
+    {
+        NSError *openError = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+        ErrorLog(@"Could not open blob pack at path '%@': %@", self.path, openError);
+        if (error != NULL)
+            *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:@"Could not open blob pack" underlyingError:openError];
+        return NO;
+    }
+    
+    // a torn record at the end would hide all the following records
+    NSError *writeError = nil;
+    if (ftruncate(fileDescriptor, (off_t)self.length) != 0 || lseek(fileDescriptor, (off_t)self.length, SEEK_SET) < 0)
+        writeError = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+    const uint8_t *bytes = records.bytes;
+    NSUInteger written = 0;
+    while (writeError == nil && written < records.length)
+    {
+        ssize_t result = write(fileDescriptor, bytes + written, records.length - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+        {
+            writeError = [NSError errorWithDomain:NSPOSIXErrorDomain code:(result < 0 ? errno : EIO) userInfo:nil];
+            break;
+        }
+        written += result;
+    }
+    
+    // a partial append is dropped, so that the next one starts after the valid records
+    if (writeError != nil)
+        ftruncate(fileDescriptor, (off_t)self.length);
+    close(fileDescriptor);
+    [self scan];
+    if (writeError != nil)
+    {
+        ErrorLog(@"Could not append to blob pack at path '%@': %@", self.path, writeError);
+        if (error != NULL)
+            *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:@"Could not append to blob pack" underlyingError:writeError];
+        return NO;
+    }
+    return YES;
+}
+
+- (unsigned long long)liveLength
+{
+    unsigned long long liveLength = 0;
+    for (NSArray *entry in self.entries.allValues)
+    {
+        if ([entry[2] longLongValue] >= 0)
+            liveLength += [entry[2] unsignedLongLongValue] + PARBlobPackMetadataLength + 2 * sizeof(uint32_t);
+    }
+    return liveLength;
+}
+
+// returns nil for deletions, and for missing or corrupt data
+- (NSData *)dataForPath:(NSString *)path
+{
+    NSArray *entry = self.entries[path];
+    int64_t dataLength = [entry[2] longLongValue];
+    if (entry == nil || dataLength < 0)
+    {
+        return nil;
+    }
+    NSRange range = NSMakeRange([entry[1] unsignedIntegerValue], (NSUInteger)dataLength);
+    if (NSMaxRange(range) > self.mappedData.length)
+    {
+        return nil;
+    }
+    NSData *data = [self.mappedData subdataWithRange:range];
+    if (PARCRC32C(0, data.bytes, data.length) != [entry[3] unsignedIntValue])
+    {
+        ErrorLog(@"Corrupt blob '%@' in pack at path '%@'", path, self.path);
+        return nil;
+    }
+    return data;
+}
+
+@end
+
+
+
+// filled in by `estimateMergeOfStore:...`
+@interface PARMergeEstimate ()
+@property (readwrite, copy) NSDictionary *addedRowCountsByDeviceIdentifier;
+@property (readwrite, copy) NSDictionary *virtualRowCountsByDeviceIdentifier;
+@property (readwrite, copy) NSArray *identicalDeviceIdentifiers;
+@property (readwrite) NSUInteger blobFileCount;
+@property (readwrite) unsigned long long blobByteCount;
+@end
+
+
+
+@interface PARStoreManager ()
+// shared by all the stores of the manager
+@property (retain) PARDispatchQueue *notificationQueue;
+@property (retain) NSOperationQueue *presenterQueue;
+@property (retain) PARDispatchQueue *fileSystemEventQueue;
+
+// stores with open databases, with their estimated footprint and last access time, only accessed from within the stateQueue
+@property (retain) PARDispatchQueue *stateQueue;
+@property (retain) NSMapTable *databaseUsageByStore;
+
+- (void)store:(PARStore *)store didAccessDatabaseWithFootprint:(NSUInteger)footprint;
+- (void)storeDidCloseDatabase:(PARStore *)store;
+@end
+
+
+@interface PARCancellationToken ()
++ (PARCancellationToken *)tokenWithParentTokens:(NSArray *)parentTokens;
+@end
+
+
+@interface PARStore ()
+@property (readwrite, copy) NSURL *storeURL;
+@property (readwrite, copy) NSString *deviceIdentifier;
+@property (readwrite, retain) PARStoreManager *manager;
+
+// databaseQueue serializes access to all CoreData related stuff
+@property (retain) PARDispatchQueue *databaseQueue;
+@property (retain) NSManagedObjectContext *_managedObjectContext;
+@property (retain) NSPersistentStore *readwriteDatabase;
+@property (copy) NSArray *readonlyDatabases;
+@property (retain) NSMutableDictionary *databaseTimestamps;
+@property (copy) NSDictionary *keyTimestamps;
+
+// adaptive keep-alive of the database connections, only accessed from within the databaseQueue
+@property NSTimeInterval lastDatabaseAccessTime;
+@property NSTimeInterval averageDatabaseAccessInterval;
+@property NSTimeInterval databaseOpenDuration;
+
+// set when the local database is written, cleared by maintenance, only accessed from within the databaseQueue
+@property BOOL needsIncrementalVacuum;
+
+// fingerprint of the local database when opened and after each of our saves, to detect replacements while open, only accessed from within the databaseQueue
+@property (copy) NSString *readwriteDatabaseFingerprint;
+
+// checksum files of the devices, by path, refreshed when they change, only accessed from within the databaseQueue
+@property (retain) NSMutableDictionary *checksumFiles;
+
+// summaries rebuilt for device databases whose summary file cannot be trusted, by device identifier, as @[summary, most recent timestamp or NSNull]; valid as long as they match the summary in the database metadata, or without one, the row count and most recent timestamp of the database; access should be synchronized on the dictionary
+@property (retain) NSMutableDictionary *rebuiltSummaries;
+
+// packs of small blobs by path, refreshed when they change, only accessed from within the blobQueue
+@property (retain) PARDispatchQueue *blobQueue;
+@property (retain) NSMutableDictionary *blobPacks;
+
+// local rows inserted in the context but not saved yet, as log dictionaries, merged into the results of dictionary fetches, which ignore pending changes; only accessed from within the databaseQueue
+@property (retain) NSMutableArray *pendingLogs;
+
+// listing of the foreign device directories, as @[fingerprint of the devices directory, paths]; set atomically so it can be used from any queue
+@property (copy) NSArray *readonlyDirectoryPathsCache;
+
+// fingerprint of the archive database when it was last synced, only accessed from within the databaseQueue
+@property (copy) NSString *archiveFingerprint;
+
+// fingerprints of the foreign databases when they were last synced, by device identifier, only used with a limit on open foreign databases
+@property (copy) NSDictionary *foreignDatabaseFingerprints;
+
+// journal of the changes not saved yet, opened when loading; set atomically so it can be used from any queue
+@property (retain) _PARJournal *journal;
+// journal segments of the changes appended while writes are coalesced, counted once per change, only accessed from within the memoryQueue
+@property (retain) NSCountedSet *coalescedJournalSegments;
+
+// cancelled and replaced by `cancelLongRunningOperations`; each long-running operation uses the token current when it starts
+@property (retain) PARCancellationToken *operationsToken;
+
+// memoryQueue serializes access to in-memory storage; its critical sections are short, and it runs blocks dispatched synchronously inline under a lock
+// to avoid deadlocks, the memoryQueue should never schedule synchronous blocks in databaseQueue (but the opposite is fine)
+@property (retain) PARDispatchQueue *memoryQueue;
+@property (retain, nonatomic) NSMutableDictionary *_memory;
+@property (readwrite, nonatomic) BOOL _loaded;
+@property (readwrite, nonatomic) BOOL _deleted;
+@property (readwrite, nonatomic) BOOL _inMemory;
+@property (readwrite, nonatomic) BOOL _inMemoryCacheEnabled;
+@property (readwrite) BOOL follower;
+@property (retain, nonatomic) NSMutableDictionary *_memoryFileData;
+// history of in-memory stores, only accessed from within the memoryQueue
+@property (retain) _PARMemoryLogs *_memoryLogs;
+@property (retain) NSMutableDictionary *_memoryKeyTimestamps;
+@property (retain) _PARSealedFile *_sealedFile;
+@property (retain) _PARSealedFile *_sharedCache;
+@property (copy) NSDictionary *_sharedCacheKeyTimestamps;
+
+// rows and bytes of the changes not inserted in the database yet are counted under the lock of the condition, which is signaled when they are inserted
+@property (retain) NSCondition *writeBacklogCondition;
+// changes coalesced while the backlog is full, and until they are written, as @[timestamp, parent timestamp or NSNull, blob] by key, only accessed from within the memoryQueue
+@property (retain) NSMutableDictionary *coalescedWrites;
+
+// handling transactions
+@property BOOL inTransaction;
+@property NSMutableDictionary *didChangeNotificationUserInfoInTransaction;
+
+// queue for the notifications
+@property (retain) PARDispatchQueue *notificationQueue;
+
+// queue needed for NSFilePresenter protocol
+@property (retain) NSOperationQueue *presenterQueue;
+
+// File coordination
+@property (readwrite, nonatomic) BOOL _fileCoordinationEnabled;
+
+// responding to file system events (Mac only)
+#if TARGET_OS_IPHONE | TARGET_IPHONE_SIMULATOR
+#elif TARGET_OS_MAC
+@property (strong) PARDispatchQueue *fileSystemEventQueue;
+@property FSEventStreamRef eventStreamDevices;
+@property FSEventStreamRef eventStreamLogs;
+#endif
+
+- (void)createFileSystemEventQueue;
+- (void)startFileSystemEventStreams;
+- (void)refreshFileSystemEventStreamLogs;
+- (void)stopFileSystemEventStreams;
+
+@end
+
+
+
+@implementation PARStore
+
++ (instancetype)storeWithURL:(NSURL *)url deviceIdentifier:(NSString *)identifier
+{
+    return [[self alloc] initWithURL:url deviceIdentifier:identifier];
+}
+
++ (instancetype)storeWithURL:(NSURL *)url deviceIdentifier:(NSString *)identifier manager:(PARStoreManager *)manager
+{
+    return [[self alloc] initWithURL:url deviceIdentifier:identifier manager:manager];
+}
+
+- (instancetype)initWithURL:(NSURL *)url deviceIdentifier:(NSString *)identifier
+{
+    return [self initWithURL:url deviceIdentifier:identifier manager:nil];
+}
+
+- (instancetype)initWithURL:(NSURL *)url deviceIdentifier:(NSString *)identifier manager:(PARStoreManager *)manager
+{
+    if (self = [super init])
+    {
+        self.storeURL = url;
+        self.deviceIdentifier = identifier;
+        self.manager = manager;
+        
+        // queue labels appear in crash reports and other debugging info
+        NSString *urlLabel = [[url lastPathComponent] stringByReplacingOccurrencesOfString:@"." withString:@"_"];
+        NSString *databaseQueueLabel = [PARDispatchQueue labelByPrependingBundleIdentifierToString:[NSString stringWithFormat:@"database.%@", urlLabel]];
+        NSString *memoryQueueLabel = [PARDispatchQueue labelByPrependingBundleIdentifierToString:[NSString stringWithFormat:@"memory.%@", urlLabel]];
+        NSString *notificationQueueLabel = [PARDispatchQueue labelByPrependingBundleIdentifierToString:[NSString stringWithFormat:@"notifications.%@", urlLabel]];
+        self.databaseQueue     = [PARDispatchQueue dispatchQueueWithLabel:databaseQueueLabel];
+        self.memoryQueue       = [PARDispatchQueue dispatchQueueWithLabel:memoryQueueLabel behavior:PARDeadlockBehaviorExecute executor:PARExecutorLock];
+        self.notificationQueue = manager.notificationQueue ?: [PARDispatchQueue dispatchQueueWithLabel:notificationQueueLabel];
+        self.blobQueue         = [PARDispatchQueue dispatchQueueWithLabel:[PARDispatchQueue labelByPrependingBundleIdentifierToString:[NSString stringWithFormat:@"blobs.%@", urlLabel]]];
+        [self createFileSystemEventQueue];
+        
+        // misc initializations
+        self.databaseTimestamps = [NSMutableDictionary dictionary];
+        self.checksumFiles = [NSMutableDictionary dictionary];
+        self.rebuiltSummaries = [NSMutableDictionary dictionary];
+        self.blobPacks = [NSMutableDictionary dictionary];
+        self.pendingLogs = [NSMutableArray array];
+        self.coalescedJournalSegments = [NSCountedSet set];
+        self.operationsToken = [PARCancellationToken token];
+        self.writeBacklogCondition = [[NSCondition alloc] init];
+        if (manager != nil)
+        {
+            self.presenterQueue = manager.presenterQueue;
+        }
+        else
+        {
+            self.presenterQueue = [[NSOperationQueue alloc] init];
+            [self.presenterQueue setMaxConcurrentOperationCount:1];
+        }
+        self._memory = [NSMutableDictionary dictionary];
+        self._memoryFileData = [NSMutableDictionary dictionary];
+        self._memoryKeyTimestamps = [NSMutableDictionary dictionary];
+        self._loaded = NO;
+        self._deleted = NO;
+        self._inMemoryCacheEnabled = YES;
+        self._fileCoordinationEnabled = YES;
+        self.minimumDatabaseKeepAliveInterval = 10.0;
+        self.maximumDatabaseKeepAliveInterval = 300.0;
+        self.incrementalVacuumPageCount = 256;
+        
+        // in memory store?
+        if (url == nil)
+        {
+            self._inMemory = YES;
+            self._loaded = YES;
+            self._memoryLogs = [[_PARMemoryLogs alloc] init];
+            // no database layer, already loaded
+            self.databaseQueue = nil;
+        }
+    }
+    return self;
+}
+
++ (instancetype)inMemoryStore
+{
+    return [self storeWithURL:nil deviceIdentifier:@""];
+}
+
+// device directories starting with a dot are ignored, so this identifier never matches an actual device
+NSString *PARFollowerDeviceIdentifier = @".follower";
+
++ (instancetype)followerStoreWithURL:(NSURL *)url
+{
+    PARStore *store = [self storeWithURL:url deviceIdentifier:PARFollowerDeviceIdentifier];
+    store.follower = YES;
+    [store disableInMemoryCache];
+    return store;
+}
+
+// followers never write to the file package
+- (BOOL)isFollowerRefusingWriteWithSelector:(SEL)selector error:(NSError **)error
+{
+    if (!self.follower)
+    {
+        return NO;
+    }
+    NSString *description = [NSString stringWithFormat:@"Method '%@' cannot be called on follower store at path '%@', which is read-only", NSStringFromSelector(selector), self.storeURL.path];
+    ErrorLog(@"%@", description);
+    if (error != NULL)
+        *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:description underlyingError:nil];
+    return YES;
+}
+
+#pragma mark - Sharing Stores
+
+// shared stores by key (class, path and device identifier), with their handle count; access should be synchronized on the dictionary
+// once the last handle is released, the entry stays until the store is torn down, so that a new store does not write the same database while the old one is still saving
++ (NSMutableDictionary *)sharedStoreRegistry
+{
+    static dispatch_once_t pred = 0;
+    static NSMutableDictionary *registry = nil;
+    dispatch_once(&pred, ^{ registry = [NSMutableDictionary dictionary]; });
+    return registry;
+}
+
++ (NSString *)sharedStoreKeyWithURL:(NSURL *)url deviceIdentifier:(NSString *)identifier
+{
+    return [NSString stringWithFormat:@"%@|%@|%@", NSStringFromClass(self), [[url URLByStandardizingPath] path], identifier];
+}
+
++ (instancetype)sharedStoreWithURL:(NSURL *)url deviceIdentifier:(NSString *)identifier
+{
+    NSString *key = [self sharedStoreKeyWithURL:url deviceIdentifier:identifier];
+    NSMutableDictionary *registry = [PARStore sharedStoreRegistry];
+    while (YES)
+    {
+        PARStore *tearingDownStore = nil;
+        @synchronized(registry)
+        {
+            NSMutableDictionary *entry = registry[key];
+            if (entry == nil)
+            {
+                PARStore *store = [self storeWithURL:url deviceIdentifier:identifier];
+                entry = [NSMutableDictionary dictionaryWithDictionary:@{@"store": store, @"count": @0}];
+                registry[key] = entry;
+            }
+            if (![entry[@"tearingDown"] boolValue])
+            {
+                entry[@"count"] = @([entry[@"count"] unsignedIntegerValue] + 1);
+                return entry[@"store"];
+            }
+            tearingDownStore = entry[@"store"];
+        }
+        
+        // the entry is removed from within the database queue, after the database is torn down
+        [tearingDownStore.memoryQueue dispatchSynchronously:^{ }];
+        [tearingDownStore.databaseQueue dispatchSynchronously:^{ }];
+    }
+}
+
+- (void)releaseSharedStore
+{
+    NSString *key = [[self class] sharedStoreKeyWithURL:self.storeURL deviceIdentifier:self.deviceIdentifier];
+    NSMutableDictionary *registry = [PARStore sharedStoreRegistry];
+    NSMutableDictionary *lastEntry = nil;
+    @synchronized(registry)
+    {
+        NSMutableDictionary *entry = registry[key];
+        if (entry[@"store"] != self || [entry[@"tearingDown"] boolValue])
+        {
+            ErrorLog(@"Store released more times than it was shared: %@", self);
+            return;
+        }
+        NSUInteger count = [entry[@"count"] unsignedIntegerValue] - 1;
+        entry[@"count"] = @(count);
+        if (count == 0)
+        {
+            entry[@"tearingDown"] = @YES;
+            lastEntry = entry;
+        }
+    }
+    if (lastEntry != nil)
+    {
+        [self tearDown];
+        
+        // the memory queue block runs after `_tearDown`, which already scheduled `_tearDownDatabase` in the database queue
+        [self.memoryQueue dispatchAsynchronously:^
+         {
+             [self.databaseQueue dispatchAsynchronously:^
+              {
+                  @synchronized(registry)
+                  {
+                      if (registry[key] == lastEntry)
+                          [registry removeObjectForKey:key];
+                  }
+              }];
+         }];
+    }
+}
+
+- (NSString *)description
+{
+    return [NSString stringWithFormat:@"<%@:%p> (device identifier: %@, url path: %@)", self.class, self, self.deviceIdentifier, self.storeURL.path];
+}
+
+#pragma mark - In-Memory Caching
+
+- (BOOL)inMemoryCacheEnabled {
+    return self._inMemoryCacheEnabled;
+}
+
+- (void)disableInMemoryCache {
+    self._inMemoryCacheEnabled = NO;
+    self._memory = nil;
+}
+
+#pragma mark - File Coordination and Presentation
+
+- (BOOL)fileCoordinationEnabled {
+    return self._fileCoordinationEnabled;
+}
+
+- (void)disableFileCoordination {
+    [NSFileCoordinator removeFilePresenter:self];
+    self._fileCoordinationEnabled = NO;
+    self.presenterQueue = nil;
+}
+
+#pragma mark - Loading / Closing Memory Layer
+
+// loading = populating the memory cache with the values from disk
+// loading is only done once, before adding or accessing values
+
+- (BOOL)loaded
+{
+    __block BOOL loaded = NO;
+    [self.memoryQueue dispatchSynchronously:^{ loaded = self._loaded; }];
+    return loaded;
+}
+
+- (void)_load
+{
+    [self _loadUsingSharedCache:YES];
+}
+
+- (void)_loadUsingSharedCache:(BOOL)usesSharedCache
+{
+    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class], NSStringFromSelector(_cmd));
+
+    if ([self loaded])
+    {
+        return;
+    }
+    
+    // changes journaled but not saved before the last session ended, e.g. with a crash, are not in the snapshot published by other processes
+    BOOL replayed = [self _replayJournal];
+    
+    // the snapshot published by another process, if any, leaves only the most recent logs to sync
+    if (usesSharedCache && !replayed)
+        [self _loadSharedCache];
+    [self _sync];
+    
+    if ([self loaded])
+        [self _openJournal];
+    
+    if ([self loaded] && self._fileCoordinationEnabled)
+    {
+        // DebugLog(@"%@ added as file presenter", self.deviceIdentifier);
+        [NSFileCoordinator addFilePresenter:self];
+        [self startFileSystemEventStreams];
+    }
+}
+
+- (void)load
+{
+    [self.databaseQueue dispatchAsynchronously:^{ [self _load]; }];
+}
+
+- (void)loadNow
+{
+    if ([self.memoryQueue isInCurrentQueueStack])
+    {
+        ErrorLog(@"To avoid deadlocks, %@ should not be called within a transaction. Bailing out.", NSStringFromSelector(_cmd));
+        return;
+    }
+    [self.databaseQueue dispatchSynchronously:^{ [self _load]; }];
+}
+
+- (void)_tearDownMemory
+{
+    NSAssert([self.memoryQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the memory queue", [self class], NSStringFromSelector(_cmd));
+
+    // reset in-memory info
+    self._memory = self._inMemoryCacheEnabled ? [NSMutableDictionary dictionary] : nil;
+    self._memoryKeyTimestamps = [NSMutableDictionary dictionary];
+    if (self._inMemory)
+        self._memoryLogs = [[_PARMemoryLogs alloc] init];
+    self._sharedCache = nil;
+    self._sharedCacheKeyTimestamps = nil;
+    self._loaded = NO;
+    self._deleted = NO;
+
+}
+
+- (void)_tearDown
+{
+    NSAssert([self.memoryQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the memory queue", [self class], NSStringFromSelector(_cmd));
+
+    // reset database layer
+    // to avoid deadlocks, it is **critical** that the call into the database queue be asynchronous
+    if (!self._deleted)
+        [self.databaseQueue dispatchAsynchronously:^
+         {
+             [self _tearDownDatabase];
+         }];
+    
+    // reset memory layer
+    [self _tearDownMemory];
+    [self.blobQueue cancelTimerWithName:@"repack"];
+
+    // to make sure the database is saved when the notification is received, the call is scheduled from within the database queue
+    [self.databaseQueue dispatchAsynchronously:^
+    {
+        [self postNotificationWithName:PARStoreDidTearDownNotification userInfo:nil];
+    }];
+}
+
+- (void)tearDown
+{
+    [self cancelLongRunningOperations];
+    [self.memoryQueue dispatchAsynchronously:^{ [self _tearDown]; }];
+}
+
+- (void)tearDownNow
+{
+    if ([self.memoryQueue isInCurrentQueueStack])
+    {
+        ErrorLog(@"To avoid deadlocks, %@ should not be called within a transaction. Bailing out.", NSStringFromSelector(_cmd));
+        return;
+    }
+    [self cancelLongRunningOperations];
+    [self.memoryQueue       dispatchSynchronously:^{ [self _tearDown]; }];
+    [self.databaseQueue     dispatchSynchronously:^{ }];
+    [self.notificationQueue dispatchSynchronously:^{ }];
+}
+
+- (void)waitUntilFinished
+{
+    if ([self.memoryQueue isInCurrentQueueStack])
+    {
+        ErrorLog(@"To avoid deadlocks, %@ should not be called within a transaction. Bailing out.", NSStringFromSelector(_cmd));
+        return;
+    }
+    [self.memoryQueue       dispatchSynchronously:^{ }];
+    [self.databaseQueue     dispatchSynchronously:^{ [self _save:NULL]; [self _sync]; }];
+    [self.notificationQueue dispatchSynchronously:^{ }];
+}
+
+#pragma mark - Cancelling Operations
+
+- (void)cancelLongRunningOperations
+{
+    PARCancellationToken *cancelledToken = nil;
+    @synchronized(self)
+    {
+        cancelledToken = self.operationsToken;
+        self.operationsToken = [PARCancellationToken token];
+    }
+    [cancelledToken cancel];
+}
+
+// the operation is cancelled by either the token passed by the caller or the store
+- (PARCancellationToken *)operationTokenWithCancellationToken:(PARCancellationToken *)cancellationToken
+{
+    PARCancellationToken *operationsToken = nil;
+    @synchronized(self)
+    {
+        operationsToken = self.operationsToken;
+    }
+    if (cancellationToken == nil)
+        return operationsToken;
+    return [PARCancellationToken tokenWithParentTokens:@[operationsToken, cancellationToken]];
+}
+
+- (NSError *)cancellationErrorWithSelector:(SEL)selector
+{
+    NSString *description = [NSString stringWithFormat:@"Method '%@' was cancelled for store at path '%@'", NSStringFromSelector(selector), self.storeURL.path];
+    return [NSError errorWithDomain:NSCocoaErrorDomain code:NSUserCancelledError userInfo:@{NSLocalizedDescriptionKey: description}];
+}
+
+// since `self` is retained by the blocks used for scheduling a 'save' or a 'sync', we do not expect to be in a situation where the store is in an unsaved or inconsistent state when dealloc-ed
+// the database queue should not have any timer set anymore
+- (void)dealloc
+{
+    // do not access '_loaded' via the queue or via the safe `loaded` accessor, to avoid further waiting for a queue: if closed properly, this will be safe, and otherwise, we are already in trouble
+    NSUInteger timerCount = _databaseQueue.timerCount;
+    if (timerCount > 0)
+        ErrorLog(@"Unexpected timer count of %@ for the database queue of store at path: %@", @(timerCount), [self.storeURL path]);
+}
+
+
+#pragma mark - Paths
+
+#ifdef PARSTORE_LEGACY
+NSString *PARDatabaseFileName = @"logs.db";
+NSString *PARChecksumsFileName = @"checksums.crc";
+NSString *PARJournalFileName = @"journal.log";
+NSString *PARSummaryFileName = @"summary.merkle";
+NSString *PARDevicesDirectoryName = @"devices";
+NSString *PARBlobsDirectoryName = @"blobs";
+NSString *PARBlobPacksDirectoryName = @".packs";
+#else
+NSString *PARDatabaseFileName = @"Logs.db";
+NSString *PARChecksumsFileName = @"Checksums.crc";
+NSString *PARJournalFileName = @"Journal.log";
+NSString *PARSummaryFileName = @"Summary.merkle";
+NSString *PARDevicesDirectoryName = @"Devices";
+NSString *PARBlobsDirectoryName = @"Blobs";
+NSString *PARBlobPacksDirectoryName = @".packs";
+#endif
+
+// the archive of inactive devices is stored as an additional device, with a valid directory name that cannot collide with the UUIDs used as device identifiers
+NSString *PARArchiveDeviceIdentifier = @"PARStoreArchive";
+
+- (NSString *)deviceRootPath
+{
+    if (self._inMemory || ![self.storeURL isFileURL])
+        return nil;
+    return [[self.storeURL path] stringByAppendingPathComponent:PARDevicesDirectoryName];
+}
+
+- (NSString *)directoryPathForDeviceIdentifier:(NSString *)deviceIdentifier
+{
+    return [[self deviceRootPath] stringByAppendingPathComponent:deviceIdentifier];
+}
+
+- (NSString *)databasePathForDeviceIdentifier:(NSString *)deviceIdentifier
+{
+    return [[self directoryPathForDeviceIdentifier:deviceIdentifier] stringByAppendingPathComponent:PARDatabaseFileName];
+}
+
+- (NSString *)deviceIdentifierForDatabasePath:(NSString *)path
+{
+    return [[path stringByDeletingLastPathComponent] lastPathComponent];
+}
+
+- (NSString *)readwriteDirectoryPath
+{
+    if (self._inMemory || ![self.storeURL isFileURL])
+        return nil;
+    return [self directoryPathForDeviceIdentifier:self.deviceIdentifier];
+}
+
+- (NSFileCoordinator *)newFileCoordinator {
+    if (self._fileCoordinationEnabled) {
+        return [[NSFileCoordinator alloc] initWithFilePresenter:self];
+    } else {
+        return [[_PARFileUncoordinator alloc] init];
+    }
+}
+
+- (BOOL)prepareFilePackageWithError:(NSError **)error
+{
+    if (self._inMemory)
+        return YES;
+	
+    __block BOOL success = YES;
+    __block NSError *localError = nil;
+
+	// URL should be a file
+	if (![self.storeURL isFileURL])
+	{
+        localError = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"%@ only supports files and cannot create file package with URL: %@", NSStringFromClass([self class]), self.storeURL] underlyingError:nil];
+		success = NO;
+	}
+		
+	// file should be a directory
+	NSString *storePath = [self.storeURL path];
+	BOOL isDir = NO;
+	BOOL fileExists = [[NSFileManager defaultManager] fileExistsAtPath:storePath isDirectory:&isDir];
+	if (success && fileExists && !isDir)
+	{
+        localError = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"The path for a store should be a directory at path: %@", storePath] underlyingError:nil];
+		success = NO;
+	}
+		
+	// file package should have a 'devices' subdirectory
+	NSString *devicesPath = [self deviceRootPath];
+	BOOL devicesPathIsDir = NO;
+	BOOL devicesDirExists = [[NSFileManager defaultManager] fileExistsAtPath:devicesPath isDirectory:&devicesPathIsDir];
+	if (success && devicesDirExists && !devicesPathIsDir)
+	{
+        localError = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"The file package for a store should have a 'devices' subdirectory at path: %@", storePath] underlyingError:nil];
+		success = NO;
+	}
+
+	// 'devices' subdir may have a 'deviceID' subdir
+	NSString *identifierPath = [self readwriteDirectoryPath];
+	BOOL identifierPathIsDir = NO;
+	BOOL identifierDirExists = [[NSFileManager defaultManager] fileExistsAtPath:identifierPath isDirectory:&identifierPathIsDir];
+	if (success && identifierDirExists && !identifierPathIsDir)
+    {
+        localError = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"The device identifier subpath '%@' should be a directory in the file package for the store at path: %@", self.deviceIdentifier, storePath] underlyingError:nil];
+		success = NO;
+	}
+
+	// create file package if necessary
+	if (success && !fileExists)
+	{
+		NSFileCoordinator *coordinator = [self newFileCoordinator];
+		[coordinator coordinateWritingItemAtURL:self.storeURL options:NSFileCoordinatorWritingForReplacing error:NULL byAccessor:^(NSURL *newURL) {
+			NSError *fmError = nil;
+			success = [[NSFileManager defaultManager] createDirectoryAtURL:self.storeURL withIntermediateDirectories:NO attributes:nil error:&fmError] && [[NSFileManager defaultManager] createDirectoryAtPath:devicesPath withIntermediateDirectories:NO attributes:nil error:&fmError];
+			if (!success)
+                localError = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Could not create the root directory for the file package for the store at path: %@", storePath] underlyingError:fmError];
+		}];
+	}
+		
+	// create deviceID subfolder if necessary
+	if (success && !identifierDirExists)
+	{
+		NSFileCoordinator *coordinator = [self newFileCoordinator];
+		[coordinator coordinateWritingItemAtURL:[NSURL fileURLWithPath:identifierPath] options:NSFileCoordinatorWritingForReplacing error:NULL byAccessor:^(NSURL *newURL) {
+			
+			NSError *fmError = nil;
+			success = [[NSFileManager defaultManager] createDirectoryAtPath:identifierPath withIntermediateDirectories:NO attributes:nil error:&fmError];
+			if (!success)
+                localError = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Could not create a subdirectory for the device identifier '%@' in the file package for the store at path: %@", self.deviceIdentifier, storePath] underlyingError:fmError];
+		}];
+	}
+
+    if (!success)
+    {
+        ErrorLog(@"Could not prepare file package for store at URL '%@' because of error: %@", self.storeURL, localError);
+        if (error != NULL)
+            *error = localError;
+    }
+    return success;
+}
+
+// the listing is only done again when the 'devices' directory changes, which is rare, but it is checked on every sync
+- (NSArray *)readonlyDirectoryPaths
+{
+    // store should be a file on disk
+    if (self._inMemory || ![self.storeURL isFileURL])
+        return @[];
+    
+    // file package should have a 'devices' subdirectory
+    NSString *devicesPath = [self deviceRootPath];
+    struct stat info;
+    if (stat(devicesPath.fileSystemRepresentation, &info) != 0 || !S_ISDIR(info.st_mode))
+        return @[];
+    
+    // adding or removing a device directory changes the modification date of the 'devices' directory
+    NSString *fingerprint = PARFingerprintForFileInfo(&info);
+    NSArray *cache = self.readonlyDirectoryPathsCache;
+    if (cache != nil && [cache[0] isEqualToString:fingerprint])
+        return cache[1];
+    
+    // subdirs of 'devices' have device-specific files
+    NSArray *subpaths = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:devicesPath error:NULL];
+    if (!subpaths)
+        return @[];
+    NSMutableArray *paths = [NSMutableArray arrayWithCapacity:[subpaths count]];
+    for (NSString *subpath in subpaths)
+    {
+        if ([subpath hasPrefix:@"."])
+            continue;
+        if ([subpath isEqualToString:self.deviceIdentifier])
+            continue;
+        NSString *fullPath = [devicesPath stringByAppendingPathComponent:subpath];
+        BOOL subpathIsDir = NO;
+        if ([[NSFileManager defaultManager] fileExistsAtPath:fullPath isDirectory:&subpathIsDir] && subpathIsDir)
+            [paths addObject:fullPath];
+    }
+    NSArray *readonlyDirectoryPaths = [NSArray arrayWithArray:paths];
+    
+    // on file systems with a 1-second resolution, the directory could still change in the same second without changing its fingerprint
+    if (time(NULL) - info.st_mtimespec.tv_sec > 1)
+        self.readonlyDirectoryPathsCache = @[fingerprint, readonlyDirectoryPaths];
+    else
+        self.readonlyDirectoryPathsCache = nil;
+    
+    return readonlyDirectoryPaths;
+}
+
+- (void)invalidateReadonlyDirectoryPaths
+{
+    self.readonlyDirectoryPathsCache = nil;
+}
+
+- (NSArray *)foreignDeviceIdentifiers
+{
+    NSMutableArray *devices = [NSMutableArray array];
+    for (NSString *path in [self readonlyDirectoryPaths])
+    {
+        NSString *device = path.lastPathComponent;
+        if (device != nil)
+        {
+            [devices addObject:device];
+        }
+    }
+    return devices.copy;
+}
+
+- (NSString *)subpathInPackageForPath:(NSString *)path
+{
+	NSArray *components = [path pathComponents];
+    NSArray *directoryComponents = [[self.storeURL path] pathComponents];
+    if ([components count] < [directoryComponents count])
+        return nil;
+    return [[components subarrayWithRange:NSMakeRange([directoryComponents count] - 1, [components count] -[directoryComponents count] + 1)] componentsJoinedByString:@"/"];
+}
+
+- (BOOL)isReadwriteDirectorySubpath:(NSString *)path
+{
+    if (self.follower)
+        return NO;
+    
+    if (self._inMemory || ![self.storeURL isFileURL])
+        return NO;
+    
+	// be careful to check relative path instead of full path comparison
+	NSString *fileName = [self.storeURL lastPathComponent];
+	NSString *relativeDevicesDir = [fileName stringByAppendingPathComponent:PARDevicesDirectoryName];
+	NSString *relativeReadWriteDir = [relativeDevicesDir stringByAppendingPathComponent:self.deviceIdentifier];
+	
+	return [path rangeOfString:relativeReadWriteDir].location != NSNotFound;
+}
+
+
+#pragma mark - Loading / Closing Database Layer
+
++ (NSManagedObjectModel *)managedObjectModel
+{
+    static dispatch_once_t pred = 0;
+    static NSManagedObjectModel *mom = nil;
+    dispatch_once(&pred,
+      ^{
+          NSAttributeDescription *blobAttribute = [[NSAttributeDescription alloc] init];
+          blobAttribute.name = BlobAttributeName;
+          blobAttribute.attributeType = NSBinaryDataAttributeType;
+          
+          NSAttributeDescription *keyAttribute = [[NSAttributeDescription alloc] init];
+          keyAttribute.name = KeyAttributeName;
+          keyAttribute.indexed = YES;
+          keyAttribute.attributeType = NSStringAttributeType;
+          
+          NSAttributeDescription *timestampAttribute = [[NSAttributeDescription alloc] init];
+          timestampAttribute.name = TimestampAttributeName;
+          timestampAttribute.indexed = YES;
+          timestampAttribute.attributeType = NSInteger64AttributeType;
+          
+          NSAttributeDescription *parentTimestampAttribute = [[NSAttributeDescription alloc] init];
+          parentTimestampAttribute.name = ParentTimestampAttributeName;
+          parentTimestampAttribute.indexed = YES;
+          parentTimestampAttribute.attributeType = NSInteger64AttributeType;
+          
+          NSEntityDescription *entity = [[NSEntityDescription alloc] init];
+          entity.name = LogEntityName;
+          entity.properties = @[blobAttribute, keyAttribute, timestampAttribute, parentTimestampAttribute];
+          
+          mom = [[NSManagedObjectModel alloc] init];
+          mom.entities = @[entity];
+      });
+    return mom;
+}
+
+// string identifying the managed object model, which changes whenever the schema changes
++ (NSString *)managedObjectModelVersion
+{
+    static dispatch_once_t pred = 0;
+    static NSString *version = nil;
+    dispatch_once(&pred,
+      ^{
+          NSDictionary *hashes = [[self managedObjectModel] entityVersionHashesByName];
+          NSMutableArray *components = [NSMutableArray array];
+          for (NSString *entityName in [hashes.allKeys sortedArrayUsingSelector:@selector(compare:)])
+          {
+              NSData *hash = hashes[entityName];
+              [components addObject:[NSString stringWithFormat:@"%@:%@", entityName, [hash base64EncodedStringWithOptions:0]]];
+          }
+          version = [components componentsJoinedByString:@","];
+      });
+    return version;
+}
+
++ (NSString *)fingerprintForFileAtPath:(NSString *)path
+{
+    return PARFingerprintForFileAtPath(path);
+}
+
+// Database files that were successfully opened with the current model, by path, with the fingerprint they had at that time. The cache is shared by all the stores in the process.
+// When a file has not changed since, it can be opened again without the migration options: with these options, Core Data reads the store metadata and checks it against the model before each opening.
++ (NSMutableDictionary *)validatedDatabaseFingerprints
+{
+    static dispatch_once_t pred = 0;
+    static NSMutableDictionary *fingerprints = nil;
+    dispatch_once(&pred, ^{ fingerprints = [NSMutableDictionary dictionary]; });
+    return fingerprints;
+}
+
++ (NSString *)schemaFingerprintForDatabaseAtPath:(NSString *)path
+{
+    NSString *fileFingerprint = [self fingerprintForFileAtPath:path];
+    if (fileFingerprint == nil)
+    {
+        return nil;
+    }
+    return [NSString stringWithFormat:@"%@|%@", fileFingerprint, [self managedObjectModelVersion]];
+}
+
++ (BOOL)isSchemaValidatedForDatabaseAtPath:(NSString *)path
+{
+    NSString *fingerprint = [self schemaFingerprintForDatabaseAtPath:path];
+    if (fingerprint == nil)
+    {
+        return NO;
+    }
+    NSMutableDictionary *fingerprints = [self validatedDatabaseFingerprints];
+    @synchronized(fingerprints)
+    {
+        return [fingerprints[path] isEqualToString:fingerprint];
+    }
+}
+
++ (void)setSchemaValidatedForDatabaseAtPath:(NSString *)path
+{
+    NSString *fingerprint = [self schemaFingerprintForDatabaseAtPath:path];
+    NSMutableDictionary *fingerprints = [self validatedDatabaseFingerprints];
+    @synchronized(fingerprints)
+    {
+        if (fingerprint == nil)
+            [fingerprints removeObjectForKey:path];
+        else
+            fingerprints[path] = fingerprint;
+    }
+}
+
+- (NSMutableDictionary *)storeOptionsForDatabaseAtPath:(NSString *)storePath readOnly:(BOOL)readOnly additionalPragmas:(NSDictionary *)additionalPragmas
+{
+    NSMutableDictionary *pragmas = [NSMutableDictionary dictionaryWithDictionary:@{
+                              @"journal_mode": @"TRUNCATE"
+                              }];
+    if (readOnly)
+    {
+        NSUInteger memoryMapSize = self.foreignDatabaseMemoryMapSize;
+        NSInteger cacheSize = self.foreignDatabaseCacheSize;
+        if (memoryMapSize > 0)
+            pragmas[@"mmap_size"] = [@(memoryMapSize) stringValue];
+        if (cacheSize != 0)
+            pragmas[@"cache_size"] = [@(cacheSize) stringValue];
+    }
+    else
+    {
+        // these only take effect when the database file is created, or rebuilt with a full vacuum
+        pragmas[@"auto_vacuum"] = @"INCREMENTAL";
+        NSUInteger pageSize = self.databasePageSize;
+        if (pageSize > 0)
+            pragmas[@"page_size"] = [@(pageSize) stringValue];
+    }
+    [pragmas addEntriesFromDictionary:additionalPragmas];
+    
+    NSMutableDictionary *storeOptions = [NSMutableDictionary dictionaryWithDictionary:@{
+                                   NSReadOnlyPersistentStoreOption:               @(readOnly),
+                                   NSSQLitePragmasOption:                         pragmas,
+                                   }];
+    if (![PARStore isSchemaValidatedForDatabaseAtPath:storePath])
+    {
+        storeOptions[NSMigratePersistentStoresAutomaticallyOption] = @YES;
+        storeOptions[NSInferMappingModelAutomaticallyOption]       = @YES;
+    }
+    return storeOptions;
+}
+
+- (NSPersistentStore *)addPersistentStoreWithCoordinator:(NSPersistentStoreCoordinator *)psc dirPath:(NSString *)path readOnly:(BOOL)readOnly error:(NSError **)error
+{
+    // for readonly stores, check whether a file is in fact present at that path (with iCloud or Dropbox, the directory could be there without the database yet)
+    NSString *storePath = [path stringByAppendingPathComponent:PARDatabaseFileName];
+    BOOL isDir = NO;
+    if (readOnly && (![[NSFileManager defaultManager] fileExistsAtPath:storePath isDirectory:&isDir] || isDir))
+    {
+        if (isDir)
+        {
+            ErrorLog(@"Cannot create persistent store for database at path '%@', because there is already a directory at this path", storePath);
+        }
+        else
+        {
+            ErrorLog(@"Cannot create persistent store for database at path '%@' in read-only mode, because there is no file at this path", storePath);
+        }
+        return nil;
+    }
+	
+	// create the store
+    NSError *localError = nil;
+    BOOL isNewDatabase = !readOnly && ![[NSFileManager defaultManager] fileExistsAtPath:storePath];
+    NSDictionary *storeOptions = [self storeOptionsForDatabaseAtPath:storePath readOnly:readOnly additionalPragmas:nil];
+    NSPersistentStore *store = [psc addPersistentStoreWithType:NSSQLiteStoreType configuration:nil URL:[NSURL fileURLWithPath:storePath] options:storeOptions error:&localError];
+    if (!store)
+    {
+        ErrorLog(@"Error creating persistent store for database at path '%@':\n%@", storePath, localError);
+        if (error != NULL)
+            *error = localError;
+        return nil;
+    }
+    [PARStore setSchemaValidatedForDatabaseAtPath:storePath];
+    
+    // a new database starts with an empty summary, saved with its first rows
+    if (isNewDatabase)
+        [self setSummary:[[_PARMerkleSummary alloc] init] inMetadataForStore:store];
+    return store;
+}
+
+// context for all the stores corresponding to the different devices
+// only the 'main' store is read/write
+- (NSManagedObjectContext *)managedObjectContext
+{
+    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class],NSStringFromSelector(_cmd));
+
+    // lazy creation
+    NSManagedObjectContext *managedObjectContext = self._managedObjectContext;
+    if (managedObjectContext != nil)
+    {
+        return managedObjectContext;
+    }
+    
+    // the time it takes to open all the databases is used to decide how long to keep them open
+    NSTimeInterval openingStartTime = [NSDate timeIntervalSinceReferenceDate];
+
+    // model
+    NSManagedObjectModel *mom = [PARStore managedObjectModel];
+    if (mom == nil)
+    {
+        return nil;
+    }
+    
+    // prepare file package on disk; followers only open existing databases
+    if (!self.follower && ![self prepareFilePackageWithError:NULL])
+    {
+        ErrorLog(@"Could not create managed object context for store at URL '%@'", self.storeURL);
+        return nil;
+    }
+    
+    // stores
+    NSPersistentStoreCoordinator *psc = [[NSPersistentStoreCoordinator alloc] initWithManagedObjectModel:mom];
+    NSError *error = nil;
+    if (!self.follower)
+    {
+        self.readwriteDatabase = [self addPersistentStoreWithCoordinator:psc dirPath:[self readwriteDirectoryPath] readOnly:NO error:&error];
+        if (!self.readwriteDatabase)
+            return nil;
+        self.readwriteDatabaseFingerprint = [PARStore schemaFingerprintForDatabaseAtPath:self.readwriteDatabase.URL.path];
+    }
+    // with a limit on open foreign databases, they are only attached when queried
+    NSArray *otherDirs = (self.maximumOpenForeignDatabaseCount == 0) ? [self readonlyDirectoryPaths] : @[];
+    NSMutableArray *otherStores = [NSMutableArray array];
+    for (NSString *dir in otherDirs)
+    {
+        NSPersistentStore *store = [self addPersistentStoreWithCoordinator:psc dirPath:dir readOnly:YES error:NULL];
+        if (store)
+            [otherStores addObject:store];
+    }
+    self.readonlyDatabases = [NSArray arrayWithArray:otherStores];
+    
+    // fetch requests raise an exception without any store, and a follower has nothing to read until a device database appears
+    if (psc.persistentStores.count == 0 && [self readonlyDirectoryPaths].count == 0)
+        return nil;
+
+    // context
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+    NSManagedObjectContext *moc = [[NSManagedObjectContext alloc] init];
+#pragma clang diagnostic pop
+    [moc setPersistentStoreCoordinator:psc];
+    [moc setUndoManager:nil];
+    self._managedObjectContext = moc;
+    self.databaseOpenDuration = [NSDate timeIntervalSinceReferenceDate] - openingStartTime;
+    return moc;
+}
+
+- (void)refreshStoreList
+{
+    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class],NSStringFromSelector(_cmd));
+    if (self._inMemory)
+        return;
+    
+    NSPersistentStoreCoordinator *psc = [[self managedObjectContext] persistentStoreCoordinator];
+    NSMutableArray *stores = [NSMutableArray arrayWithArray:self.readonlyDatabases];
+    
+    // databases of devices archived by another client are gone, and their logs are now in the archive
+    for (NSPersistentStore *store in self.readonlyDatabases)
+    {
+        if (![[NSFileManager defaultManager] fileExistsAtPath:store.URL.path])
+        {
+            NSString *deviceIdentifier = [self deviceIdentifierForDatabasePath:store.URL.path];
+            if (deviceIdentifier != nil)
+                [self.databaseTimestamps removeObjectForKey:deviceIdentifier];
+            [psc removePersistentStore:store error:NULL];
+            [stores removeObject:store];
+        }
+    }
+    
+    // with a limit on open foreign databases, new databases are attached when queried
+    if (self.maximumOpenForeignDatabaseCount > 0)
+    {
+        for (NSPersistentStore *store in stores)
+            [psc setURL:store.URL forPersistentStore:store];
+        self.readonlyDatabases = [NSArray arrayWithArray:stores];
+        return;
+    }
+    
+    NSArray *currentDirs = [stores valueForKeyPath:@"URL.path"];
+    NSArray *allDirs = [self readonlyDirectoryPaths];
+    NSString *archivePath = [self databasePathForDeviceIdentifier:PARArchiveDeviceIdentifier];
+    for (NSString *path in allDirs)
+    {
+		NSString *storePath = [path stringByAppendingPathComponent:PARDatabaseFileName];
+        
+        // store is already known
+        if ([currentDirs containsObject:storePath])
+        {
+            // the archive is frozen until archived again
+            if ([storePath isEqualToString:archivePath] && [PARFingerprintForFileAtPath(archivePath) isEqualToString:self.archiveFingerprint])
+                continue;
+            
+            // refresh the URL to force a cache flush and reload the synced contents if available
+			NSPersistentStore *existingStore = [psc persistentStoreForURL:[NSURL fileURLWithPath:storePath]];
+            [psc setURL:existingStore.URL forPersistentStore:existingStore];
+		}
+		
+        // new store
+        else
+        {
+            NSPersistentStore *newStore = [self addPersistentStoreWithCoordinator:psc dirPath:path readOnly:YES error:NULL];
+            if (newStore)
+                [stores addObject:newStore];
+        }
+    }
+    self.readonlyDatabases = [NSArray arrayWithArray:stores];
+}
+
+// attaches the databases of the devices, and detaches the least recently used ones beyond the limit; `readonlyDatabases` is kept in order of use
+- (NSArray *)attachForeignDatabasesForDeviceIdentifiers:(NSArray *)deviceIdentifiers
+{
+    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class], NSStringFromSelector(_cmd));
+    
+    NSPersistentStoreCoordinator *psc = [[self managedObjectContext] persistentStoreCoordinator];
+    if (psc == nil)
+        return @[];
+    
+    NSMutableArray *attachedStores = [NSMutableArray arrayWithArray:self.readonlyDatabases];
+    NSMutableArray *stores = [NSMutableArray arrayWithCapacity:deviceIdentifiers.count];
+    for (NSString *deviceIdentifier in deviceIdentifiers)
+    {
+        NSString *dirPath = [self directoryPathForDeviceIdentifier:deviceIdentifier];
+        NSPersistentStore *store = [psc persistentStoreForURL:[NSURL fileURLWithPath:[dirPath stringByAppendingPathComponent:PARDatabaseFileName]]];
+        if (store != nil)
+            [attachedStores removeObject:store];
+        else
+            store = [self addPersistentStoreWithCoordinator:psc dirPath:dirPath readOnly:YES error:NULL];
+        if (store == nil)
+            continue;
+        [attachedStores addObject:store];
+        [stores addObject:store];
+    }
+    
+    // the objects already fetched from detached stores are not used anymore, since they are turned back into faults after use
+    NSUInteger limit = MAX(self.maximumOpenForeignDatabaseCount, stores.count);
+    while (attachedStores.count > limit)
+    {
+        [psc removePersistentStore:attachedStores.firstObject error:NULL];
+        [attachedStores removeObjectAtIndex:0];
+    }
+    self.readonlyDatabases = [NSArray arrayWithArray:attachedStores];
+    return stores;
+}
+
+// without any limit on open foreign databases, the block is called once with nil, for a query on all the databases; otherwise, it is called for each group of databases, which are attached as needed
+- (void)enumerateDatabaseGroupsForDeviceIdentifiers:(NSArray *)deviceIdentifiers usingBlock:(void(^)(NSArray *stores))block
+{
+    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class], NSStringFromSelector(_cmd));
+    
+    NSUInteger groupSize = self.maximumOpenForeignDatabaseCount;
+    if (groupSize == 0)
+    {
+        block(nil);
+        return;
+    }
+    
+    NSUInteger location = 0;
+    do
+    {
+        NSArray *group = [deviceIdentifiers subarrayWithRange:NSMakeRange(location, MIN(groupSize, deviceIdentifiers.count - location))];
+        NSMutableArray *stores = [NSMutableArray arrayWithArray:[self attachForeignDatabasesForDeviceIdentifiers:group]];
+        if (location == 0 && self.readwriteDatabase != nil)
+            [stores addObject:self.readwriteDatabase];
+        if (stores.count > 0)
+            block(stores);
+        location += groupSize;
+    }
+    while (location < deviceIdentifiers.count);
+}
+
+- (void)enumerateDatabaseGroupsUsingBlock:(void(^)(NSArray *stores))block
+{
+    NSArray *deviceIdentifiers = (self.maximumOpenForeignDatabaseCount == 0) ? @[] : [self foreignDeviceIdentifiers];
+    [self enumerateDatabaseGroupsForDeviceIdentifiers:deviceIdentifiers usingBlock:block];
+}
+
+- (BOOL)_save:(NSError **)error
+{
+    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class],NSStringFromSelector(_cmd));
+    [self.databaseQueue cancelTimerWithName:@"save_delay"];
+    [self.databaseQueue cancelTimerWithName:@"save_coalesce"];
+    
+    if ([self deleted])
+    {
+        NSError *localError = [NSError errorWithObject:self code:__LINE__ localizedDescription:@"Cannot save deleted store" underlyingError:nil];
+        if (error != NULL)
+        {
+            *error = localError;
+        }
+        return NO;
+    }
+
+    // autoclose database
+    [self closeDatabaseSoon];
+
+    // skip save if already closes, or nothing to save
+    if (self._managedObjectContext == nil || self.follower)
+    {
+        return YES;
+    }
+    
+    // save
+    NSError *localError = nil;
+    BOOL hasChanges = self._managedObjectContext.hasChanges;
+    if (hasChanges)
+        self.needsIncrementalVacuum = YES;
+    NSSet *insertedLogs = self._managedObjectContext.insertedObjects;
+    NSData *checksumRecords = self.checksumsEnabled ? [self checksumRecordsForLogs:insertedLogs] : nil;
+    NSString *summaryPath = [[self readwriteDirectoryPath] stringByAppendingPathComponent:PARSummaryFileName];
+    _PARMerkleSummary *summary = (insertedLogs.count > 0 && self.readwriteDatabase != nil) ? [self summaryByAddingLogs:insertedLogs toStore:self.readwriteDatabase summaryPath:summaryPath] : nil;
+    NSFileCoordinator *coordinator = [self newFileCoordinator];
+    NSURL *databaseURL = [NSURL fileURLWithPath:[[self readwriteDirectoryPath] stringByAppendingPathComponent:PARDatabaseFileName]];
+    NSError *coordinatorError = nil;
+    __block NSError *saveError = nil;
+    [coordinator coordinateWritingItemAtURL:databaseURL options:NSFileCoordinatorWritingForReplacing error:&coordinatorError byAccessor:^(NSURL *newURL)
+     {
+         NSError *blockError = nil;
+         if (![self._managedObjectContext save:&blockError])
+             saveError = blockError;
+     }];
+
+    // handle error
+    localError = coordinatorError ?: saveError;
+    if (localError)
+    {
+        NSString *storePath = [self.storeURL path];
+        ErrorLog(@"Could not save store:\npath: %@\nerror: %@\n", storePath, [localError localizedDescription]);
+        if (error != NULL)
+            *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Could not save store for device identifier '%@' at path: %@", self.deviceIdentifier, [self.storeURL path]] underlyingError:localError];
+        return NO;
+    }
+    
+    [self.pendingLogs removeAllObjects];
+    
+    // checksums and summaries are only written once the rows are
+    if (checksumRecords.length > 0)
+        [_PARChecksumFile writeRecords:checksumRecords toPath:[[self readwriteDirectoryPath] stringByAppendingPathComponent:PARChecksumsFileName] append:YES error:NULL];
+    if (summary != nil)
+        [summary writeToPath:summaryPath error:NULL];
+    else if (insertedLogs.count > 0)
+        [[NSFileManager defaultManager] removeItemAtPath:summaryPath error:NULL];
+    
+    // the journal segments are only needed until all their changes are saved; changes still waiting to be inserted keep theirs
+    [self.journal didSave];
+    
+    #if TARGET_OS_IPHONE | TARGET_IPHONE_SIMULATOR
+    
+    #elif TARGET_OS_MAC
+    // save was successful: "blink" the database which relinquishes the lock on the file just enough for a service like Dropbox to upload the new version on the server
+    // not needed on iOS where the files are all under the control of the app and would need to be manually uploaded to online file services
+    NSPersistentStore *store = self.readwriteDatabase;
+    if (store !=  nil)
+    {
+        // "blinking" can be done by simply setting again the URL of the persistent store
+        [[self._managedObjectContext persistentStoreCoordinator] setURL:store.URL forPersistentStore:store];
+    }
+    #endif
+
+    // our own saves change the fingerprint of the local database, but not its schema
+    if (hasChanges)
+        self.readwriteDatabaseFingerprint = [PARStore schemaFingerprintForDatabaseAtPath:databaseURL.path];
+
+    if (hasChanges)
+        [self publishSharedCacheSoon];
+    return YES;
+}
+
+// the context should already be open
+- (void)_insertLogWithKey:(NSString *)key blob:(NSData *)blob timestamp:(NSNumber *)timestamp parentTimestamp:(NSNumber *)parentTimestamp
+{
+    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class], NSStringFromSelector(_cmd));
+    
+    NSManagedObject *newLog = [NSEntityDescription insertNewObjectForEntityForName:LogEntityName inManagedObjectContext:self._managedObjectContext];
+    [newLog setValue:timestamp forKey:TimestampAttributeName];
+    [newLog setValue:parentTimestamp forKey:ParentTimestampAttributeName];
+    [newLog setValue:key forKey:KeyAttributeName];
+    [newLog setValue:blob forKey:BlobAttributeName];
+    
+    NSMutableDictionary *log = [NSMutableDictionary dictionaryWithCapacity:4];
+    log[TimestampAttributeName] = timestamp;
+    log[ParentTimestampAttributeName] = parentTimestamp;
+    log[KeyAttributeName] = key;
+    log[BlobAttributeName] = blob;
+    [self.pendingLogs addObject:log];
+}
+
+- (void)saveNow
+{
+    if ([self.memoryQueue isInCurrentQueueStack])
+    {
+        ErrorLog(@"To avoid deadlocks, %@ should not be called within a transaction. Bailing out.", NSStringFromSelector(_cmd));
+        return;
+    }
+    [self.databaseQueue dispatchSynchronously:^{ [self _save:NULL]; }];
+}
+
+- (void)saveSoon
+{
+    [self.databaseQueue scheduleTimerWithName:@"save_delay" timeInterval:1.0 behavior:PARTimerBehaviorDelay block:^{ [self _save:NULL]; }];
+    [self.databaseQueue scheduleTimerWithName:@"save_coalesce" timeInterval:15.0 behavior:PARTimerBehaviorCoalesce block:^{ [self _save:NULL]; }];
+}
+
+// returns YES if changes were missing from the database
+- (BOOL)_replayJournal
+{
+    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class], NSStringFromSelector(_cmd));
+    
+    if (self.follower || [self deleted] || self.readwriteDirectoryPath == nil)
+    {
+        return NO;
+    }
+    NSString *path = [[self readwriteDirectoryPath] stringByAppendingPathComponent:PARJournalFileName];
+    NSArray *segmentPaths = [_PARJournal segmentPathsForPath:path];
+    NSMutableArray *journalRecords = [NSMutableArray array];
+    for (NSString *segmentPath in segmentPaths)
+        [journalRecords addObjectsFromArray:[_PARJournal recordsAtPath:segmentPath]];
+    
+    // a coalesced change is journaled with the same parent as the coalesced change of the same key it replaces, and only the latest one was to be written: replaying the others would fork the history of the key
+    NSMutableDictionary *latestRecords = [NSMutableDictionary dictionaryWithCapacity:journalRecords.count];
+    for (NSArray *record in journalRecords)
+        latestRecords[@[record[0], record[2]]] = record;
+    NSMutableArray *records = [NSMutableArray arrayWithCapacity:latestRecords.count];
+    for (NSArray *record in journalRecords)
+        if (latestRecords[@[record[0], record[2]]] == record)
+            [records addObject:record];
+    
+    if (records.count == 0)
+    {
+        for (NSString *segmentPath in segmentPaths)
+            [[NSFileManager defaultManager] removeItemAtPath:segmentPath error:NULL];
+        return NO;
+    }
+    NSManagedObjectContext *moc = [self managedObjectContext];
+    if (moc == nil || self.readwriteDatabase == nil)
+    {
+        return NO;
+    }
+    
+    // the changes may have been saved before the journal was emptied
+    NSNumber *minTimestamp = nil;
+    for (NSArray *record in records)
+        if (minTimestamp == nil || [record[1] compare:minTimestamp] == NSOrderedAscending)
+            minTimestamp = record[1];
+    NSFetchRequest *request = [NSFetchRequest fetchRequestWithEntityName:LogEntityName];
+    request.affectedStores = @[self.readwriteDatabase];
+    request.predicate = [NSPredicate predicateWithFormat:@"%K >= %@", TimestampAttributeName, minTimestamp];
+    request.propertiesToFetch = @[TimestampAttributeName, KeyAttributeName];
+    request.resultType = NSDictionaryResultType;
+    NSError *fetchError = nil;
+    NSArray *savedLogs = [moc executeFetchRequest:request error:&fetchError];
+    if (savedLogs == nil)
+    {
+        ErrorLog(@"Could not replay journal at path '%@': %@", path, fetchError);
+        return NO;
+    }
+    NSMutableSet *savedChanges = [NSMutableSet setWithCapacity:savedLogs.count];
+    for (NSDictionary *log in savedLogs)
+        [savedChanges addObject:@[log[TimestampAttributeName], log[KeyAttributeName]]];
+    
+    NSUInteger replayedCount = 0;
+    for (NSArray *record in records)
+    {
+        if ([savedChanges containsObject:@[record[1], record[0]]])
+            continue;
+        [self _insertLogWithKey:record[0] blob:record[3] timestamp:record[1] parentTimestamp:(record[2] != [NSNull null]) ? record[2] : nil];
+        replayedCount++;
+    }
+    if (replayedCount > 0)
+    {
+        if (![self _save:NULL])
+            return NO;
+        DebugLog(@"Replayed %@ changes from journal at path '%@'", @(replayedCount), path);
+    }
+    for (NSString *segmentPath in segmentPaths)
+        [[NSFileManager defaultManager] removeItemAtPath:segmentPath error:NULL];
+    return replayedCount > 0;
+}
+
+- (void)_openJournal
+{
+    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class], NSStringFromSelector(_cmd));
+    
+    if (!self.journalEnabled || self.follower || self.journal != nil || self.readwriteDirectoryPath == nil)
+    {
+        return;
+    }
+    
+    // a journal left by a failed replay is kept for the next load
+    NSString *path = [[self readwriteDirectoryPath] stringByAppendingPathComponent:PARJournalFileName];
+    for (NSString *segmentPath in [_PARJournal segmentPathsForPath:path])
+    {
+        if ([[[NSFileManager defaultManager] attributesOfItemAtPath:segmentPath error:NULL] fileSize] > 0)
+        {
+            ErrorLog(@"Journal disabled because the journal at path '%@' could not be replayed", segmentPath);
+            return;
+        }
+    }
+    self.journal = [_PARJournal journalWithPath:path error:NULL];
+    self.journal.syncInterval = self.journalSyncInterval;
+}
+
+- (void)_tearDownDatabase
+{
+    if (self._managedObjectContext)
+    {
+        [self _save:NULL];
+        [self _closeDatabase];
+    }
+    [self.journal close];
+    self.journal = nil;
+    // the memory is already torn down, and there is nothing left to publish
+    [self.databaseQueue cancelTimerWithName:@"publish_shared_cache"];
+    [NSFileCoordinator removeFilePresenter:self];
+    [self stopFileSystemEventStreams];
+    self.databaseTimestamps = [NSMutableDictionary dictionary];
+    self.foreignDatabaseFingerprints = nil;
+}
+
+- (void)_closeDatabase
+{
+    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class], NSStringFromSelector(_cmd));
+    [self _save:NULL];
+    [self.databaseQueue cancelTimerWithName:@"close_database"];
+    BOOL wasOpen = (self._managedObjectContext != nil);
+    self._managedObjectContext = nil;
+    [self.pendingLogs removeAllObjects];
+    if (wasOpen)
+        [self.manager storeDidCloseDatabase:self];
+
+    // our own saves change the fingerprint of the local database, but not its schema; a file replaced while open, e.g. by a sync service, is checked again when next opened
+    NSString *readwriteDatabasePath = [[self readwriteDirectoryPath] stringByAppendingPathComponent:PARDatabaseFileName];
+    NSString *openFingerprint = self.readwriteDatabaseFingerprint;
+    self.readwriteDatabaseFingerprint = nil;
+    if (wasOpen && readwriteDatabasePath != nil && !self.follower && openFingerprint != nil && [[PARStore schemaFingerprintForDatabaseAtPath:readwriteDatabasePath] isEqualToString:openFingerprint])
+        [PARStore setSchemaValidatedForDatabaseAtPath:readwriteDatabasePath];
+}
+
+- (void)closeDatabase
+{
+    [self.databaseQueue dispatchAsynchronously:^{ [self _closeDatabase]; }];
+}
+
+// Factors used to adapt the keep-alive interval:
+// - bursts of accesses: the connections stay open over several times the typical interval between accesses
+// - expensive reopening: packages with many devices or large databases take longer to open, and the connections stay open proportionally longer; e.g. a 50 ms opening buys 50 s
+#define PARKeepAliveAccessIntervalFactor 4.0
+#define PARKeepAliveOpenDurationFactor   1000.0
+
+// accesses closer than this are considered part of the same access (e.g. `_sync` calling `_save`)
+#define PARKeepAliveMinimumAccessInterval 0.1
+
+// SQLite defaults, used to estimate the page cache of each connection
+#define PARDefaultDatabaseCacheBytes (2000 * 1024)
+#define PARDefaultDatabasePageSize   4096
+
+- (NSUInteger)estimatedDatabaseFootprint
+{
+    NSInteger cacheSize = self.foreignDatabaseCacheSize;
+    NSUInteger foreignCacheBytes = PARDefaultDatabaseCacheBytes;
+    if (cacheSize > 0)
+        foreignCacheBytes = cacheSize * PARDefaultDatabasePageSize;
+    else if (cacheSize < 0)
+        foreignCacheBytes = -cacheSize * 1024;
+    return PARDefaultDatabaseCacheBytes + self.readonlyDatabases.count * foreignCacheBytes;
+}
+
+- (NSTimeInterval)databaseKeepAliveInterval
+{
+    NSTimeInterval interval = MAX(PARKeepAliveAccessIntervalFactor * self.averageDatabaseAccessInterval, PARKeepAliveOpenDurationFactor * self.databaseOpenDuration);
+    NSTimeInterval minimum = self.minimumDatabaseKeepAliveInterval;
+    NSTimeInterval maximum = MAX(minimum, self.maximumDatabaseKeepAliveInterval);
+    return MIN(MAX(interval, minimum), maximum);
+}
+
+- (void)closeDatabaseSoon
+{
+    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class], NSStringFromSelector(_cmd));
+
+    // exponentially weighted moving average of the interval between accesses; long idle periods are capped, so a single one does not erase the history of a bursty workload
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    NSTimeInterval lastAccessTime = self.lastDatabaseAccessTime;
+    NSTimeInterval accessInterval = now - lastAccessTime;
+    if (lastAccessTime == 0.0)
+    {
+        self.lastDatabaseAccessTime = now;
+    }
+    else if (accessInterval > PARKeepAliveMinimumAccessInterval)
+    {
+        accessInterval = MIN(accessInterval, self.maximumDatabaseKeepAliveInterval);
+        NSTimeInterval average = self.averageDatabaseAccessInterval;
+        self.averageDatabaseAccessInterval = (average == 0.0) ? accessInterval : 0.8 * average + 0.2 * accessInterval;
+        self.lastDatabaseAccessTime = now;
+    }
+
+    // the manager may close the databases of other stores to stay within its memory budget
+    if (self._managedObjectContext != nil)
+        [self.manager store:self didAccessDatabaseWithFootprint:[self estimatedDatabaseFootprint]];
+
+    [self.databaseQueue scheduleTimerWithName:@"close_database" timeInterval:[self databaseKeepAliveInterval] behavior:PARTimerBehaviorDelay block:^
+    {
+        [self _closeDatabase];
+        
+        // the store is idle: good time for a bounded maintenance step
+        if (self.needsIncrementalVacuum && self.incrementalVacuumPageCount > 0)
+            [self _performMaintenanceWithFullRebuild:NO error:NULL];
+    }];
+}
+
+- (void)closeDatabaseNow
+{
+    if ([self.memoryQueue isInCurrentQueueStack])
+    {
+        ErrorLog(@"To avoid deadlocks, %@ should not be called within a transaction. Bailing out.", NSStringFromSelector(_cmd));
+        return;
+    }
+    [self.databaseQueue dispatchSynchronously:^{ [self _closeDatabase]; }];
+}
+
+
+#pragma mark - Storage Maintenance
+
+// The local database is opened with a separate coordinator, and a pragma run when the connection opens:
+// - incremental vacuum: releases up to `incrementalVacuumPageCount` free pages; no-op for databases created before `auto_vacuum` was enabled
+// - full rebuild: `VACUUM`, which also applies the current `page_size` and `auto_vacuum` settings to an existing database
+- (BOOL)_performMaintenanceWithFullRebuild:(BOOL)rebuild error:(NSError **)error
+{
+    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class], NSStringFromSelector(_cmd));
+
+    if (self._inMemory || self.follower || [self deleted])
+    {
+        return YES;
+    }
+    
+    NSString *storePath = [[self readwriteDirectoryPath] stringByAppendingPathComponent:PARDatabaseFileName];
+    if (![[NSFileManager defaultManager] fileExistsAtPath:storePath])
+    {
+        return YES;
+    }
+    
+    // the main connection should not hold the database while it is rebuilt
+    [self _closeDatabase];
+
+    NSMutableDictionary *storeOptions = nil;
+    if (rebuild)
+    {
+        storeOptions = [self storeOptionsForDatabaseAtPath:storePath readOnly:NO additionalPragmas:nil];
+        storeOptions[NSSQLiteManualVacuumOption] = @YES;
+    }
+    else
+    {
+        storeOptions = [self storeOptionsForDatabaseAtPath:storePath readOnly:NO additionalPragmas:@{@"incremental_vacuum": [@(self.incrementalVacuumPageCount) stringValue]}];
+    }
+    
+    NSFileCoordinator *coordinator = [self newFileCoordinator];
+    NSError *coordinatorError = nil;
+    __block NSError *storeError = nil;
+    [coordinator coordinateWritingItemAtURL:[NSURL fileURLWithPath:storePath] options:0 error:&coordinatorError byAccessor:^(NSURL *newURL)
+     {
+         NSPersistentStoreCoordinator *psc = [[NSPersistentStoreCoordinator alloc] initWithManagedObjectModel:[PARStore managedObjectModel]];
+         NSError *addError = nil;
+         NSPersistentStore *store = [psc addPersistentStoreWithType:NSSQLiteStoreType configuration:nil URL:newURL options:storeOptions error:&addError];
+         if (store == nil)
+             storeError = addError;
+         else
+             [psc removePersistentStore:store error:NULL];
+     }];
+    
+    NSError *localError = coordinatorError ?: storeError;
+    if (localError != nil)
+    {
+        ErrorLog(@"Could not perform maintenance of database at path '%@': %@", storePath, localError);
+        if (error != NULL)
+            *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Could not perform maintenance of database for device identifier '%@' at path: %@", self.deviceIdentifier, [self.storeURL path]] underlyingError:localError];
+        return NO;
+    }
+    
+    // the file changed, but not its schema
+    [PARStore setSchemaValidatedForDatabaseAtPath:storePath];
+    self.needsIncrementalVacuum = NO;
+    return YES;
+}
+
+- (BOOL)performMaintenanceWithFullRebuild:(BOOL)rebuild error:(NSError **)error
+{
+    if ([self.memoryQueue isInCurrentQueueStack])
+    {
+        ErrorLog(@"To avoid deadlocks, %@ should not be called within a transaction. Bailing out.", NSStringFromSelector(_cmd));
+        if (error != NULL)
+            *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Method '%@' should not be called within a transaction", NSStringFromSelector(_cmd)] underlyingError:nil];
+        return NO;
+    }
+    __block BOOL success = YES;
+    __block NSError *localError = nil;
+    [self.databaseQueue dispatchSynchronously:^
+     {
+         NSError *maintenanceError = nil;
+         success = [self _performMaintenanceWithFullRebuild:rebuild error:&maintenanceError];
+         localError = maintenanceError;
+     }];
+    if (!success && error != NULL)
+        *error = localError;
+    return success;
+}
+
+
+#pragma mark - Checksums
+
+// `logs` can be managed objects or log representations
+- (NSData *)checksumRecordsForLogs:(id <NSFastEnumeration>)logs
+{
+    NSMutableData *records = [NSMutableData data];
+    for (id log in logs)
+    {
+        [_PARChecksumFile appendRecordForKey:[log valueForKey:KeyAttributeName] timestamp:[log valueForKey:TimestampAttributeName] parentTimestamp:[log valueForKey:ParentTimestampAttributeName] blob:[log valueForKey:BlobAttributeName] toData:records];
+    }
+    return records;
+}
+
+- (_PARChecksumFile *)checksumFileForDatabasePath:(NSString *)databasePath
+{
+    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class], NSStringFromSelector(_cmd));
+    NSString *path = [[databasePath stringByDeletingLastPathComponent] stringByAppendingPathComponent:PARChecksumsFileName];
+    _PARChecksumFile *checksumFile = self.checksumFiles[path];
+    NSString *fingerprint = [PARStore fingerprintForFileAtPath:path];
+    if (checksumFile == nil || (fingerprint != checksumFile.fingerprint && ![fingerprint isEqualToString:checksumFile.fingerprint]))
+    {
+        checksumFile = [_PARChecksumFile checksumFileWithPath:path];
+        self.checksumFiles[path] = checksumFile;
+    }
+    return checksumFile;
+}
+
+- (void)verifyChecksumsWithCompletionHandler:(void(^)(NSDictionary<NSString *, NSArray<PARChange *> *> *corruptChanges))completionHandler
+{
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^
+    {
+        NSMutableDictionary *corruptChanges = [NSMutableDictionary dictionary];
+        
+        // separate read-only connections, so the store queues are not blocked during verification
+        NSPersistentStoreCoordinator *psc = [[NSPersistentStoreCoordinator alloc] initWithManagedObjectModel:[PARStore managedObjectModel]];
+        NSArray *directoryPaths = [self readonlyDirectoryPaths];
+        if ([self readwriteDirectoryPath] != nil)
+            directoryPaths = [directoryPaths arrayByAddingObject:[self readwriteDirectoryPath]];
+        NSManagedObjectContext *moc = [[NSManagedObjectContext alloc] initWithConcurrencyType:NSPrivateQueueConcurrencyType];
+        [moc setPersistentStoreCoordinator:psc];
+        [moc setUndoManager:nil];
+        
+        for (NSString *directoryPath in directoryPaths)
+        {
+            NSString *checksumsPath = [directoryPath stringByAppendingPathComponent:PARChecksumsFileName];
+            NSPersistentStore *store = [[NSFileManager defaultManager] fileExistsAtPath:checksumsPath] ? [self addPersistentStoreWithCoordinator:psc dirPath:directoryPath readOnly:YES error:NULL] : nil;
+            if (store == nil)
+                continue;
+            
+            _PARChecksumFile *checksumFile = [_PARChecksumFile checksumFileWithPath:checksumsPath];
+            NSString *deviceIdentifier = [self deviceIdentifierForDatabasePath:store.URL.path];
+            NSMutableArray *deviceCorruptChanges = [NSMutableArray array];
+            [moc performBlockAndWait:^
+            {
+                NSFetchRequest *request = [NSFetchRequest fetchRequestWithEntityName:LogEntityName];
+                request.affectedStores = @[store];
+                [self parstore_enumerateObjectsForFetchRequest:request managedObjectContext:moc batchSize:1000 withBlock:^(NSArray *batch, BOOL hasMore, BOOL *stop)
+                {
+                    for (NSManagedObject *log in batch)
+                    {
+                        NSString *key = [log valueForKey:KeyAttributeName];
+                        NSNumber *timestamp = [log valueForKey:TimestampAttributeName];
+                        NSNumber *parentTimestamp = [log valueForKey:ParentTimestampAttributeName];
+                        NSData *blob = [log valueForKey:BlobAttributeName];
+                        if (key != nil && timestamp != nil && ![checksumFile verifyKey:key timestamp:timestamp parentTimestamp:parentTimestamp blob:blob])
+                        {
+                            id plist = (blob.length > 0) ? [NSPropertyListSerialization propertyListWithData:blob options:NSPropertyListImmutable format:NULL error:NULL] : nil;
+                            [deviceCorruptChanges addObject:[PARChange changeWithTimestamp:timestamp parentTimestamp:parentTimestamp key:key propertyList:plist]];
+                        }
+                        [moc refreshObject:log mergeChanges:NO];
+                    }
+                }];
+            }];
+            
+            if (deviceCorruptChanges.count > 0 && deviceIdentifier != nil)
+                corruptChanges[deviceIdentifier] = deviceCorruptChanges.copy;
+            [psc removePersistentStore:store error:NULL];
+        }
+        
+        if (completionHandler)
+            completionHandler(corruptChanges.copy);
+    });
+}
+
+
+#pragma mark - Summaries
+
+- (_PARMerkleSummary *)summaryForDeviceIdentifier:(NSString *)deviceIdentifier
+{
+    return [self summaryForDeviceIdentifier:deviceIdentifier rebuildingIfNeeded:YES];
+}
+
+// sets the summary in the metadata of the store, to be saved in the same transaction as the rows; without a summary, the summary file is not valid for the database anymore
+- (void)setSummary:(_PARMerkleSummary *)summary inMetadataForStore:(NSPersistentStore *)store
+{
+    NSPersistentStoreCoordinator *psc = store.persistentStoreCoordinator;
+    NSMutableDictionary *metadata = [NSMutableDictionary dictionaryWithDictionary:[psc metadataForPersistentStore:store]];
+    if (summary != nil)
+        metadata[PARMerkleMetadataKey] = summary.metadata;
+    else
+        [metadata removeObjectForKey:PARMerkleMetadataKey];
+    [psc setMetadata:metadata forPersistentStore:store];
+}
+
+// called before saving the rows inserted in the store: the rows are only added to a summary file that matches the database, or to the empty summary of a new database; returns the summary to write once the rows are saved, or nil if the file should be removed, and rebuilt when next needed
+- (_PARMerkleSummary *)summaryByAddingLogs:(id <NSFastEnumeration>)logs toStore:(NSPersistentStore *)store summaryPath:(NSString *)summaryPath
+{
+    _PARMerkleSummary *summary = nil;
+    if (self.summariesEnabled)
+    {
+        NSDictionary *metadata = [store.persistentStoreCoordinator metadataForPersistentStore:store][PARMerkleMetadataKey];
+        summary = [_PARMerkleSummary summaryWithPath:summaryPath] ?: [[_PARMerkleSummary alloc] init];
+        if ([summary matchesMetadata:metadata])
+            [summary addLogs:logs];
+        else
+            summary = nil;
+    }
+    [self setSummary:summary inMetadataForStore:store];
+    return summary;
+}
+
+// summary of the saved rows of a device, rebuilt from the database if the file is missing or does not match the database; returns nil if the database cannot be read, or if the summary would need to be rebuilt and `rebuild` is NO
+// the merge skips the devices with the same summary, so the file is only trusted if it matches the summary saved in the database metadata with the rows, and has as many rows as the database
+- (_PARMerkleSummary *)summaryForDeviceIdentifier:(NSString *)deviceIdentifier rebuildingIfNeeded:(BOOL)rebuild
+{
+    NSAssert(!rebuild || [self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class], NSStringFromSelector(_cmd));
+    NSString *directoryPath = [self directoryPathForDeviceIdentifier:deviceIdentifier];
+    if (directoryPath == nil)
+    {
+        return nil;
+    }
+    NSString *databasePath = [directoryPath stringByAppendingPathComponent:PARDatabaseFileName];
+    if (![[NSFileManager defaultManager] fileExistsAtPath:databasePath])
+    {
+        return [[_PARMerkleSummary alloc] init];
+    }
+    
+    // the metadata of the open database of the device may not be saved yet
+    BOOL isOpenDatabase = [self.databaseQueue isInCurrentQueueStack] && self.readwriteDatabase != nil && [deviceIdentifier isEqualToString:self.deviceIdentifier];
+    NSDictionary *metadata = nil;
+    if (isOpenDatabase)
+        metadata = [self.readwriteDatabase.persistentStoreCoordinator metadataForPersistentStore:self.readwriteDatabase];
+    else
+        metadata = [NSPersistentStoreCoordinator metadataForPersistentStoreOfType:NSSQLiteStoreType URL:[NSURL fileURLWithPath:databasePath] options:nil error:NULL];
+    NSDictionary *summaryMetadata = metadata[PARMerkleMetadataKey];
+    
+    // databases written without the summary in their metadata are checked against the most recent timestamp of the rebuilt summary as well
+    NSString *summaryPath = [directoryPath stringByAppendingPathComponent:PARSummaryFileName];
+    __block _PARMerkleSummary *summary = [_PARMerkleSummary summaryWithPath:summaryPath];
+    __block NSNumber *expectedMaxTimestamp = nil;
+    if (![summary matchesMetadata:summaryMetadata])
+    {
+        summary = nil;
+        @synchronized(self.rebuiltSummaries)
+        {
+            NSArray *rebuiltSummary = self.rebuiltSummaries[deviceIdentifier];
+            if (summaryMetadata == nil || [rebuiltSummary.firstObject matchesMetadata:summaryMetadata])
+            {
+                summary = rebuiltSummary.firstObject;
+                if (summaryMetadata == nil && rebuiltSummary.lastObject != [NSNull null])
+                    expectedMaxTimestamp = rebuiltSummary.lastObject;
+            }
+        }
+    }
+    
+    // separate read-only connection, as for merging
+    NSPersistentStoreCoordinator *psc = [[NSPersistentStoreCoordinator alloc] initWithManagedObjectModel:[PARStore managedObjectModel]];
+    NSError *psError = nil;
+    NSPersistentStore *store = [self addPersistentStoreWithCoordinator:psc dirPath:directoryPath readOnly:YES error:&psError];
+    if (store == nil)
+    {
+        ErrorLog(@"Could not open database for device '%@' to summarize it: %@", deviceIdentifier, psError);
+        return nil;
+    }
+    NSManagedObjectContext *moc = [[NSManagedObjectContext alloc] initWithConcurrencyType:NSPrivateQueueConcurrencyType];
+    [moc setPersistentStoreCoordinator:psc];
+    [moc setUndoManager:nil];
+    
+    __block BOOL rebuilt = NO;
+    __block NSNumber *maxTimestamp = nil;
+    [moc performBlockAndWait:^
+    {
+        // the row count is checked as well, in case rows were saved by a version that did not update the metadata
+        NSFetchRequest *request = [NSFetchRequest fetchRequestWithEntityName:LogEntityName];
+        NSError *countError = nil;
+        NSUInteger count = [moc countForFetchRequest:request error:&countError];
+        if (count == NSNotFound)
+        {
+            ErrorLog(@"Could not count rows for device '%@' to summarize them: %@", deviceIdentifier, countError);
+            summary = nil;
+            return;
+        }
+        
+        // most recent timestamp, only needed without a summary in the metadata
+        if (summaryMetadata == nil && count > 0)
+        {
+            NSExpressionDescription *expressionDescription = [[NSExpressionDescription alloc] init];
+            expressionDescription.name = @"maxTimestamp";
+            expressionDescription.expression = [NSExpression expressionForFunction:@"max:" arguments:@[[NSExpression expressionForKeyPath:TimestampAttributeName]]];
+            expressionDescription.expressionResultType = NSInteger64AttributeType;
+            NSFetchRequest *maxTimestampRequest = [NSFetchRequest fetchRequestWithEntityName:LogEntityName];
+            maxTimestampRequest.resultType = NSDictionaryResultType;
+            maxTimestampRequest.propertiesToFetch = @[expressionDescription];
+            NSError *fetchError = nil;
+            maxTimestamp = [[moc executeFetchRequest:maxTimestampRequest error:&fetchError] lastObject][@"maxTimestamp"];
+            if (maxTimestamp == nil)
+            {
+                ErrorLog(@"Could not fetch the most recent timestamp for device '%@' to summarize it: %@", deviceIdentifier, fetchError);
+                summary = nil;
+                return;
+            }
+        }
+        
+        if (summary != nil && summary.rowCount == count && (expectedMaxTimestamp == maxTimestamp || [expectedMaxTimestamp isEqual:maxTimestamp]))
+        {
+            return;
+        }
+        if (!rebuild)
+        {
+            summary = nil;
+            return;
+        }
+        summary = [[_PARMerkleSummary alloc] init];
+        [self parstore_enumerateObjectsForFetchRequest:request managedObjectContext:moc batchSize:1000 withBlock:^(NSArray *batch, BOOL hasMore, BOOL *stop)
+        {
+            [summary addLogs:batch];
+            for (NSManagedObject *log in batch)
+                [moc refreshObject:log mergeChanges:NO];
+        }];
+        rebuilt = YES;
+    }];
+    [psc removePersistentStore:store error:NULL];
     
-    NSPersistentStoreCoordinator *psc = [[self managedObjectContext] persistentStoreCoordinator];
-    NSMutableArray *stores = [NSMutableArray arrayWithArray:self.readonlyDatabases];
-    NSArray *currentDirs = [stores valueForKeyPath:@"URL.path"];
-    NSArray *allDirs = [self readonlyDirectoryPaths];
-    for (NSString *path in allDirs)
+    // the other device directories belong to their devices, so their rebuilt summaries are only kept in memory, until their database changes
+    // the metadata of the open database is saved with its next rows
+    if (rebuilt && summary != nil)
     {
-		NSString *storePath = [path stringByAppendingPathComponent:PARDatabaseFileName];
-        
-        // store is already known
-        if ([currentDirs containsObject:storePath])
+        if (self.summariesEnabled && !self.follower && [deviceIdentifier isEqualToString:self.deviceIdentifier])
         {
-            // refresh the URL to force a cache flush and reload the synced contents if available
-			NSPersistentStore *existingStore = [psc persistentStoreForURL:[NSURL fileURLWithPath:storePath]];
-            [psc setURL:existingStore.URL forPersistentStore:existingStore];
-		}
-		
-        // new store
+            [summary writeToPath:summaryPath error:NULL];
+            if (isOpenDatabase)
+            {
+                [self setSummary:summary inMetadataForStore:self.readwriteDatabase];
+            }
+            else
+            {
+                NSMutableDictionary *newMetadata = [NSMutableDictionary dictionaryWithDictionary:metadata];
+                newMetadata[PARMerkleMetadataKey] = summary.metadata;
+                NSError *metadataError = nil;
+                if (![NSPersistentStoreCoordinator setMetadata:newMetadata forPersistentStoreOfType:NSSQLiteStoreType URL:[NSURL fileURLWithPath:databasePath] options:nil error:&metadataError])
+                    ErrorLog(@"Could not save the summary in the database for device '%@': %@", deviceIdentifier, metadataError);
+            }
+        }
         else
         {
-            NSPersistentStore *newStore = [self addPersistentStoreWithCoordinator:psc dirPath:path readOnly:YES error:NULL];
-            if (newStore)
-                [stores addObject:newStore];
+            @synchronized(self.rebuiltSummaries)
+            {
+                self.rebuiltSummaries[deviceIdentifier] = @[summary, maxTimestamp ?: [NSNull null]];
+            }
         }
     }
-    self.readonlyDatabases = [NSArray arrayWithArray:stores];
+    return summary;
 }
 
-- (BOOL)_save:(NSError **)error
+- (_PARMerkleSummary *)summaryNowForDeviceIdentifier:(NSString *)deviceIdentifier
 {
-    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class],NSStringFromSelector(_cmd));
-    [self.databaseQueue cancelTimerWithName:@"save_delay"];
-    [self.databaseQueue cancelTimerWithName:@"save_coalesce"];
-    
-    if ([self deleted])
+    if (self._inMemory)
     {
-        NSError *localError = [NSError errorWithObject:self code:__LINE__ localizedDescription:@"Cannot save deleted store" underlyingError:nil];
-        if (error != NULL)
-        {
-            *error = localError;
-        }
-        return NO;
+        return nil;
     }
+    __block _PARMerkleSummary *summary = nil;
+    [self.databaseQueue dispatchSynchronously:^{ summary = [self summaryForDeviceIdentifier:deviceIdentifier]; }];
+    return summary;
+}
 
-    // autoclose database
-    [self closeDatabaseSoon];
+- (NSData *)summaryHashForDeviceIdentifier:(NSString *)deviceIdentifier
+{
+    if ([self.memoryQueue isInCurrentQueueStack])
+    {
+        ErrorLog(@"To avoid deadlocks, %@ should not be called within a transaction. Bailing out.", NSStringFromSelector(_cmd));
+        return nil;
+    }
+    return [self summaryNowForDeviceIdentifier:deviceIdentifier].rootHash;
+}
 
-    // skip save if already closes
-    if (self._managedObjectContext == nil)
+- (NSArray *)timestampRangesDifferingFromStore:(PARStore *)store forDeviceIdentifier:(NSString *)deviceIdentifier
+{
+    if ([self.memoryQueue isInCurrentQueueStack] || [store.memoryQueue isInCurrentQueueStack])
     {
-        return YES;
+        ErrorLog(@"To avoid deadlocks, %@ should not be called within a transaction. Bailing out.", NSStringFromSelector(_cmd));
+        return nil;
     }
     
-    // save
-    NSError *localError = nil;
-    NSFileCoordinator *coordinator = [self newFileCoordinator];
-    NSURL *databaseURL = [NSURL fileURLWithPath:[[self readwriteDirectoryPath] stringByAppendingPathComponent:PARDatabaseFileName]];
-    NSError *coordinatorError = nil;
-    __block NSError *saveError = nil;
-    [coordinator coordinateWritingItemAtURL:databaseURL options:NSFileCoordinatorWritingForReplacing error:&coordinatorError byAccessor:^(NSURL *newURL)
-     {
-         NSError *blockError = nil;
-         if (![self._managedObjectContext save:&blockError])
-             saveError = blockError;
-     }];
+    // each summary is read within its own database queue, so both queues are never held at once
+    _PARMerkleSummary *summary = [self summaryNowForDeviceIdentifier:deviceIdentifier];
+    _PARMerkleSummary *otherSummary = [store summaryNowForDeviceIdentifier:deviceIdentifier];
+    if (summary == nil || otherSummary == nil)
+    {
+        return nil;
+    }
+    return [summary timestampRangesDifferingFromSummary:otherSummary];
+}
 
-    // handle error
-    localError = coordinatorError ?: saveError;
-    if (localError)
+
+#pragma mark - Sealed Base Layer
+
++ (BOOL)writeSealedFileWithEntries:(NSDictionary *)entries toURL:(NSURL *)url error:(NSError **)error
+{
+    NSMutableDictionary *blobs = [NSMutableDictionary dictionaryWithCapacity:entries.count];
+    for (NSString *key in entries)
     {
-        NSString *storePath = [self.storeURL path];
-        ErrorLog(@"Could not save store:\npath: %@\nerror: %@\n", storePath, [localError localizedDescription]);
+        id plist = entries[key];
+        if (plist == [NSNull null])
+            continue;
+        NSError *blobError = nil;
+        NSData *blob = [NSPropertyListSerialization dataWithPropertyList:plist format:NSPropertyListBinaryFormat_v1_0 options:0 error:&blobError];
+        if (blob == nil)
+        {
+            if (error != NULL)
+                *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Could not serialize value for key '%@' in sealed file at path: %@", key, url.path] underlyingError:blobError];
+            return NO;
+        }
+        blobs[key] = blob;
+    }
+    return [_PARSealedFile writeBlobs:blobs toURL:url error:error];
+}
+
+- (BOOL)mountSealedFileAtURL:(NSURL *)url error:(NSError **)error
+{
+    if (self._inMemory)
+    {
+        // in-memory stores do not keep track of removed keys, which would then expose the sealed values again
         if (error != NULL)
-            *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Could not save store for device identifier '%@' at path: %@", self.deviceIdentifier, [self.storeURL path]] underlyingError:localError];
+            *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:@"Sealed files cannot be mounted in in-memory stores" underlyingError:nil];
         return NO;
     }
     
-    #if TARGET_OS_IPHONE | TARGET_IPHONE_SIMULATOR
-    
-    #elif TARGET_OS_MAC
-    // save was successful: "blink" the database which relinquishes the lock on the file just enough for a service like Dropbox to upload the new version on the server
-    // not needed on iOS where the files are all under the control of the app and would need to be manually uploaded to online file services
-    NSPersistentStore *store = self.readwriteDatabase;
-    if (store !=  nil)
+    _PARSealedFile *sealedFile = [_PARSealedFile sealedFileWithURL:url error:error];
+    if (sealedFile == nil)
     {
-        // "blinking" can be done by simply setting again the URL of the persistent store
-        [[self._managedObjectContext persistentStoreCoordinator] setURL:store.URL forPersistentStore:store];
+        return NO;
     }
-    #endif
-
+    [self.memoryQueue dispatchSynchronously:^{ self._sealedFile = sealedFile; }];
     return YES;
 }
 
-- (void)saveNow
+- (NSURL *)sealedFileURL
 {
-    if ([self.memoryQueue isInCurrentQueueStack])
-    {
-        ErrorLog(@"To avoid deadlocks, %@ should not be called within a transaction. Bailing out.", NSStringFromSelector(_cmd));
-        return;
-    }
-    [self.databaseQueue dispatchSynchronously:^{ [self _save:NULL]; }];
+    __block NSURL *url = nil;
+    [self.memoryQueue dispatchSynchronously:^{ url = self._sealedFile.URL; }];
+    return url;
 }
 
-- (void)saveSoon
+
+#pragma mark - Shared Cache
+
+// A shared cache is a sealed file with the values under prefixed keys, and one metadata entry with the timestamps and a version.
+NSString *PARSharedCacheMetadataKey = @"m";
+NSString *PARSharedCacheValuePrefix = @"v:";
+#define PARSharedCacheVersion 1
+
+- (void)publishSharedCacheSoon
 {
-    [self.databaseQueue scheduleTimerWithName:@"save_delay" timeInterval:1.0 behavior:PARTimerBehaviorDelay block:^{ [self _save:NULL]; }];
-    [self.databaseQueue scheduleTimerWithName:@"save_coalesce" timeInterval:15.0 behavior:PARTimerBehaviorCoalesce block:^{ [self _save:NULL]; }];
+    if (!self.publishesSharedCache)
+        return;
+    [self.databaseQueue scheduleTimerWithName:@"publish_shared_cache" timeInterval:5.0 behavior:PARTimerBehaviorCoalesce block:^{ [self _publishSharedCache:NULL]; }];
 }
 
-- (void)_tearDownDatabase
+- (BOOL)publishSharedCacheWithError:(NSError **)error
 {
-    if (self._managedObjectContext)
+    if ([self.memoryQueue isInCurrentQueueStack])
     {
-        [self _save:NULL];
-        [self _closeDatabase];
+        ErrorLog(@"To avoid deadlocks, %@ should not be called within a transaction. Bailing out.", NSStringFromSelector(_cmd));
+        if (error != NULL)
+            *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Method '%@' should not be called within a transaction", NSStringFromSelector(_cmd)] underlyingError:nil];
+        return NO;
     }
-    [NSFileCoordinator removeFilePresenter:self];
-    [self stopFileSystemEventStreams];
-    self.databaseTimestamps = [NSMutableDictionary dictionary];
+    __block BOOL success = NO;
+    __block NSError *localError = nil;
+    [self.databaseQueue dispatchSynchronously:^{ success = [self _publishSharedCache:&localError]; }];
+    if (error != NULL)
+        *error = localError;
+    return success;
 }
 
-- (void)_closeDatabase
+- (BOOL)_publishSharedCache:(NSError **)error
 {
     NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class], NSStringFromSelector(_cmd));
-    [self _save:NULL];
-    [self.databaseQueue cancelTimerWithName:@"close_database"];
-    self._managedObjectContext = nil;
+    
+    NSURL *url = self.sharedCacheURL;
+    if (url == nil || self._inMemory || !self._inMemoryCacheEnabled || [self deleted])
+    {
+        return YES;
+    }
+    
+    // readers rely on the databases for anything more recent than the snapshot, so the values in memory should all be saved first
+    if (![self _save:error])
+    {
+        return NO;
+    }
+    [self.databaseQueue cancelTimerWithName:@"publish_shared_cache"];
+    
+    // the values still in the mapped cache are copied without decoding them
+    __block BOOL loaded = NO;
+    __block NSDictionary *values = nil;
+    __block NSDictionary *keyTimestamps = nil;
+    __block _PARSealedFile *previousCache = nil;
+    __block NSDictionary *previousCacheKeyTimestamps = nil;
+    [self.memoryQueue dispatchSynchronously:^
+     {
+         loaded = self._loaded;
+         values = self._memory.copy;
+         keyTimestamps = self._memoryKeyTimestamps.copy;
+         previousCache = self._sharedCache;
+         previousCacheKeyTimestamps = self._sharedCacheKeyTimestamps;
+     }];
+    if (!loaded)
+    {
+        return YES;
+    }
+    
+    NSMutableDictionary *blobs = [NSMutableDictionary dictionaryWithCapacity:keyTimestamps.count + 1];
+    for (NSString *key in keyTimestamps)
+    {
+        NSString *cacheKey = [PARSharedCacheValuePrefix stringByAppendingString:key];
+        id plist = values[key];
+        NSData *blob = nil;
+        if (plist != nil)
+            blob = [self dataFromPropertyList:plist error:NULL];
+        else if ([previousCacheKeyTimestamps[key] isEqual:keyTimestamps[key]])
+            blob = [[previousCache blobForKey:cacheKey] copy];
+        if (blob.length > 0)
+            blobs[cacheKey] = blob;
+    }
+    NSDictionary *metadata = @{@"version": @(PARSharedCacheVersion),
+                               @"storePath": self.storeURL.path.stringByStandardizingPath,
+                               @"keyTimestamps": keyTimestamps,
+                               @"databaseTimestamps": self.databaseTimestamps.copy};
+    NSError *metadataError = nil;
+    NSData *metadataBlob = [NSPropertyListSerialization dataWithPropertyList:metadata format:NSPropertyListBinaryFormat_v1_0 options:0 error:&metadataError];
+    if (metadataBlob == nil)
+    {
+        if (error != NULL)
+            *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Could not serialize shared cache metadata for store at path: %@", self.storeURL.path] underlyingError:metadataError];
+        return NO;
+    }
+    blobs[PARSharedCacheMetadataKey] = metadataBlob;
+    
+    // the file is written atomically, and processes still mapping the previous version keep reading it until they reload
+    return [_PARSealedFile writeBlobs:blobs toURL:url error:error];
 }
 
-- (void)closeDatabase
+- (void)_loadSharedCache
 {
-    [self.databaseQueue dispatchAsynchronously:^{ [self _closeDatabase]; }];
+    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class], NSStringFromSelector(_cmd));
+    
+    NSURL *url = self.sharedCacheURL;
+    if (url == nil || self._inMemory || ![[NSFileManager defaultManager] fileExistsAtPath:url.path])
+    {
+        return;
+    }
+    
+    NSError *error = nil;
+    _PARSealedFile *cache = [_PARSealedFile sealedFileWithURL:url error:&error];
+    NSDictionary *metadata = nil;
+    if (cache != nil)
+    {
+        NSData *metadataBlob = [cache blobForKey:PARSharedCacheMetadataKey];
+        metadata = (metadataBlob != nil) ? [NSPropertyListSerialization propertyListWithData:metadataBlob options:NSPropertyListImmutable format:NULL error:&error] : nil;
+    }
+    if (metadata == nil)
+    {
+        ErrorLog(@"Ignoring invalid shared cache at path '%@': %@", url.path, error);
+        return;
+    }
+    
+    NSDictionary *keyTimestamps = metadata[@"keyTimestamps"];
+    NSDictionary *databaseTimestamps = metadata[@"databaseTimestamps"];
+    if (![metadata[@"version"] isEqual:@(PARSharedCacheVersion)] || ![metadata[@"storePath"] isEqual:self.storeURL.path.stringByStandardizingPath] || ![keyTimestamps isKindOfClass:[NSDictionary class]] || ![databaseTimestamps isKindOfClass:[NSDictionary class]])
+    {
+        ErrorLog(@"Ignoring shared cache at path '%@', published for another version or store", url.path);
+        return;
+    }
+    
+    // the incremental sync relies on all the devices of the snapshot being found
+    NSMutableSet *deviceIdentifiers = [NSMutableSet setWithArray:[self foreignDeviceIdentifiers]];
+    [deviceIdentifiers addObject:self.deviceIdentifier];
+    if (![[NSSet setWithArray:databaseTimestamps.allKeys] isSubsetOfSet:deviceIdentifiers])
+    {
+        ErrorLog(@"Ignoring shared cache at path '%@', published for other devices", url.path);
+        return;
+    }
+    
+    self.keyTimestamps = keyTimestamps;
+    self.databaseTimestamps = databaseTimestamps.mutableCopy;
+    [self.memoryQueue dispatchSynchronously:^
+     {
+         self._sharedCache = cache;
+         self._sharedCacheKeyTimestamps = keyTimestamps;
+         self._memoryKeyTimestamps = keyTimestamps.mutableCopy;
+         self._loaded = YES;
+         [self postNotificationWithName:PARStoreDidLoadNotification userInfo:nil];
+     }];
 }
 
-- (void)closeDatabaseSoon
+// values not changed since the snapshot are decoded from the mapped cache when first accessed
+- (id)_sharedCacheValueForKey:(NSString *)key
 {
-    [self.databaseQueue scheduleTimerWithName:@"close_database" timeInterval:60.0 behavior:PARTimerBehaviorDelay block:^{ [self _closeDatabase]; }];
+    NSAssert([self.memoryQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the memory queue", [self class], NSStringFromSelector(_cmd));
+    NSNumber *cacheTimestamp = self._sharedCacheKeyTimestamps[key];
+    if (cacheTimestamp == nil || ![cacheTimestamp isEqual:self._memoryKeyTimestamps[key]])
+    {
+        return nil;
+    }
+    NSData *blob = [self._sharedCache blobForKey:[PARSharedCacheValuePrefix stringByAppendingString:key]];
+    id plist = [self propertyListFromData:blob error:NULL];
+    self._memory[key] = plist;
+    return plist;
 }
 
-- (void)closeDatabaseNow
+- (void)_decodeSharedCacheValues
 {
-    if ([self.memoryQueue isInCurrentQueueStack])
+    NSAssert([self.memoryQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the memory queue", [self class], NSStringFromSelector(_cmd));
+    for (NSString *key in self._sharedCacheKeyTimestamps)
     {
-        ErrorLog(@"To avoid deadlocks, %@ should not be called within a transaction. Bailing out.", NSStringFromSelector(_cmd));
-        return;
+        if (self._memory[key] == nil)
+            [self _sharedCacheValueForKey:key];
     }
-    [self.databaseQueue dispatchSynchronously:^{ [self _closeDatabase]; }];
 }
 
 
@@ -839,7 +3731,7 @@ NSString *PARBlobsDirectoryName = @"Blobs";
     if (self._inMemory)
     {
         [self.memoryQueue dispatchSynchronously:^{
-            keys = self._memory.allKeys;
+            keys = self._memoryLogs.allKeys;
         }];
     }
     else
@@ -852,26 +3744,49 @@ NSString *PARBlobsDirectoryName = @"Blobs";
                  return;
              }
              
-             NSError *fetchError = nil;
-             NSFetchRequest *request = [NSFetchRequest fetchRequestWithEntityName:LogEntityName];
-             request.propertiesToFetch = @[KeyAttributeName];
-             request.propertiesToGroupBy = @[KeyAttributeName];
-             request.resultType = NSDictionaryResultType;
-             NSArray *results = [moc executeFetchRequest:request error:&fetchError];
-             if (!results)
-             {
-                 ErrorLog(@"Error fetching unique keys for store:\npath: %@\nerror: %@", [self.storeURL path], fetchError);
-                 return;
-             }
+             NSMutableSet *allKeys = [NSMutableSet set];
+             [self enumerateDatabaseGroupsUsingBlock:^(NSArray *stores)
+              {
+                  NSError *fetchError = nil;
+                  NSFetchRequest *request = [NSFetchRequest fetchRequestWithEntityName:LogEntityName];
+                  request.propertiesToFetch = @[KeyAttributeName];
+                  request.propertiesToGroupBy = @[KeyAttributeName];
+                  request.resultType = NSDictionaryResultType;
+                  request.affectedStores = stores;
+                  NSArray *results = [moc executeFetchRequest:request error:&fetchError];
+                  if (!results)
+                  {
+                      ErrorLog(@"Error fetching unique keys for store:\npath: %@\nerror: %@", [self.storeURL path], fetchError);
+                      return;
+                  }
+                  [allKeys addObjectsFromArray:[results valueForKey:KeyAttributeName]];
+              }];
+             
+             // the local rows not saved yet are not returned by dictionary fetches
+             for (NSDictionary *log in self.pendingLogs)
+                 [allKeys addObject:log[KeyAttributeName]];
              
-             if ([results count] > 0)
+             if ([allKeys count] > 0)
              {
-                 keys = [results valueForKey:KeyAttributeName];
+                 keys = [allKeys allObjects];
              }
              
              [self closeDatabaseSoon];
          }];
     }
+    
+    // keys from the sealed base layer
+    __block _PARSealedFile *sealedFile = nil;
+    [self.memoryQueue dispatchSynchronously:^{ sealedFile = self._sealedFile; }];
+    if (sealedFile != nil)
+    {
+        NSMutableSet *allKeys = [NSMutableSet setWithArray:keys];
+        [sealedFile enumerateKeysAndBlobsUsingBlock:^(NSString *key, NSData *blob, BOOL *stop)
+         {
+             [allKeys addObject:key];
+         }];
+        keys = allKeys.allObjects;
+    }
     return keys;
 }
 
@@ -884,7 +3799,25 @@ NSString *PARBlobsDirectoryName = @"Blobs";
 {
     NSAssert(self._inMemoryCacheEnabled, @"allEntries method only supported for PARStores using a memory cache");
     __block NSDictionary *allEntries = nil;
-    [self.memoryQueue dispatchSynchronously:^{ allEntries = self._memory.copy; }];
+    [self.memoryQueue dispatchSynchronously:^
+     {
+         [self _decodeSharedCacheValues];
+         if (self._sealedFile == nil)
+         {
+             allEntries = self._memory.copy;
+             return;
+         }
+         
+         // sealed values are only used for keys without any log
+         NSMutableDictionary *entries = [NSMutableDictionary dictionary];
+         [self._sealedFile enumerateKeysAndBlobsUsingBlock:^(NSString *key, NSData *blob, BOOL *stop)
+          {
+              if (self._memoryKeyTimestamps[key] == nil)
+                  entries[key] = [self propertyListFromData:blob error:NULL];
+          }];
+         [entries addEntriesFromDictionary:self._memory];
+         allEntries = entries.copy;
+     }];
     return allEntries;
 }
 
@@ -892,7 +3825,12 @@ NSString *PARBlobsDirectoryName = @"Blobs";
 {
     NSAssert(self._inMemoryCacheEnabled, @"propertyListValueForKey: method only supported for PARStores using a memory cache");
     __block id plist = nil;
-    [self.memoryQueue dispatchSynchronously:^{ plist = self._memory[key]; }];
+    [self.memoryQueue dispatchSynchronously:^
+     {
+         plist = self._memory[key] ?: [self _sharedCacheValueForKey:key];
+         if (plist == nil && self._sealedFile != nil && self._memoryKeyTimestamps[key] == nil)
+             plist = [self propertyListFromData:[self._sealedFile blobForKey:key] error:NULL];
+     }];
     return plist;
 }
 
@@ -912,17 +3850,49 @@ NSString *PARBlobsDirectoryName = @"Blobs";
 
 - (void)setPropertyListValue:(id)plist forKey:(NSString *)key
 {
+    [self setPropertyListValue:plist forKey:key error:NULL];
+}
+
+- (BOOL)setPropertyListValue:(id)plist forKey:(NSString *)key error:(NSError **)error
+{
+    if ([self isFollowerRefusingWriteWithSelector:_cmd error:error])
+    {
+        return NO;
+    }
+    
     // both nil and [NSNull null] can be used as a marker for removal, but [NSNull null] will be easier to manipulate in the rest of this method
     if (plist == nil)
     {
         plist = [NSNull null];
     }
+    
+    // the value is encoded before entering the memory queue, so that other accesses do not wait for it
+    NSError *localError = nil;
+    NSData *blob = nil;
+    if (!self._inMemory)
+    {
+        blob = (plist == [NSNull null]) ? [NSData data] : [self dataFromPropertyList:plist error:&localError];
+        if (!blob)
+        {
+            ErrorLog(@"Error creating data from plist:\nkey: %@:\nplist: %@\nerror: %@", key, plist, [localError localizedDescription]);
+            if (error != NULL)
+                *error = localError;
+            return NO;
+        }
+        if (![self waitForWriteBacklogWithSelector:_cmd error:error])
+        {
+            return NO;
+        }
+    }
 
+    __block BOOL success = YES;
+    __block _PARJournal *journal = nil;
     [self.memoryQueue dispatchSynchronously:^
      {
          if (self._loaded == NO)
          {
              ErrorLog(@"Could not set value for key '%@' because the store has not been loaded yet", key);
+             success = NO;
              return;
          }
          
@@ -937,44 +3907,61 @@ NSString *PARBlobsDirectoryName = @"Blobs";
              self._memory[key] = plist;
          }
          
+         NSNumber *oldTimestamp = self._memoryKeyTimestamps[key];
+         self._memoryKeyTimestamps[key] = newTimestamp;
+         [self postDidChangeNotificationWithUserInfo:@{@"values": @{key: plist}, @"timestamps": @{key: newTimestamp}}];
+         
          if (self._inMemory)
          {
-             [self postDidChangeNotificationWithUserInfo:@{@"values": @{key: plist}, @"timestamps": @{key: newTimestamp}}];
+             [self._memoryLogs addChange:[PARChange changeWithTimestamp:newTimestamp parentTimestamp:oldTimestamp key:key propertyList:(plist != [NSNull null] ? plist : nil)] forDeviceIdentifier:self.deviceIdentifier];
              return;
          }
          
-         NSError *error = nil;
-         NSData *blob = (plist == [NSNull null]) ? [NSData data] : [self dataFromPropertyList:plist error:&error];
-         if (!blob)
-         {
-             ErrorLog(@"Error creating data from plist:\nkey: %@:\nplist: %@\nerror: %@", key, plist, [error localizedDescription]);
-         }
-         else
+         // a coalesced change replaces the previous coalesced change of the key, and is journaled with the same parent, so that a replay only keeps the latest one
+         if ([self shouldCoalesceWritesForKeys:@[key]])
          {
-             NSNumber *oldTimestamp = self._memoryKeyTimestamps[key];
-             self._memoryKeyTimestamps[key] = newTimestamp;
-             [self postDidChangeNotificationWithUserInfo:@{@"values": @{key: plist}, @"timestamps": @{key: newTimestamp}}];
-             
-             [self.databaseQueue dispatchAsynchronously:
-              ^{
-                  NSManagedObjectContext *moc = [self managedObjectContext];
-                  if (moc == nil)
-                  {
-                      return;
-                  }
-                  
-                  NSManagedObject *newLog = [NSEntityDescription insertNewObjectForEntityForName:LogEntityName inManagedObjectContext:moc];
-                  [newLog setValue:newTimestamp forKey:TimestampAttributeName];
-                  [newLog setValue:oldTimestamp forKey:ParentTimestampAttributeName];
-                  [newLog setValue:key forKey:KeyAttributeName];
-                  [newLog setValue:blob forKey:BlobAttributeName];
-                  self.databaseTimestamps[self.deviceIdentifier] = newTimestamp;
-                  
-                  // schedule database save
-                  [self saveSoon];
-              }];
+             NSNumber *parentTimestamp = [self _coalesceWriteWithKey:key blob:blob timestamp:newTimestamp parentTimestamp:oldTimestamp];
+             id journalSegment = [self.journal appendRecordForKey:key timestamp:newTimestamp parentTimestamp:parentTimestamp blob:blob];
+             if (journalSegment != nil)
+             {
+                 journal = self.journal;
+                 [self.coalescedJournalSegments addObject:journalSegment];
+             }
+             return;
          }
+         
+         // journaled before the insertion is scheduled, so that a save cannot remove the journal segment before the change is inserted
+         id journalSegment = [self.journal appendRecordForKey:key timestamp:newTimestamp parentTimestamp:oldTimestamp blob:blob];
+         if (journalSegment != nil)
+             journal = self.journal;
+         
+         NSUInteger byteCount = key.length + blob.length;
+         [self addWriteBacklogRowCount:1 byteCount:byteCount];
+         [self.databaseQueue dispatchAsynchronously:
+          ^{
+              [self addWriteBacklogRowCount:-1 byteCount:-(NSInteger)byteCount];
+              NSManagedObjectContext *moc = [self managedObjectContext];
+              if (moc == nil)
+              {
+                  return;
+              }
+              
+              // a change that could not be inserted stays pending in the journal, so that its segment is not removed
+              [self _insertLogWithKey:key blob:blob timestamp:newTimestamp parentTimestamp:oldTimestamp];
+              [journal didInsertRecordCount:1 inSegment:journalSegment];
+              self.databaseTimestamps[self.deviceIdentifier] = newTimestamp;
+              
+              // schedule database save
+              [self saveSoon];
+          }];
      }];
+    
+    // flushed outside of the memory queue, so that other accesses do not wait for the disk
+    [journal synchronize];
+    
+    if (!success && error != NULL)
+        *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Could not set value for key '%@' because the store has not been loaded yet", key] underlyingError:nil];
+    return success;
 }
 
 - (void)setEntriesFromDictionary:(NSDictionary *)dictionary {
@@ -983,10 +3970,40 @@ NSString *PARBlobsDirectoryName = @"Blobs";
 
 - (void)setEntriesFromDictionary:(NSDictionary *)dictionary timestampApplied:(NSNumber * _Nonnull __autoreleasing * _Nullable)returnTimestamp
 {
+    if ([self isFollowerRefusingWriteWithSelector:_cmd error:NULL])
+    {
+        return;
+    }
+    
+    // the values are encoded before entering the memory queue, so that other accesses do not wait for it
+    NSMutableDictionary *blobs = [NSMutableDictionary dictionaryWithCapacity:dictionary.count];
+    NSUInteger byteCount = 0;
+    if (!self._inMemory)
+    {
+        for (NSString *key in dictionary.keyEnumerator)
+        {
+            id plist = dictionary[key];
+            NSError *error = nil;
+            NSData *blob = (plist != [NSNull null] ? [self dataFromPropertyList:plist error:&error] : [NSData data]);
+            if (!blob)
+            {
+                ErrorLog(@"Error creating data from plist:\nkey: %@:\nplist: %@\nerror: %@", key, plist, [error localizedDescription]);
+                continue;
+            }
+            blobs[key] = blob;
+            byteCount += key.length + blob.length;
+        }
+        if (![self waitForWriteBacklogWithSelector:_cmd error:NULL])
+        {
+            return;
+        }
+    }
+    
     // get the timestamp **now**, so we have the current date, not the date at which the block will run
     NSNumber *newTimestamp = [PARStore timestampNow];
     if (returnTimestamp) *returnTimestamp = newTimestamp;
 
+    __block _PARJournal *journal = nil;
     [self.memoryQueue dispatchSynchronously:^
      {
          if (self._loaded == NO)
@@ -1001,15 +4018,6 @@ NSString *PARBlobsDirectoryName = @"Blobs";
              self._memory[key] = (plist != [NSNull null] ? plist : nil);
          }];
          
-         if (self._inMemory)
-         {
-             NSMutableDictionary *newTimestamps = [NSMutableDictionary dictionaryWithCapacity:dictionary.count];
-             for (NSString *key in dictionary.keyEnumerator)
-                 newTimestamps[key] = newTimestamp;
-             [self postDidChangeNotificationWithUserInfo:@{@"values": dictionary, @"timestamps": newTimestamps}];
-             return;
-         }
-         
          // memory timestamps
          NSMutableDictionary *oldTimestamps = [NSMutableDictionary dictionaryWithCapacity:dictionary.count];
          NSMutableDictionary *newTimestamps = [NSMutableDictionary dictionaryWithCapacity:dictionary.count];
@@ -1023,9 +4031,45 @@ NSString *PARBlobsDirectoryName = @"Blobs";
          }
 
          [self postDidChangeNotificationWithUserInfo:@{@"values": dictionary, @"timestamps": newTimestamps}];
+         
+         if (self._inMemory)
+         {
+             [dictionary enumerateKeysAndObjectsUsingBlock:^(NSString *key, id plist, BOOL *stop)
+              {
+                  [self._memoryLogs addChange:[PARChange changeWithTimestamp:newTimestamp parentTimestamp:oldTimestamps[key] key:key propertyList:(plist != [NSNull null] ? plist : nil)] forDeviceIdentifier:self.deviceIdentifier];
+              }];
+             return;
+         }
+         
+         // journaled before the insertion is scheduled, so that a save cannot remove a journal segment before its changes are inserted; the changes may span two segments if a save happens in the meantime
+         // a coalesced change replaces the previous coalesced change of its key, and is journaled with the same parent, so that a replay only keeps the latest one
+         BOOL coalesces = [self shouldCoalesceWritesForKeys:blobs];
+         NSCountedSet *journalSegments = coalesces ? self.coalescedJournalSegments : [NSCountedSet set];
+         __block BOOL journaled = NO;
+         [blobs enumerateKeysAndObjectsUsingBlock:^(NSString *key, NSData *blob, BOOL *stop)
+          {
+              NSNumber *parentTimestamp = oldTimestamps[key];
+              if (coalesces)
+                  parentTimestamp = [self _coalesceWriteWithKey:key blob:blob timestamp:newTimestamp parentTimestamp:parentTimestamp];
+              id journalSegment = [self.journal appendRecordForKey:key timestamp:newTimestamp parentTimestamp:parentTimestamp blob:blob];
+              if (journalSegment != nil)
+              {
+                  [journalSegments addObject:journalSegment];
+                  journaled = YES;
+              }
+          }];
+         if (journaled)
+             journal = self.journal;
+         
+         if (coalesces)
+         {
+             return;
+         }
 
+         [self addWriteBacklogRowCount:blobs.count byteCount:byteCount];
          [self.databaseQueue dispatchAsynchronously: ^
           {
+              [self addWriteBacklogRowCount:-(NSInteger)blobs.count byteCount:-(NSInteger)byteCount];
               NSManagedObjectContext *moc = [self managedObjectContext];
               if (moc == nil)
               {
@@ -1033,32 +4077,386 @@ NSString *PARBlobsDirectoryName = @"Blobs";
               }
               
               // each key/value --> new Log
-              [dictionary enumerateKeysAndObjectsUsingBlock:^(id key, id plist, BOOL *stop)
+              [blobs enumerateKeysAndObjectsUsingBlock:^(id key, NSData *blob, BOOL *stop)
               {
-                  NSError *error = nil;
-                  NSData *blob = (plist != [NSNull null] ? [self dataFromPropertyList:plist error:&error] : [NSData data]);
-                  if (!blob)
-                  {
-                      ErrorLog(@"Error creating data from plist:\nkey: %@:\nplist: %@\nerror: %@", key, plist, [error localizedDescription]);
-                      return;
-                  }
-
-                  NSManagedObject *newLog = [NSEntityDescription insertNewObjectForEntityForName:LogEntityName inManagedObjectContext:moc];
-                  [newLog setValue:newTimestamp forKey:TimestampAttributeName];
-                  [newLog setValue:oldTimestamps[key] forKey:ParentTimestampAttributeName];
-                  [newLog setValue:key forKey:KeyAttributeName];
-                  [newLog setValue:blob forKey:BlobAttributeName];
+                  [self _insertLogWithKey:key blob:blob timestamp:newTimestamp parentTimestamp:oldTimestamps[key]];
               }];
+              for (id journalSegment in journalSegments)
+                  [journal didInsertRecordCount:[journalSegments countForObject:journalSegment] inSegment:journalSegment];
               self.databaseTimestamps[self.deviceIdentifier] = newTimestamp;
               
               // schedule database save
               [self saveSoon];
           }];
      }];
+    
+    // flushed outside of the memory queue, so that other accesses do not wait for the disk
+    [journal synchronize];
+}
+
+
+#pragma mark - Write Backlog
+
+@synthesize writeBacklogRowCount = _writeBacklogRowCount;
+@synthesize writeBacklogByteCount = _writeBacklogByteCount;
+
+- (NSUInteger)writeBacklogRowCount
+{
+    [self.writeBacklogCondition lock];
+    NSUInteger count = _writeBacklogRowCount;
+    [self.writeBacklogCondition unlock];
+    return count;
+}
+
+- (NSUInteger)writeBacklogByteCount
+{
+    [self.writeBacklogCondition lock];
+    NSUInteger count = _writeBacklogByteCount;
+    [self.writeBacklogCondition unlock];
+    return count;
+}
+
+- (BOOL)isWriteBacklogFull
+{
+    NSUInteger maximumRowCount = self.maximumWriteBacklogRowCount;
+    NSUInteger maximumByteCount = self.maximumWriteBacklogByteCount;
+    [self.writeBacklogCondition lock];
+    BOOL full = (maximumRowCount > 0 && _writeBacklogRowCount >= maximumRowCount) || (maximumByteCount > 0 && _writeBacklogByteCount >= maximumByteCount);
+    [self.writeBacklogCondition unlock];
+    return full;
+}
+
+- (void)addWriteBacklogRowCount:(NSInteger)rowCount byteCount:(NSInteger)byteCount
+{
+    [self.writeBacklogCondition lock];
+    _writeBacklogRowCount += rowCount;
+    _writeBacklogByteCount += byteCount;
+    if (rowCount < 0 || byteCount < 0)
+        [self.writeBacklogCondition broadcast];
+    [self.writeBacklogCondition unlock];
+}
+
+// called before a change, outside of the store queues; returns NO if the change should be refused
+- (BOOL)waitForWriteBacklogWithSelector:(SEL)selector error:(NSError **)error
+{
+    PARWriteBacklogPolicy policy = self.writeBacklogPolicy;
+    if (policy == PARWriteBacklogPolicyCoalesce || ![self isWriteBacklogFull])
+    {
+        return YES;
+    }
+    
+    if (policy == PARWriteBacklogPolicyFailFast)
+    {
+        NSString *description = [NSString stringWithFormat:@"Method '%@' failed because the write backlog of store at path '%@' is full: %@ rows, %@ bytes", NSStringFromSelector(selector), self.storeURL.path, @(self.writeBacklogRowCount), @(self.writeBacklogByteCount)];
+        ErrorLog(@"%@", description);
+        if (error != NULL)
+            *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:description underlyingError:nil];
+        return NO;
+    }
+    
+    // the backlog cannot drain while we wait within the database queue, or within a transaction that the database queue may be waiting for
+    if ([self.databaseQueue isInCurrentQueueStack] || [self.memoryQueue isInCurrentQueueStack])
+    {
+        return YES;
+    }
+    NSUInteger maximumRowCount = self.maximumWriteBacklogRowCount;
+    NSUInteger maximumByteCount = self.maximumWriteBacklogByteCount;
+    [self.writeBacklogCondition lock];
+    while ((maximumRowCount > 0 && _writeBacklogRowCount >= maximumRowCount) || (maximumByteCount > 0 && _writeBacklogByteCount >= maximumByteCount))
+        [self.writeBacklogCondition wait];
+    [self.writeBacklogCondition unlock];
+    return YES;
+}
+
+// once a key is coalesced, its changes are coalesced until the coalesced write is done, even if the backlog is no longer full: a change written directly in the meantime would be written before the coalesced one, and replaced by it in the coalesced write
+- (BOOL)shouldCoalesceWritesForKeys:(id <NSFastEnumeration>)keys
+{
+    NSAssert([self.memoryQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the memory queue", [self class], NSStringFromSelector(_cmd));
+    if (self.coalescedWrites != nil)
+    {
+        for (NSString *key in keys)
+        {
+            if (self.coalescedWrites[key] != nil)
+                return YES;
+        }
+    }
+    return self.writeBacklogPolicy == PARWriteBacklogPolicyCoalesce && [self isWriteBacklogFull];
+}
+
+// with the coalesce policy, while the backlog is full, only the latest change of each key is kept, and written with the parent timestamp of the first change not written yet, which is returned
+- (NSNumber *)_coalesceWriteWithKey:(NSString *)key blob:(NSData *)blob timestamp:(NSNumber *)timestamp parentTimestamp:(NSNumber *)parentTimestamp
+{
+    NSAssert([self.memoryQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the memory queue", [self class], NSStringFromSelector(_cmd));
+    
+    // a single write is scheduled for all the coalesced changes
+    if (self.coalescedWrites == nil)
+    {
+        self.coalescedWrites = [NSMutableDictionary dictionary];
+        [self.databaseQueue dispatchAsynchronously:^{ [self _writeCoalescedChanges]; }];
+    }
+    
+    NSArray *previousWrite = self.coalescedWrites[key];
+    if (previousWrite != nil)
+    {
+        parentTimestamp = (previousWrite[1] != [NSNull null]) ? previousWrite[1] : nil;
+        [self addWriteBacklogRowCount:-1 byteCount:-(NSInteger)(key.length + [previousWrite[2] length])];
+    }
+    self.coalescedWrites[key] = @[timestamp, parentTimestamp ?: [NSNull null], blob];
+    [self addWriteBacklogRowCount:1 byteCount:key.length + blob.length];
+    return parentTimestamp;
+}
+
+- (void)_writeCoalescedChanges
+{
+    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class], NSStringFromSelector(_cmd));
+    
+    __block NSDictionary *coalescedWrites = nil;
+    __block NSCountedSet *journalSegments = nil;
+    [self.memoryQueue dispatchSynchronously:^
+     {
+         coalescedWrites = self.coalescedWrites;
+         journalSegments = self.coalescedJournalSegments;
+         self.coalescedWrites = nil;
+         self.coalescedJournalSegments = [NSCountedSet set];
+     }];
+    
+    NSUInteger byteCount = 0;
+    for (NSString *key in coalescedWrites)
+        byteCount += key.length + [coalescedWrites[key][2] length];
+    [self addWriteBacklogRowCount:-(NSInteger)coalescedWrites.count byteCount:-(NSInteger)byteCount];
+    
+    NSManagedObjectContext *moc = [self managedObjectContext];
+    if (moc == nil || coalescedWrites.count == 0)
+    {
+        return;
+    }
+    
+    NSNumber *lastTimestamp = self.databaseTimestamps[self.deviceIdentifier];
+    for (NSString *key in coalescedWrites)
+    {
+        NSArray *write = coalescedWrites[key];
+        [self _insertLogWithKey:key blob:write[2] timestamp:write[0] parentTimestamp:(write[1] != [NSNull null]) ? write[1] : nil];
+        if (lastTimestamp == nil || [lastTimestamp compare:write[0]] == NSOrderedAscending)
+            lastTimestamp = write[0];
+    }
+    // the changes replaced by a coalesced change are done too
+    for (id journalSegment in journalSegments)
+        [self.journal didInsertRecordCount:[journalSegments countForObject:journalSegment] inSegment:journalSegment];
+    self.databaseTimestamps[self.deviceIdentifier] = lastTimestamp;
+    
+    // schedule database save
+    [self saveSoon];
+}
+
+#define PARImportBatchSize 10000
+
+- (BOOL)importEntriesFromEnumerator:(NSEnumerator *)enumerator error:(NSError **)error
+{
+    return [self importEntriesFromEnumerator:enumerator cancellationToken:nil error:error];
+}
+
+- (BOOL)importEntriesFromEnumerator:(NSEnumerator *)enumerator cancellationToken:(PARCancellationToken *)cancellationToken error:(NSError **)error
+{
+    PARCancellationToken *operationToken = [self operationTokenWithCancellationToken:cancellationToken];
+    if ([self isFollowerRefusingWriteWithSelector:_cmd error:error])
+    {
+        return NO;
+    }
+    
+    NSError *localError = nil;
+    if ([self.memoryQueue isInCurrentQueueStack])
+    {
+        localError = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"To avoid deadlocks, %@ should not be called within a transaction", NSStringFromSelector(_cmd)] underlyingError:nil];
+    }
+    else if (![self loaded])
+    {
+        localError = [NSError errorWithObject:self code:__LINE__ localizedDescription:@"Could not import entries because the store has not been loaded yet" underlyingError:nil];
+    }
+    
+    BOOL done = NO;
+    while (!done && localError == nil)
+    {
+        // a batch is either imported or not at all, so the import can stop between batches
+        if (operationToken.cancelled)
+        {
+            localError = [self cancellationErrorWithSelector:_cmd];
+            break;
+        }
+        
+        @autoreleasepool
+        {
+            // next batch: the same key may appear more than once, the last value wins
+            NSMutableDictionary *batch = [NSMutableDictionary dictionaryWithCapacity:PARImportBatchSize];
+            while (batch.count < PARImportBatchSize)
+            {
+                NSDictionary *entries = [enumerator nextObject];
+                if (entries == nil)
+                {
+                    done = YES;
+                    break;
+                }
+                if (![entries isKindOfClass:[NSDictionary class]])
+                {
+                    localError = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Objects to import should be dictionaries, not: %@", entries] underlyingError:nil];
+                    break;
+                }
+                [batch addEntriesFromDictionary:entries];
+            }
+            if (localError != nil || batch.count == 0)
+            {
+                break;
+            }
+            
+            // serialize the values before touching the store, so that a batch is either imported or not at all; the values are encoded in parallel, with the error as the result for values that cannot be encoded
+            NSArray *sortedKeys = [batch.allKeys sortedArrayUsingSelector:@selector(compare:)];
+            NSArray *blobs = [PARDispatchQueue forkJoinMapObjects:sortedKeys priority:PARTaskPriorityDefault block:^id(NSString *key, NSUInteger index)
+            {
+                id plist = batch[key];
+                NSError *blobError = nil;
+                NSData *blob = (plist != [NSNull null]) ? [self dataFromPropertyList:plist error:&blobError] : [NSData data];
+                return blob ?: blobError;
+            }];
+            NSUInteger errorIndex = [blobs indexOfObjectPassingTest:^BOOL(id blob, NSUInteger index, BOOL *stop) { return ![blob isKindOfClass:[NSData class]]; }];
+            if (errorIndex != NSNotFound)
+            {
+                NSError *blobError = [blobs[errorIndex] isKindOfClass:[NSError class]] ? blobs[errorIndex] : nil;
+                localError = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Could not import value for key '%@'", sortedKeys[errorIndex]] underlyingError:blobError];
+                break;
+            }
+            
+            localError = [self _importBatch:batch sortedKeys:sortedKeys blobs:blobs];
+        }
+    }
+    
+    // errors from the enumerator itself
+    if (localError == nil && [enumerator respondsToSelector:@selector(error)])
+    {
+        localError = [(_PARJSONLinesEnumerator *)enumerator error];
+    }
+    
+    if (localError != nil)
+    {
+        ErrorLog(@"Error importing entries in store at path '%@': %@", self.storeURL.path, localError);
+        if (error != NULL)
+            *error = localError;
+        return NO;
+    }
+    return YES;
+}
+
+- (BOOL)importEntriesFromJSONLinesAtURL:(NSURL *)url error:(NSError **)error
+{
+    return [self importEntriesFromEnumerator:[[_PARJSONLinesEnumerator alloc] initWithURL:url] cancellationToken:nil error:error];
+}
+
+// the database queue is blocked for the whole batch, so the rows are inserted and saved in one transaction, and the memory layer is only updated in one pass once they are saved
+- (NSError *)_importBatch:(NSDictionary *)batch sortedKeys:(NSArray *)sortedKeys blobs:(NSArray *)blobs
+{
+    NSNumber *newTimestamp = [PARStore timestampNow];
+
+    // parent timestamps
+    __block NSDictionary *oldTimestamps = nil;
+    PARDispatchBlock readMemoryTimestamps = ^
+    {
+        NSMutableDictionary *timestamps = [NSMutableDictionary dictionaryWithCapacity:sortedKeys.count];
+        for (NSString *key in sortedKeys)
+        {
+            NSNumber *oldTimestamp = self._memoryKeyTimestamps[key];
+            if (oldTimestamp)
+                timestamps[key] = oldTimestamp;
+        }
+        oldTimestamps = timestamps;
+    };
+    
+    // memory layer; values set in the meantime are more recent than the batch, and win
+    PARDispatchBlock applyToMemory = ^
+    {
+        NSMutableDictionary *values = [NSMutableDictionary dictionaryWithCapacity:sortedKeys.count];
+        NSMutableDictionary *newTimestamps = [NSMutableDictionary dictionaryWithCapacity:sortedKeys.count];
+        for (NSString *key in sortedKeys)
+        {
+            NSNumber *currentTimestamp = self._memoryKeyTimestamps[key];
+            if (currentTimestamp != nil && [currentTimestamp compare:newTimestamp] == NSOrderedDescending)
+                continue;
+            id plist = batch[key];
+            self._memory[key] = (plist != [NSNull null] ? plist : nil);
+            self._memoryKeyTimestamps[key] = newTimestamp;
+            if (self._inMemory)
+                [self._memoryLogs addChange:[PARChange changeWithTimestamp:newTimestamp parentTimestamp:oldTimestamps[key] key:key propertyList:(plist != [NSNull null] ? plist : nil)] forDeviceIdentifier:self.deviceIdentifier];
+            values[key] = plist;
+            newTimestamps[key] = newTimestamp;
+        }
+        if (values.count > 0)
+            [self postDidChangeNotificationWithUserInfo:@{@"values": values, @"timestamps": newTimestamps}];
+    };
+    
+    if (self._inMemory)
+    {
+        [self.memoryQueue dispatchSynchronously:^
+         {
+             readMemoryTimestamps();
+             applyToMemory();
+         }];
+        return nil;
+    }
+    
+    __block NSError *batchError = nil;
+    [self.databaseQueue dispatchSynchronously:^
+     {
+         NSManagedObjectContext *moc = [self managedObjectContext];
+         if (moc == nil)
+         {
+             batchError = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Could not open the database to import entries in store at path '%@'", self.storeURL.path] underlyingError:nil];
+             return;
+         }
+         
+         // pending changes are saved first, so the context can be rolled back or reset after the batch
+         NSError *saveError = nil;
+         if (![self _save:&saveError])
+         {
+             batchError = saveError;
+             return;
+         }
+         
+         // the database queue can safely wait for the memory queue
+         [self.memoryQueue dispatchSynchronously:readMemoryTimestamps];
+         
+         // rows sorted by key
+         [sortedKeys enumerateObjectsUsingBlock:^(NSString *key, NSUInteger index, BOOL *stop)
+          {
+              [self _insertLogWithKey:key blob:blobs[index] timestamp:newTimestamp parentTimestamp:oldTimestamps[key]];
+          }];
+         
+         // one transaction per batch; a batch that cannot be saved is discarded, so that it is not saved later along with other changes
+         if (![self _save:&saveError])
+         {
+             [moc rollback];
+             [self.pendingLogs removeAllObjects];
+             batchError = saveError;
+             return;
+         }
+         self.databaseTimestamps[self.deviceIdentifier] = newTimestamp;
+         [self.memoryQueue dispatchSynchronously:applyToMemory];
+         
+         // turn the saved rows into faults to free up memory
+         [moc reset];
+     }];
+    return batchError;
 }
 
 - (BOOL)insertChanges:(NSArray *)changes forDeviceIdentifier:(NSString *)deviceIdentifier appendOnly:(BOOL)appendOnly error:(NSError * __autoreleasing *)error
 {
+    if ([self isFollowerRefusingWriteWithSelector:_cmd error:error])
+    {
+        return NO;
+    }
+    
+    if (self._inMemory)
+    {
+        [self.memoryQueue dispatchSynchronously:^{ [self _insertMemoryChanges:changes forDeviceIdentifier:deviceIdentifier appendOnly:appendOnly]; }];
+        return YES;
+    }
+    
     // Model and PSC
     NSManagedObjectModel *mom = [PARStore managedObjectModel];
     NSPersistentStoreCoordinator *psc = [[NSPersistentStoreCoordinator alloc] initWithManagedObjectModel:mom];
@@ -1162,24 +4560,126 @@ NSString *PARBlobsDirectoryName = @"Blobs";
         }
         
         // Save
+        NSSet *insertedLogs = moc.insertedObjects;
+        NSData *checksumRecords = self.checksumsEnabled ? [self checksumRecordsForLogs:insertedLogs] : nil;
+        NSString *summaryPath = [dirPath stringByAppendingPathComponent:PARSummaryFileName];
+        _PARMerkleSummary *summary = (insertedLogs.count > 0) ? [self summaryByAddingLogs:insertedLogs toStore:store summaryPath:summaryPath] : nil;
         if (![moc save:&error])
         {
             outerError = error;
             ErrorLog(@"Failed to save context in addChanges: %@", error);
         }
+        else
+        {
+            if (checksumRecords.length > 0)
+                [_PARChecksumFile writeRecords:checksumRecords toPath:[dirPath stringByAppendingPathComponent:PARChecksumsFileName] append:YES error:NULL];
+            if (summary != nil)
+                [summary writeToPath:summaryPath error:NULL];
+            else if (insertedLogs.count > 0)
+                [[NSFileManager defaultManager] removeItemAtPath:summaryPath error:NULL];
+        }
         [moc reset];
     }];
     
     // Clean up the observer
     [[NSNotificationCenter defaultCenter] removeObserver:observer];
     
-    if (outerError)
+    if (outerError)
+    {
+        if (error) *error = outerError;
+        return NO;
+    }
+    
+    return YES;
+}
+
+// same semantics as the insertion in the databases, followed by a sync of the memory layer
+- (void)_insertMemoryChanges:(NSArray *)changes forDeviceIdentifier:(NSString *)deviceIdentifier appendOnly:(BOOL)appendOnly
+{
+    NSAssert([self.memoryQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the memory queue", [self class], NSStringFromSelector(_cmd));
+    
+    NSNumber *maxTimestamp = [self._memoryLogs mostRecentTimestampForDeviceIdentifier:deviceIdentifier];
+    NSMutableDictionary *changedValues = [NSMutableDictionary dictionary];
+    NSMutableDictionary *changedTimestamps = [NSMutableDictionary dictionary];
+    for (PARChange *change in changes)
+    {
+        if (appendOnly && maxTimestamp != nil && [change.timestamp compare:maxTimestamp] == NSOrderedAscending) continue;
+        if ([self._memoryLogs containsChange:change forDeviceIdentifier:deviceIdentifier]) continue;
+        [self._memoryLogs addChange:change forDeviceIdentifier:deviceIdentifier];
+        
+        // only the most recent change of each key is applied
+        NSNumber *latestTimestamp = changedTimestamps[change.key] ?: self._memoryKeyTimestamps[change.key];
+        if (latestTimestamp == nil || [latestTimestamp compare:change.timestamp] == NSOrderedAscending)
+        {
+            changedValues[change.key] = change.propertyList ?: [NSNull null];
+            changedTimestamps[change.key] = change.timestamp;
+        }
+    }
+    
+    if (changedValues.count > 0)
     {
-        if (error) *error = outerError;
+        [self applySyncChangeWithValues:changedValues timestamps:changedTimestamps];
+        [self postNotificationWithName:PARStoreDidSyncNotification userInfo:@{@"values": changedValues, @"timestamps": changedTimestamps}];
+    }
+}
+
+- (BOOL)flushToURL:(NSURL *)url deviceIdentifier:(NSString *)deviceIdentifier error:(NSError **)error
+{
+    if (!self._inMemory || url == nil)
+    {
+        NSString *description = [NSString stringWithFormat:@"Method '%@' can only flush an in-memory store to a file URL", NSStringFromSelector(_cmd)];
+        ErrorLog(@"%@", description);
+        if (error != NULL)
+            *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:description underlyingError:nil];
+        return NO;
+    }
+    if ([self.memoryQueue isInCurrentQueueStack])
+    {
+        ErrorLog(@"To avoid deadlocks, %@ should not be called within a transaction. Bailing out.", NSStringFromSelector(_cmd));
+        if (error != NULL)
+            *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Method '%@' should not be called within a transaction", NSStringFromSelector(_cmd)] underlyingError:nil];
         return NO;
     }
     
-    return YES;
+    // the history and blobs as they are now
+    NSMutableDictionary *changesByDeviceIdentifier = [NSMutableDictionary dictionary];
+    __block NSDictionary *blobs = nil;
+    [self.memoryQueue dispatchSynchronously:^
+     {
+         for (NSString *memoryDeviceIdentifier in self._memoryLogs.deviceIdentifiers)
+             changesByDeviceIdentifier[memoryDeviceIdentifier] = [self._memoryLogs changesMatchingPredicate:nil forDeviceIdentifier:memoryDeviceIdentifier];
+         blobs = [self._memoryFileData copy];
+     }];
+    
+    // the changes of this store become the changes of the device passed, and changes already in the package are skipped
+    PARStore *store = [PARStore storeWithURL:url deviceIdentifier:deviceIdentifier];
+    [store loadNow];
+    NSError *flushError = nil;
+    BOOL success = [store loaded];
+    if (!success)
+        flushError = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Could not load store at path '%@' to flush in-memory store", url.path] underlyingError:nil];
+    for (NSString *memoryDeviceIdentifier in changesByDeviceIdentifier)
+    {
+        if (!success)
+            break;
+        NSString *targetDeviceIdentifier = [memoryDeviceIdentifier isEqualToString:self.deviceIdentifier] ? deviceIdentifier : memoryDeviceIdentifier;
+        success = [store insertChanges:changesByDeviceIdentifier[memoryDeviceIdentifier] forDeviceIdentifier:targetDeviceIdentifier appendOnly:NO error:&flushError];
+    }
+    for (NSString *path in blobs)
+    {
+        if (!success)
+            break;
+        success = [store writeBlobData:blobs[path] toPath:path error:&flushError];
+    }
+    [store tearDownNow];
+    
+    if (!success)
+    {
+        ErrorLog(@"Could not flush in-memory store to path '%@': %@", url.path, flushError);
+        if (error != NULL)
+            *error = flushError;
+    }
+    return success;
 }
 
 - (void)runTransaction:(PARDispatchBlock)block
@@ -1228,6 +4728,11 @@ NSString *PARBlobsDirectoryName = @"Blobs";
 
 - (BOOL)writeBlobData:(NSData *)data toPath:(NSString *)path error:(NSError **)error
 {
+    if ([self isFollowerRefusingWriteWithSelector:_cmd error:error])
+    {
+        return NO;
+    }
+    
     // nil path = error
     if (path == nil)
     {
@@ -1256,6 +4761,12 @@ NSString *PARBlobsDirectoryName = @"Blobs";
         return YES;
     }
     
+    // small blobs are appended to the pack of the device
+    if (data.length < self.blobPackThreshold)
+    {
+        return [self writePackedBlobData:data toPath:path error:error];
+    }
+    
     // otherwise blobs are stored in a special blob directory
     __block NSError *localError = nil;
     NSURL *fileURL = [[self blobDirectoryURL] URLByAppendingPathComponent:path];
@@ -1288,12 +4799,20 @@ NSString *PARBlobsDirectoryName = @"Blobs";
             *error = localError;
         return NO;
     }
+    
+    // a packed version would hide the file
+    [self deletePackedBlobAtPath:path];
     return YES;
 }
 
 // TODO: rename to copyBlobFromPath:toPath:error:, the current name is ambiguous
 - (BOOL)writeBlobFromPath:(NSString *)sourcePath toPath:(NSString *)targetSubpath error:(NSError **)error
 {
+    if ([self isFollowerRefusingWriteWithSelector:_cmd error:error])
+    {
+        return NO;
+    }
+    
     // nil local path = error
     if (targetSubpath == nil)
     {
@@ -1332,6 +4851,19 @@ NSString *PARBlobsDirectoryName = @"Blobs";
         return [self writeBlobData:sourceData toPath:targetSubpath error:error];
     }
     
+    // small blobs are appended to the pack of the device
+    if (self.blobPackThreshold > 0)
+    {
+        NSDictionary *sourceAttributes = [[NSFileManager defaultManager] attributesOfItemAtPath:sourcePath error:NULL];
+        if (sourceAttributes != nil && [sourceAttributes fileSize] < self.blobPackThreshold)
+        {
+            NSError *errorReadingData = nil;
+            NSData *sourceData = [NSData dataWithContentsOfFile:sourcePath options:0 error:&errorReadingData];
+            if (sourceData != nil)
+                return [self writePackedBlobData:sourceData toPath:targetSubpath error:error];
+        }
+    }
+    
     // otherwise blobs are stored in a special blob directory
     __block NSError *localError = nil;
     NSURL *targetURL = [[self blobDirectoryURL] URLByAppendingPathComponent:targetSubpath];
@@ -1379,11 +4911,19 @@ NSString *PARBlobsDirectoryName = @"Blobs";
         }
         return NO;
     }
+    
+    // a packed version would hide the file
+    [self deletePackedBlobAtPath:targetSubpath];
     return YES;
 }
 
 - (BOOL)deleteBlobAtPath:(NSString *)path error:(NSError **)error
 {
+    if ([self isFollowerRefusingWriteWithSelector:_cmd error:error])
+    {
+        return NO;
+    }
+    
     // nil path = error
     if (path == nil)
     {
@@ -1404,6 +4944,12 @@ NSString *PARBlobsDirectoryName = @"Blobs";
         return YES;
     }
     
+    // packed blobs are deleted by appending a deletion to the pack of the device
+    if ([self deletePackedBlobAtPath:path] && ![[NSFileManager defaultManager] fileExistsAtPath:[self absolutePathForBlobPath:path]])
+    {
+        return YES;
+    }
+    
     // otherwise blobs are stored in a special blob directory
     __block NSError *localError = nil;
     NSURL *fileURL = [[self blobDirectoryURL] URLByAppendingPathComponent:path];
@@ -1453,6 +4999,21 @@ NSString *PARBlobsDirectoryName = @"Blobs";
         return foundData;
     }
     
+    // small blobs may be in a pack
+    BOOL packed = NO;
+    NSData *packedData = [self packedBlobDataAtPath:path packed:&packed];
+    if (packed)
+    {
+        if (packedData == nil)
+        {
+            NSError *localError = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Could not read packed data blob at path '%@'", path] underlyingError:nil];
+            ErrorLog(@"Error reading data blob: %@", localError);
+            if (error != NULL)
+                *error = localError;
+        }
+        return packedData;
+    }
+    
     // otherwise blobs are stored in a special blob directory
     __block NSError *localError = nil;
     NSURL *fileURL = [[self blobDirectoryURL] URLByAppendingPathComponent:path];
@@ -1522,15 +5083,335 @@ NSString *PARBlobsDirectoryName = @"Blobs";
         }];
         
         NSUInteger prefixLength = self.blobDirectoryURL.path.length+1; // +1 is for the last slash
+        NSMutableSet *paths = [NSMutableSet setWithCapacity:urls.count];
         for (NSURL *url in urls) {
             // Resolving symbolic link here, because on iOS at least, the directory enumerator
             // uses a sym linked "private" folder, causing the path to be different to what comes
             // out for the blobDirectoryURL.
             NSString *absolutePath = [url URLByResolvingSymlinksInPath].path;
             NSString *relativePath = [absolutePath substringFromIndex:prefixLength];
+            [paths addObject:relativePath];
             block(relativePath);
         }
+        
+        // packed blobs, at the same level as the files
+        for (NSString *path in [self packedBlobPaths]) {
+            if (![paths containsObject:path] && path.pathComponents.count == 1) {
+                block(path);
+            }
+        }
+    }
+}
+
+
+#pragma mark - Packing Blobs
+
+- (NSString *)blobPacksDirectoryPath
+{
+    return [[self blobDirectoryURL].path stringByAppendingPathComponent:PARBlobPacksDirectoryName];
+}
+
+- (NSString *)localBlobPackPath
+{
+    return [[self blobPacksDirectoryPath] stringByAppendingPathComponent:[self.deviceIdentifier stringByAppendingPathExtension:@"pack"]];
+}
+
+// packs of all the devices, reloaded when they change
+- (NSArray *)_currentBlobPacks
+{
+    NSAssert([self.blobQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the blob queue", [self class], NSStringFromSelector(_cmd));
+    NSString *directoryPath = [self blobPacksDirectoryPath];
+    NSMutableDictionary *packs = [NSMutableDictionary dictionary];
+    for (NSString *name in [[NSFileManager defaultManager] contentsOfDirectoryAtPath:directoryPath error:NULL])
+    {
+        if (![name.pathExtension isEqualToString:@"pack"])
+            continue;
+        NSString *path = [directoryPath stringByAppendingPathComponent:name];
+        _PARBlobPack *pack = self.blobPacks[path];
+        NSString *fingerprint = PARFingerprintForFileAtPath(path);
+        if (pack == nil || (fingerprint != pack.fingerprint && ![fingerprint isEqualToString:pack.fingerprint]))
+            pack = [_PARBlobPack packWithPath:path];
+        packs[path] = pack;
+    }
+    self.blobPacks = packs;
+    return packs.allValues;
+}
+
+// the most recent record for the path in all the packs, as @[pack, entry], or nil if no pack has the path
+- (NSArray *)_mostRecentBlobPackRecordForPath:(NSString *)path
+{
+    NSArray *mostRecentRecord = nil;
+    for (_PARBlobPack *pack in [self _currentBlobPacks])
+    {
+        NSArray *entry = pack.entries[path];
+        if (entry != nil && (mostRecentRecord == nil || [entry[0] compare:mostRecentRecord[1][0]] == NSOrderedDescending))
+            mostRecentRecord = @[pack, entry];
+    }
+    return mostRecentRecord;
+}
+
+- (BOOL)_appendBlobPackRecords:(NSData *)records error:(NSError **)error
+{
+    NSAssert([self.blobQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the blob queue", [self class], NSStringFromSelector(_cmd));
+    [[NSFileManager defaultManager] createDirectoryAtPath:[self blobPacksDirectoryPath] withIntermediateDirectories:YES attributes:nil error:NULL];
+    NSString *packPath = [self localBlobPackPath];
+    [self _currentBlobPacks];
+    _PARBlobPack *pack = self.blobPacks[packPath] ?: [_PARBlobPack packWithPath:packPath];
+    
+    __block BOOL success = NO;
+    __block NSError *localError = nil;
+    NSError *coordinatorError = nil;
+    [[self newFileCoordinator] coordinateWritingItemAtURL:[NSURL fileURLWithPath:packPath] options:0 error:&coordinatorError byAccessor:^(NSURL *newURL)
+    {
+        NSError *appendError = nil;
+        success = [pack appendRecords:records error:&appendError];
+        localError = appendError;
+    }];
+    if (!success)
+    {
+        localError = localError ?: coordinatorError;
+        ErrorLog(@"Error writing to blob pack: %@", localError);
+        if (error != NULL)
+            *error = localError;
+        return NO;
+    }
+    self.blobPacks[packPath] = pack;
+    
+    // the records replaced by more recent ones are only removed by repacking, once they take most of the pack
+    if (pack.length > 1024 * 1024 && pack.liveLength < pack.length / 2)
+        [self.blobQueue scheduleTimerWithName:@"repack" timeInterval:30.0 behavior:PARTimerBehaviorDelay block:^{ [self _repackBlobs:NULL]; }];
+    return YES;
+}
+
+- (BOOL)writePackedBlobData:(NSData *)data toPath:(NSString *)path error:(NSError **)error
+{
+    __block BOOL success = NO;
+    __block NSError *localError = nil;
+    [self.blobQueue dispatchSynchronously:^
+    {
+        NSError *appendError = nil;
+        success = [self _appendBlobPackRecords:[_PARBlobPack recordWithPath:path timestamp:[PARStore timestampNow].longLongValue data:data] error:&appendError];
+        localError = appendError;
+    }];
+    if (!success)
+    {
+        if (error != NULL)
+            *error = localError;
+        return NO;
+    }
+    
+    // the pack now has the most recent version of the blob
+    NSURL *fileURL = [[self blobDirectoryURL] URLByAppendingPathComponent:path];
+    if ([[NSFileManager defaultManager] fileExistsAtPath:fileURL.path])
+    {
+        [[self newFileCoordinator] coordinateWritingItemAtURL:fileURL options:NSFileCoordinatorWritingForDeleting error:NULL byAccessor:^(NSURL *newURL)
+        {
+            [[NSFileManager defaultManager] removeItemAtURL:newURL error:NULL];
+        }];
+    }
+    return YES;
+}
+
+// returns YES if there was a packed blob at that path
+- (BOOL)deletePackedBlobAtPath:(NSString *)path
+{
+    return [self deletePackedBlobAtPath:path olderThanDate:nil];
+}
+
+// only deletes a packed blob written before `date`, if not nil, e.g. the modification date of a file copied by a merge; the deletion then has that date, so that packed blobs written since, e.g. merged from the same store, still win
+- (BOOL)deletePackedBlobAtPath:(NSString *)path olderThanDate:(NSDate *)date
+{
+    if (![[NSFileManager defaultManager] fileExistsAtPath:[self blobPacksDirectoryPath]])
+    {
+        return NO;
+    }
+    __block BOOL deleted = NO;
+    [self.blobQueue dispatchSynchronously:^
+    {
+        NSArray *record = [self _mostRecentBlobPackRecordForPath:path];
+        if (record == nil || [record[1][2] longLongValue] < 0)
+            return;
+        if (date != nil && [[NSDate dateWithTimeIntervalSinceReferenceDate:[record[1][0] longLongValue] / 1000000.0] compare:date] != NSOrderedAscending)
+            return;
+        int64_t timestamp = (date != nil) ? (int64_t)(date.timeIntervalSinceReferenceDate * 1000000.0) : [PARStore timestampNow].longLongValue;
+        deleted = [self _appendBlobPackRecords:[_PARBlobPack recordWithPath:path timestamp:timestamp data:nil] error:NULL];
+    }];
+    return deleted;
+}
+
+- (NSData *)packedBlobDataAtPath:(NSString *)path packed:(BOOL *)packed
+{
+    *packed = NO;
+    if (![[NSFileManager defaultManager] fileExistsAtPath:[self blobPacksDirectoryPath]])
+    {
+        return nil;
+    }
+    __block NSData *data = nil;
+    __block BOOL foundRecord = NO;
+    [self.blobQueue dispatchSynchronously:^
+    {
+        NSArray *record = [self _mostRecentBlobPackRecordForPath:path];
+        if (record == nil || [record[1][2] longLongValue] < 0)
+            return;
+        foundRecord = YES;
+        data = [record[0] dataForPath:path];
+    }];
+    *packed = foundRecord;
+    return data;
+}
+
+- (NSArray *)packedBlobPaths
+{
+    if (![[NSFileManager defaultManager] fileExistsAtPath:[self blobPacksDirectoryPath]])
+    {
+        return @[];
+    }
+    NSMutableArray *paths = [NSMutableArray array];
+    [self.blobQueue dispatchSynchronously:^
+    {
+        [[_PARBlobPack mostRecentRecordsInPacks:[self _currentBlobPacks]] enumerateKeysAndObjectsUsingBlock:^(NSString *path, NSArray *record, BOOL *stop)
+        {
+            if ([record[1][2] longLongValue] >= 0)
+                [paths addObject:path];
+        }];
+    }];
+    return paths;
+}
+
+- (BOOL)repackBlobsWithError:(NSError **)error
+{
+    if ([self isFollowerRefusingWriteWithSelector:_cmd error:error])
+    {
+        return NO;
+    }
+    if (self._inMemory)
+    {
+        return YES;
+    }
+    __block BOOL success = NO;
+    __block NSError *localError = nil;
+    [self.blobQueue dispatchSynchronously:^
+    {
+        NSError *repackError = nil;
+        success = [self _repackBlobs:&repackError];
+        localError = repackError;
+    }];
+    if (!success && error != NULL)
+        *error = localError;
+    return success;
+}
+
+// rewrites the pack of the device with only the records still needed
+- (BOOL)_repackBlobs:(NSError **)error
+{
+    NSAssert([self.blobQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the blob queue", [self class], NSStringFromSelector(_cmd));
+    [self.blobQueue cancelTimerWithName:@"repack"];
+    NSArray *packs = [self _currentBlobPacks];
+    NSString *packPath = [self localBlobPackPath];
+    _PARBlobPack *pack = self.blobPacks[packPath];
+    if (pack == nil)
+    {
+        return YES;
+    }
+    
+    NSDictionary *mostRecentRecords = [_PARBlobPack mostRecentRecordsInPacks:packs];
+    NSMutableData *records = [NSMutableData data];
+    for (NSString *path in [pack.entries.allKeys sortedArrayUsingSelector:@selector(compare:)])
+    {
+        // records replaced by the ones of another device are dropped
+        NSArray *entry = pack.entries[path];
+        if (mostRecentRecords[path][0] != pack)
+            continue;
+        
+        NSData *data = nil;
+        if ([entry[2] longLongValue] >= 0)
+        {
+            data = [pack dataForPath:path];
+            if (data == nil)
+                continue;
+        }
+        else
+        {
+            // deletions are only needed to hide the blobs of other devices
+            BOOL hidesBlob = NO;
+            for (_PARBlobPack *otherPack in packs)
+            {
+                NSArray *otherEntry = otherPack.entries[path];
+                if (otherPack != pack && otherEntry != nil && [otherEntry[2] longLongValue] >= 0)
+                    hidesBlob = YES;
+            }
+            if (!hidesBlob)
+                continue;
+        }
+        [records appendData:[_PARBlobPack recordWithPath:path timestamp:[entry[0] longLongValue] data:data]];
+    }
+    
+    __block NSError *localError = nil;
+    NSError *coordinatorError = nil;
+    [[self newFileCoordinator] coordinateWritingItemAtURL:[NSURL fileURLWithPath:packPath] options:NSFileCoordinatorWritingForReplacing error:&coordinatorError byAccessor:^(NSURL *newURL)
+    {
+        NSError *writeError = nil;
+        if (![records writeToURL:newURL options:NSDataWritingAtomic error:&writeError])
+            localError = writeError;
+    }];
+    localError = localError ?: coordinatorError;
+    if (localError != nil)
+    {
+        ErrorLog(@"Could not repack blobs at path '%@': %@", packPath, localError);
+        if (error != NULL)
+            *error = localError;
+        return NO;
+    }
+    self.blobPacks[packPath] = [_PARBlobPack packWithPath:packPath];
+    return YES;
+}
+
+// appends the records of the packs in the directory that are more recent than the blobs of the store, or only counts them for a dry run; returns the error if they could not be appended
+- (NSError *)_mergeBlobPacksAtPath:(NSString *)directoryPath blobCount:(NSUInteger *)blobCount byteCount:(unsigned long long *)byteCount dryRun:(BOOL)dryRun
+{
+    NSAssert(dryRun || [self.blobQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the blob queue", [self class], NSStringFromSelector(_cmd));
+    NSDictionary *mergedRecords = [_PARBlobPack mostRecentRecordsInPacks:[_PARBlobPack packsInDirectoryAtPath:directoryPath]];
+    NSDictionary *records = [_PARBlobPack mostRecentRecordsInPacks:dryRun ? [_PARBlobPack packsInDirectoryAtPath:[self blobPacksDirectoryPath]] : [self _currentBlobPacks]];
+    NSMutableData *newRecords = [NSMutableData data];
+    NSUInteger count = 0;
+    unsigned long long bytes = 0;
+    for (NSString *path in [mergedRecords.allKeys sortedArrayUsingSelector:@selector(compare:)])
+    {
+        // newer or equal version prevails in case of conflict, as for files
+        NSArray *mergedEntry = mergedRecords[path][1];
+        int64_t timestamp = [mergedEntry[0] longLongValue];
+        NSArray *entry = records[path][1];
+        if (entry != nil && [entry[0] longLongValue] >= timestamp)
+            continue;
+        NSDate *fileModificationDate = [[NSFileManager defaultManager] attributesOfItemAtPath:[self absolutePathForBlobPath:path] error:NULL][NSFileModificationDate];
+        if (fileModificationDate != nil && (entry == nil || [entry[2] longLongValue] < 0) && [fileModificationDate compare:[NSDate dateWithTimeIntervalSinceReferenceDate:timestamp / 1000000.0]] != NSOrderedAscending)
+            continue;
+        
+        NSData *data = nil;
+        if ([mergedEntry[2] longLongValue] >= 0)
+        {
+            data = [mergedRecords[path][0] dataForPath:path];
+            if (data == nil)
+                continue;
+        }
+        else if (entry == nil)
+        {
+            continue;
+        }
+        count++;
+        bytes += data.length;
+        if (!dryRun)
+            [newRecords appendData:[_PARBlobPack recordWithPath:path timestamp:timestamp data:data]];
     }
+    if (blobCount != NULL)
+        *blobCount = count;
+    if (byteCount != NULL)
+        *byteCount = bytes;
+    
+    NSError *error = nil;
+    if (newRecords.length > 0)
+        [self _appendBlobPackRecords:newRecords error:&error];
+    return error;
 }
 
 
@@ -1568,6 +5449,18 @@ NSString *PARBlobsDirectoryName = @"Blobs";
     NSManagedObjectContext *moc = [self managedObjectContext];
     if (moc == nil)
     {
+        // a follower of a package without any device database yet is simply empty
+        if (self.follower && [[NSFileManager defaultManager] fileExistsAtPath:[self deviceRootPath]])
+        {
+            [self.memoryQueue dispatchSynchronously:^
+             {
+                 if (self._loaded)
+                     return;
+                 self._loaded = YES;
+                 [self postNotificationWithName:PARStoreDidLoadNotification userInfo:nil];
+             }];
+            return;
+        }
         ErrorLog(@"Could not load managed object context and sync store at path '%@'", [self.storeURL path]);
         return;
     }
@@ -1578,10 +5471,22 @@ NSString *PARBlobsDirectoryName = @"Blobs";
     
     // autoclose database
     [self closeDatabaseSoon];
+    
+    // checked between batches of rows; a cancelled sync leaves the timestamps untouched, so the next sync reads the same rows again
+    PARCancellationToken *operationToken = [self operationTokenWithCancellationToken:nil];
 
     // because of the way we use the `databaseQueue` and `memoryQueue`, the returned value is guaranteed to take into account any previous execution of `_sync`
     BOOL loaded = [self loaded];
     
+    // with a limit on open foreign databases, only the databases that changed since the last sync are read
+    NSMutableDictionary *foreignDatabaseFingerprints = nil;
+    if (self.maximumOpenForeignDatabaseCount > 0)
+    {
+        foreignDatabaseFingerprints = [NSMutableDictionary dictionary];
+        for (NSString *deviceIdentifier in [self foreignDeviceIdentifiers])
+            [foreignDatabaseFingerprints setValue:PARFingerprintForFileAtPath([self databasePathForDeviceIdentifier:deviceIdentifier]) forKey:deviceIdentifier];
+    }
+    
     // timestampLimit = load only logs after that timestamp, so we only load the newest logs (will be nil if nothing was loaded yet)
     NSNumber *timestampLimit = nil;
     if (loaded)
@@ -1589,11 +5494,19 @@ NSString *PARBlobsDirectoryName = @"Blobs";
         // there are 2 ways to determine `timestampLimit`, which depends on wether a new database was added since the last sync
         [self refreshStoreList];
         
-        // we can count databases because the count would always go up (db's are not deleted)
+        // databases of archived devices are gone, even if they were not attached
+        for (NSString *deviceIdentifier in self.databaseTimestamps.allKeys)
+        {
+            if (foreignDatabaseFingerprints != nil && foreignDatabaseFingerprints[deviceIdentifier] == nil && ![deviceIdentifier isEqualToString:self.deviceIdentifier])
+                [self.databaseTimestamps removeObjectForKey:deviceIdentifier];
+        }
+        
+        // we can count databases because the count would always go up (db's are not deleted, only archived)
         NSUInteger countAllDatabasesBefore   = [self.databaseTimestamps count];
-        NSUInteger countReadonlyDatabasesNow = [self.readonlyDatabases count];
-        NSAssert(countReadonlyDatabasesNow + 1 >= countAllDatabasesBefore, @"Inconsistent tracking of persistent stores");
-        BOOL newStoreAdded = (countAllDatabasesBefore < countReadonlyDatabasesNow + 1);
+        NSUInteger countForeignDatabasesNow  = (foreignDatabaseFingerprints != nil) ? [foreignDatabaseFingerprints count] : [self.readonlyDatabases count];
+        NSUInteger countAllDatabasesNow      = countForeignDatabasesNow + (self.readwriteDatabase != nil ? 1 : 0);
+        NSAssert(countAllDatabasesNow >= countAllDatabasesBefore, @"Inconsistent tracking of persistent stores");
+        BOOL newStoreAdded = (countAllDatabasesBefore < countAllDatabasesNow);
         
         // Case 1: new store was added --> use the oldest of the latest timestamps from each valid key
         // Case 2: no new store added  --> use the oldest of the latest timestamps from each store
@@ -1605,19 +5518,10 @@ NSString *PARBlobsDirectoryName = @"Blobs";
         }
     }
     
-    // Make sure logs are saved before querying. Some queries don't work without saved data, because they use SQLite.
-    NSError *saveError;
-    if (moc.hasChanges)
-    {
-        if (![moc save:&saveError])
-        {
-            ErrorLog(@"Could not save the context in preparation for sync: %@", saveError);
-            return;
-        }
-    }
-    
     // fetch Log rows created after the `timestampLimit`
+    // the queries use object IDs, which only work with saved rows: the local rows not saved yet are merged from the overlay at the end, rather than saved first
     NSFetchRequest *logsRequest = [NSFetchRequest fetchRequestWithEntityName:LogEntityName];
+    logsRequest.includesPendingChanges = NO;
     if (timestampLimit)
     {
         [logsRequest setPredicate:[NSPredicate predicateWithFormat:@"%K > %@", TimestampAttributeName, timestampLimit]];
@@ -1625,20 +5529,103 @@ NSString *PARBlobsDirectoryName = @"Blobs";
     
     // sort in reverse timestamp order (newest first), though it's not clear the order is correctly respected when we fetch managed object IDs, not managed objects
     [logsRequest setSortDescriptors:@[[NSSortDescriptor sortDescriptorWithKey:TimestampAttributeName ascending:NO]]];
+    
+    // the archive is only queried again after archiving more devices, which changes the file
+    NSString *archivePath = [self databasePathForDeviceIdentifier:PARArchiveDeviceIdentifier];
+    NSString *archiveFingerprint = PARFingerprintForFileAtPath(archivePath);
+    if (loaded && archiveFingerprint != nil && [archiveFingerprint isEqualToString:self.archiveFingerprint])
+    {
+        NSMutableArray *affectedStores = [NSMutableArray arrayWithArray:moc.persistentStoreCoordinator.persistentStores];
+        [affectedStores removeObject:[moc.persistentStoreCoordinator persistentStoreForURL:[NSURL fileURLWithPath:archivePath]]];
+        if (affectedStores.count > 0)
+            logsRequest.affectedStores = affectedStores;
+    }
 
     // this will be set to YES if at least one of latest values come from one of the foreign stores
     __block BOOL hasForeignChanges = NO;
+    
+    // rows arriving after the initial load are checked against their checksums, so that corrupt rows do not spread; the initial load is not slowed down
+    BOOL verifiesChecksums = loaded && self.checksumsEnabled;
+    
+    // the checksum file of each database is only looked up once per sync, and not for each row
+    NSMapTable *checksumFilesByStore = [NSMapTable strongToStrongObjectsMapTable];
+    _PARChecksumFile *(^checksumFileForStore)(NSPersistentStore *) = ^_PARChecksumFile *(NSPersistentStore *store)
+    {
+        _PARChecksumFile *checksumFile = [checksumFilesByStore objectForKey:store];
+        if (checksumFile == nil)
+        {
+            checksumFile = [self checksumFileForDatabasePath:store.URL.path];
+            [checksumFilesByStore setObject:checksumFile forKey:store];
+        }
+        return checksumFile;
+    };
+    
+    // without a memory cache, the values from the first load are never used, only the timestamps
+    BOOL decodesValues = loaded || self._inMemoryCacheEnabled;
 
     // keep track of updated timestamps and values that will be used to calculate the new logTimestamps and databaseTimestamps at the end
-    NSMapTable *updatedDatabaseTimestamps = [NSMapTable weakToStrongObjectsMapTable];
+    // stores are retained, since they can be detached before the end of the sync, with a limit on open foreign databases
+    NSMapTable *updatedDatabaseTimestamps = [NSMapTable strongToStrongObjectsMapTable];
     NSMutableDictionary *updatedKeyTimestamps = [NSMutableDictionary dictionary];
     NSMutableDictionary *updatedValues = [NSMutableDictionary dictionary];
     
     // just go through each row (back in time) until all entries are loaded
-    [self parstore_enumerateObjectsForFetchRequest:logsRequest managedObjectContext:moc batchSize:1000 withBlock:^(NSArray *batch, BOOL hasMore, BOOL *stop)
+    // decoding the blobs is the slow part: in each batch, the rows that will be used are selected first, their blobs are decoded in parallel, and the rows are then processed in order
+    void (^enumerationBlock)(NSArray *, BOOL, BOOL *) = ^(NSArray *batch, BOOL hasMore, BOOL *stop)
     {
+        if (operationToken.cancelled)
+        {
+            *stop = YES;
+            return;
+        }
+        
+        // selection, assuming all the blobs can be decoded
+        NSMutableDictionary *selectedKeyTimestamps = [NSMutableDictionary dictionary];
+        NSMutableIndexSet *selectedRows = [NSMutableIndexSet indexSet];
+        NSMutableIndexSet *rejectedRows = [NSMutableIndexSet indexSet];
+        NSMutableArray *decodedRows = [NSMutableArray array];
+        NSMutableArray *decodedBlobs = [NSMutableArray array];
+        NSUInteger row = 0;
+        for (NSManagedObject *log in batch)
+        {
+            NSUInteger currentRow = row++;
+            NSString *key = [log valueForKey:KeyAttributeName];
+            if (!key)
+                continue;
+            NSNumber *logTimestamp = [log valueForKey:TimestampAttributeName];
+            NSNumber *mostRecentTimestamp = selectedKeyTimestamps[key] ?: (updatedValues[key] != nil ? updatedKeyTimestamps[key] : nil);
+            if (mostRecentTimestamp != nil && [logTimestamp compare:mostRecentTimestamp] == NSOrderedAscending)
+                continue;
+            NSData *blob = [log valueForKey:BlobAttributeName];
+            NSPersistentStore *store = [[log objectID] persistentStore];
+            if (verifiesChecksums && ![checksumFileForStore(store) verifyKey:key timestamp:logTimestamp parentTimestamp:[log valueForKey:ParentTimestampAttributeName] blob:blob])
+            {
+                ErrorLog(@"Checksum mismatch, row skipped:\nrow: %@\ndatabase: %@", log.objectID, store.URL.path);
+                [rejectedRows addIndex:currentRow];
+                continue;
+            }
+            selectedKeyTimestamps[key] = logTimestamp;
+            [selectedRows addIndex:currentRow];
+            if (blob.length > 0 && decodesValues)
+            {
+                [decodedRows addObject:@(currentRow)];
+                [decodedBlobs addObject:blob];
+            }
+        }
+        
+        // parallel decoding, with the error as the result for blobs that cannot be decoded
+        NSArray *decodedValues = [PARDispatchQueue forkJoinMapObjects:decodedBlobs priority:PARTaskPriorityHigh block:^id(NSData *blob, NSUInteger index)
+        {
+            NSError *blobError = nil;
+            return [self propertyListFromData:blob error:&blobError] ?: blobError;
+        }];
+        NSDictionary *decodedValuesByRow = [NSDictionary dictionaryWithObjects:decodedValues forKeys:decodedRows];
+        
+        row = 0;
         for (NSManagedObject *log in batch)
         {
+            NSUInteger currentRow = row++;
+            
             // key
             NSString *key = [log valueForKey:KeyAttributeName];
             if (!key)
@@ -1672,9 +5659,30 @@ NSString *PARBlobsDirectoryName = @"Blobs";
             
             // blob --> object
             // nil or empty blob counts as a deletion marker, and we will use NSNull as a marker value for the rest of the method
+            // rows not selected above are only needed when a more recent blob could not be decoded
             NSError *blobError = nil;
             NSData *blob = [log valueForKey:BlobAttributeName];
-            id plistValue = (blob.length > 0 ? [self propertyListFromData:blob error:&blobError] : [NSNull null]);
+            if ([rejectedRows containsIndex:currentRow])
+            {
+                [moc refreshObject:log mergeChanges:YES];
+                continue;
+            }
+            id plistValue = decodedValuesByRow[@(currentRow)];
+            if (plistValue == nil)
+            {
+                if (verifiesChecksums && ![selectedRows containsIndex:currentRow] && ![checksumFileForStore(store) verifyKey:key timestamp:logTimestamp parentTimestamp:[log valueForKey:ParentTimestampAttributeName] blob:blob])
+                {
+                    ErrorLog(@"Checksum mismatch, row skipped:\nrow: %@\ndatabase: %@", log.objectID, store.URL.path);
+                    [moc refreshObject:log mergeChanges:YES];
+                    continue;
+                }
+                plistValue = (blob.length > 0 && decodesValues ? [self propertyListFromData:blob error:&blobError] : [NSNull null]);
+            }
+            else if ([plistValue isKindOfClass:[NSError class]])
+            {
+                blobError = plistValue;
+                plistValue = nil;
+            }
             if (!plistValue)
             {
                 ErrorLog(@"Error deserializing blob data:\nrow: %@\ndatabase: %@\nerror: %@", log.objectID, log.objectID.persistentStore.URL.path, blobError);
@@ -1695,7 +5703,57 @@ NSString *PARBlobsDirectoryName = @"Blobs";
             // Turn object back into fault to free up memory
             [moc refreshObject:log mergeChanges:YES];
         }
-    }];
+    };
+    if (foreignDatabaseFingerprints == nil)
+    {
+        [self parstore_enumerateObjectsForFetchRequest:logsRequest managedObjectContext:moc batchSize:1000 withBlock:enumerationBlock];
+    }
+    else
+    {
+        NSMutableArray *changedDeviceIdentifiers = [NSMutableArray array];
+        [foreignDatabaseFingerprints enumerateKeysAndObjectsUsingBlock:^(NSString *deviceIdentifier, NSString *fingerprint, BOOL *stop)
+         {
+             if (!loaded || ![fingerprint isEqualToString:self.foreignDatabaseFingerprints[deviceIdentifier]])
+                 [changedDeviceIdentifiers addObject:deviceIdentifier];
+         }];
+        [self enumerateDatabaseGroupsForDeviceIdentifiers:changedDeviceIdentifiers usingBlock:^(NSArray *stores)
+         {
+             if (operationToken.cancelled)
+                 return;
+             NSFetchRequest *groupRequest = [logsRequest copy];
+             groupRequest.affectedStores = stores;
+             [self parstore_enumerateObjectsForFetchRequest:groupRequest managedObjectContext:moc batchSize:1000 withBlock:enumerationBlock];
+         }];
+    }
+    
+    // nothing read so far is applied
+    if (operationToken.cancelled)
+    {
+        DebugLog(@"Sync cancelled for store at path '%@'", [self.storeURL path]);
+        return;
+    }
+    if (foreignDatabaseFingerprints != nil)
+        self.foreignDatabaseFingerprints = foreignDatabaseFingerprints;
+    
+    // local rows not saved yet
+    NSPersistentStore *readwriteDatabase = self.readwriteDatabase;
+    for (NSDictionary *log in self.pendingLogs)
+    {
+        NSString *key = log[KeyAttributeName];
+        NSNumber *logTimestamp = log[TimestampAttributeName];
+        NSNumber *databaseTimestamp = (readwriteDatabase != nil) ? [updatedDatabaseTimestamps objectForKey:readwriteDatabase] : nil;
+        if (readwriteDatabase != nil && (databaseTimestamp == nil || [databaseTimestamp compare:logTimestamp] == NSOrderedAscending))
+            [updatedDatabaseTimestamps setObject:logTimestamp forKey:readwriteDatabase];
+        NSNumber *mostRecentTimestamp = updatedKeyTimestamps[key];
+        if (mostRecentTimestamp != nil && [logTimestamp compare:mostRecentTimestamp] == NSOrderedAscending)
+            continue;
+        NSData *blob = log[BlobAttributeName];
+        id plistValue = (blob.length > 0 && decodesValues) ? [self propertyListFromData:blob error:NULL] : [NSNull null];
+        if (plistValue == nil)
+            continue;
+        updatedValues[key] = plistValue;
+        updatedKeyTimestamps[key] = logTimestamp;
+    }
     
     // update the timestamps for the keys
     NSMutableDictionary *newKeyTimestamps = self.keyTimestamps.mutableCopy ?: [NSMutableDictionary dictionary];
@@ -1704,17 +5762,39 @@ NSString *PARBlobsDirectoryName = @"Blobs";
     
     // update the timestamps for the databases
     NSMutableDictionary *newDatabaseTimestamps = [NSMutableDictionary dictionary];
-    for (NSPersistentStore *store in [self.readonlyDatabases arrayByAddingObject:self.readwriteDatabase])
+    if (foreignDatabaseFingerprints == nil)
     {
-        NSString *deviceIdentifier = [self deviceIdentifierForDatabasePath:store.URL.path];
-        if (deviceIdentifier == nil)
+        NSArray *allDatabases = (self.readwriteDatabase != nil) ? [self.readonlyDatabases arrayByAddingObject:self.readwriteDatabase] : self.readonlyDatabases;
+        for (NSPersistentStore *store in allDatabases)
         {
-            continue;
+            NSString *deviceIdentifier = [self deviceIdentifierForDatabasePath:store.URL.path];
+            if (deviceIdentifier == nil)
+            {
+                continue;
+            }
+            NSNumber *timestamp = [updatedDatabaseTimestamps objectForKey:store] ?: self.databaseTimestamps[deviceIdentifier] ?: [PARStore timestampForDistantPast];
+            newDatabaseTimestamps[deviceIdentifier] = timestamp;
+        }
+    }
+    else
+    {
+        // the databases are not all attached
+        NSMutableArray *deviceIdentifiers = [NSMutableArray arrayWithArray:foreignDatabaseFingerprints.allKeys];
+        if (self.readwriteDatabase != nil)
+            [deviceIdentifiers addObject:self.deviceIdentifier];
+        for (NSString *deviceIdentifier in deviceIdentifiers)
+            newDatabaseTimestamps[deviceIdentifier] = self.databaseTimestamps[deviceIdentifier] ?: [PARStore timestampForDistantPast];
+        for (NSPersistentStore *store in updatedDatabaseTimestamps)
+        {
+            NSString *deviceIdentifier = [self deviceIdentifierForDatabasePath:store.URL.path];
+            if (deviceIdentifier != nil)
+                newDatabaseTimestamps[deviceIdentifier] = [updatedDatabaseTimestamps objectForKey:store];
         }
-        NSNumber *timestamp = [updatedDatabaseTimestamps objectForKey:store] ?: self.databaseTimestamps[deviceIdentifier] ?: [PARStore timestampForDistantPast];
-        newDatabaseTimestamps[deviceIdentifier] = timestamp;
     }
     self.databaseTimestamps = newDatabaseTimestamps;
+    self.archiveFingerprint = archiveFingerprint;
+    if (updatedKeyTimestamps.count > 0)
+        [self publishSharedCacheSoon];
     
     // store loaded the first time --> set all the data at once
     if (!loaded)
@@ -1775,7 +5855,11 @@ NSString *PARBlobsDirectoryName = @"Blobs";
 - (id)fetchPropertyListValueForKey:(NSString *)key timestamp:(NSNumber *)timestamp
 {
     if (self._inMemory)
-        return nil;
+    {
+        __block id plist = nil;
+        [self.memoryQueue dispatchSynchronously:^{ plist = [self._memoryLogs mostRecentChangeForKey:key timestamp:timestamp].propertyList; }];
+        return plist;
+    }
     
     if ([self.memoryQueue isInCurrentQueueStack])
     {
@@ -1784,6 +5868,7 @@ NSString *PARBlobsDirectoryName = @"Blobs";
     }
     
     __block id plist = nil;
+    __block BOOL foundLog = NO;
     [self.databaseQueue dispatchSynchronously:^
      {
          NSManagedObjectContext *moc = [self managedObjectContext];
@@ -1792,7 +5877,6 @@ NSString *PARBlobsDirectoryName = @"Blobs";
              return;
          }
 
-         NSError *fetchError = nil;
          NSFetchRequest *request = [NSFetchRequest fetchRequestWithEntityName:LogEntityName];
          request.sortDescriptors = @[[NSSortDescriptor sortDescriptorWithKey:TimestampAttributeName ascending:NO]];
          if (timestamp == nil)
@@ -1805,24 +5889,44 @@ NSString *PARBlobsDirectoryName = @"Blobs";
          }
          request.fetchLimit = 1;
          request.returnsObjectsAsFaults = NO;
-         NSArray *results = [moc executeFetchRequest:request error:&fetchError];
-         if (!results)
-         {
-             ErrorLog(@"Error fetching logs for store:\npath: %@\nerror: %@", [self.storeURL path], fetchError);
-             return;
-         }
          
-         if ([results count] > 0)
+         // the values are read right away, because the database of a group could be detached while querying the next groups
+         __block NSNumber *latestTimestamp = nil;
+         __block NSData *latestBlob = nil;
+         __block NSManagedObjectID *latestLogID = nil;
+         __block NSString *latestLogPath = nil;
+         [self enumerateDatabaseGroupsUsingBlock:^(NSArray *stores)
+          {
+              NSError *fetchError = nil;
+              request.affectedStores = stores;
+              NSArray *results = [moc executeFetchRequest:request error:&fetchError];
+              if (!results)
+              {
+                  ErrorLog(@"Error fetching logs for store:\npath: %@\nerror: %@", [self.storeURL path], fetchError);
+                  return;
+              }
+              NSManagedObject *log = results.lastObject;
+              NSNumber *logTimestamp = [log valueForKey:TimestampAttributeName];
+              if (log != nil && (latestTimestamp == nil || [logTimestamp compare:latestTimestamp] == NSOrderedDescending))
+              {
+                  latestTimestamp = logTimestamp;
+                  latestBlob = [log valueForKey:BlobAttributeName];
+                  latestLogID = log.objectID;
+                  latestLogPath = log.objectID.persistentStore.URL.path;
+              }
+          }];
+         
+         if (latestLogID != nil)
          {
-             NSManagedObject *latestLog = results.lastObject;
-             NSData *blob = [latestLog valueForKey:BlobAttributeName];
+             foundLog = YES;
+             NSData *blob = latestBlob;
              // an empty data blob acts as a deletion/nil-value marker
              if (!blob || blob.length > 0) {
                  NSError *plistError = nil;
                  plist = [self propertyListFromData:blob error:&plistError];
                  if (plist == nil)
                  {
-                     ErrorLog(@"Error deserializing 'blob' data in Logs database:\nrow: %@\nfile: %@\nerror: %@", latestLog.objectID, latestLog.objectID.persistentStore.URL.path, plistError);
+                     ErrorLog(@"Error deserializing 'blob' data in Logs database:\nrow: %@\nfile: %@\nerror: %@", latestLogID, latestLogPath, plistError);
                  }
              }
          }
@@ -1830,6 +5934,16 @@ NSString *PARBlobsDirectoryName = @"Blobs";
          [self closeDatabaseSoon];
      }];
     
+    // the sealed base layer predates all the logs
+    if (!foundLog)
+    {
+        [self.memoryQueue dispatchSynchronously:^
+         {
+             if (self._sealedFile != nil)
+                 plist = [self propertyListFromData:[self._sealedFile blobForKey:key] error:NULL];
+         }];
+    }
+    
     return plist;
 }
 
@@ -1924,11 +6038,27 @@ NSString *PARBlobsDirectoryName = @"Blobs";
 
 - (void)mergeStore:(PARStore *)mergedStore unsafeDeviceIdentifiers:(NSArray *)unsafeDeviceIdentifiers completionHandler:(void(^)(NSError*))completionHandler
 {
+    [self mergeStore:mergedStore unsafeDeviceIdentifiers:unsafeDeviceIdentifiers cancellationToken:nil completionHandler:completionHandler];
+}
+
+- (void)mergeStore:(PARStore *)mergedStore unsafeDeviceIdentifiers:(NSArray *)unsafeDeviceIdentifiers cancellationToken:(PARCancellationToken *)cancellationToken completionHandler:(void(^)(NSError*))completionHandler
+{
+    PARCancellationToken *operationToken = [self operationTokenWithCancellationToken:cancellationToken];
     if (completionHandler == nil)
     {
         completionHandler = ^(NSError *error){ };
     }
     
+    NSError *followerError = nil;
+    if ([self isFollowerRefusingWriteWithSelector:_cmd error:&followerError])
+    {
+        [[PARDispatchQueue globalDispatchQueue] dispatchAsynchronously:^
+        {
+            completionHandler(followerError);
+        }];
+        return;
+    }
+    
     if (![self.deviceIdentifier isEqualToString:mergedStore.deviceIdentifier])
     {
         NSError *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"merging is only valid for stores with the same device identifier:\nmerged store: %@\ndestination store: %@", mergedStore, self] underlyingError:nil];
@@ -1953,6 +6083,11 @@ NSString *PARBlobsDirectoryName = @"Blobs";
     [self.databaseQueue dispatchAsynchronously:^
     {
         __block NSError *mergeError = nil;
+        if (operationToken.cancelled)
+        {
+            completionHandler([self cancellationErrorWithSelector:@selector(mergeStore:unsafeDeviceIdentifiers:cancellationToken:completionHandler:)]);
+            return;
+        }
         [mergedStore.databaseQueue dispatchSynchronously:^
         {
             // merge blob files
@@ -1971,18 +6106,30 @@ NSString *PARBlobsDirectoryName = @"Blobs";
             }
             for (NSString *subpath in mergedSubpaths)
             {
+                // each blob is copied atomically
+                if (operationToken.cancelled)
+                {
+                    mergeError = [self cancellationErrorWithSelector:@selector(mergeStore:unsafeDeviceIdentifiers:cancellationToken:completionHandler:)];
+                    break;
+                }
+                
+                // packs are merged record by record below
+                if ([subpath.pathComponents.firstObject isEqualToString:PARBlobPacksDirectoryName])
+                {
+                    continue;
+                }
                 NSString *mergedPath = [mergedBlobsPath stringByAppendingPathComponent:subpath];
                 NSString *targetPath = [targetBlobsPath stringByAppendingPathComponent:subpath];
+                NSDate *mergedModificationDate = [[NSFileManager defaultManager] attributesOfItemAtPath:mergedPath error:&error][NSFileModificationDate];
+                if (mergedModificationDate == nil)
+                {
+                    mergeError = error;
+                    continue;
+                }
                 
                 // newer or equal modification date prevails in case of conflict
                 if ([targetSubpaths containsObject:subpath])
                 {
-                    NSDate *mergedModificationDate = [[NSFileManager defaultManager] attributesOfItemAtPath:mergedPath error:&error][NSFileModificationDate];
-                    if (mergedModificationDate == nil)
-                    {
-                        mergeError = error;
-                        continue;
-                    }
                     NSDate *targetModificationDate = [[NSFileManager defaultManager] attributesOfItemAtPath:targetPath error:&error][NSFileModificationDate];
                     if (targetModificationDate == nil)
                     {
@@ -2011,6 +6158,20 @@ NSString *PARBlobsDirectoryName = @"Blobs";
                     continue;
                 }
                 [[NSFileManager defaultManager] removeItemAtPath:tempTargetPath error:NULL];
+                
+                // an older packed blob at that path would hide the copied file, as when writing a blob
+                [self deletePackedBlobAtPath:subpath olderThanDate:mergedModificationDate];
+            }
+            
+            // packed blobs more recent in the merged store are appended to the pack of the device
+            if (!operationToken.cancelled)
+            {
+                [self.blobQueue dispatchSynchronously:^
+                {
+                    NSError *packError = [self _mergeBlobPacksAtPath:[mergedStore blobPacksDirectoryPath] blobCount:NULL byteCount:NULL dryRun:NO];
+                    if (packError != nil)
+                        mergeError = packError;
+                }];
             }
 
             // closing the database while we go through the different stores
@@ -2025,6 +6186,24 @@ NSString *PARBlobsDirectoryName = @"Blobs";
             // merge logs for each device identifier
             for (NSString *deviceIdentifier in allDeviceIdentifiers)
             {
+                // each device database is replaced as a whole, so the merge can stop between devices
+                if (operationToken.cancelled)
+                {
+                    mergeError = [self cancellationErrorWithSelector:@selector(mergeStore:unsafeDeviceIdentifiers:cancellationToken:completionHandler:)];
+                    break;
+                }
+                
+                // a device with the same rows in both stores has nothing to merge, and its rows are not read
+                if (self.summariesEnabled)
+                {
+                    NSData *mergedHash = [mergedStore summaryForDeviceIdentifier:deviceIdentifier].rootHash;
+                    NSData *hash = [self summaryForDeviceIdentifier:deviceIdentifier].rootHash;
+                    if (mergedHash != nil && [mergedHash isEqualToData:hash])
+                    {
+                        continue;
+                    }
+                }
+                
                 NSArray *logs1 = [mergedStore _sortedLogRepresentationsFromDeviceIdentifier:deviceIdentifier];
                 NSArray *logs2 = [self _sortedLogRepresentationsFromDeviceIdentifier:deviceIdentifier];
 
@@ -2074,7 +6253,8 @@ NSString *PARBlobsDirectoryName = @"Blobs";
             [self _tearDownMemory];
             
             // we can safely call `_load` because (1) we are within the database queue, and (2) we are not using a dispatch_sync from the memory queue into the database queue (this would lead to deadlock, though in fact it is prevented at runtime, see safety check in `loadNow`)
-            [self _load];
+            // the merged logs can be older than the shared cache, which is thus not used
+            [self _loadUsingSharedCache:NO];
             
             // adjust the memory cache
             [currentMemoryKeyTimestamps enumerateKeysAndObjectsUsingBlock:^(NSString *key, NSNumber *memoryTimestamp, BOOL *stop)
@@ -2097,6 +6277,204 @@ NSString *PARBlobsDirectoryName = @"Blobs";
     }];
 }
 
+- (void)estimateMergeOfStore:(PARStore *)mergedStore unsafeDeviceIdentifiers:(NSArray *)unsafeDeviceIdentifiers completionHandler:(void(^)(PARMergeEstimate *estimate, NSError *error))completionHandler
+{
+    if (completionHandler == nil)
+    {
+        return;
+    }
+    
+    if (![self.deviceIdentifier isEqualToString:mergedStore.deviceIdentifier])
+    {
+        NSError *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"merging is only valid for stores with the same device identifier:\nmerged store: %@\ndestination store: %@", mergedStore, self] underlyingError:nil];
+        [[PARDispatchQueue globalDispatchQueue] dispatchAsynchronously:^
+        {
+            completionHandler(nil, error);
+        }];
+        return;
+    }
+    
+    if ([unsafeDeviceIdentifiers containsObject:self.deviceIdentifier])
+    {
+        NSError *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"merging is only valid if the unsafe device identifiers do not include the local device identifier:\nunsafe devices: %@\nmerged store: %@\ndestination store: %@", unsafeDeviceIdentifiers, mergedStore, self] underlyingError:nil];
+        [[PARDispatchQueue globalDispatchQueue] dispatchAsynchronously:^
+        {
+            completionHandler(nil, error);
+        }];
+        return;
+    }
+    
+    // separate read-only connections, so the store queues are not blocked during the estimate
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^
+    {
+        NSMutableDictionary *addedRowCounts = [NSMutableDictionary dictionary];
+        NSMutableDictionary *virtualRowCounts = [NSMutableDictionary dictionary];
+        NSMutableArray *identicalDeviceIdentifiers = [NSMutableArray array];
+        
+        // same devices as the merge
+        NSMutableSet *allDeviceIdentifiers = [NSMutableSet setWithArray:[mergedStore foreignDeviceIdentifiers]];
+        [allDeviceIdentifiers addObjectsFromArray:[self foreignDeviceIdentifiers]];
+        [allDeviceIdentifiers addObject:self.deviceIdentifier];
+        for (NSString *deviceIdentifier in allDeviceIdentifiers)
+        {
+            // with up-to-date summaries, only the ranges that differ are read
+            NSArray *timestampRanges = nil;
+            if (self.summariesEnabled && mergedStore.summariesEnabled)
+            {
+                _PARMerkleSummary *mergedSummary = [mergedStore summaryForDeviceIdentifier:deviceIdentifier rebuildingIfNeeded:NO];
+                _PARMerkleSummary *summary = [self summaryForDeviceIdentifier:deviceIdentifier rebuildingIfNeeded:NO];
+                if (mergedSummary != nil && summary != nil)
+                {
+                    if ([mergedSummary.rootHash isEqualToData:summary.rootHash])
+                    {
+                        [identicalDeviceIdentifiers addObject:deviceIdentifier];
+                        continue;
+                    }
+                    timestampRanges = [summary timestampRangesDifferingFromSummary:mergedSummary];
+                }
+            }
+            
+            // rows that cannot be read would make the estimate wrong
+            NSError *rowsError = nil;
+            NSSet *rows = [self _rowIdentifiersFromDeviceIdentifier:deviceIdentifier timestampRanges:timestampRanges error:&rowsError];
+            NSMutableSet *missingRows = [[mergedStore _rowIdentifiersFromDeviceIdentifier:deviceIdentifier timestampRanges:timestampRanges error:&rowsError] mutableCopy];
+            if (rows == nil || missingRows == nil)
+            {
+                completionHandler(nil, rowsError);
+                return;
+            }
+            [missingRows minusSet:rows];
+            if (missingRows.count == 0)
+            {
+                continue;
+            }
+            
+            // unsafe devices: the missing rows go to the virtual device, with the rows it already has in both stores, minus the ones now in the device
+            if ([unsafeDeviceIdentifiers containsObject:deviceIdentifier])
+            {
+                NSString *virtualDeviceIdentifier = [NSString stringWithFormat:@"%@|%@", self.deviceIdentifier, deviceIdentifier];
+                NSSet *mergedVirtualRows = [mergedStore _rowIdentifiersFromDeviceIdentifier:virtualDeviceIdentifier timestampRanges:nil error:&rowsError];
+                NSSet *virtualRows = [self _rowIdentifiersFromDeviceIdentifier:virtualDeviceIdentifier timestampRanges:nil error:&rowsError];
+                if (timestampRanges != nil)
+                    rows = [self _rowIdentifiersFromDeviceIdentifier:deviceIdentifier timestampRanges:nil error:&rowsError];
+                if (mergedVirtualRows == nil || virtualRows == nil || rows == nil)
+                {
+                    completionHandler(nil, rowsError);
+                    return;
+                }
+                [missingRows unionSet:mergedVirtualRows];
+                [missingRows unionSet:virtualRows];
+                [missingRows minusSet:rows];
+                virtualRowCounts[deviceIdentifier] = @(missingRows.count);
+            }
+            else
+            {
+                addedRowCounts[deviceIdentifier] = @(missingRows.count);
+            }
+        }
+        
+        // blob files copied by the merge: missing, or older in the destination
+        NSUInteger blobFileCount = 0;
+        unsigned long long blobByteCount = 0;
+        NSString *mergedBlobsPath = mergedStore.blobDirectoryURL.path;
+        NSString *targetBlobsPath = self.blobDirectoryURL.path;
+        NSDirectoryEnumerator *enumerator = [[NSFileManager defaultManager] enumeratorAtPath:mergedBlobsPath];
+        for (NSString *subpath in enumerator)
+        {
+            NSDictionary *mergedAttributes = enumerator.fileAttributes;
+            if ([subpath isEqualToString:PARBlobPacksDirectoryName])
+            {
+                [enumerator skipDescendants];
+                continue;
+            }
+            if (![mergedAttributes[NSFileType] isEqualToString:NSFileTypeRegular])
+            {
+                continue;
+            }
+            NSDictionary *targetAttributes = [[NSFileManager defaultManager] attributesOfItemAtPath:[targetBlobsPath stringByAppendingPathComponent:subpath] error:NULL];
+            if (targetAttributes != nil && [targetAttributes[NSFileModificationDate] compare:mergedAttributes[NSFileModificationDate]] != NSOrderedAscending)
+            {
+                continue;
+            }
+            blobFileCount++;
+            blobByteCount += [mergedAttributes[NSFileSize] unsignedLongLongValue];
+        }
+        NSUInteger packedBlobCount = 0;
+        unsigned long long packedByteCount = 0;
+        [self _mergeBlobPacksAtPath:[mergedStore blobPacksDirectoryPath] blobCount:&packedBlobCount byteCount:&packedByteCount dryRun:YES];
+        blobFileCount += packedBlobCount;
+        blobByteCount += packedByteCount;
+        
+        PARMergeEstimate *estimate = [[PARMergeEstimate alloc] init];
+        estimate.addedRowCountsByDeviceIdentifier = addedRowCounts;
+        estimate.virtualRowCountsByDeviceIdentifier = virtualRowCounts;
+        estimate.identicalDeviceIdentifiers = identicalDeviceIdentifiers;
+        estimate.blobFileCount = blobFileCount;
+        estimate.blobByteCount = blobByteCount;
+        completionHandler(estimate, nil);
+    });
+}
+
+// timestamps, keys and parent timestamps of the rows of a device, which are all indexed, as @[timestamp, key, parent timestamp or NSNull]; the blobs are not read
+// `timestampRanges` are inclusive ranges as returned by the summaries, or nil for all the rows; returns nil if the database cannot be read
+- (NSSet *)_rowIdentifiersFromDeviceIdentifier:(NSString *)deviceIdentifier timestampRanges:(NSArray *)timestampRanges error:(NSError **)error
+{
+    NSString *directoryPath = [self directoryPathForDeviceIdentifier:deviceIdentifier];
+    if (directoryPath == nil || (timestampRanges != nil && timestampRanges.count == 0) || ![[NSFileManager defaultManager] fileExistsAtPath:[directoryPath stringByAppendingPathComponent:PARDatabaseFileName]])
+    {
+        return [NSSet set];
+    }
+    NSPersistentStoreCoordinator *psc = [[NSPersistentStoreCoordinator alloc] initWithManagedObjectModel:[PARStore managedObjectModel]];
+    NSError *psError = nil;
+    NSPersistentStore *store = [self addPersistentStoreWithCoordinator:psc dirPath:directoryPath readOnly:YES error:&psError];
+    if (store == nil)
+    {
+        ErrorLog(@"Could not open database for device '%@' to estimate a merge: %@", deviceIdentifier, psError);
+        if (error != NULL)
+            *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Could not open database for device '%@' to estimate a merge at path: %@", deviceIdentifier, directoryPath] underlyingError:psError];
+        return nil;
+    }
+    NSManagedObjectContext *moc = [[NSManagedObjectContext alloc] initWithConcurrencyType:NSPrivateQueueConcurrencyType];
+    [moc setPersistentStoreCoordinator:psc];
+    [moc setUndoManager:nil];
+    
+    __block NSMutableSet *rows = [NSMutableSet set];
+    __block NSError *localError = nil;
+    [moc performBlockAndWait:^
+    {
+        NSFetchRequest *request = [NSFetchRequest fetchRequestWithEntityName:LogEntityName];
+        request.resultType = NSDictionaryResultType;
+        request.propertiesToFetch = @[TimestampAttributeName, KeyAttributeName, ParentTimestampAttributeName];
+        if (timestampRanges != nil)
+        {
+            NSMutableArray *rangePredicates = [NSMutableArray arrayWithCapacity:timestampRanges.count];
+            for (NSArray *range in timestampRanges)
+                [rangePredicates addObject:[NSPredicate predicateWithFormat:@"%K >= %@ AND %K <= %@", TimestampAttributeName, range[0], TimestampAttributeName, range[1]]];
+            request.predicate = [NSCompoundPredicate orPredicateWithSubpredicates:rangePredicates];
+        }
+        NSError *fetchError = nil;
+        NSArray *logs = [moc executeFetchRequest:request error:&fetchError];
+        if (logs == nil)
+        {
+            ErrorLog(@"Could not fetch rows for device '%@' to estimate a merge: %@", deviceIdentifier, fetchError);
+            localError = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Could not fetch rows for device '%@' to estimate a merge at path: %@", deviceIdentifier, directoryPath] underlyingError:fetchError];
+            rows = nil;
+            return;
+        }
+        for (NSDictionary *log in logs)
+        {
+            NSNumber *timestamp = log[TimestampAttributeName];
+            NSString *key = log[KeyAttributeName];
+            if (timestamp != nil && key != nil)
+                [rows addObject:@[timestamp, key, log[ParentTimestampAttributeName] ?: [NSNull null]]];
+        }
+    }];
+    [psc removePersistentStore:store error:NULL];
+    if (rows == nil && error != NULL)
+        *error = localError;
+    return rows;
+}
+
 - (NSArray *)_sortedLogRepresentationsFromDeviceIdentifier:(NSString *)deviceIdentifier
 {
     // moc
@@ -2166,6 +6544,7 @@ NSString *PARBlobsDirectoryName = @"Blobs";
         }
     }
     
+    _PARMerkleSummary *summary = (self.summariesEnabled && logRepresentations.count > 0) ? [_PARMerkleSummary summaryWithLogs:logRepresentations] : nil;
     if (logRepresentations.count > 0)
     {
         // create device directory if needed
@@ -2200,6 +6579,9 @@ NSString *PARBlobsDirectoryName = @"Blobs";
             [newLog setValuesForKeysWithDictionary:rep];
         }
         
+        // the summary is saved in the metadata in the same transaction as the rows
+        [self setSummary:summary inMetadataForStore:ps];
+        
         // save new moc
         NSError *saveError = nil;
         BOOL saveSuccess = [moc save:&saveError];
@@ -2215,6 +6597,20 @@ NSString *PARBlobsDirectoryName = @"Blobs";
         moc = nil;
     }
     
+    // checksums of the new rows replace the old ones
+    NSString *checksumsPath = [[self directoryPathForDeviceIdentifier:deviceIdentifier] stringByAppendingPathComponent:PARChecksumsFileName];
+    if (self.checksumsEnabled && logRepresentations.count > 0)
+        [_PARChecksumFile writeRecords:[self checksumRecordsForLogs:logRepresentations] toPath:checksumsPath append:NO error:NULL];
+    else
+        [[NSFileManager defaultManager] removeItemAtPath:checksumsPath error:NULL];
+    
+    // same for the summary
+    NSString *summaryPath = [[self directoryPathForDeviceIdentifier:deviceIdentifier] stringByAppendingPathComponent:PARSummaryFileName];
+    if (summary != nil)
+        [summary writeToPath:summaryPath error:NULL];
+    else
+        [[NSFileManager defaultManager] removeItemAtPath:summaryPath error:NULL];
+    
     // delete old db
     [[NSFileManager defaultManager] removeItemAtPath:tempPath error:NULL];
     
@@ -2374,13 +6770,110 @@ NSString *PARBlobsDirectoryName = @"Blobs";
             pos1 ++;
         }
     }
-    // we ran out of logs in logs2 --> add every remaining log in logs1
-    if (pos1 < max1)
+    // we ran out of logs in logs2 --> add every remaining log in logs1
+    if (pos1 < max1)
+    {
+        [finalLogs addObjectsFromArray:[logs1 subarrayWithRange:NSMakeRange(pos1, max1 - pos1)]];
+    }
+    
+    return finalLogs.copy;
+}
+
+
+#pragma mark - Archiving
+
+- (void)archiveDevicesInactiveForTimeInterval:(NSTimeInterval)interval unsafeDeviceIdentifiers:(NSArray *)unsafeDeviceIdentifiers completionHandler:(void(^)(NSArray *archivedDeviceIdentifiers, NSError *error))completionHandler
+{
+    if (completionHandler == nil)
+    {
+        completionHandler = ^(NSArray *archivedDeviceIdentifiers, NSError *error){ };
+    }
+    
+    NSError *followerError = nil;
+    if ([self isFollowerRefusingWriteWithSelector:_cmd error:&followerError])
+    {
+        [[PARDispatchQueue globalDispatchQueue] dispatchAsynchronously:^
+         {
+             completionHandler(@[], followerError);
+         }];
+        return;
+    }
+    
+    [self.databaseQueue dispatchAsynchronously:^
+     {
+         NSError *archiveError = nil;
+         NSArray *archivedDeviceIdentifiers = [self _archiveDevicesInactiveForTimeInterval:interval unsafeDeviceIdentifiers:unsafeDeviceIdentifiers error:&archiveError];
+         completionHandler(archivedDeviceIdentifiers ?: @[], archiveError);
+     }];
+}
+
+- (NSArray *)_archiveDevicesInactiveForTimeInterval:(NSTimeInterval)interval unsafeDeviceIdentifiers:(NSArray *)unsafeDeviceIdentifiers error:(NSError **)error
+{
+    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class], NSStringFromSelector(_cmd));
+    
+    if (self._inMemory || [self deleted])
+    {
+        return @[];
+    }
+    
+    // the databases are replaced below
+    [self _closeDatabase];
+    
+    // same rules as merging: the local device and the unsafe devices, which could still be writing, are never archived
+    int64_t timestampLimit = [[PARStore timestampNow] longLongValue] - (int64_t)(interval * 1000 * 1000);
+    NSArray *archiveLogs = [self _sortedLogRepresentationsFromDeviceIdentifier:PARArchiveDeviceIdentifier];
+    if (archiveLogs == nil)
+    {
+        if (error != NULL)
+            *error = [NSError errorWithObject:self code:__LINE__ localizedDescription:[NSString stringWithFormat:@"Could not read the archive of store at path: %@", self.storeURL.path] underlyingError:nil];
+        return nil;
+    }
+    NSMutableArray *archivedDeviceIdentifiers = [NSMutableArray array];
+    for (NSString *deviceIdentifier in [self foreignDeviceIdentifiers])
+    {
+        if ([deviceIdentifier isEqualToString:PARArchiveDeviceIdentifier] || [unsafeDeviceIdentifiers containsObject:deviceIdentifier])
+            continue;
+        
+        NSArray *logs = [self _sortedLogRepresentationsFromDeviceIdentifier:deviceIdentifier];
+        NSNumber *latestTimestamp = [logs.lastObject objectForKey:TimestampAttributeName];
+        if (logs == nil || (latestTimestamp != nil && latestTimestamp.longLongValue > timestampLimit))
+            continue;
+        
+        archiveLogs = [self _unionOfLogRepresentations:archiveLogs andLogRepresentations:logs];
+        [archivedDeviceIdentifiers addObject:deviceIdentifier];
+    }
+    if (archivedDeviceIdentifiers.count == 0)
     {
-        [finalLogs addObjectsFromArray:[logs1 subarrayWithRange:NSMakeRange(pos1, max1 - pos1)]];
+        return @[];
     }
     
-    return finalLogs.copy;
+    // the archive is complete before removing any device, so that other clients always find every log in one of the databases
+    NSError *replaceError = [self _replacePersistentStoreWithDeviceIdentifier:PARArchiveDeviceIdentifier logRepresentations:archiveLogs];
+    if (replaceError != nil)
+    {
+        if (error != NULL)
+            *error = replaceError;
+        return nil;
+    }
+    
+    // the archive takes over the oldest of the timestamps already synced, so that the next sync does not miss any log
+    NSNumber *archiveTimestamp = self.databaseTimestamps[PARArchiveDeviceIdentifier];
+    for (NSString *deviceIdentifier in archivedDeviceIdentifiers)
+    {
+        NSNumber *timestamp = self.databaseTimestamps[deviceIdentifier];
+        if (timestamp != nil && (archiveTimestamp == nil || [timestamp compare:archiveTimestamp] == NSOrderedAscending))
+            archiveTimestamp = timestamp;
+        [self.databaseTimestamps removeObjectForKey:deviceIdentifier];
+        
+        NSError *removeError = nil;
+        if (![[NSFileManager defaultManager] removeItemAtPath:[self directoryPathForDeviceIdentifier:deviceIdentifier] error:&removeError])
+            ErrorLog(@"Could not remove archived device '%@' from store at path '%@': %@", deviceIdentifier, self.storeURL.path, removeError);
+    }
+    if (archiveTimestamp != nil && [self loaded])
+        self.databaseTimestamps[PARArchiveDeviceIdentifier] = archiveTimestamp;
+    [self invalidateReadonlyDirectoryPaths];
+    
+    return archivedDeviceIdentifiers.copy;
 }
 
 
@@ -2464,6 +6957,17 @@ NSString *PARBlobsDirectoryName = @"Blobs";
     }
 
     NSMutableDictionary *timestamps = [NSMutableDictionary dictionary];
+    if (self._inMemory)
+    {
+        [self.memoryQueue dispatchSynchronously:^
+         {
+             timestamps[self.deviceIdentifier] = [PARStore timestampForDistantPast];
+             for (NSString *deviceIdentifier in self._memoryLogs.deviceIdentifiers)
+                 timestamps[deviceIdentifier] = [self._memoryLogs mostRecentTimestampForDeviceIdentifier:deviceIdentifier];
+         }];
+        return [NSDictionary dictionaryWithDictionary:timestamps];
+    }
+    
     [self.databaseQueue dispatchSynchronously:^
      {
          NSManagedObjectContext *moc = [self managedObjectContext];
@@ -2472,16 +6976,17 @@ NSString *PARBlobsDirectoryName = @"Blobs";
              return;
          }
 
+         // with a limit on open foreign databases, only some of the databases are attached, but the timestamps are kept for all of them
+         [timestamps addEntriesFromDictionary:self.databaseTimestamps];
          NSArray *allStores = [moc.persistentStoreCoordinator persistentStores];
          for (NSPersistentStore *store in allStores)
          {
              NSString *deviceIdentifier = [self deviceIdentifierForDatabasePath:store.URL.path];
-             if (deviceIdentifier == nil)
+             if (deviceIdentifier == nil || timestamps[deviceIdentifier] != nil)
              {
                  continue;
              }
-             NSNumber *timestamp = self.databaseTimestamps[deviceIdentifier] ?: [PARStore timestampForDistantPast];
-             timestamps[deviceIdentifier] = timestamp;
+             timestamps[deviceIdentifier] = [PARStore timestampForDistantPast];
          }
          
          [self closeDatabaseSoon];
@@ -2503,6 +7008,11 @@ NSString *PARBlobsDirectoryName = @"Blobs";
     }
 
     __block NSNumber *timestamp = nil;
+    if (self._inMemory)
+    {
+        [self.memoryQueue dispatchSynchronously:^{ timestamp = [self._memoryLogs mostRecentTimestampForDeviceIdentifier:deviceIdentifier]; }];
+        return timestamp;
+    }
     [self.databaseQueue dispatchSynchronously:^
     {
         timestamp = self.databaseTimestamps[deviceIdentifier];
@@ -2542,13 +7052,18 @@ NSString *PARBlobsDirectoryName = @"Blobs";
 }
 
 - (NSArray *)fetchChangesSinceTimestamp:(nullable NSNumber *)timestamp forDeviceIdentifier:(nullable NSString *)deviceIdentifier
+{
+    return [self fetchChangesSinceTimestamp:timestamp forDeviceIdentifier:deviceIdentifier cancellationToken:nil];
+}
+
+- (NSArray *)fetchChangesSinceTimestamp:(nullable NSNumber *)timestamp forDeviceIdentifier:(nullable NSString *)deviceIdentifier cancellationToken:(nullable PARCancellationToken *)cancellationToken
 {
     NSPredicate *predicate = [NSPredicate predicateWithValue:YES];
     if (timestamp != nil)
     {
         predicate = [NSPredicate predicateWithFormat:@"%K > %@", TimestampAttributeName, timestamp];
     }
-    return [self fetchChangesMatchingPredicate:predicate forDeviceIdentifier:deviceIdentifier];
+    return [self fetchChangesMatchingPredicate:predicate forDeviceIdentifier:deviceIdentifier cancellationToken:cancellationToken];
 }
 
 - (NSArray *)fetchChangesFromTimestamp:(nullable NSNumber *)firstTimestamp toTimestamp:(nullable NSNumber *)lastTimestamp forDeviceIdentifier:(nullable NSString *)deviceIdentifier
@@ -2631,6 +7146,12 @@ NSString *PARBlobsDirectoryName = @"Blobs";
 }
 
 - (NSArray *)fetchChangesMatchingPredicate:(NSPredicate *)predicate forDeviceIdentifier:(nullable NSString *)fetchDeviceIdentifier
+{
+    return [self fetchChangesMatchingPredicate:predicate forDeviceIdentifier:fetchDeviceIdentifier cancellationToken:nil];
+}
+
+// returns nil if cancelled
+- (NSArray *)fetchChangesMatchingPredicate:(NSPredicate *)predicate forDeviceIdentifier:(nullable NSString *)fetchDeviceIdentifier cancellationToken:(PARCancellationToken *)cancellationToken
 {
     if ([self.memoryQueue isInCurrentQueueStack])
     {
@@ -2638,9 +7159,22 @@ NSString *PARBlobsDirectoryName = @"Blobs";
         return nil;
     }
     
+    PARCancellationToken *operationToken = [self operationTokenWithCancellationToken:cancellationToken];
+    if (self._inMemory)
+    {
+        __block NSArray *memoryChanges = nil;
+        [self.memoryQueue dispatchSynchronously:^{ memoryChanges = [self._memoryLogs changesMatchingPredicate:predicate forDeviceIdentifier:fetchDeviceIdentifier]; }];
+        return operationToken.cancelled ? nil : memoryChanges;
+    }
+    
     NSMutableArray *changes = [NSMutableArray array];
     [self.databaseQueue dispatchSynchronously:^
      {
+         if (operationToken.cancelled)
+         {
+             return;
+         }
+         
          NSManagedObjectContext *moc = [self managedObjectContext];
          if (moc == nil)
          {
@@ -2648,29 +7182,34 @@ NSString *PARBlobsDirectoryName = @"Blobs";
          }
          
          // From the documentation for `includesPendingChanges`: "A value of YES is not supported in conjunction with the result type NSDictionaryResultType, including calculation of aggregate results (such as max and min). For dictionaries, the array returned from the fetch reflects the current state in the persistent store, and does not take into account any pending changes, insertions, or deletions in the context."
-         // this means we need to save pending changes first to make sure they show up in the query
-         [self _save:NULL];
+         // this means the local rows not saved yet are merged from the overlay, rather than saved first, which would commit to disk on every read
+         NSArray *pendingLogs = @[];
+         if (fetchDeviceIdentifier == nil || [fetchDeviceIdentifier isEqualToString:self.deviceIdentifier])
+             pendingLogs = [self.pendingLogs filteredArrayUsingPredicate:predicate];
+         
+         // with all the databases open, the rows of each database are read in the order of the timestamp index and merged, instead of sorting the union of all the databases
+         if (fetchDeviceIdentifier == nil && self.maximumOpenForeignDatabaseCount == 0)
+         {
+             __block NSUInteger count = 0;
+             [self _enumerateChangesMatchingPredicate:predicate inDatabases:moc.persistentStoreCoordinator.persistentStores pendingLogs:pendingLogs usingBlock:^(PARChange *change, BOOL *stop)
+              {
+                  [changes addObject:change];
+                  if (++count % 1000 == 0 && operationToken.cancelled)
+                      *stop = YES;
+              }];
+             [self closeDatabaseSoon];
+             return;
+         }
          
          // fetch Log rows in timestamp order, starting at `timestampLimit`
-         NSError *errorLogs = nil;
          NSFetchRequest *logsRequest = [NSFetchRequest fetchRequestWithEntityName:LogEntityName];
          
          // Determine affected stores, based on device identifiers
          if (fetchDeviceIdentifier == nil) {
              logsRequest.affectedStores = nil; // All stores
          }
-         else if ([fetchDeviceIdentifier isEqualToString:self.deviceIdentifier])
-         {
-             logsRequest.affectedStores = @[self.readwriteDatabase]; // Local store
-         }
          else {
-             // Filter stores to find one that matches the device.
-             NSPredicate *predicate = [NSPredicate predicateWithBlock:^(NSPersistentStore *store, NSDictionary *bindings) {
-                 NSString *storeDeviceIdentifier = [self deviceIdentifierForDatabasePath:store.URL.path];
-                 return [storeDeviceIdentifier isEqualToString:fetchDeviceIdentifier];
-             }];
-             NSArray *eligibleStores = [self.readonlyDatabases filteredArrayUsingPredicate:predicate];
-             logsRequest.affectedStores = eligibleStores;
+             logsRequest.affectedStores = [self historyDatabasesForDeviceIdentifier:fetchDeviceIdentifier];
          }
          
          // Predicate
@@ -2680,27 +7219,254 @@ NSString *PARBlobsDirectoryName = @"Blobs";
          logsRequest.sortDescriptors = @[[NSSortDescriptor sortDescriptorWithKey:TimestampAttributeName ascending:YES]];
          logsRequest.resultType = NSDictionaryResultType;
          
-         // Execute the fetch
-         NSArray *logs = [moc executeFetchRequest:logsRequest error:&errorLogs];
-         if (!logs)
+         // Execute the fetch, in groups of databases if they cannot all be open at once
+         void (^fetchBlock)(NSArray *) = ^(NSArray *stores)
          {
-             ErrorLog(@"Error fetching logs for store at path '%@' because of error: %@", [self.storeURL path], errorLogs);
-             return;
+             if (operationToken.cancelled)
+             {
+                 return;
+             }
+             NSError *errorLogs = nil;
+             if (stores != nil)
+                 logsRequest.affectedStores = stores;
+             NSArray *logs = [moc executeFetchRequest:logsRequest error:&errorLogs];
+             if (!logs)
+             {
+                 ErrorLog(@"Error fetching logs for store at path '%@' because of error: %@", [self.storeURL path], errorLogs);
+                 return;
+             }
+             
+             // Convert logs to changes, checking for cancellation between batches, since decoding the blobs is the slow part; the blobs of a batch are decoded in parallel
+             for (NSUInteger start = 0; start < logs.count; start += 1000)
+             {
+                 if (operationToken.cancelled)
+                 {
+                     return;
+                 }
+                 NSArray *batch = [logs subarrayWithRange:NSMakeRange(start, MIN(1000, logs.count - start))];
+                 NSArray *batchChanges = [PARDispatchQueue forkJoinMapObjects:batch priority:PARTaskPriorityDefault block:^id(NSDictionary *logDictionary, NSUInteger index)
+                 {
+                     return [self changeFromLogDictionary:logDictionary];
+                 }];
+                 for (id change in batchChanges)
+                 {
+                     if (change != [NSNull null]) [changes addObject:change];
+                 }
+             }
+         };
+         if (fetchDeviceIdentifier == nil)
+         {
+             [self enumerateDatabaseGroupsUsingBlock:fetchBlock];
+             if (self.maximumOpenForeignDatabaseCount > 0)
+                 [changes sortWithOptions:NSSortStable usingComparator:^NSComparisonResult(PARChange *change1, PARChange *change2) { return [change1.timestamp compare:change2.timestamp]; }];
+         }
+         else
+         {
+             fetchBlock(nil);
          }
          
-         // Convert logs to changes
-         for (NSDictionary *logDictionary in logs)
+         if (pendingLogs.count > 0 && !operationToken.cancelled)
          {
-             PARChange *change = [self changeFromLogDictionary:logDictionary];
-             if (change) [changes addObject:change];
+             for (NSDictionary *logDictionary in pendingLogs)
+             {
+                 PARChange *change = [self changeFromLogDictionary:logDictionary];
+                 if (change != nil) [changes addObject:change];
+             }
+             [changes sortWithOptions:NSSortStable usingComparator:^NSComparisonResult(PARChange *change1, PARChange *change2) { return [change1.timestamp compare:change2.timestamp]; }];
          }
          
          [self closeDatabaseSoon];
      }];
     
+    if (operationToken.cancelled)
+    {
+        DebugLog(@"History fetch cancelled for store at path '%@'", [self.storeURL path]);
+        return nil;
+    }
     return changes;
 }
 
+// returns NO if cancelled
+- (BOOL)enumerateChangesSinceTimestamp:(nullable NSNumber *)timestamp forDeviceIdentifier:(nullable NSString *)fetchDeviceIdentifier cancellationToken:(nullable PARCancellationToken *)cancellationToken usingBlock:(void(^)(PARChange *change, BOOL *stop))block
+{
+    if ([self.memoryQueue isInCurrentQueueStack])
+    {
+        ErrorLog(@"To avoid deadlocks, %@ should not be called within a transaction. Bailing out.", NSStringFromSelector(_cmd));
+        return NO;
+    }
+    
+    NSPredicate *predicate = [NSPredicate predicateWithValue:YES];
+    if (timestamp != nil)
+    {
+        predicate = [NSPredicate predicateWithFormat:@"%K > %@", TimestampAttributeName, timestamp];
+    }
+    
+    // when the databases cannot all be open at once, or the history is only in memory, the changes are fetched first
+    if (self._inMemory || (fetchDeviceIdentifier == nil && self.maximumOpenForeignDatabaseCount > 0))
+    {
+        NSArray *changes = [self fetchChangesMatchingPredicate:predicate forDeviceIdentifier:fetchDeviceIdentifier cancellationToken:cancellationToken];
+        if (changes == nil)
+        {
+            return NO;
+        }
+        [changes enumerateObjectsUsingBlock:^(PARChange *change, NSUInteger idx, BOOL *stop) { block(change, stop); }];
+        return YES;
+    }
+    
+    PARCancellationToken *operationToken = [self operationTokenWithCancellationToken:cancellationToken];
+    [self.databaseQueue dispatchSynchronously:^
+     {
+         if (operationToken.cancelled)
+         {
+             return;
+         }
+         
+         NSManagedObjectContext *moc = [self managedObjectContext];
+         if (moc == nil)
+         {
+             return;
+         }
+         
+         NSArray *pendingLogs = @[];
+         if (fetchDeviceIdentifier == nil || [fetchDeviceIdentifier isEqualToString:self.deviceIdentifier])
+             pendingLogs = [self.pendingLogs filteredArrayUsingPredicate:predicate];
+         NSArray *databases = (fetchDeviceIdentifier == nil) ? moc.persistentStoreCoordinator.persistentStores : [self historyDatabasesForDeviceIdentifier:fetchDeviceIdentifier];
+         
+         __block NSUInteger count = 0;
+         [self _enumerateChangesMatchingPredicate:predicate inDatabases:databases pendingLogs:pendingLogs usingBlock:^(PARChange *change, BOOL *stop)
+          {
+              if (++count % 1000 == 0 && operationToken.cancelled)
+              {
+                  *stop = YES;
+                  return;
+              }
+              block(change, stop);
+          }];
+         
+         [self closeDatabaseSoon];
+     }];
+    
+    if (operationToken.cancelled)
+    {
+        DebugLog(@"History enumeration cancelled for store at path '%@'", [self.storeURL path]);
+        return NO;
+    }
+    return YES;
+}
+
+// databases with the rows of a device, attached if needed
+- (NSArray *)historyDatabasesForDeviceIdentifier:(NSString *)deviceIdentifier
+{
+    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class], NSStringFromSelector(_cmd));
+    
+    if ([deviceIdentifier isEqualToString:self.deviceIdentifier])
+    {
+        return (self.readwriteDatabase != nil) ? @[self.readwriteDatabase] : @[]; // Local store
+    }
+    if (self.maximumOpenForeignDatabaseCount > 0)
+    {
+        return [self attachForeignDatabasesForDeviceIdentifiers:@[deviceIdentifier]];
+    }
+    
+    // Filter stores to find one that matches the device.
+    NSPredicate *predicate = [NSPredicate predicateWithBlock:^(NSPersistentStore *store, NSDictionary *bindings) {
+        NSString *storeDeviceIdentifier = [self deviceIdentifierForDatabasePath:store.URL.path];
+        return [storeDeviceIdentifier isEqualToString:deviceIdentifier];
+    }];
+    return [self.readonlyDatabases filteredArrayUsingPredicate:predicate];
+}
+
+#define PARChangeCursorPageSize 1000
+
+// pages start after the last row read, using the timestamp index: the rows with a timestamp at least the last one, skipping the ones with that timestamp already read
+// many rows can share a timestamp, e.g. after `setEntriesFromDictionary:` or an import, so the rows are also sorted by key and parent timestamp: the order of the rows with the same timestamp is then the same from one page to the next, and so are the rows skipped
+- (_PARChangeCursor *)changeCursorForDatabase:(NSPersistentStore *)database predicate:(NSPredicate *)predicate order:(NSUInteger)order
+{
+    NSManagedObjectContext *moc = self._managedObjectContext;
+    NSFetchRequest *request = [NSFetchRequest fetchRequestWithEntityName:LogEntityName];
+    request.affectedStores = @[database];
+    request.sortDescriptors = @[[NSSortDescriptor sortDescriptorWithKey:TimestampAttributeName ascending:YES],
+                                [NSSortDescriptor sortDescriptorWithKey:KeyAttributeName ascending:YES],
+                                [NSSortDescriptor sortDescriptorWithKey:ParentTimestampAttributeName ascending:YES]];
+    request.resultType = NSDictionaryResultType;
+    request.fetchLimit = PARChangeCursorPageSize;
+    
+    __block NSNumber *lastTimestamp = nil;
+    __block NSUInteger lastTimestampCount = 0;
+    __block BOOL exhausted = NO;
+    return [_PARChangeCursor cursorWithOrder:order pageLoader:^NSArray *
+    {
+        // pages where no row can be decoded are skipped
+        NSMutableArray *changes = [NSMutableArray array];
+        while (changes.count == 0 && !exhausted)
+        {
+            request.predicate = predicate;
+            if (lastTimestamp != nil)
+                request.predicate = [NSCompoundPredicate andPredicateWithSubpredicates:@[predicate, [NSPredicate predicateWithFormat:@"%K >= %@", TimestampAttributeName, lastTimestamp]]];
+            request.fetchOffset = lastTimestampCount;
+            NSError *fetchError = nil;
+            NSArray *logs = [moc executeFetchRequest:request error:&fetchError];
+            if (logs == nil)
+            {
+                ErrorLog(@"Error fetching logs from database at path '%@' because of error: %@", database.URL.path, fetchError);
+                exhausted = YES;
+                break;
+            }
+            exhausted = (logs.count < PARChangeCursorPageSize);
+            for (NSDictionary *logDictionary in logs)
+            {
+                NSNumber *timestamp = logDictionary[TimestampAttributeName];
+                if (lastTimestamp != nil && [timestamp isEqualToNumber:lastTimestamp])
+                {
+                    lastTimestampCount++;
+                }
+                else
+                {
+                    lastTimestamp = timestamp;
+                    lastTimestampCount = 1;
+                }
+            }
+            NSArray *pageChanges = [PARDispatchQueue forkJoinMapObjects:logs priority:PARTaskPriorityDefault block:^id(NSDictionary *logDictionary, NSUInteger index)
+            {
+                return [self changeFromLogDictionary:logDictionary];
+            }];
+            for (id change in pageChanges)
+            {
+                if (change != [NSNull null]) [changes addObject:change];
+            }
+        }
+        return changes;
+    }];
+}
+
+// merges the rows of the databases and the local rows not saved yet in timestamp order, holding a page of each database at a time; returns NO if stopped by the block
+- (BOOL)_enumerateChangesMatchingPredicate:(NSPredicate *)predicate inDatabases:(NSArray *)databases pendingLogs:(NSArray *)pendingLogs usingBlock:(void(^)(PARChange *change, BOOL *stop))block
+{
+    NSAssert([self.databaseQueue isInCurrentQueueStack], @"%@:%@ should only be called from within the database queue", [self class], NSStringFromSelector(_cmd));
+    
+    NSMutableArray *cursors = [NSMutableArray arrayWithCapacity:databases.count + 1];
+    for (NSPersistentStore *database in databases)
+        [cursors addObject:[self changeCursorForDatabase:database predicate:predicate order:cursors.count]];
+    if (pendingLogs.count > 0)
+    {
+        NSMutableArray *pendingChanges = [NSMutableArray arrayWithCapacity:pendingLogs.count];
+        for (NSDictionary *logDictionary in pendingLogs)
+        {
+            PARChange *change = [self changeFromLogDictionary:logDictionary];
+            if (change != nil) [pendingChanges addObject:change];
+        }
+        [pendingChanges sortWithOptions:NSSortStable usingComparator:^NSComparisonResult(PARChange *change1, PARChange *change2) { return [change1.timestamp compare:change2.timestamp]; }];
+        __block NSArray *page = pendingChanges;
+        [cursors addObject:[_PARChangeCursor cursorWithOrder:cursors.count pageLoader:^NSArray *
+        {
+            NSArray *currentPage = page;
+            page = @[];
+            return currentPage;
+        }]];
+    }
+    return [_PARChangeCursor mergeCursors:cursors usingBlock:block];
+}
+
 - (PARChange *)changeFromLogDictionary:(NSDictionary *)logDictionary {
     NSNumber *timestamp = logDictionary[TimestampAttributeName];
     NSNumber *parentTimestamp = logDictionary[ParentTimestampAttributeName];
@@ -2837,6 +7603,8 @@ NSString *PARBlobsDirectoryName = @"Blobs";
      {
          NSError *saveError = nil;
          BOOL success = (self._managedObjectContext == nil) || [self._managedObjectContext save:&saveError];
+         if (success)
+             [self.pendingLogs removeAllObjects];
          completionHandler((success) ? nil : saveError);
      }];
 }
@@ -2900,6 +7668,12 @@ static void PARStoreLogsDidChange(
         return;
     }
     
+    if (self.manager != nil)
+    {
+        self.fileSystemEventQueue = self.manager.fileSystemEventQueue;
+        return;
+    }
+    
     NSString *urlLabel = [[self.storeURL lastPathComponent] stringByReplacingOccurrencesOfString:@"." withString:@"_"];
     NSString *fileSystemEventQueueLabel = [PARDispatchQueue labelByPrependingBundleIdentifierToString:[NSString stringWithFormat:@"fsevent.%@", urlLabel]];
     self.fileSystemEventQueue = [PARDispatchQueue dispatchQueueWithLabel:fileSystemEventQueueLabel];
@@ -3046,6 +7820,7 @@ static void PARStoreDevicesDidChange(
                                   const FSEventStreamEventId eventIds[])
 {
     __weak PARStore *store = (__bridge PARStore *)callbackContext;
+    [store invalidateReadonlyDirectoryPaths];
     [store refreshFileSystemEventStreamLogs];
 }
 
@@ -3081,6 +7856,172 @@ static void PARStoreLogsDidChange(
 @end
 
 
+#pragma mark - PARStoreManager
+
+@implementation PARStoreManager
+
++ (PARStoreManager *)sharedManager
+{
+    static dispatch_once_t pred = 0;
+    static PARStoreManager *sharedManager = nil;
+    dispatch_once(&pred, ^{ sharedManager = [[PARStoreManager alloc] init]; });
+    return sharedManager;
+}
+
+- (instancetype)init
+{
+    if (self = [super init])
+    {
+        NSString *pointerLabel = [NSString stringWithFormat:@"%p", self];
+        self.notificationQueue = [PARDispatchQueue dispatchQueueWithLabel:[PARDispatchQueue labelByPrependingBundleIdentifierToString:[NSString stringWithFormat:@"manager.notifications.%@", pointerLabel]]];
+        self.fileSystemEventQueue = [PARDispatchQueue dispatchQueueWithLabel:[PARDispatchQueue labelByPrependingBundleIdentifierToString:[NSString stringWithFormat:@"manager.fsevent.%@", pointerLabel]]];
+        self.stateQueue = [PARDispatchQueue dispatchQueueWithLabel:[PARDispatchQueue labelByPrependingBundleIdentifierToString:[NSString stringWithFormat:@"manager.state.%@", pointerLabel]]];
+        self.presenterQueue = [[NSOperationQueue alloc] init];
+        [self.presenterQueue setMaxConcurrentOperationCount:1];
+        self.databaseUsageByStore = [NSMapTable weakToStrongObjectsMapTable];
+        self.memoryBudget = 64 * 1024 * 1024;
+    }
+    return self;
+}
+
+- (NSUInteger)estimatedMemoryUsage
+{
+    __block NSUInteger usage = 0;
+    [self.stateQueue dispatchSynchronously:^
+     {
+         for (NSArray *databaseUsage in self.databaseUsageByStore.objectEnumerator)
+             usage += [databaseUsage[0] unsignedIntegerValue];
+     }];
+    return usage;
+}
+
+// called from within the database queue of the store: the state queue should never dispatch synchronously into a store queue
+- (void)store:(PARStore *)store didAccessDatabaseWithFootprint:(NSUInteger)footprint
+{
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    NSMutableArray *storesToClose = [NSMutableArray array];
+    [self.stateQueue dispatchSynchronously:^
+     {
+         [self.databaseUsageByStore setObject:@[@(footprint), @(now)] forKey:store];
+         NSUInteger budget = self.memoryBudget;
+         if (budget == 0)
+         {
+             return;
+         }
+         
+         NSUInteger usage = 0;
+         for (NSArray *databaseUsage in self.databaseUsageByStore.objectEnumerator)
+             usage += [databaseUsage[0] unsignedIntegerValue];
+         if (usage <= budget)
+         {
+             return;
+         }
+         
+         // least recently used first
+         NSArray *stores = [self.databaseUsageByStore.keyEnumerator.allObjects sortedArrayUsingComparator:^NSComparisonResult(PARStore *store1, PARStore *store2)
+         {
+             NSNumber *time1 = [self.databaseUsageByStore objectForKey:store1][1];
+             NSNumber *time2 = [self.databaseUsageByStore objectForKey:store2][1];
+             return [time1 compare:time2];
+         }];
+         for (PARStore *otherStore in stores)
+         {
+             if (usage <= budget)
+                 break;
+             if (otherStore == store)
+                 continue;
+             usage -= [[self.databaseUsageByStore objectForKey:otherStore][0] unsignedIntegerValue];
+             [self.databaseUsageByStore removeObjectForKey:otherStore];
+             [storesToClose addObject:otherStore];
+         }
+     }];
+    
+    // asynchronous, so the database queue of the calling store does not wait for another store
+    for (PARStore *otherStore in storesToClose)
+        [otherStore closeDatabase];
+}
+
+- (void)storeDidCloseDatabase:(PARStore *)store
+{
+    [self.stateQueue dispatchSynchronously:^{ [self.databaseUsageByStore removeObjectForKey:store]; }];
+}
+
+@end
+
+
+#pragma mark - PARCancellationToken
+
+@interface PARCancellationToken ()
+@property (readwrite, getter=isCancelled) BOOL cancelled;
+@property (copy) NSArray *parentTokens;
+@end
+
+
+@implementation PARCancellationToken
+
+@synthesize cancelled = _cancelled;
+
++ (PARCancellationToken *)token
+{
+    return [[self alloc] init];
+}
+
++ (PARCancellationToken *)tokenWithParentTokens:(NSArray *)parentTokens
+{
+    PARCancellationToken *token = [[self alloc] init];
+    token.parentTokens = parentTokens;
+    return token;
+}
+
+- (void)cancel
+{
+    self.cancelled = YES;
+}
+
+// the flag can be set and read from any thread; a token is also cancelled when any of its parents is
+- (BOOL)isCancelled
+{
+    @synchronized(self)
+    {
+        if (_cancelled)
+            return YES;
+    }
+    for (PARCancellationToken *parentToken in self.parentTokens)
+    {
+        if (parentToken.cancelled)
+            return YES;
+    }
+    return NO;
+}
+
+- (void)setCancelled:(BOOL)cancelled
+{
+    @synchronized(self)
+    {
+        _cancelled = cancelled;
+    }
+}
+
+@end
+
+
+#pragma mark - PARMergeEstimate
+
+@implementation PARMergeEstimate
+
+- (NSUInteger)addedRowCount
+{
+    return [[self.addedRowCountsByDeviceIdentifier.allValues valueForKeyPath:@"@sum.self"] unsignedIntegerValue];
+}
+
+- (NSString *)description
+{
+    return [NSString stringWithFormat:@"<%@:%p> = added rows: %@, virtual device rows: %@, identical devices: %@, blob files: %@ (%@ bytes)", self.class, self, self.addedRowCountsByDeviceIdentifier, self.virtualRowCountsByDeviceIdentifier, self.identicalDeviceIdentifiers, @(self.blobFileCount), @(self.blobByteCount)];
+}
+
+@end
+
+
 #pragma mark - PARChange
 
 @interface PARChange ()
@@ -295,6 +295,151 @@
 }
 
 
+#pragma mark - Lock Executor
+
+- (void)testLockExecutorIsInCurrentQueueStack
+{
+    __block BOOL isInCurrentQueueStack1 = NO;
+    __block BOOL isInCurrentQueueStack2 = NO;
+    __block BOOL reentrantBlockExecuted = NO;
+    PARDispatchQueue *queue1 = [PARDispatchQueue dispatchQueueWithLabel:NSStringFromSelector(_cmd) behavior:PARDeadlockBehaviorExecute executor:PARExecutorLock];
+    PARDispatchQueue *queue2 = [PARDispatchQueue dispatchQueueWithLabel:NSStringFromSelector(_cmd)];
+    XCTAssertEqual(queue1.executor, PARExecutorLock);
+    XCTAssertEqual(queue2.executor, PARExecutorDispatch);
+    
+    [queue2 dispatchSynchronously:^
+     {
+         [queue1 dispatchSynchronously:^
+          {
+              isInCurrentQueueStack1 = [queue1 isInCurrentQueueStack];
+              isInCurrentQueueStack2 = [queue2 isInCurrentQueueStack];
+              [queue1 dispatchSynchronously:^{ reentrantBlockExecuted = YES; }];
+          }];
+     }];
+    
+    XCTAssertTrue(isInCurrentQueueStack1, @"isInCurrentQueueStack should be true when called from inside a block executed under the lock");
+    XCTAssertTrue(isInCurrentQueueStack2, @"isInCurrentQueueStack should be true for the queue down the queue hierarchy");
+    XCTAssertTrue(reentrantBlockExecuted, @"a reentrant synchronous dispatch should execute the block inline");
+    XCTAssertFalse([queue1 isInCurrentQueueStack], @"isInCurrentQueueStack should be false when called from outside the queue");
+}
+
+- (void)testLockExecutorOrder
+{
+    PARDispatchQueue *queue = [PARDispatchQueue dispatchQueueWithLabel:NSStringFromSelector(_cmd) behavior:PARDeadlockBehaviorExecute executor:PARExecutorLock];
+    NSMutableArray *order = [NSMutableArray array];
+    [queue dispatchAsynchronously:^{ [NSThread sleepForTimeInterval:0.02]; [order addObject:@1]; }];
+    [queue dispatchAsynchronously:^{ [order addObject:@2]; }];
+    [queue dispatchSynchronously:^{ [order addObject:@3]; }];
+    XCTAssertEqualObjects(order, (@[@1, @2, @3]), @"blocks dispatched synchronously should wait for the blocks dispatched asynchronously before them");
+}
+
+- (void)testLockExecutorIsInCurrentQueueStackWithPendingAsynchronousBlocks
+{
+    __block BOOL isInCurrentQueueStack2 = NO;
+    __block BOOL nestedBlockExecuted = NO;
+    PARDispatchQueue *queue1 = [PARDispatchQueue dispatchQueueWithLabel:NSStringFromSelector(_cmd) behavior:PARDeadlockBehaviorExecute executor:PARExecutorLock];
+    PARDispatchQueue *queue2 = [PARDispatchQueue dispatchQueueWithLabel:NSStringFromSelector(_cmd)];
+    
+    // the synchronous dispatch waits for the asynchronous block inside the dispatch queue, and should still see the queue stack of the caller
+    [queue2 dispatchSynchronously:^
+     {
+         [queue1 dispatchAsynchronously:^{ [NSThread sleepForTimeInterval:0.02]; }];
+         [queue1 dispatchSynchronously:^
+          {
+              isInCurrentQueueStack2 = [queue2 isInCurrentQueueStack];
+              [queue2 dispatchSynchronously:^{ nestedBlockExecuted = YES; }];
+          }];
+     }];
+    
+    XCTAssertTrue(isInCurrentQueueStack2, @"isInCurrentQueueStack should be true for the queue down the queue hierarchy, even when waiting for asynchronous blocks");
+    XCTAssertTrue(nestedBlockExecuted, @"a nested synchronous dispatch back onto a queue down the hierarchy should execute the block inline");
+}
+
+// get/set of a dictionary, the typical critical section of the memory queue of a store
+- (void)_performDictionaryAccessesWithQueue:(PARDispatchQueue *)queue threadCount:(NSUInteger)threadCount accessCount:(NSUInteger)accessCount
+{
+    NSMutableDictionary *dictionary = [NSMutableDictionary dictionary];
+    NSArray *keys = @[@"title", @"first", @"last", @"summary"];
+    dispatch_group_t group = dispatch_group_create();
+    for (NSUInteger threadIndex = 0; threadIndex < threadCount; threadIndex++)
+    {
+        dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^
+        {
+            for (NSUInteger i = 0; i < accessCount; i++)
+            {
+                NSString *key = keys[i % keys.count];
+                if (i % 4 == 0)
+                    [queue dispatchSynchronously:^{ dictionary[key] = @(i); }];
+                else
+                    [queue dispatchSynchronously:^{ (void)dictionary[key]; }];
+            }
+        });
+    }
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+}
+
+- (void)testLockExecutorPerformance
+{
+    PARDispatchQueue *queue = [PARDispatchQueue dispatchQueueWithLabel:NSStringFromSelector(_cmd) behavior:PARDeadlockBehaviorExecute executor:PARExecutorLock];
+    [self measureBlock:^{ [self _performDictionaryAccessesWithQueue:queue threadCount:1 accessCount:100000]; }];
+}
+
+- (void)testLockExecutorContendedPerformance
+{
+    PARDispatchQueue *queue = [PARDispatchQueue dispatchQueueWithLabel:NSStringFromSelector(_cmd) behavior:PARDeadlockBehaviorExecute executor:PARExecutorLock];
+    [self measureBlock:^{ [self _performDictionaryAccessesWithQueue:queue threadCount:4 accessCount:100000]; }];
+}
+
+- (void)testDispatchExecutorPerformance
+{
+    PARDispatchQueue *queue = [PARDispatchQueue dispatchQueueWithLabel:NSStringFromSelector(_cmd)];
+    [self measureBlock:^{ [self _performDictionaryAccessesWithQueue:queue threadCount:1 accessCount:100000]; }];
+}
+
+- (void)testDispatchExecutorContendedPerformance
+{
+    PARDispatchQueue *queue = [PARDispatchQueue dispatchQueueWithLabel:NSStringFromSelector(_cmd)];
+    [self measureBlock:^{ [self _performDictionaryAccessesWithQueue:queue threadCount:4 accessCount:100000]; }];
+}
+
+
+#pragma mark - Fork/Join
+
+- (void)testForkJoinMapObjects
+{
+    NSMutableArray *numbers = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 10000; i++)
+        [numbers addObject:@(i)];
+    NSArray *squares = [PARDispatchQueue forkJoinMapObjects:numbers priority:PARTaskPriorityDefault block:^id(NSNumber *number, NSUInteger index)
+    {
+        if (index % 10 == 0)
+            return nil;
+        return @(number.unsignedIntegerValue * number.unsignedIntegerValue);
+    }];
+    XCTAssertEqual(squares.count, numbers.count);
+    XCTAssertEqualObjects(squares[0], [NSNull null], @"nil results should be replaced with NSNull");
+    XCTAssertEqualObjects(squares[9999], @(9999 * 9999));
+    XCTAssertEqualObjects([PARDispatchQueue forkJoinMapObjects:@[] priority:PARTaskPriorityLow block:^id(id object, NSUInteger index) { return object; }], @[]);
+}
+
+- (void)testForkJoinWithinQueueAndTask
+{
+    __block NSUInteger total = 0;
+    PARDispatchQueue *queue = [PARDispatchQueue dispatchQueueWithLabel:NSStringFromSelector(_cmd)];
+    [queue dispatchSynchronously:^
+     {
+         NSArray *sums = [PARDispatchQueue forkJoinMapObjects:@[@10, @20, @30] priority:PARTaskPriorityHigh block:^id(NSNumber *count, NSUInteger index)
+         {
+             // nested fork/join
+             NSArray *ones = [PARDispatchQueue forkJoinMapObjects:[NSArray arrayWithObjects:@1, @1, @1, @1, @1, nil] priority:PARTaskPriorityHigh block:^id(NSNumber *one, NSUInteger index) { return one; }];
+             return @(count.unsignedIntegerValue + ones.count);
+         }];
+         total = [[sums valueForKeyPath:@"@sum.self"] unsignedIntegerValue];
+     }];
+    XCTAssertEqual(total, 75);
+}
+
+
 #pragma mark - Global Queue
 
 // with a concurrent queue like the global dispatch queue, PARDispatchQueue should not keep track of the queue stack to try to avoid deadlocks, or it will be very confused
@@ -96,6 +96,154 @@
     document1 = nil;
 }
 
+- (void)testDatabaseKeepAlive
+{
+    NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"doc.parstore"];
+    PARStoreExample *document1 = [PARStoreExample storeWithURL:url deviceIdentifier:[self deviceIdentifierForTest]];
+    document1.minimumDatabaseKeepAliveInterval = 0.5;
+    document1.maximumDatabaseKeepAliveInterval = 0.5;
+    [document1 loadNow];
+    document1.title = @"The Title";
+    [document1 saveNow];
+    XCTAssertNotNil([document1 valueForKey:@"_managedObjectContext"], @"Database should be kept open right after a save");
+
+    // once the keep-alive interval has elapsed, the database should be closed, but the values still available
+    [NSThread sleepForTimeInterval:1.5];
+    XCTAssertNil([document1 valueForKey:@"_managedObjectContext"], @"Database should be closed after the keep-alive interval");
+    XCTAssertEqualObjects(document1.title, @"The Title", @"Title is '%@' but should be '%@'", document1.title, @"The Title");
+    XCTAssertEqualObjects([document1 fetchPropertyListValueForKey:@"title"], @"The Title", @"Database should be reopened as needed");
+
+    [document1 tearDownNow];
+    document1 = nil;
+}
+
+// databases that were already opened are reopened without migration checks, unless the file changed in the meantime
+- (void)testReopenDatabaseAfterChangeOnDisk
+{
+    NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"doc.parstore"];
+    PARStoreExample *document1 = [PARStoreExample storeWithURL:url deviceIdentifier:@"1"];
+    [document1 loadNow];
+    document1.title = @"Title 1";
+    [document1 tearDownNow];
+
+    PARStoreExample *document2 = [PARStoreExample storeWithURL:url deviceIdentifier:@"2"];
+    [document2 loadNow];
+    XCTAssertEqualObjects(document2.title, @"Title 1", @"Title is '%@' but should be '%@'", document2.title, @"Title 1");
+    [document2 closeDatabaseNow];
+
+    // unchanged file
+    PARStoreExample *document3 = [PARStoreExample storeWithURL:url deviceIdentifier:@"1"];
+    [document3 loadNow];
+    XCTAssertEqualObjects(document3.title, @"Title 1", @"Title is '%@' but should be '%@'", document3.title, @"Title 1");
+    document3.title = @"Title 2";
+    [document3 tearDownNow];
+
+    // changed file
+    [document2 syncNow];
+    XCTAssertEqualObjects(document2.title, @"Title 2", @"Title is '%@' but should be '%@'", document2.title, @"Title 2");
+    [document2 tearDownNow];
+}
+
+// the page size is stored in the SQLite header, as a big-endian 16-bit value at offset 16
+- (NSUInteger)pageSizeOfDatabaseAtURL:(NSURL *)url
+{
+    NSData *data = [NSData dataWithContentsOfURL:url];
+    if (data.length < 18)
+        return 0;
+    const uint8_t *bytes = data.bytes;
+    NSUInteger pageSize = (bytes[16] << 8) | bytes[17];
+    return (pageSize == 1) ? 65536 : pageSize;
+}
+
+- (void)testSharedStore
+{
+    NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"doc.parstore"];
+    PARStoreExample *document1 = [PARStoreExample sharedStoreWithURL:url deviceIdentifier:[self deviceIdentifierForTest]];
+    PARStoreExample *document2 = [PARStoreExample sharedStoreWithURL:url deviceIdentifier:[self deviceIdentifierForTest]];
+    PARStoreExample *document3 = [PARStoreExample sharedStoreWithURL:url deviceIdentifier:@"other"];
+    XCTAssertEqual(document1, document2, @"Stores with the same URL and device identifier should be shared");
+    XCTAssertNotEqual(document1, document3, @"Stores with different device identifiers should not be shared");
+    
+    [document1 loadNow];
+    document1.title = @"Title 1";
+    XCTAssertEqualObjects(document2.title, @"Title 1");
+    
+    // still loaded until the last handle is released
+    [document1 releaseSharedStore];
+    XCTAssertTrue([document2 loaded], @"Shared store should stay loaded until the last handle is released");
+    [document2 releaseSharedStore];
+    [document3 releaseSharedStore];
+    XCTAssertFalse([document2 loaded], @"Shared store should be torn down when the last handle is released");
+    
+    // new store after release, only once the released store is done writing its database
+    PARStoreExample *document4 = [PARStoreExample sharedStoreWithURL:url deviceIdentifier:[self deviceIdentifierForTest]];
+    XCTAssertNotEqual(document1, document4, @"Released store should not be shared anymore");
+    XCTAssertNil([document1 valueForKey:@"_managedObjectContext"], @"Released store should be torn down before a new store is shared");
+    [document4 loadNow];
+    XCTAssertEqualObjects(document4.title, @"Title 1");
+    [document4 releaseSharedStore];
+    XCTAssertFalse([document4 loaded], @"Shared store should be torn down when the last handle is released");
+}
+
+- (void)testStoreManagerMemoryBudget
+{
+    // budget large enough for the databases of one store only
+    PARStoreManager *manager = [[PARStoreManager alloc] init];
+    manager.memoryBudget = 1;
+    PARStoreExample *document1 = [PARStoreExample storeWithURL:[[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"doc1.parstore"] deviceIdentifier:[self deviceIdentifierForTest] manager:manager];
+    PARStoreExample *document2 = [PARStoreExample storeWithURL:[[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"doc2.parstore"] deviceIdentifier:[self deviceIdentifierForTest] manager:manager];
+    XCTAssertEqual(document1.manager, manager);
+    
+    [document1 loadNow];
+    document1.title = @"Title 1";
+    [document1 saveNow];
+    XCTAssertNotNil([document1 valueForKey:@"_managedObjectContext"], @"Database should be kept open right after a save");
+    
+    // opening the second store closes the databases of the first one, which is still usable
+    [document2 loadNow];
+    document2.title = @"Title 2";
+    [document2 saveNow];
+    [[document1 valueForKey:@"databaseQueue"] dispatchSynchronously:^{ }];
+    XCTAssertNil([document1 valueForKey:@"_managedObjectContext"], @"Database should be closed to stay within the memory budget");
+    XCTAssertNotNil([document2 valueForKey:@"_managedObjectContext"], @"Database of the most recent store should stay open");
+    XCTAssertEqualObjects([document1 fetchPropertyListValueForKey:@"title"], @"Title 1");
+    
+    [document1 tearDownNow];
+    [document2 tearDownNow];
+}
+
+- (void)testMaintenanceWithFullRebuild
+{
+    NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"doc.parstore"];
+    NSURL *databaseURL = [[[url URLByAppendingPathComponent:@"Devices"] URLByAppendingPathComponent:[self deviceIdentifierForTest]] URLByAppendingPathComponent:@"Logs.db"];
+    PARStoreExample *document1 = [PARStoreExample storeWithURL:url deviceIdentifier:[self deviceIdentifierForTest]];
+    [document1 loadNow];
+    document1.title = @"Title 1";
+    document1.title = @"Title 2";
+    [document1 saveNow];
+    [document1 closeDatabaseNow];
+    NSUInteger initialPageSize = [self pageSizeOfDatabaseAtURL:databaseURL];
+    XCTAssertTrue(initialPageSize > 0, @"Could not read page size of database at path: %@", databaseURL.path);
+    
+    // rebuild with a different page size
+    NSUInteger newPageSize = (initialPageSize == 8192) ? 16384 : 8192;
+    document1.databasePageSize = newPageSize;
+    NSError *error = nil;
+    XCTAssertTrue([document1 performMaintenanceWithFullRebuild:YES error:&error], @"error: %@", error);
+    XCTAssertEqual([self pageSizeOfDatabaseAtURL:databaseURL], newPageSize);
+    XCTAssertTrue([document1 performMaintenanceWithFullRebuild:NO error:&error], @"error: %@", error);
+    XCTAssertEqualObjects([document1 fetchPropertyListValueForKey:@"title"], @"Title 2");
+    [document1 tearDownNow];
+    document1 = nil;
+    
+    // second load = same data
+    PARStoreExample *document2 = [PARStoreExample storeWithURL:url deviceIdentifier:[self deviceIdentifierForTest]];
+    [document2 loadNow];
+    XCTAssertEqualObjects(document2.title, @"Title 2", @"Title is '%@' but should be '%@'", document2.title, @"Title 2");
+    [document2 tearDownNow];
+    document2 = nil;
+}
+
 - (void)testFilePackageIsNotDirectory
 {
     // create and load document
@@ -425,6 +573,354 @@
     document2 = nil;
 }
 
+- (void)testImportEntriesFromJSONLines
+{
+    NSString *lines = @"{\"title\": \"Some title\", \"first\": \"Albert\"}\n\n{\"last\": \"Einstein\"}\n{\"first\": null, \"summary\": \"Physicist\"}";
+    NSURL *linesURL = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"entries.jsonl"];
+    XCTAssertTrue([lines writeToURL:linesURL atomically:YES encoding:NSUTF8StringEncoding error:NULL]);
+    
+    // first load = create document and import data
+    NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"doc.parstore"];
+    PARStoreExample *document1 = [PARStoreExample storeWithURL:url deviceIdentifier:[self deviceIdentifierForTest]];
+    [document1 loadNow];
+    NSError *error = nil;
+    XCTAssertTrue([document1 importEntriesFromJSONLinesAtURL:linesURL error:&error], @"error: %@", error);
+    XCTAssertEqualObjects(document1.title, @"Some title");
+    XCTAssertEqualObjects(document1.last, @"Einstein");
+    XCTAssertEqualObjects(document1.summary, @"Physicist");
+    XCTAssertNil(document1.first, @"unexpected 'first' value: '%@' instead of nil", document1.first);
+    [document1 tearDownNow];
+    document1 = nil;
+    
+    // second load = load document and compare data
+    PARStoreExample *document2 = [PARStoreExample storeWithURL:url deviceIdentifier:[self deviceIdentifierForTest]];
+    [document2 loadNow];
+    XCTAssertEqualObjects(document2.title, @"Some title");
+    XCTAssertEqualObjects(document2.last, @"Einstein");
+    XCTAssertEqualObjects(document2.summary, @"Physicist");
+    XCTAssertNil(document2.first, @"unexpected 'first' value: '%@' instead of nil", document2.first);
+    
+    // invalid line
+    NSURL *invalidURL = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"invalid.jsonl"];
+    XCTAssertTrue([@"[1, 2]" writeToURL:invalidURL atomically:YES encoding:NSUTF8StringEncoding error:NULL]);
+    error = nil;
+    XCTAssertFalse([document2 importEntriesFromJSONLinesAtURL:invalidURL error:&error]);
+    XCTAssertNotNil(error);
+    [document2 tearDownNow];
+    document2 = nil;
+}
+
+
+- (void)testWriteBacklog
+{
+    NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"doc.parstore"];
+    PARStoreExample *document1 = [PARStoreExample storeWithURL:url deviceIdentifier:[self deviceIdentifierForTest]];
+    [document1 loadNow];
+    document1.maximumWriteBacklogRowCount = 1;
+    document1.writeBacklogPolicy = PARWriteBacklogPolicyFailFast;
+    PARDispatchQueue *databaseQueue = [document1 valueForKey:@"databaseQueue"];
+    
+    // busy database queue --> the second change is refused
+    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+    [databaseQueue dispatchAsynchronously:^{ dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER); }];
+    NSError *error = nil;
+    XCTAssertTrue([document1 setPropertyListValue:@"Albert" forKey:@"first" error:&error], @"error: %@", error);
+    XCTAssertEqual(document1.writeBacklogRowCount, 1);
+    XCTAssertGreaterThan(document1.writeBacklogByteCount, 0);
+    XCTAssertFalse([document1 setPropertyListValue:@"Einstein" forKey:@"last" error:&error]);
+    XCTAssertNotNil(error);
+    XCTAssertNil(document1.last, @"unexpected 'last' value: '%@' instead of nil", document1.last);
+    dispatch_semaphore_signal(semaphore);
+    [document1 waitUntilFinished];
+    XCTAssertEqual(document1.writeBacklogRowCount, 0);
+    XCTAssertEqual(document1.writeBacklogByteCount, 0);
+    
+    // busy database queue --> only the last title is written
+    document1.writeBacklogPolicy = PARWriteBacklogPolicyCoalesce;
+    [databaseQueue dispatchAsynchronously:^{ dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER); }];
+    document1.summary = @"Physicist";
+    document1.title = @"Title 1";
+    document1.title = @"Title 2";
+    document1.title = @"Title 3";
+    XCTAssertEqualObjects(document1.title, @"Title 3");
+    XCTAssertEqual(document1.writeBacklogRowCount, 2);
+    dispatch_semaphore_signal(semaphore);
+    [document1 waitUntilFinished];
+    XCTAssertEqual(document1.writeBacklogRowCount, 0);
+    NSArray *titleChanges = [[document1 fetchChangesSinceTimestamp:nil] filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"key == 'title'"]];
+    XCTAssertEqual(titleChanges.count, 1);
+    XCTAssertEqualObjects([titleChanges.firstObject propertyList], @"Title 3");
+    
+    // a key stays coalesced until the coalesced write is done, even if the backlog drains in the meantime, so that its changes stay chained and in order
+    [databaseQueue dispatchAsynchronously:^{ dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER); }];
+    document1.first = @"Al";
+    document1.title = @"Title 4";
+    document1.maximumWriteBacklogRowCount = 10;
+    document1.title = @"Title 5";
+    document1.maximumWriteBacklogRowCount = 1;
+    document1.title = @"Title 6";
+    dispatch_semaphore_signal(semaphore);
+    [document1 waitUntilFinished];
+    XCTAssertEqual(document1.writeBacklogRowCount, 0);
+    titleChanges = [[document1 fetchChangesSinceTimestamp:nil] filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"key == 'title'"]];
+    XCTAssertEqualObjects([titleChanges valueForKey:@"propertyList"], (@[@"Title 3", @"Title 6"]));
+    XCTAssertNil([titleChanges[0] parentTimestamp]);
+    XCTAssertEqualObjects([titleChanges[1] parentTimestamp], [titleChanges[0] timestamp]);
+    [document1 tearDownNow];
+    
+    // reload
+    PARStoreExample *document2 = [PARStoreExample storeWithURL:url deviceIdentifier:[self deviceIdentifierForTest]];
+    [document2 loadNow];
+    XCTAssertEqualObjects(document2.first, @"Al");
+    XCTAssertEqualObjects(document2.summary, @"Physicist");
+    XCTAssertEqualObjects(document2.title, @"Title 6");
+    XCTAssertNil(document2.last, @"unexpected 'last' value: '%@' instead of nil", document2.last);
+    [document2 tearDownNow];
+}
+
+
+- (NSArray *)journalURLsForStoreURL:(NSURL *)url
+{
+    NSURL *deviceURL = [[url URLByAppendingPathComponent:@"Devices"] URLByAppendingPathComponent:[self deviceIdentifierForTest]];
+    NSArray *contents = [[NSFileManager defaultManager] contentsOfDirectoryAtURL:deviceURL includingPropertiesForKeys:nil options:0 error:NULL];
+    return [contents filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"lastPathComponent BEGINSWITH 'Journal'"]];
+}
+
+- (unsigned long long)journalLengthForStoreURL:(NSURL *)url
+{
+    unsigned long long length = 0;
+    for (NSURL *journalURL in [self journalURLsForStoreURL:url])
+        length += [[[NSFileManager defaultManager] attributesOfItemAtPath:journalURL.path error:NULL] fileSize];
+    return length;
+}
+
+- (void)testJournalReplay
+{
+    NSURL *tmpURL = [self urlWithUniqueTmpDirectory];
+    NSURL *url = [tmpURL URLByAppendingPathComponent:@"doc.parstore"];
+    NSURL *crashURL = [tmpURL URLByAppendingPathComponent:@"crash.parstore"];
+    PARStoreExample *document1 = [PARStoreExample storeWithURL:url deviceIdentifier:[self deviceIdentifierForTest]];
+    document1.journalEnabled = YES;
+    [document1 loadNow];
+    document1.title = @"Some title";
+    [document1 saveNow];
+    
+    // busy database queue --> the changes are only in the journal when the package is copied, as if the process had crashed
+    // the last title changes are coalesced, and only the latest one is to be written
+    PARDispatchQueue *databaseQueue = [document1 valueForKey:@"databaseQueue"];
+    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+    [databaseQueue dispatchAsynchronously:^{ dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER); }];
+    document1.first = @"Albert";
+    [document1 setEntriesFromDictionary:@{@"last": @"Einstein", @"summary": @"Physicist"}];
+    document1.maximumWriteBacklogRowCount = 1;
+    document1.writeBacklogPolicy = PARWriteBacklogPolicyCoalesce;
+    document1.title = @"Title 2";
+    document1.title = @"Title 3";
+    NSError *error = nil;
+    XCTAssertTrue([[NSFileManager defaultManager] copyItemAtURL:url toURL:crashURL error:&error], @"error: %@", error);
+    dispatch_semaphore_signal(semaphore);
+    [document1 tearDownNow];
+    NSArray *journalURLs = [self journalURLsForStoreURL:crashURL];
+    XCTAssertEqual(journalURLs.count, 1UL);
+    NSData *journal = [NSData dataWithContentsOfURL:journalURLs.firstObject];
+    XCTAssertGreaterThan(journal.length, 0);
+    
+    // reload --> the journal is replayed and removed, without the coalesced change that was replaced
+    PARStoreExample *document2 = [PARStoreExample storeWithURL:crashURL deviceIdentifier:[self deviceIdentifierForTest]];
+    [document2 loadNow];
+    XCTAssertEqualObjects(document2.title, @"Title 3");
+    XCTAssertEqualObjects(document2.first, @"Albert");
+    XCTAssertEqualObjects(document2.last, @"Einstein");
+    XCTAssertEqualObjects(document2.summary, @"Physicist");
+    NSArray *titleChanges = [[document2 fetchChangesSinceTimestamp:nil] filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"key == 'title'"]];
+    XCTAssertEqualObjects([titleChanges valueForKey:@"propertyList"], (@[@"Some title", @"Title 3"]));
+    XCTAssertEqualObjects([titleChanges[1] parentTimestamp], [titleChanges[0] timestamp]);
+    XCTAssertFalse([[NSFileManager defaultManager] fileExistsAtPath:[journalURLs.firstObject path]]);
+    [document2 tearDownNow];
+    
+    // changes already saved are not replayed again, the replaced coalesced change does not fork the history, and a partial record is ignored; a journal written before segments is replayed too
+    NSURL *journalURL = [[[crashURL URLByAppendingPathComponent:@"Devices"] URLByAppendingPathComponent:[self deviceIdentifierForTest]] URLByAppendingPathComponent:@"Journal.log"];
+    NSMutableData *truncatedJournal = [journal mutableCopy];
+    [truncatedJournal appendData:[journal subdataWithRange:NSMakeRange(0, journal.length / 2)]];
+    [truncatedJournal writeToURL:journalURL atomically:YES];
+    PARStoreExample *document3 = [PARStoreExample storeWithURL:crashURL deviceIdentifier:[self deviceIdentifierForTest]];
+    [document3 loadNow];
+    XCTAssertEqualObjects(document3.first, @"Albert");
+    NSArray *firstChanges = [[document3 fetchChangesSinceTimestamp:nil] filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"key == 'first'"]];
+    XCTAssertEqual(firstChanges.count, 1);
+    titleChanges = [[document3 fetchChangesSinceTimestamp:nil] filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"key == 'title'"]];
+    XCTAssertEqual(titleChanges.count, 2);
+    XCTAssertEqual([self journalURLsForStoreURL:crashURL].count, 0UL);
+    [document3 tearDownNow];
+}
+
+- (void)testJournalSegmentsUnderSteadyLoad
+{
+    NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"doc.parstore"];
+    PARStoreExample *document = [PARStoreExample storeWithURL:url deviceIdentifier:[self deviceIdentifierForTest]];
+    document.journalEnabled = YES;
+    [document loadNow];
+    PARDispatchQueue *databaseQueue = [document valueForKey:@"databaseQueue"];
+    
+    // each save happens while a change is still waiting to be inserted --> only the segment of that change is kept
+    unsigned long long firstLength = 0;
+    for (NSUInteger i = 0; i < 10; i++)
+    {
+        [databaseQueue dispatchSynchronously:^
+         {
+             document.title = [NSString stringWithFormat:@"Title %@", @(i)];
+             [document saveNow];
+         }];
+        if (i == 0)
+            firstLength = [self journalLengthForStoreURL:url];
+    }
+    XCTAssertGreaterThan(firstLength, 0ULL);
+    XCTAssertEqual([self journalLengthForStoreURL:url], firstLength);
+    
+    // no change waiting --> the journal is emptied
+    [document saveNow];
+    XCTAssertEqual([self journalLengthForStoreURL:url], 0ULL);
+    XCTAssertEqualObjects(document.title, @"Title 9");
+    [document tearDownNow];
+}
+
+
+- (void)testCancellingOperations
+{
+    NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"doc.parstore"];
+    PARStoreExample *document1 = [PARStoreExample storeWithURL:url deviceIdentifier:[self deviceIdentifierForTest]];
+    [document1 loadNow];
+    document1.title = @"Some title";
+    [document1 saveNow];
+    
+    // a cancelled token stops the operations before their first batch
+    PARCancellationToken *token = [PARCancellationToken token];
+    XCTAssertFalse(token.cancelled);
+    [token cancel];
+    XCTAssertTrue(token.cancelled);
+    NSError *error = nil;
+    XCTAssertFalse([document1 importEntriesFromEnumerator:@[@{@"first": @"Albert"}].objectEnumerator cancellationToken:token error:&error]);
+    XCTAssertEqualObjects(error.domain, NSCocoaErrorDomain);
+    XCTAssertEqual(error.code, NSUserCancelledError);
+    XCTAssertNil(document1.first, @"unexpected 'first' value: '%@' instead of nil", document1.first);
+    XCTAssertNil([document1 fetchChangesSinceTimestamp:nil forDeviceIdentifier:nil cancellationToken:token]);
+    XCTAssertEqual([document1 fetchChangesSinceTimestamp:nil forDeviceIdentifier:nil cancellationToken:[PARCancellationToken token]].count, 1);
+    
+    // cancelled merge
+    NSURL *url2 = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"doc.parstore"];
+    PARStoreExample *document2 = [PARStoreExample storeWithURL:url2 deviceIdentifier:[self deviceIdentifierForTest]];
+    [document2 loadNow];
+    document2.first = @"Albert";
+    [document2 saveNow];
+    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+    __block NSError *mergeError = nil;
+    [document1 mergeStore:document2 unsafeDeviceIdentifiers:@[] cancellationToken:token completionHandler:^(NSError *completionError)
+     {
+         mergeError = completionError;
+         dispatch_semaphore_signal(semaphore);
+     }];
+    XCTAssertEqual(dispatch_semaphore_wait(semaphore, dispatch_time(DISPATCH_TIME_NOW, (int64_t)(5 * NSEC_PER_SEC))), 0);
+    XCTAssertEqual(mergeError.code, NSUserCancelledError);
+    XCTAssertNil(document1.first, @"unexpected 'first' value: '%@' instead of nil", document1.first);
+    
+    // operations started after cancelling the store are not affected
+    [document1 cancelLongRunningOperations];
+    XCTAssertTrue([document1 importEntriesFromEnumerator:@[@{@"first": @"Albert"}].objectEnumerator error:&error], @"error: %@", error);
+    XCTAssertEqualObjects(document1.first, @"Albert");
+    XCTAssertEqual([document1 fetchChangesSinceTimestamp:nil].count, 2);
+    [document1 syncNow];
+    XCTAssertEqualObjects(document1.title, @"Some title");
+    
+    [document1 tearDownNow];
+    [document2 tearDownNow];
+}
+
+
+- (void)testSealedBaseLayer
+{
+    NSURL *sealedURL = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"seed.parsealed"];
+    NSDictionary *seed = @{@"title": @"Seed title", @"first": @"Albert", @"last": @"Einstein"};
+    NSError *error = nil;
+    XCTAssertTrue([PARStore writeSealedFileWithEntries:seed toURL:sealedURL error:&error], @"error: %@", error);
+    
+    // mount = sealed values visible
+    NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"doc.parstore"];
+    PARStoreExample *document1 = [PARStoreExample storeWithURL:url deviceIdentifier:[self deviceIdentifierForTest]];
+    XCTAssertTrue([document1 mountSealedFileAtURL:sealedURL error:&error], @"error: %@", error);
+    [document1 loadNow];
+    XCTAssertEqualObjects(document1.sealedFileURL, sealedURL);
+    XCTAssertEqualObjects(document1.title, @"Seed title");
+    XCTAssertEqualObjects(document1.allEntries, seed);
+    
+    // logs hide the sealed values
+    document1.title = @"New title";
+    document1.first = nil;
+    XCTAssertEqualObjects(document1.title, @"New title");
+    XCTAssertNil(document1.first, @"unexpected 'first' value: '%@' instead of nil", document1.first);
+    XCTAssertEqualObjects(document1.last, @"Einstein");
+    NSDictionary *expectedEntries = @{@"title": @"New title", @"last": @"Einstein"};
+    XCTAssertEqualObjects(document1.allEntries, expectedEntries);
+    [document1 tearDownNow];
+    document1 = nil;
+    
+    // second load = same result
+    PARStoreExample *document2 = [PARStoreExample storeWithURL:url deviceIdentifier:[self deviceIdentifierForTest]];
+    XCTAssertTrue([document2 mountSealedFileAtURL:sealedURL error:&error], @"error: %@", error);
+    [document2 loadNow];
+    XCTAssertEqualObjects(document2.allEntries, expectedEntries);
+    XCTAssertEqualObjects([document2 fetchPropertyListValueForKey:@"last"], @"Einstein");
+    XCTAssertEqualObjects([NSSet setWithArray:[document2 fetchAllKeys]], ([NSSet setWithArray:@[@"title", @"first", @"last"]]));
+    [document2 tearDownNow];
+    document2 = nil;
+}
+
+- (void)testSharedCache
+{
+    NSURL *cacheURL = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"doc.parcache"];
+    NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"doc.parstore"];
+    PARStoreExample *leader = [PARStoreExample storeWithURL:url deviceIdentifier:@"1"];
+    leader.sharedCacheURL = cacheURL;
+    leader.publishesSharedCache = YES;
+    [leader loadNow];
+    leader.title = @"Title 1";
+    leader.first = @"Albert";
+    leader.last = @"Einstein";
+    leader.last = nil;
+    NSError *error = nil;
+    XCTAssertTrue([leader publishSharedCacheWithError:&error], @"error: %@", error);
+    
+    // the other process starts from the snapshot
+    PARStoreExample *reader = [PARStoreExample storeWithURL:url deviceIdentifier:@"2"];
+    reader.sharedCacheURL = cacheURL;
+    [reader loadNow];
+    XCTAssertTrue([reader loaded], @"Store not loaded");
+    XCTAssertNotNil([reader valueForKey:@"_sharedCache"], @"Shared cache should be mapped");
+    XCTAssertEqualObjects(reader.title, @"Title 1");
+    NSDictionary *expectedEntries = @{@"title": @"Title 1", @"first": @"Albert"};
+    XCTAssertEqualObjects(reader.allEntries, expectedEntries);
+    XCTAssertEqualObjects([reader mostRecentTimestampForKey:@"title"], [leader mostRecentTimestampForKey:@"title"]);
+    
+    // and only syncs the changes published since
+    PARNotificationSemaphore *semaphore = [PARNotificationSemaphore semaphoreForNotificationName:PARStoreDidSyncNotification object:reader];
+    leader.title = @"Title 2";
+    [leader saveNow];
+    [reader syncNow];
+    XCTAssertTrue([semaphore waitUntilNotificationWithTimeout:10.0], @"Timeout while waiting for document change");
+    XCTAssertEqualObjects(reader.title, @"Title 2");
+    XCTAssertEqualObjects(reader.first, @"Albert");
+    
+    // ignored for another package
+    PARStoreExample *other = [PARStoreExample storeWithURL:[[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"other.parstore"] deviceIdentifier:@"1"];
+    other.sharedCacheURL = cacheURL;
+    [other loadNow];
+    XCTAssertNil([other valueForKey:@"_sharedCache"]);
+    XCTAssertNil(other.title);
+    
+    [leader tearDownNow];
+    [reader tearDownNow];
+    [other tearDownNow];
+}
+
 
 #pragma mark - Testing Sync
 
@@ -585,6 +1081,351 @@
     [store4 tearDownNow];
 }
 
+// testing that the mmap and cache settings for the foreign databases do not get in the way of syncing
+- (void)testStoreSyncWithForeignDatabaseTuning
+{
+    NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"SyncTest.parstore"];
+
+    PARStoreExample *store1 = [PARStoreExample storeWithURL:url deviceIdentifier:@"1"];
+    [store1 loadNow];
+    store1.title = @"The Title";
+    [store1 saveNow];
+
+    PARStoreExample *store2 = [PARStoreExample storeWithURL:url deviceIdentifier:@"2"];
+    store2.foreignDatabaseMemoryMapSize = 64 * 1024 * 1024;
+    store2.foreignDatabaseCacheSize = -4096;
+    [store2 loadNow];
+    XCTAssertTrue([store2 loaded], @"Store not loaded");
+    XCTAssertEqualObjects(store2.title, @"The Title", @"Title is '%@' but should be '%@'", store2.title, @"The Title");
+
+    // change first store --> should trigger a change in the second store
+    PARNotificationSemaphore *semaphore = [PARNotificationSemaphore semaphoreForNotificationName:PARStoreDidSyncNotification object:store2];
+    store1.title = @"New Title";
+    [store1 saveNow];
+    BOOL completedWithoutTimeout = [semaphore waitUntilNotificationWithTimeout:10.0];
+    XCTAssertTrue(completedWithoutTimeout, @"Timeout while waiting for document sync");
+    XCTAssertEqualObjects(store2.title, @"New Title", @"Title is '%@' but should be '%@'", store2.title, @"New Title");
+
+    [store1 tearDownNow];
+    [store2 tearDownNow];
+}
+
+- (void)testStoreSyncWithMaximumOpenForeignDatabaseCount
+{
+    NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"SyncTest.parstore"];
+    PARStoreExample *store1 = [PARStoreExample storeWithURL:url deviceIdentifier:@"1"];
+    PARStoreExample *store2 = [PARStoreExample storeWithURL:url deviceIdentifier:@"2"];
+    PARStoreExample *store3 = [PARStoreExample storeWithURL:url deviceIdentifier:@"3"];
+    [store1 loadNow];
+    [store2 loadNow];
+    [store3 loadNow];
+    store1.title = @"Title";
+    store2.first = @"Albert";
+    store3.last = @"Einstein";
+    [store1 saveNow];
+    [store2 saveNow];
+    [store3 saveNow];
+    
+    // loaded in groups of one database
+    PARStoreExample *store4 = [PARStoreExample storeWithURL:url deviceIdentifier:@"4"];
+    store4.maximumOpenForeignDatabaseCount = 1;
+    [store4 loadNow];
+    NSDictionary *expectedEntries = @{@"title": @"Title", @"first": @"Albert", @"last": @"Einstein"};
+    XCTAssertEqualObjects(store4.allEntries, expectedEntries);
+    XCTAssertLessThanOrEqual([[store4 valueForKey:@"readonlyDatabases"] count], 1UL);
+    XCTAssertEqualObjects([store4 fetchPropertyListValueForKey:@"title"], @"Title");
+    XCTAssertEqualObjects([NSSet setWithArray:[store4 fetchAllKeys]], [NSSet setWithArray:expectedEntries.allKeys]);
+    XCTAssertEqual([store4 fetchChangesSinceTimestamp:nil].count, 3UL);
+    
+    // only the changed database is read
+    PARNotificationSemaphore *semaphore = [PARNotificationSemaphore semaphoreForNotificationName:PARStoreDidSyncNotification object:store4];
+    store2.first = @"Alfred";
+    [store2 saveNow];
+    [store4 syncNow];
+    XCTAssertTrue([semaphore waitUntilNotificationWithTimeout:10.0], @"Timeout while waiting for document sync");
+    XCTAssertEqualObjects(store4.first, @"Alfred");
+    NSArray *openDatabases = [store4 valueForKey:@"readonlyDatabases"];
+    XCTAssertEqual(openDatabases.count, 1UL);
+    XCTAssertEqualObjects([[openDatabases.firstObject URL] URLByDeletingLastPathComponent].lastPathComponent, @"2");
+    
+    [store1 tearDownNow];
+    [store2 tearDownNow];
+    [store3 tearDownNow];
+    [store4 tearDownNow];
+}
+
+- (void)testFollowerStore
+{
+    NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"SyncTest.parstore"];
+    
+    PARStoreExample *store1 = [PARStoreExample storeWithURL:url deviceIdentifier:@"1"];
+    [store1 loadNow];
+    store1.title = @"Title 1";
+    [store1 saveNow];
+    
+    PARStoreExample *follower = [PARStoreExample followerStoreWithURL:url];
+    [follower loadNow];
+    XCTAssertTrue([follower loaded], @"Store not loaded");
+    XCTAssertTrue(follower.follower);
+    XCTAssertFalse([follower inMemoryCacheEnabled], @"Follower should not cache values");
+    XCTAssertEqualObjects([follower fetchPropertyListValueForKey:@"title"], @"Title 1");
+    XCTAssertEqualObjects([follower mostRecentTimestampForKey:@"title"], [store1 mostRecentTimestampForKey:@"title"]);
+    
+    // new changes are tailed
+    PARNotificationSemaphore *semaphore = [PARNotificationSemaphore semaphoreForNotificationName:PARStoreDidSyncNotification object:follower];
+    store1.title = @"Title 2";
+    [store1 saveNow];
+    [follower syncNow];
+    XCTAssertTrue([semaphore waitUntilNotificationWithTimeout:10.0], @"Timeout while waiting for document change");
+    XCTAssertEqualObjects([follower fetchPropertyListValueForKey:@"title"], @"Title 2");
+    
+    // never writes to the package
+    [follower setPropertyListValue:@"Title 3" forKey:@"title"];
+    NSError *error = nil;
+    XCTAssertFalse([follower writeBlobData:[NSData data] toPath:@"blob" error:&error]);
+    XCTAssertNotNil(error);
+    [follower saveNow];
+    XCTAssertEqualObjects([follower fetchPropertyListValueForKey:@"title"], @"Title 2");
+    NSArray *devices = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:[follower valueForKey:@"deviceRootPath"] error:NULL];
+    XCTAssertEqualObjects(devices, @[@"1"], @"Follower should not create a device directory");
+    
+    [store1 tearDownNow];
+    [follower tearDownNow];
+}
+
+- (void)testDeviceDirectoryListingCache
+{
+    NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"SyncTest.parstore"];
+    PARStoreExample *store1 = [PARStoreExample storeWithURL:url deviceIdentifier:@"1"];
+    [store1 loadNow];
+    XCTAssertEqualObjects([store1 valueForKey:@"foreignDeviceIdentifiers"], @[]);
+    
+    // a new device is listed right away, even when added in the same second as the previous listing
+    PARStoreExample *store2 = [PARStoreExample storeWithURL:url deviceIdentifier:@"2"];
+    [store2 loadNow];
+    XCTAssertEqualObjects([store1 valueForKey:@"foreignDeviceIdentifiers"], @[@"2"]);
+    
+    // cached once the directory is old enough
+    [NSThread sleepForTimeInterval:2.0];
+    XCTAssertEqualObjects([store1 valueForKey:@"foreignDeviceIdentifiers"], @[@"2"]);
+    XCTAssertNotNil([store1 valueForKey:@"readonlyDirectoryPathsCache"]);
+    PARStoreExample *store3 = [PARStoreExample storeWithURL:url deviceIdentifier:@"3"];
+    [store3 loadNow];
+    XCTAssertEqualObjects([NSSet setWithArray:[store1 valueForKey:@"foreignDeviceIdentifiers"]], ([NSSet setWithArray:@[@"2", @"3"]]));
+    
+    [store1 tearDownNow];
+    [store2 tearDownNow];
+    [store3 tearDownNow];
+}
+
+- (void)testArchiveInactiveDevices
+{
+    NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"SyncTest.parstore"];
+    NSNumber *oldTimestamp1 = @([[PARStore timestampNow] longLongValue] - 3LL * 24 * 3600 * 1000 * 1000);
+    NSNumber *oldTimestamp2 = @([[PARStore timestampNow] longLongValue] - 2LL * 24 * 3600 * 1000 * 1000);
+    PARStoreExample *store0 = [PARStoreExample storeWithURL:url deviceIdentifier:@"1"];
+    [store0 loadNow];
+    NSError *error = nil;
+    XCTAssertTrue([store0 insertChanges:@[[PARChange changeWithTimestamp:oldTimestamp1 parentTimestamp:nil key:@"title" propertyList:@"Old title"]] forDeviceIdentifier:@"old1" appendOnly:NO error:&error], @"error: %@", error);
+    XCTAssertTrue([store0 insertChanges:@[[PARChange changeWithTimestamp:oldTimestamp2 parentTimestamp:nil key:@"first" propertyList:@"Albert"]] forDeviceIdentifier:@"old2" appendOnly:NO error:&error], @"error: %@", error);
+    XCTAssertTrue([store0 insertChanges:@[[PARChange changeWithTimestamp:oldTimestamp2 parentTimestamp:nil key:@"last" propertyList:@"Einstein"]] forDeviceIdentifier:@"unsafe" appendOnly:NO error:&error], @"error: %@", error);
+    [store0 tearDownNow];
+    store0 = nil;
+    
+    PARStoreExample *store1 = [PARStoreExample storeWithURL:url deviceIdentifier:@"1"];
+    [store1 loadNow];
+    PARStoreExample *store2 = [PARStoreExample storeWithURL:url deviceIdentifier:@"2"];
+    [store2 loadNow];
+    store2.summary = @"Summary";
+    [store2 saveNow];
+    [store1 syncNow];
+    NSDictionary *expectedEntries = @{@"title": @"Old title", @"first": @"Albert", @"last": @"Einstein", @"summary": @"Summary"};
+    XCTAssertEqualObjects(store1.allEntries, expectedEntries);
+    
+    // only the inactive devices that are not unsafe
+    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+    __block NSArray *archivedDeviceIdentifiers = nil;
+    [store1 archiveDevicesInactiveForTimeInterval:24 * 3600 unsafeDeviceIdentifiers:@[@"unsafe"] completionHandler:^(NSArray *deviceIdentifiers, NSError *archiveError)
+     {
+         XCTAssertNil(archiveError);
+         archivedDeviceIdentifiers = deviceIdentifiers;
+         dispatch_semaphore_signal(semaphore);
+     }];
+    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    XCTAssertEqualObjects([NSSet setWithArray:archivedDeviceIdentifiers], ([NSSet setWithArray:@[@"old1", @"old2"]]));
+    NSArray *devices = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:[store1 valueForKey:@"deviceRootPath"] error:NULL];
+    XCTAssertEqualObjects([NSSet setWithArray:devices], ([NSSet setWithArray:@[@"1", @"2", @"unsafe", @"PARStoreArchive"]]));
+    
+    // same values for all stores, including the ones that were already loaded
+    [store1 syncNow];
+    [store2 syncNow];
+    store2.summary = @"New summary";
+    [store2 saveNow];
+    [store1 syncNow];
+    expectedEntries = @{@"title": @"Old title", @"first": @"Albert", @"last": @"Einstein", @"summary": @"New summary"};
+    XCTAssertEqualObjects(store1.allEntries, expectedEntries);
+    XCTAssertEqualObjects(store2.allEntries, expectedEntries);
+    PARStoreExample *store3 = [PARStoreExample storeWithURL:url deviceIdentifier:@"3"];
+    [store3 loadNow];
+    XCTAssertEqualObjects(store3.allEntries, expectedEntries);
+    
+    [store1 tearDownNow];
+    [store2 tearDownNow];
+    [store3 tearDownNow];
+}
+
+
+- (void)testChecksumVerification
+{
+    NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"doc.parstore"];
+    PARStoreExample *document1 = [PARStoreExample storeWithURL:url deviceIdentifier:@"1"];
+    document1.checksumsEnabled = YES;
+    [document1 loadNow];
+    document1.title = @"Title 1";
+    [document1 saveNow];
+    document1.first = @"Albert";
+    [document1 saveNow];
+    
+    // all rows valid
+    __block NSDictionary *corruptChanges = nil;
+    dispatch_semaphore_t sema = dispatch_semaphore_create(0);
+    [document1 verifyChecksumsWithCompletionHandler:^(NSDictionary *changes)
+    {
+        corruptChanges = changes;
+        dispatch_semaphore_signal(sema);
+    }];
+    long waitResult = dispatch_semaphore_wait(sema, dispatch_time(DISPATCH_TIME_NOW, 10.0 * NSEC_PER_SEC));
+    XCTAssertEqual(waitResult, 0, @"Timeout while waiting for checksum verification");
+    XCTAssertEqual(corruptChanges.count, (NSUInteger)0, @"unexpected corrupt changes: %@", corruptChanges);
+    
+    // alter the checksum of the first row, as if the row had been corrupted
+    NSURL *checksumsURL = [[[url URLByAppendingPathComponent:@"Devices"] URLByAppendingPathComponent:@"1"] URLByAppendingPathComponent:@"Checksums.crc"];
+    NSMutableData *checksums = [NSMutableData dataWithContentsOfURL:checksumsURL];
+    XCTAssertEqual(checksums.length, (NSUInteger)32);
+    ((uint8_t *)checksums.mutableBytes)[12] ^= 0xFF;
+    XCTAssertTrue([checksums writeToURL:checksumsURL atomically:YES]);
+    
+    [document1 verifyChecksumsWithCompletionHandler:^(NSDictionary *changes)
+    {
+        corruptChanges = changes;
+        dispatch_semaphore_signal(sema);
+    }];
+    waitResult = dispatch_semaphore_wait(sema, dispatch_time(DISPATCH_TIME_NOW, 10.0 * NSEC_PER_SEC));
+    XCTAssertEqual(waitResult, 0, @"Timeout while waiting for checksum verification");
+    NSArray *changes = corruptChanges[@"1"];
+    XCTAssertEqual(changes.count, (NSUInteger)1, @"unexpected corrupt changes: %@", corruptChanges);
+    XCTAssertEqualObjects([changes.firstObject key], @"title");
+    
+    [document1 tearDownNow];
+    document1 = nil;
+}
+
+- (void)testSummaries
+{
+    NSURL *urlA = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"SummaryTestA.parstore"];
+    PARStoreExample *storeA = [PARStoreExample storeWithURL:urlA deviceIdentifier:@"1"];
+    storeA.summariesEnabled = YES;
+    [storeA loadNow];
+    storeA.title = @"Title";
+    storeA.first = @"Albert";
+    [storeA saveNow];
+    
+    // same rows in another package
+    NSURL *urlB = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"SummaryTestB.parstore"];
+    PARStoreExample *storeB = [PARStoreExample storeWithURL:urlB deviceIdentifier:@"1"];
+    storeB.summariesEnabled = YES;
+    [storeB loadNow];
+    NSError *error = nil;
+    XCTAssertTrue([storeB insertChanges:[storeA fetchChangesSinceTimestamp:nil] forDeviceIdentifier:@"1" appendOnly:NO error:&error], @"error inserting changes: %@", error);
+    NSData *hash = [storeA summaryHashForDeviceIdentifier:@"1"];
+    XCTAssertNotNil(hash);
+    XCTAssertEqualObjects([storeB summaryHashForDeviceIdentifier:@"1"], hash);
+    XCTAssertEqualObjects([storeA timestampRangesDifferingFromStore:storeB forDeviceIdentifier:@"1"], @[]);
+    
+    // a new row is in the only range that differs
+    storeA.last = @"Einstein";
+    [storeA saveNow];
+    XCTAssertNotEqualObjects([storeA summaryHashForDeviceIdentifier:@"1"], hash);
+    NSArray *ranges = [storeA timestampRangesDifferingFromStore:storeB forDeviceIdentifier:@"1"];
+    XCTAssertEqual(ranges.count, (NSUInteger)1);
+    NSNumber *timestamp = [[storeA fetchChangesSinceTimestamp:nil].lastObject timestamp];
+    XCTAssertTrue([ranges[0][0] compare:timestamp] != NSOrderedDescending && [ranges[0][1] compare:timestamp] != NSOrderedAscending, @"timestamp %@ should be in range %@", timestamp, ranges[0]);
+    NSArray *changes = [storeA fetchChangesFromTimestamp:ranges[0][0] toTimestamp:ranges[0][1] forDeviceIdentifier:@"1"];
+    XCTAssertTrue([storeB insertChanges:changes forDeviceIdentifier:@"1" appendOnly:NO error:&error], @"error inserting changes: %@", error);
+    XCTAssertEqualObjects([storeA timestampRangesDifferingFromStore:storeB forDeviceIdentifier:@"1"], @[]);
+    
+    // a missing summary is rebuilt from the database
+    hash = [storeA summaryHashForDeviceIdentifier:@"1"];
+    NSURL *summaryURL = [[[urlA URLByAppendingPathComponent:@"Devices"] URLByAppendingPathComponent:@"1"] URLByAppendingPathComponent:@"Summary.merkle"];
+    XCTAssertTrue([[NSFileManager defaultManager] removeItemAtURL:summaryURL error:NULL]);
+    XCTAssertEqualObjects([storeA summaryHashForDeviceIdentifier:@"1"], hash);
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:summaryURL.path]);
+    
+    // a summary with as many rows but other ones, e.g. synced separately from the database, is not trusted
+    NSURL *urlC = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"SummaryTestC.parstore"];
+    PARStoreExample *storeC = [PARStoreExample storeWithURL:urlC deviceIdentifier:@"1"];
+    storeC.summariesEnabled = YES;
+    [storeC loadNow];
+    storeC.title = @"Other Title";
+    storeC.first = @"Marie";
+    storeC.last = @"Curie";
+    [storeC saveNow];
+    NSData *otherHash = [storeC summaryHashForDeviceIdentifier:@"1"];
+    XCTAssertNotEqualObjects(otherHash, hash);
+    NSURL *otherSummaryURL = [[[urlC URLByAppendingPathComponent:@"Devices"] URLByAppendingPathComponent:@"1"] URLByAppendingPathComponent:@"Summary.merkle"];
+    XCTAssertTrue([[NSFileManager defaultManager] removeItemAtURL:summaryURL error:NULL]);
+    XCTAssertTrue([[NSFileManager defaultManager] copyItemAtURL:otherSummaryURL toURL:summaryURL error:NULL]);
+    XCTAssertEqualObjects([storeA summaryHashForDeviceIdentifier:@"1"], hash);
+    
+    [storeA tearDownNow];
+    [storeB tearDownNow];
+    [storeC tearDownNow];
+}
+
+- (void)testSummariesInCopiedPackage
+{
+    NSURL *tmpURL = [self urlWithUniqueTmpDirectory];
+    NSURL *url = [tmpURL URLByAppendingPathComponent:@"SummaryTest.parstore"];
+    PARStoreExample *store1 = [PARStoreExample storeWithURL:url deviceIdentifier:@"1"];
+    store1.summariesEnabled = YES;
+    [store1 loadNow];
+    store1.title = @"Title";
+    store1.first = @"Albert";
+    [store1 saveNow];
+    store1.last = @"Einstein";
+    [store1 saveNow];
+    [store1 tearDownNow];
+    
+    // the files of the copy are new, but the rows are the same
+    NSURL *copyURL = [tmpURL URLByAppendingPathComponent:@"SummaryTestCopy.parstore"];
+    NSError *error = nil;
+    XCTAssertTrue([[NSFileManager defaultManager] copyItemAtURL:url toURL:copyURL error:&error], @"error: %@", error);
+    PARStoreExample *store2 = [PARStoreExample storeWithURL:url deviceIdentifier:@"1"];
+    store2.summariesEnabled = YES;
+    [store2 loadNow];
+    PARStoreExample *copy = [PARStoreExample storeWithURL:copyURL deviceIdentifier:@"1"];
+    copy.summariesEnabled = YES;
+    [copy loadNow];
+    
+    // the estimate does not rebuild summaries, so the device is only found identical if the summaries of both packages are trusted as they are
+    __block PARMergeEstimate *estimate = nil;
+    dispatch_semaphore_t sema = dispatch_semaphore_create(0);
+    [store2 estimateMergeOfStore:copy unsafeDeviceIdentifiers:@[] completionHandler:^(PARMergeEstimate *result, NSError *estimateError)
+    {
+        XCTAssertNil(estimateError, @"error estimating merge: %@", estimateError);
+        estimate = result;
+        dispatch_semaphore_signal(sema);
+    }];
+    long waitResult = dispatch_semaphore_wait(sema, dispatch_time(DISPATCH_TIME_NOW, 10.0 * NSEC_PER_SEC));
+    XCTAssertEqual(waitResult, 0, @"Timeout while waiting for merge estimate");
+    XCTAssertEqualObjects(estimate.identicalDeviceIdentifiers, @[@"1"]);
+    XCTAssertEqual(estimate.addedRowCount, (NSUInteger)0);
+    XCTAssertEqualObjects([copy summaryHashForDeviceIdentifier:@"1"], [store2 summaryHashForDeviceIdentifier:@"1"]);
+    
+    [store2 tearDownNow];
+    [copy tearDownNow];
+}
+
 
 #pragma mark - Testing Merge
 
@@ -634,6 +1475,80 @@
     [storeA3 tearDownNow];
 }
 
+- (void)testMergeEstimate
+{
+    NSURL *urlA = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"MergeTestA.parstore"];
+    PARStoreExample *storeA1 = [PARStoreExample storeWithURL:urlA deviceIdentifier:@"1"];
+    [storeA1 loadNow];
+    storeA1.title = @"titleA1";
+    [storeA1 saveNow];
+    
+    NSURL *urlB = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"MergeTestB.parstore"];
+    PARStoreExample *storeB1 = [PARStoreExample storeWithURL:urlB deviceIdentifier:@"1"];
+    PARStoreExample *storeB2 = [PARStoreExample storeWithURL:urlB deviceIdentifier:@"2"];
+    [storeB1 loadNow];
+    [storeB2 loadNow];
+    storeB1.title = @"titleB1";
+    storeB2.title = @"titleB2";
+    storeB2.first = @"Albert";
+    [storeB1 saveNow];
+    [storeB2 saveNow];
+    NSData *blob = [@"blob" dataUsingEncoding:NSUTF8StringEncoding];
+    NSError *error = nil;
+    XCTAssertTrue([storeB1 writeBlobData:blob toPath:@"blob.txt" error:&error], @"error writing blob: %@", error);
+    
+    __block PARMergeEstimate *estimate = nil;
+    dispatch_semaphore_t sema = dispatch_semaphore_create(0);
+    [storeA1 estimateMergeOfStore:storeB1 unsafeDeviceIdentifiers:@[] completionHandler:^(PARMergeEstimate *result, NSError *estimateError)
+    {
+        XCTAssertNil(estimateError, @"error estimating merge: %@", estimateError);
+        estimate = result;
+        dispatch_semaphore_signal(sema);
+    }];
+    long waitResult = dispatch_semaphore_wait(sema, dispatch_time(DISPATCH_TIME_NOW, 10.0 * NSEC_PER_SEC));
+    XCTAssertEqual(waitResult, 0, @"Timeout while waiting for merge estimate");
+    XCTAssertEqualObjects(estimate.addedRowCountsByDeviceIdentifier, (@{@"1": @1, @"2": @2}));
+    XCTAssertEqualObjects(estimate.virtualRowCountsByDeviceIdentifier, @{});
+    XCTAssertEqual(estimate.addedRowCount, (NSUInteger)3);
+    XCTAssertEqual(estimate.blobFileCount, (NSUInteger)1);
+    XCTAssertEqual(estimate.blobByteCount, (unsigned long long)blob.length);
+    
+    // unsafe devices go to their virtual device
+    [storeA1 estimateMergeOfStore:storeB1 unsafeDeviceIdentifiers:@[@"2"] completionHandler:^(PARMergeEstimate *result, NSError *estimateError)
+    {
+        estimate = result;
+        dispatch_semaphore_signal(sema);
+    }];
+    waitResult = dispatch_semaphore_wait(sema, dispatch_time(DISPATCH_TIME_NOW, 10.0 * NSEC_PER_SEC));
+    XCTAssertEqual(waitResult, 0, @"Timeout while waiting for merge estimate");
+    XCTAssertEqualObjects(estimate.addedRowCountsByDeviceIdentifier, (@{@"1": @1}));
+    XCTAssertEqualObjects(estimate.virtualRowCountsByDeviceIdentifier, (@{@"2": @2}));
+    
+    // nothing changed
+    XCTAssertEqual([storeA1 fetchChangesSinceTimestamp:nil].count, (NSUInteger)1);
+    XCTAssertEqualObjects(storeA1.title, @"titleA1");
+    
+    // a database that cannot be read fails the estimate
+    NSURL *unreadableDirectoryURL = [[urlB URLByAppendingPathComponent:@"Devices"] URLByAppendingPathComponent:@"4"];
+    XCTAssertTrue([[NSFileManager defaultManager] createDirectoryAtURL:unreadableDirectoryURL withIntermediateDirectories:YES attributes:nil error:NULL]);
+    XCTAssertTrue([[@"not a database" dataUsingEncoding:NSUTF8StringEncoding] writeToURL:[unreadableDirectoryURL URLByAppendingPathComponent:@"Logs.db"] atomically:YES]);
+    __block NSError *failedEstimateError = nil;
+    [storeA1 estimateMergeOfStore:storeB1 unsafeDeviceIdentifiers:@[] completionHandler:^(PARMergeEstimate *result, NSError *estimateError)
+    {
+        estimate = result;
+        failedEstimateError = estimateError;
+        dispatch_semaphore_signal(sema);
+    }];
+    waitResult = dispatch_semaphore_wait(sema, dispatch_time(DISPATCH_TIME_NOW, 10.0 * NSEC_PER_SEC));
+    XCTAssertEqual(waitResult, 0, @"Timeout while waiting for merge estimate");
+    XCTAssertNil(estimate);
+    XCTAssertNotNil(failedEstimateError);
+    
+    [storeA1 tearDownNow];
+    [storeB1 tearDownNow];
+    [storeB2 tearDownNow];
+}
+
 - (void)testMergeWithUnsafeDeviceIdentifiers
 {
     NSURL *urlA = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"MergeTestA.parstore"];
@@ -880,6 +1795,42 @@
     [store2 tearDownNow];
 }
 
+- (void)testMostRecentTimestampsByDeviceIdentifierWithMaximumOpenForeignDatabaseCount
+{
+    NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"SyncTest.parstore"];
+    PARStoreExample *store1 = [PARStoreExample storeWithURL:url deviceIdentifier:@"1"];
+    PARStoreExample *store2 = [PARStoreExample storeWithURL:url deviceIdentifier:@"2"];
+    PARStoreExample *store3 = [PARStoreExample storeWithURL:url deviceIdentifier:@"3"];
+    [store1 loadNow];
+    [store2 loadNow];
+    [store3 loadNow];
+    store1.title = @"Title";
+    store2.first = @"Albert";
+    store3.last = @"Einstein";
+    [store1 saveNow];
+    [store2 saveNow];
+    [store3 saveNow];
+    
+    // fewer databases open than devices
+    PARStoreExample *store4 = [PARStoreExample storeWithURL:url deviceIdentifier:@"4"];
+    store4.maximumOpenForeignDatabaseCount = 1;
+    [store4 loadNow];
+    XCTAssertLessThanOrEqual([[store4 valueForKey:@"readonlyDatabases"] count], 1UL);
+    
+    // all the devices have a timestamp, whether their database is open or not
+    NSDictionary *timestamps = [store4 mostRecentTimestampsByDeviceIdentifier];
+    XCTAssertEqualObjects(timestamps[@"1"], [store1 mostRecentTimestampForDeviceIdentifier:@"1"]);
+    XCTAssertEqualObjects(timestamps[@"2"], [store2 mostRecentTimestampForDeviceIdentifier:@"2"]);
+    XCTAssertEqualObjects(timestamps[@"3"], [store3 mostRecentTimestampForDeviceIdentifier:@"3"]);
+    for (NSString *deviceIdentifier in @[@"1", @"2", @"3"])
+        XCTAssertEqualObjects(timestamps[deviceIdentifier], [store4 mostRecentTimestampForDeviceIdentifier:deviceIdentifier]);
+    
+    [store1 tearDownNow];
+    [store2 tearDownNow];
+    [store3 tearDownNow];
+    [store4 tearDownNow];
+}
+
 - (void)testTimestampOrder
 {
 	NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"SyncTest.parstore"];
@@ -1045,6 +1996,141 @@
     XCTAssertEqualObjects(changes, expectedChanges, @"unexpected changes: %@", changes);
 }
 
+- (void)testInMemoryHistory
+{
+    PARStoreExample *store1 = [PARStoreExample inMemoryStore];
+    store1.first = @"Albert";
+    store1.title = @"Title 1";
+    NSNumber *middleTimestamp = [PARStore timestampNow];
+    store1.title = @"Title 2";
+    [store1 setEntriesFromDictionary:@{@"last": @"Einstein", @"summary": @"Physicist"}];
+    
+    // history and timestamps, as with a file package
+    NSArray *changes = [store1 fetchChangesSinceTimestamp:nil];
+    XCTAssertEqual(changes.count, 5);
+    NSArray *actualTimestamps = [changes valueForKey:@"timestamp"];
+    XCTAssertEqualObjects(actualTimestamps, [actualTimestamps sortedArrayUsingSelector:@selector(compare:)]);
+    NSArray *titleChanges = [[store1 fetchChangesSinceTimestamp:nil] filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"key == 'title'"]];
+    XCTAssertEqual(titleChanges.count, 2);
+    XCTAssertEqualObjects([titleChanges[1] parentTimestamp], [titleChanges[0] timestamp]);
+    XCTAssertEqualObjects([store1 mostRecentTimestampForKey:@"title"], [titleChanges[1] timestamp]);
+    XCTAssertEqualObjects([store1 fetchPropertyListValueForKey:@"title"], @"Title 2");
+    XCTAssertEqualObjects([store1 fetchPropertyListValueForKey:@"title" timestamp:middleTimestamp], @"Title 1");
+    XCTAssertEqualObjects([store1 mostRecentTimestampForDeviceIdentifier:store1.deviceIdentifier], [changes.lastObject timestamp]);
+    XCTAssertEqual([store1 fetchMostRecentChangesMatchingKeyPrefix:@"ti" forDeviceIdentifier:nil].count, 1);
+    
+    // changes inserted for another device are applied like a sync, once
+    PARChange *foreignChange = [PARChange changeWithTimestamp:[PARStore timestampNow] parentTimestamp:nil key:@"title" propertyList:@"Title 3"];
+    NSError *error = nil;
+    XCTAssertTrue([store1 insertChanges:@[foreignChange] forDeviceIdentifier:@"2" appendOnly:NO error:&error], @"error: %@", error);
+    XCTAssertTrue([store1 insertChanges:@[foreignChange] forDeviceIdentifier:@"2" appendOnly:NO error:&error], @"error: %@", error);
+    XCTAssertEqualObjects(store1.title, @"Title 3");
+    XCTAssertEqual([store1 fetchChangesSinceTimestamp:nil forDeviceIdentifier:@"2"].count, 1);
+    XCTAssertEqual([store1 fetchChangesSinceTimestamp:nil].count, 6);
+    
+    // flush to a file package
+    NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"doc.parstore"];
+    XCTAssertTrue([store1 writeBlobData:[@"blob" dataUsingEncoding:NSUTF8StringEncoding] toPath:@"blob.txt" error:&error], @"error: %@", error);
+    XCTAssertTrue([store1 flushToURL:url deviceIdentifier:@"1" error:&error], @"error: %@", error);
+    PARStoreExample *store2 = [PARStoreExample storeWithURL:url deviceIdentifier:@"1"];
+    [store2 loadNow];
+    XCTAssertEqualObjects(store2.first, @"Albert");
+    XCTAssertEqualObjects(store2.last, @"Einstein");
+    XCTAssertEqualObjects(store2.title, @"Title 3");
+    XCTAssertEqualObjects([store2 fetchChangesSinceTimestamp:nil forDeviceIdentifier:@"1"], [store1 fetchChangesSinceTimestamp:nil forDeviceIdentifier:store1.deviceIdentifier]);
+    XCTAssertEqualObjects([store2 fetchChangesSinceTimestamp:nil forDeviceIdentifier:@"2"], @[foreignChange]);
+    XCTAssertNotNil([store2 blobDataAtPath:@"blob.txt" error:NULL]);
+    [store2 tearDownNow];
+}
+
+- (void)testBlobPacks
+{
+    NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"doc.parstore"];
+    PARStoreExample *store = [PARStoreExample storeWithURL:url deviceIdentifier:[self deviceIdentifierForTest]];
+    store.blobPackThreshold = 1024;
+    [store loadNow];
+    NSError *error = nil;
+
+    // small blobs go to the pack, without a file of their own
+    NSData *smallBlob = [@"small blob" dataUsingEncoding:NSUTF8StringEncoding];
+    XCTAssertTrue([store writeBlobData:smallBlob toPath:@"small.txt" error:&error], @"error: %@", error);
+    XCTAssertTrue([store writeBlobData:smallBlob toPath:@"replaced.txt" error:&error], @"error: %@", error);
+    XCTAssertFalse([[NSFileManager defaultManager] fileExistsAtPath:[store absolutePathForBlobPath:@"small.txt"]]);
+    XCTAssertEqualObjects([store blobDataAtPath:@"small.txt" error:&error], smallBlob);
+    NSMutableSet *paths = [NSMutableSet set];
+    [store enumerateBlobs:^(NSString *path) { [paths addObject:path]; }];
+    XCTAssertEqualObjects(paths, ([NSSet setWithArray:@[@"small.txt", @"replaced.txt"]]));
+
+    // a large blob replaces the packed version with a file
+    NSMutableData *largeBlob = [NSMutableData dataWithLength:4096];
+    XCTAssertTrue([store writeBlobData:largeBlob toPath:@"replaced.txt" error:&error], @"error: %@", error);
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:[store absolutePathForBlobPath:@"replaced.txt"]]);
+    XCTAssertEqualObjects([store blobDataAtPath:@"replaced.txt" error:&error], largeBlob);
+
+    // deleted blobs are gone, and repacking keeps the live ones
+    XCTAssertTrue([store writeBlobData:smallBlob toPath:@"deleted.txt" error:&error], @"error: %@", error);
+    XCTAssertTrue([store deleteBlobAtPath:@"deleted.txt" error:&error], @"error: %@", error);
+    XCTAssertNil([store blobDataAtPath:@"deleted.txt" error:NULL]);
+    XCTAssertTrue([store repackBlobsWithError:&error], @"error: %@", error);
+    XCTAssertEqualObjects([store blobDataAtPath:@"small.txt" error:&error], smallBlob);
+    XCTAssertEqualObjects([store blobDataAtPath:@"replaced.txt" error:&error], largeBlob);
+    XCTAssertNil([store blobDataAtPath:@"deleted.txt" error:NULL]);
+    [paths removeAllObjects];
+    [store enumerateBlobs:^(NSString *path) { [paths addObject:path]; }];
+    XCTAssertEqualObjects(paths, ([NSSet setWithArray:@[@"small.txt", @"replaced.txt"]]));
+
+    // packed blobs are read by other devices
+    PARStoreExample *store2 = [PARStoreExample storeWithURL:url deviceIdentifier:@"2"];
+    [store2 loadNow];
+    XCTAssertEqualObjects([store2 blobDataAtPath:@"small.txt" error:&error], smallBlob);
+    [store2 tearDownNow];
+    
+    // a more recent blob file merged from another store replaces the packed blob
+    NSURL *otherURL = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"other.parstore"];
+    PARStoreExample *otherStore = [PARStoreExample storeWithURL:otherURL deviceIdentifier:[self deviceIdentifierForTest]];
+    [otherStore loadNow];
+    NSData *mergedBlob = [@"merged blob" dataUsingEncoding:NSUTF8StringEncoding];
+    XCTAssertTrue([otherStore writeBlobData:mergedBlob toPath:@"small.txt" error:&error], @"error: %@", error);
+    XCTAssertTrue([[NSFileManager defaultManager] setAttributes:@{NSFileModificationDate: [NSDate dateWithTimeIntervalSinceNow:10.0]} ofItemAtPath:[otherStore absolutePathForBlobPath:@"small.txt"] error:&error], @"error: %@", error);
+    dispatch_semaphore_t sema = dispatch_semaphore_create(0);
+    [store mergeStore:otherStore unsafeDeviceIdentifiers:@[] completionHandler:^(NSError *mergeError)
+    {
+        XCTAssertNil(mergeError, @"error merging: %@", mergeError);
+        dispatch_semaphore_signal(sema);
+    }];
+    long waitResult = dispatch_semaphore_wait(sema, dispatch_time(DISPATCH_TIME_NOW, 10.0 * NSEC_PER_SEC));
+    XCTAssertEqual(waitResult, 0, @"Timeout while waiting for merge");
+    XCTAssertEqualObjects([store blobDataAtPath:@"small.txt" error:&error], mergedBlob);
+    [otherStore tearDownNow];
+    [store tearDownNow];
+}
+
+- (void)testChangesHistoryWithPendingChanges
+{
+    NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"doc.parstore"];
+    PARStoreExample *store = [PARStoreExample storeWithURL:url deviceIdentifier:[self deviceIdentifierForTest]];
+    [store loadNow];
+    store.first = @"Albert";
+    [store saveNow];
+    store.last = @"Einstein";
+    store.title = @"Title";
+    
+    // the changes not saved yet are in the history, and reading it does not save them
+    NSArray *changes = [store fetchChangesSinceTimestamp:nil];
+    XCTAssertEqualObjects([changes valueForKey:@"key"], (@[@"first", @"last", @"title"]));
+    XCTAssertEqual([store fetchChangesSinceTimestamp:nil forDeviceIdentifier:[self deviceIdentifierForTest]].count, 3);
+    XCTAssertEqualObjects([NSSet setWithArray:[store fetchAllKeys]], ([NSSet setWithArray:@[@"first", @"last", @"title"]]));
+    [store syncNow];
+    __block NSUInteger pendingCount = 0;
+    [[store valueForKey:@"databaseQueue"] dispatchSynchronously:^{ pendingCount = [[store valueForKey:@"pendingLogs"] count]; }];
+    XCTAssertEqual(pendingCount, 2);
+    
+    // once saved, the changes are only returned once
+    [store saveNow];
+    XCTAssertEqual([store fetchChangesSinceTimestamp:nil].count, 3);
+    [store tearDownNow];
+}
+
 - (void)testChangesHistoryWithSync
 {
     NSString *device1 = [[NSUUID UUID] UUIDString];
@@ -1105,6 +2191,63 @@
     XCTAssertEqualObjects(changes1, expectedChanges, @"unexpected changes: %@", changes1);
 }
 
+- (void)testEnumerateChangesAcrossDevices
+{
+    NSString *device1 = [[NSUUID UUID] UUIDString];
+    NSString *device2 = [[NSUUID UUID] UUIDString];
+    NSURL *url = [[self urlWithUniqueTmpDirectory] URLByAppendingPathComponent:@"doc.parstore"];
+    
+    // interleave the changes of the two devices, with some left unsaved in store1
+    PARStoreExample *store1 = [PARStoreExample storeWithURL:url deviceIdentifier:device1];
+    PARStoreExample *store2 = [PARStoreExample storeWithURL:url deviceIdentifier:device2];
+    [store1 loadNow];
+    [store2 loadNow];
+    for (NSUInteger i = 0; i < 20; i++)
+    {
+        store1.first = [NSString stringWithFormat:@"first %@", @(i)];
+        store2.last = [NSString stringWithFormat:@"last %@", @(i)];
+    }
+    [store2 saveNow];
+    [store1 saveNow];
+    store1.title = @"Title";
+    [store1 syncNow];
+    
+    // same changes as the fetches of each device, in timestamp order
+    NSArray *expectedChanges = [[[store1 fetchChangesSinceTimestamp:nil forDeviceIdentifier:device1] arrayByAddingObjectsFromArray:[store1 fetchChangesSinceTimestamp:nil forDeviceIdentifier:device2]] sortedArrayUsingComparator:^NSComparisonResult(PARChange *change1, PARChange *change2) { return [change1.timestamp compare:change2.timestamp]; }];
+    XCTAssertEqual(expectedChanges.count, 41);
+    NSMutableArray *changes = [NSMutableArray array];
+    BOOL completed = [store1 enumerateChangesSinceTimestamp:nil forDeviceIdentifier:nil cancellationToken:nil usingBlock:^(PARChange *change, BOOL *stop) { [changes addObject:change]; }];
+    XCTAssertTrue(completed);
+    XCTAssertEqualObjects([changes valueForKey:@"timestamp"], [expectedChanges valueForKey:@"timestamp"]);
+    XCTAssertEqualObjects([NSSet setWithArray:changes], [NSSet setWithArray:expectedChanges]);
+    
+    // one device only, and stopping early
+    [changes removeAllObjects];
+    [store1 enumerateChangesSinceTimestamp:nil forDeviceIdentifier:device2 cancellationToken:nil usingBlock:^(PARChange *change, BOOL *stop) { [changes addObject:change]; }];
+    XCTAssertEqualObjects(changes, [store1 fetchChangesSinceTimestamp:nil forDeviceIdentifier:device2]);
+    [changes removeAllObjects];
+    [store1 enumerateChangesSinceTimestamp:[expectedChanges[9] timestamp] forDeviceIdentifier:nil cancellationToken:nil usingBlock:^(PARChange *change, BOOL *stop)
+     {
+         [changes addObject:change];
+         *stop = (changes.count == 5);
+     }];
+    XCTAssertEqualObjects([changes valueForKey:@"timestamp"], [[expectedChanges subarrayWithRange:NSMakeRange(10, 5)] valueForKey:@"timestamp"]);
+    
+    // more rows with the same timestamp than in a page: each row is read once
+    NSMutableDictionary *entries = [NSMutableDictionary dictionary];
+    for (NSUInteger i = 0; i < 2500; i++)
+        entries[[NSString stringWithFormat:@"key %@", @(i)]] = @(i);
+    [store1 setEntriesFromDictionary:entries];
+    [store1 saveNow];
+    NSMutableArray *keys = [NSMutableArray array];
+    [store1 enumerateChangesSinceTimestamp:[expectedChanges.lastObject timestamp] forDeviceIdentifier:device1 cancellationToken:nil usingBlock:^(PARChange *change, BOOL *stop) { [keys addObject:change.key]; }];
+    XCTAssertEqual(keys.count, entries.count);
+    XCTAssertEqualObjects([NSSet setWithArray:keys], [NSSet setWithArray:entries.allKeys]);
+    
+    [store1 tearDownNow];
+    [store2 tearDownNow];
+}
+
 
 #pragma mark - Testing Queues
 